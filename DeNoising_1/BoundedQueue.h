@@ -0,0 +1,99 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef __BOUNDED_QUEUE_H__
+#define __BOUNDED_QUEUE_H__
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+
+
+// -----------------------------------------------------------------------------------------
+// A blocking FIFO queue with a fixed capacity, used to connect the stages of a pipeline
+// running on different threads. 'Push' blocks while the queue is full, which throttles a
+// fast producer to the pace of its consumer and bounds the memory held in flight. 'Pop'
+// blocks while the queue is empty. Once 'Close' is called, 'Push' fails and 'Pop' drains the
+// remaining items and then fails, which lets consumers exit cleanly.
+// Requires C++11.
+// -----------------------------------------------------------------------------------------
+template <typename T>
+class CBoundedQueue
+{
+public:
+	explicit CBoundedQueue(size_t capacity) : m_capacity(capacity ? capacity : 1), m_isClosed(false) {}
+
+	bool Push(T item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_items.size() >= m_capacity && !m_isClosed)
+			m_notFull.wait(lock);
+		if (m_isClosed)
+			return false;
+		m_items.push_back(std::move(item));
+		m_notEmpty.notify_one();
+		return true;
+	}
+
+	bool Pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_items.empty() && !m_isClosed)
+			m_notEmpty.wait(lock);
+		if (m_items.empty())
+			return false;	// Closed and drained
+		item = std::move(m_items.front());
+		m_items.pop_front();
+		m_notFull.notify_one();
+		return true;
+	}
+
+	void Close()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_isClosed = true;
+		m_notFull.notify_all();
+		m_notEmpty.notify_all();
+	}
+
+	size_t GetSize() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_items.size();
+	}
+
+	size_t GetCapacity() const { return m_capacity; }
+
+private:
+	CBoundedQueue(const CBoundedQueue&);
+	CBoundedQueue& operator=(const CBoundedQueue&);
+
+	const size_t				m_capacity;
+	bool						m_isClosed;
+	std::deque<T>				m_items;
+	mutable std::mutex			m_mutex;
+	std::condition_variable		m_notFull;
+	std::condition_variable		m_notEmpty;
+};
+
+
+
+#endif	// __BOUNDED_QUEUE_H__
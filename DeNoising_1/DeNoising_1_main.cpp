@@ -130,7 +130,9 @@ int main(int argc, char *argv[])
 
 	std::cout << "Initialized" << std::endl;
 	
-	int err = noiseCleaner.CleanNoise((unsigned char *)img->imageData, (unsigned char *)oimg->imageData, img->width, img->height, 0.12f, true);
+	// The rows of an IplImage are padded to 'widthStep' bytes
+	int err = noiseCleaner.CleanNoiseRegion((unsigned char *)img->imageData, img->widthStep, (unsigned char *)oimg->imageData,
+											oimg->widthStep, 0, 0, img->width, img->height, 0.12f, true);
 
 	if (err)
 	{
@@ -159,7 +161,8 @@ int main(int argc, char *argv[])
 
 	
 
-	err = noiseCleaner.CleanNoise((unsigned char *)img_1->imageData, (unsigned char *)oimg_1->imageData, img_1->width, img_1->height, 0.2f, true);
+	err = noiseCleaner.CleanNoiseRegion((unsigned char *)img_1->imageData, img_1->widthStep, (unsigned char *)oimg_1->imageData,
+										oimg_1->widthStep, 0, 0, img_1->width, img_1->height, 0.2f, true);
 	if (err)
 	{
 		std::cerr << "Kernel failed, exiting (error: " << err << ")" << std::endl;
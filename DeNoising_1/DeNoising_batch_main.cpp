@@ -0,0 +1,555 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <memory>
+#ifdef USE_OPENCV
+#include <cv.h>
+#include <highgui.h>
+#endif
+#include <CL/cl.h>
+
+#if defined(_WIN32) || defined(_WIN64) || defined(_WINDOWS)
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "Utils.h"
+#include "NoiseCleaner.h"
+#include "BoundedQueue.h"
+#include "ImageIO.h"
+
+
+// -----------------------------------------------------------------------------------------
+// Headless batch denoiser. The input images are decoded and the results encoded by two
+// groups of worker threads, while the main thread owns the CNoiseCleaner and only feeds the
+// device. The stages are connected by bounded queues, so decoding runs ahead of the device
+// by at most 'queue depth' images and the device does not wait on the image codecs as long
+// as the workers keep up.
+// PGM, PPM and raw files are not decoded: the decode workers map the input and the output
+// files (see CImageFile) and the device thread denoises from one mapping into the other, the
+// encode workers only unmap them. Other formats are read and written with OpenCV, which is
+// optional at build time (USE_OPENCV).
+//
+//   decode workers -> [decoded queue] -> main thread (CleanNoise) -> [denoised queue] -> encode workers
+// -----------------------------------------------------------------------------------------
+
+#define DEF_THRESH			0.12f
+#define DEF_THREADS			4
+#define DEF_QUEUE_DEPTH		8
+#define DEF_SUFFIX			"_denoised"
+
+
+struct SBatchConfig
+{
+	std::vector<std::string>	inputs;
+	std::string					outDir;
+	float						thresh;
+	bool						isSoftThresh;
+	cl_device_type				deviceType;
+	int							numThreads;
+	int							queueDepth;
+	bool						isPrintStats;
+	bool						isSelfTest;
+	int							rawWidth;		// The size of the frames in raw files, which have no header
+	int							rawHeight;
+};
+
+// A grayscale image in a contiguous buffer (no row padding), as CleanNoise expects it. The
+// images of CImageFile formats stay in their mapped files and 'pixels' is not used.
+struct SFrame
+{
+	std::string					inPath;
+	std::string					outPath;
+	int							width;
+	int							height;
+	std::vector<unsigned char>	pixels;
+	std::unique_ptr<CImageFile>	pInFile;
+	std::unique_ptr<CImageFile>	pOutFile;
+};
+
+
+//-----------------------------------------------------------------------------------------
+static bool IsImageFile(const std::string& name)
+{
+	CImageFile::EFormat format;
+	if (CImageFile::GetFormat(name.c_str(), format))
+		return true;
+#ifdef USE_OPENCV
+	static const char* EXTENSIONS[] = {".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff"};
+	size_t dotPos = name.find_last_of('.');
+	if (dotPos == std::string::npos)
+		return false;
+	std::string ext = name.substr(dotPos);
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	for (size_t i = 0; i < sizeof(EXTENSIONS) / sizeof(EXTENSIONS[0]); i++)
+	{
+		if (ext == EXTENSIONS[i])
+			return true;
+	}
+#endif
+	return false;
+}
+//-----------------------------------------------------------------------------------------
+static bool ListDirectory(const std::string& dirPath, std::vector<std::string>& files)
+{
+	std::vector<std::string> names;
+#if defined(_WIN32) || defined(_WIN64) || defined(_WINDOWS)
+	WIN32_FIND_DATAA findData;
+	HANDLE hFind = FindFirstFileA((dirPath + "\\*").c_str(), &findData);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return false;
+	do
+	{
+		if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && IsImageFile(findData.cFileName))
+			names.push_back(dirPath + "\\" + findData.cFileName);
+	} while (FindNextFileA(hFind, &findData));
+	FindClose(hFind);
+#else
+	DIR* pDir = opendir(dirPath.c_str());
+	if (!pDir)
+		return false;
+	struct dirent* pEntry;
+	while ((pEntry = readdir(pDir)) != NULL)
+	{
+		std::string path = dirPath + "/" + pEntry->d_name;
+		struct stat fileStat;
+		if (stat(path.c_str(), &fileStat) == 0 && S_ISREG(fileStat.st_mode) && IsImageFile(pEntry->d_name))
+			names.push_back(path);
+	}
+	closedir(pDir);
+#endif
+	// Directory order is arbitrary, sorting makes runs reproducible
+	std::sort(names.begin(), names.end());
+	files.insert(files.end(), names.begin(), names.end());
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+static bool IsDirectory(const std::string& path)
+{
+#if defined(_WIN32) || defined(_WIN64) || defined(_WINDOWS)
+	DWORD attributes = GetFileAttributesA(path.c_str());
+	return (attributes != INVALID_FILE_ATTRIBUTES) && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat fileStat;
+	return (stat(path.c_str(), &fileStat) == 0) && S_ISDIR(fileStat.st_mode);
+#endif
+}
+//-----------------------------------------------------------------------------------------
+static bool ReadFileList(const char* pFilename, std::vector<std::string>& inputs)
+{
+	std::ifstream fh(pFilename);
+	if (!fh.is_open())
+		return false;
+	std::string line;
+	while (std::getline(fh, line))
+	{
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+		if (!line.empty() && line[0] != '#')
+			inputs.push_back(line);
+	}
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+static std::string GetOutputPath(const SBatchConfig& config, const std::string& inPath)
+{
+	size_t slashPos = inPath.find_last_of("/\\");
+	std::string baseName = (slashPos == std::string::npos) ? inPath : inPath.substr(slashPos + 1);
+	if (!config.outDir.empty())
+		return config.outDir + "/" + baseName;
+
+	// Without an output directory the result is written next to the input
+	size_t dotPos = inPath.find_last_of('.');
+	if (dotPos == std::string::npos || (slashPos != std::string::npos && dotPos < slashPos))
+		return inPath + DEF_SUFFIX;
+	return inPath.substr(0, dotPos) + DEF_SUFFIX + inPath.substr(dotPos);
+}
+//-----------------------------------------------------------------------------------------
+static bool IsPowerOfTwo(int value)
+{
+	return (value > 0) && ((value & (value - 1)) == 0);
+}
+//-----------------------------------------------------------------------------------------
+static bool IsSupportedSize(const std::string& path, int width, int height)
+{
+	if (IsPowerOfTwo(width) && IsPowerOfTwo(height))
+		return true;
+	std::cerr << "Unsupported size " << width << "x" << height << " (width and height must be powers of two): " << path << std::endl;
+	return false;
+}
+//-----------------------------------------------------------------------------------------
+static bool MapFrame(const SBatchConfig& config, SFrame& frame)
+{
+	frame.pInFile.reset(new CImageFile);
+	if (!frame.pInFile->OpenRead(frame.inPath.c_str(), config.rawWidth, config.rawHeight))
+	{
+		std::cerr << "Failed to map image (only 8bit binary PGM/PPM, raw files need --raw-size): " << frame.inPath << std::endl;
+		return false;
+	}
+	frame.width = frame.pInFile->GetWidth();
+	frame.height = frame.pInFile->GetHeight();
+	if (!IsSupportedSize(frame.inPath, frame.width, frame.height))
+		return false;
+
+	// Creating the output would truncate an input which is still mapped
+	CImageFile::EFormat outFormat;
+	if (frame.outPath == frame.inPath)
+	{
+		std::cerr << "The output would overwrite the input: " << frame.inPath << std::endl;
+		return false;
+	}
+	if (!CImageFile::GetFormat(frame.outPath.c_str(), outFormat))
+	{
+		std::cerr << "Unsupported output format: " << frame.outPath << std::endl;
+		return false;
+	}
+	frame.pOutFile.reset(new CImageFile);
+	if (!frame.pOutFile->Create(frame.outPath.c_str(), outFormat, frame.width, frame.height))
+	{
+		std::cerr << "Failed to create image: " << frame.outPath << std::endl;
+		return false;
+	}
+
+	// The page faults are taken here rather than by the device thread
+	frame.pInFile->Prefetch();
+	frame.pOutFile->Prefetch();
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+static bool DecodeFrame(const SBatchConfig& config, SFrame& frame)
+{
+	CImageFile::EFormat format;
+	if (CImageFile::GetFormat(frame.inPath.c_str(), format))
+		return MapFrame(config, frame);
+
+#ifdef USE_OPENCV
+	const std::string& path = frame.inPath;
+	IplImage* pImage = cvLoadImage(path.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
+	if (!pImage)
+	{
+		std::cerr << "Failed to load image: " << path << std::endl;
+		return false;
+	}
+
+	bool isValid = (pImage->depth == 8 && pImage->nChannels == 1);
+	if (!isValid)
+		std::cerr << "Unsupported format (only 8bit single channel): " << path << std::endl;
+	else
+		isValid = IsSupportedSize(path, pImage->width, pImage->height);
+
+	if (isValid)
+	{
+		frame.width = pImage->width;
+		frame.height = pImage->height;
+		frame.pixels.resize(frame.width * frame.height);
+		for (int y = 0; y < frame.height; y++)
+			memcpy(&frame.pixels[y * frame.width], pImage->imageData + y * pImage->widthStep, frame.width);
+	}
+
+	cvReleaseImage(&pImage);
+	return isValid;
+#else
+	std::cerr << "Unsupported format (built without OpenCV, only PGM, PPM and raw): " << frame.inPath << std::endl;
+	return false;
+#endif
+}
+//-----------------------------------------------------------------------------------------
+static bool EncodeFrame(SFrame& frame)
+{
+	// The pixels of a mapped file are in place already
+	if (frame.pOutFile)
+	{
+		frame.pOutFile->Close();
+		frame.pInFile->Close();
+		return true;
+	}
+
+#ifdef USE_OPENCV
+	IplImage* pImage = cvCreateImage(cvSize(frame.width, frame.height), IPL_DEPTH_8U, 1);
+	for (int y = 0; y < frame.height; y++)
+		memcpy(pImage->imageData + y * pImage->widthStep, &frame.pixels[y * frame.width], frame.width);
+
+	bool isSaved = (cvSaveImage(frame.outPath.c_str(), pImage) != 0);
+	if (!isSaved)
+		std::cerr << "Failed to write image: " << frame.outPath << std::endl;
+
+	cvReleaseImage(&pImage);
+	return isSaved;
+#else
+	return false;
+#endif
+}
+//-----------------------------------------------------------------------------------------
+static void PrintUsage(const char* pProgName)
+{
+	std::cerr << "Usage: " << pProgName << " [options] <image file or directory>...\n"
+			  << "  --list FILE         Read input paths from FILE, one per line\n"
+			  << "  --out-dir DIR       Write results to DIR (default: next to the input, with a '" << DEF_SUFFIX << "' suffix)\n"
+			  << "  --thresh T          Threshold (default " << DEF_THRESH << ")\n"
+			  << "  --mode MODE         Thresholding mode: hard or soft (default soft)\n"
+			  << "  --backend TYPE      OpenCL device type: gpu, cpu or accelerator (default gpu)\n"
+			  << "  --threads N         Decode + encode worker threads (default " << DEF_THREADS << ")\n"
+			  << "  --queue-depth N     Images buffered between the stages (default " << DEF_QUEUE_DEPTH << ")\n"
+			  << "  --raw-size WxH      Size of the frames in .raw/.gray files (8bit gray levels without a header)\n"
+			  << "  --stats             Print the per-stage device statistics at exit\n"
+			  << "  --self-test         Run CNoiseCleaner's internal self test and exit\n";
+}
+//-----------------------------------------------------------------------------------------
+static bool ParseArgs(int argc, char *argv[], SBatchConfig& config)
+{
+	config.thresh = DEF_THRESH;
+	config.isSoftThresh = true;
+	config.deviceType = CL_DEVICE_TYPE_GPU;
+	config.numThreads = DEF_THREADS;
+	config.queueDepth = DEF_QUEUE_DEPTH;
+	config.isPrintStats = false;
+	config.isSelfTest = false;
+	config.rawWidth = 0;
+	config.rawHeight = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char* pArg = argv[i];
+		const char* pValue = (i + 1 < argc) ? argv[i + 1] : NULL;
+		if (pArg[0] != '-')
+		{
+			config.inputs.push_back(pArg);
+			continue;
+		}
+
+		if (!strcmp(pArg, "--stats"))
+		{
+			config.isPrintStats = true;
+			continue;
+		}
+		if (!strcmp(pArg, "--self-test"))
+		{
+			config.isSelfTest = true;
+			continue;
+		}
+
+		bool isValid = (pValue != NULL);
+		if (!strcmp(pArg, "--list") && isValid)
+			isValid = ReadFileList(pValue, config.inputs);
+		else if (!strcmp(pArg, "--out-dir") && isValid)
+			config.outDir = pValue;
+		else if (!strcmp(pArg, "--thresh") && isValid)
+			config.thresh = (float)atof(pValue);
+		else if (!strcmp(pArg, "--mode") && isValid)
+		{
+			config.isSoftThresh = !strcmp(pValue, "soft");
+			isValid = config.isSoftThresh || !strcmp(pValue, "hard");
+		}
+		else if (!strcmp(pArg, "--backend") && isValid)
+		{
+			if (!strcmp(pValue, "gpu"))
+				config.deviceType = CL_DEVICE_TYPE_GPU;
+			else if (!strcmp(pValue, "cpu"))
+				config.deviceType = CL_DEVICE_TYPE_CPU;
+			else if (!strcmp(pValue, "accelerator"))
+				config.deviceType = CL_DEVICE_TYPE_ACCELERATOR;
+			else
+				isValid = false;
+		}
+		else if (!strcmp(pArg, "--threads") && isValid)
+			isValid = ((config.numThreads = atoi(pValue)) > 0);
+		else if (!strcmp(pArg, "--queue-depth") && isValid)
+			isValid = ((config.queueDepth = atoi(pValue)) > 0);
+		else if (!strcmp(pArg, "--raw-size") && isValid)
+			isValid = (sscanf(pValue, "%dx%d", &config.rawWidth, &config.rawHeight) == 2);
+		else
+			isValid = false;
+
+		if (!isValid)
+			return false;
+		i++;
+	}
+
+	return config.isSelfTest || !config.inputs.empty();
+}
+//-----------------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+	SBatchConfig config;
+	if (!ParseArgs(argc, argv, config))
+	{
+		PrintUsage(argv[0]);
+		return -1;
+	}
+
+	if (config.isSelfTest)
+	{
+		CNoiseCleaner noiseCleaner(config.deviceType);
+		bool isPassed = noiseCleaner.PerformSelfTest();
+		std::cout << "Self test " << (isPassed ? "passed" : "FAILED") << " on " << noiseCleaner.GetDeviceName() << std::endl;
+		return isPassed ? 0 : -1;
+	}
+
+	// Expand directories into the image files they contain
+	std::vector<std::string> files;
+	for (size_t i = 0; i < config.inputs.size(); i++)
+	{
+		if (!IsDirectory(config.inputs[i]))
+			files.push_back(config.inputs[i]);
+		else if (!ListDirectory(config.inputs[i], files))
+			std::cerr << "Failed to list directory: " << config.inputs[i] << std::endl;
+	}
+	if (files.empty())
+	{
+		std::cerr << "No input images" << std::endl;
+		return -1;
+	}
+
+	// Compiling the kernels takes a while, it is done before the clock starts
+	CNoiseCleaner noiseCleaner(config.deviceType);
+	CCleanNoiseStatsCollector statsCollector;
+	noiseCleaner.SetStatsCollector(&statsCollector);
+
+	CBoundedQueue<SFrame> decodedQueue(config.queueDepth);
+	CBoundedQueue<SFrame> denoisedQueue(config.queueDepth);
+	std::atomic<size_t> nextFile(0);
+	std::atomic<int> numDecodersLeft(0);
+	std::atomic<int> numFailed(0);
+	std::atomic<int> numWritten(0);
+	std::atomic<unsigned long long> numPixelsWritten(0);
+
+	int numDecoders = std::max(1, config.numThreads / 2);
+	int numEncoders = std::max(1, config.numThreads - numDecoders);
+	numDecodersLeft = numDecoders;
+
+	cl_ulong startTime = OpenCLEnv::GetHostTime();
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < numDecoders; i++)
+	{
+		workers.push_back(std::thread([&]() {
+			size_t fileIdx;
+			while ((fileIdx = nextFile++) < files.size())
+			{
+				SFrame frame;
+				frame.inPath = files[fileIdx];
+				frame.outPath = GetOutputPath(config, frame.inPath);
+				if (!DecodeFrame(config, frame))
+				{
+					// A mapped output which will not be written is removed
+					if (frame.pOutFile)
+					{
+						frame.pOutFile->Close();
+						remove(frame.outPath.c_str());
+					}
+					numFailed++;
+				}
+				else if (!decodedQueue.Push(std::move(frame)))
+					break;
+			}
+			// The last decoder to finish tells the device stage there is no more input
+			if (--numDecodersLeft == 0)
+				decodedQueue.Close();
+		}));
+	}
+	for (int i = 0; i < numEncoders; i++)
+	{
+		workers.push_back(std::thread([&]() {
+			SFrame frame;
+			while (denoisedQueue.Pop(frame))
+			{
+				if (!EncodeFrame(frame))
+				{
+					numFailed++;
+					continue;
+				}
+				numWritten++;
+				numPixelsWritten += (unsigned long long)frame.width * frame.height;
+			}
+		}));
+	}
+
+	//
+	// Device stage: the main thread owns the OpenCL queue, it only waits when the decoders
+	// fall behind (measured as 'starvedTime')
+	//
+	std::vector<unsigned char> outPixels;
+	cl_ulong starvedTime = 0;
+	for (;;)
+	{
+		SFrame frame;
+		cl_ulong waitStartTime = OpenCLEnv::GetHostTime();
+		if (!decodedQueue.Pop(frame))
+			break;
+		starvedTime += OpenCLEnv::GetHostTime() - waitStartTime;
+
+		// Mapped frames are denoised from the input file straight into the output file
+		unsigned char* pIn;
+		unsigned char* pOut;
+		if (frame.pInFile)
+		{
+			pIn = frame.pInFile->GetPixels();
+			pOut = frame.pOutFile->GetPixels();
+		}
+		else
+		{
+			outPixels.resize(frame.pixels.size());
+			pIn = &frame.pixels[0];
+			pOut = &outPixels[0];
+		}
+		int err = noiseCleaner.CleanNoise(pIn, pOut, frame.width, frame.height, config.thresh, config.isSoftThresh);
+		if (err)
+		{
+			std::cerr << "Kernel failed on " << frame.inPath << " (error: " << err << ")" << std::endl;
+			if (frame.pOutFile)
+			{
+				frame.pOutFile->Close();
+				remove(frame.outPath.c_str());
+			}
+			numFailed++;
+			continue;
+		}
+		if (!frame.pOutFile)
+			frame.pixels.swap(outPixels);
+		denoisedQueue.Push(std::move(frame));
+	}
+	denoisedQueue.Close();
+
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	double elapsedSec = (double)(OpenCLEnv::GetHostTime() - startTime) / 1e9;
+	std::cout << "Denoised " << numWritten << " of " << files.size() << " images (" << numFailed << " failed) in "
+			  << elapsedSec << " s on " << noiseCleaner.GetDeviceName() << ": "
+			  << (elapsedSec > 0 ? numWritten / elapsedSec : 0.0) << " images/s, "
+			  << (elapsedSec > 0 ? (double)numPixelsWritten / elapsedSec / 1e6 : 0.0) << " MPix/s, device stage starved for "
+			  << (double)starvedTime / 1e6 << " ms" << std::endl;
+	if (config.isPrintStats)
+		statsCollector.Print(std::cout);
+
+	return (numFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,936 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <CL/cl.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "Utils.h"
+#include "NoiseCleaner.h"
+#include "HaarCPU.h"
+
+
+// -----------------------------------------------------------------------------------------
+// Benchmark driver for CNoiseCleaner. It sweeps image sizes, batch counts (the number of
+// frames denoised back-to-back in one timed sample), hard/soft thresholding and OpenCL
+// backends, and writes one record per configuration in JSON or CSV format so the results
+// can be compared between releases. With '--transpose' it measures the effective bandwidth
+// of the transpose kernels against a device-to-device copy instead. With '--half' the
+// coefficients are stored as halves and with '--integer' the integer transform is used, and
+// every record also carries the PSNR of the output against the 32-bit pipeline. '--tune' runs
+// 'CNoiseCleaner::AutoTune' on every backend first, so the sweep uses the tuned parameters.
+// '--cpu-transform' compares the naive and the cache-blocked 2D transforms of CHaarCPU with
+// the hardware cache counters of perf events (Linux only) instead of using OpenCL.
+// -----------------------------------------------------------------------------------------
+
+#define DEF_THRESH		0.12f
+#define DEF_ITERATIONS	30
+#define DEF_WARMUP		3
+
+
+struct SBenchConfig
+{
+	std::vector<int>			widths;
+	std::vector<int>			heights;
+	std::vector<int>			batches;
+	std::vector<bool>			softModes;
+	std::vector<cl_device_type>	backends;
+	int							iterations;
+	int							warmup;
+	float						thresh;
+	bool						isProfilingEnabled;
+	bool						isCSV;
+	bool						isTranspose;
+	bool						isInPlace;
+	bool						isNonStandard;
+	int							neighWindowSize;	// 0 for the pointwise thresholding
+	bool						isMetrics;
+	bool						isHalfPrecision;
+	bool						isInteger;
+	bool						isMemoryReport;
+	bool						isTune;
+	bool						isCPUTransform;
+	std::string					outFile;
+	std::string					traceFile;
+};
+
+struct SBenchResult
+{
+	std::string		backend;
+	std::string		device;
+	int				width;
+	int				height;
+	int				batch;
+	bool			isSoftThresh;
+	int				numFrames;
+	const char*		pPipeline;		// The pipeline actually used: "default", "in-place" or "non-standard"
+	const char*		pPrecision;		// "fp32", "fp16" or "int"
+	bool			hasPSNR;
+	double			psnrDb;			// Of the output against the 32-bit pipeline
+	size_t			deviceBytes;
+	double			medianFrameMs;
+	double			p99FrameMs;
+	double			medianBatchMs;
+	double			p99BatchMs;
+	double			mpixPerSec;
+	double			kernelMs;		// Means per frame
+	double			transferMs;
+	double			hostMs;
+	double			queuedMs;
+	double			launches;
+	double			bytesToDevice;
+	double			bytesFromDevice;
+	double			stageMs[SCleanNoiseStats::NUM_STAGES];
+};
+
+struct SCPUTransformResult
+{
+	int					width;
+	int					height;
+	const char*			pVersion;		// "naive" or "blocked"
+	double				medianMs;		// Of a forward and an inverse transform
+	bool				hasCounters;
+	double				cacheReferences;	// Means per forward and inverse transform
+	double				cacheMisses;
+	double				l1dReadMisses;
+};
+
+struct STransposeResult
+{
+	std::string			backend;
+	std::string			device;
+	int					width;
+	int					height;
+	STransposeBandwidth	bandwidth;
+};
+
+
+//-----------------------------------------------------------------------------------------
+// Hardware cache counters of the calling thread through perf_event_open. They are not
+// available on other systems, or when the kernel does not allow unprivileged counting
+// (/proc/sys/kernel/perf_event_paranoid).
+//-----------------------------------------------------------------------------------------
+class CCacheCounters
+{
+public:
+	enum { CACHE_REFERENCES, CACHE_MISSES, L1D_READ_MISSES, NUM_COUNTERS };
+
+	CCacheCounters()
+	{
+		for (int i = 0; i < NUM_COUNTERS; i++)
+			m_fds[i] = -1;
+#ifdef __linux__
+		const unsigned int types[NUM_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+		const unsigned long long configs[NUM_COUNTERS] = {PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+		for (int i = 0; i < NUM_COUNTERS; i++)
+		{
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = types[i];
+			attr.config = configs[i];
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			m_fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+#endif
+	}
+	~CCacheCounters()
+	{
+#ifdef __linux__
+		for (int i = 0; i < NUM_COUNTERS; i++)
+		{
+			if (m_fds[i] >= 0)
+				close(m_fds[i]);
+		}
+#endif
+	}
+	bool IsAvailable() const
+	{
+		for (int i = 0; i < NUM_COUNTERS; i++)
+		{
+			if (m_fds[i] < 0)
+				return false;
+		}
+		return true;
+	}
+	void Start()
+	{
+#ifdef __linux__
+		for (int i = 0; i < NUM_COUNTERS && IsAvailable(); i++)
+		{
+			ioctl(m_fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(m_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+	void Stop(unsigned long long counts[NUM_COUNTERS])
+	{
+		for (int i = 0; i < NUM_COUNTERS; i++)
+		{
+			counts[i] = 0;
+#ifdef __linux__
+			if (!IsAvailable())
+				continue;
+			ioctl(m_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+			if (read(m_fds[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i]))
+				counts[i] = 0;
+#endif
+		}
+	}
+
+private:
+	int	m_fds[NUM_COUNTERS];
+};
+//-----------------------------------------------------------------------------------------
+static const char* GetBackendName(cl_device_type deviceType)
+{
+	switch (deviceType)
+	{
+	case CL_DEVICE_TYPE_GPU:			return "gpu";
+	case CL_DEVICE_TYPE_CPU:			return "cpu";
+	case CL_DEVICE_TYPE_ACCELERATOR:	return "accelerator";
+	default:							return "default";
+	}
+}
+//-----------------------------------------------------------------------------------------
+static bool ParseIntList(const char* pStr, std::vector<int>& values)
+{
+	values.clear();
+	while (*pStr)
+	{
+		char* pEnd = NULL;
+		long value = strtol(pStr, &pEnd, 10);
+		if (pEnd == pStr || value <= 0)
+			return false;
+		values.push_back((int)value);
+		pStr = (*pEnd == ',') ? pEnd + 1 : pEnd;
+		if (*pEnd != ',' && *pEnd != '\0')
+			return false;
+	}
+	return !values.empty();
+}
+//-----------------------------------------------------------------------------------------
+static bool ParseSizes(const char* pStr, std::vector<int>& widths, std::vector<int>& heights)
+{
+	// Each entry is either 'N' (a square NxN image) or 'WxH'
+	widths.clear();
+	heights.clear();
+	while (*pStr)
+	{
+		char* pEnd = NULL;
+		long width = strtol(pStr, &pEnd, 10);
+		long height = width;
+		if (pEnd == pStr || width <= 0)
+			return false;
+		if (*pEnd == 'x')
+		{
+			pStr = pEnd + 1;
+			height = strtol(pStr, &pEnd, 10);
+			if (pEnd == pStr || height <= 0)
+				return false;
+		}
+		widths.push_back((int)width);
+		heights.push_back((int)height);
+		if (*pEnd != ',' && *pEnd != '\0')
+			return false;
+		pStr = (*pEnd == ',') ? pEnd + 1 : pEnd;
+	}
+	return !widths.empty();
+}
+//-----------------------------------------------------------------------------------------
+static bool ParseModes(const char* pStr, std::vector<bool>& softModes)
+{
+	softModes.clear();
+	std::string modes(pStr);
+	if (modes.find("hard") != std::string::npos)
+		softModes.push_back(false);
+	if (modes.find("soft") != std::string::npos)
+		softModes.push_back(true);
+	return !softModes.empty();
+}
+//-----------------------------------------------------------------------------------------
+static bool ParseBackends(const char* pStr, std::vector<cl_device_type>& backends)
+{
+	backends.clear();
+	std::string names(pStr);
+	if (names.find("gpu") != std::string::npos)
+		backends.push_back(CL_DEVICE_TYPE_GPU);
+	if (names.find("cpu") != std::string::npos)
+		backends.push_back(CL_DEVICE_TYPE_CPU);
+	if (names.find("accelerator") != std::string::npos)
+		backends.push_back(CL_DEVICE_TYPE_ACCELERATOR);
+	return !backends.empty();
+}
+//-----------------------------------------------------------------------------------------
+static double GetPercentile(std::vector<double> samples, double percentile)
+{
+	if (samples.empty())
+		return 0.0;
+	std::sort(samples.begin(), samples.end());
+	// Nearest-rank percentile
+	size_t rank = (size_t)((percentile / 100.0) * samples.size() + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > samples.size())
+		rank = samples.size();
+	return samples[rank - 1];
+}
+//-----------------------------------------------------------------------------------------
+static void MakeTestImage(unsigned char* pImage, int width, int height)
+{
+	// A checkerboard with uniform noise, so the thresholding stage has actual work to do
+	unsigned int seed = 12345;
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			seed = seed * 1103515245 + 12345;
+			int noise = (int)((seed >> 16) % 41) - 20;
+			int value = (((x / 16) + (y / 16)) & 1) * 140 + 50 + noise;
+			pImage[y*width + x] = (unsigned char)value;
+		}
+	}
+}
+//-----------------------------------------------------------------------------------------
+static void WritePSNR(std::ostream& os, const SBenchResult& r, const char* pNone)
+{
+	// Identical outputs have an infinite PSNR, which neither JSON nor CSV can hold
+	if (r.hasPSNR && r.psnrDb < HUGE_VAL)
+		os << r.psnrDb;
+	else
+		os << pNone;
+}
+//-----------------------------------------------------------------------------------------
+static void RunConfig(CNoiseCleaner& noiseCleaner, CNoiseCleaner* pRefCleaner, const SBenchConfig& config, int width, int height,
+					  int batch, bool isSoftThresh, SBenchResult& result)
+{
+	unsigned int numPixels = width*height;
+	std::vector<unsigned char> inImage(numPixels);
+	std::vector<unsigned char> outImage(numPixels);
+	MakeTestImage(&inImage[0], width, height);
+
+	std::vector<double> frameMs;
+	std::vector<double> batchMs;
+	SCleanNoiseStats stats;
+	SCleanNoiseMetrics metrics;
+	CCleanNoiseStatsCollector collector;
+	cl_ulong totalTime = 0;
+	int numFrames = 0;
+
+	for (int iter = -config.warmup; iter < config.iterations; iter++)
+	{
+		cl_ulong batchStartTime = OpenCLEnv::GetHostTime();
+		for (int i = 0; i < batch; i++)
+		{
+			cl_ulong frameStartTime = OpenCLEnv::GetHostTime();
+			if (config.isInteger)
+				noiseCleaner.CleanNoiseInteger(&inImage[0], &outImage[0], width, height, config.thresh, isSoftThresh, &stats);
+			else
+				noiseCleaner.CleanNoise(&inImage[0], &outImage[0], width, height, config.thresh, isSoftThresh, &stats,
+										config.isMetrics ? &metrics : NULL);
+			cl_ulong frameTime = OpenCLEnv::GetHostTime() - frameStartTime;
+			if (iter < 0)
+				continue;	// Warm-up iterations are not recorded
+
+			frameMs.push_back((double)frameTime / 1e6);
+			collector.Add(stats);
+			numFrames++;
+		}
+		cl_ulong batchTime = OpenCLEnv::GetHostTime() - batchStartTime;
+		if (iter >= 0)
+		{
+			batchMs.push_back((double)batchTime / 1e6);
+			totalTime += batchTime;
+		}
+	}
+
+	result.width = width;
+	result.height = height;
+	result.batch = batch;
+	result.isSoftThresh = isSoftThresh;
+	result.numFrames = numFrames;
+	SDeviceMemoryFootprint footprint;
+	noiseCleaner.GetDeviceMemoryFootprint(width, height, 1, config.isInPlace && !config.isInteger, footprint);
+	result.pPipeline = footprint.isInPlace ? "in-place" : "default";
+	if (noiseCleaner.IsNonStandardMode() && !config.isInteger && width > 1 && height > 1)
+		result.pPipeline = "non-standard";
+	result.deviceBytes = footprint.totalBytes;
+	if (config.isInteger && noiseCleaner.IsHalfPrecision())
+		result.deviceBytes *= 2;	// The integer pipeline always has 32-bit coefficients
+	result.pPrecision = config.isInteger ? "int" : (noiseCleaner.IsHalfPrecision() ? "fp16" : "fp32");
+	result.hasPSNR = (pRefCleaner != NULL);
+	result.psnrDb = 0.0;
+	if (pRefCleaner)
+	{
+		std::vector<unsigned char> refImage(numPixels);
+		pRefCleaner->CleanNoise(&inImage[0], &refImage[0], width, height, config.thresh, isSoftThresh);
+		result.psnrDb = OpenCLEnv::ComputePSNR(&refImage[0], &outImage[0], numPixels);
+	}
+	result.medianFrameMs = GetPercentile(frameMs, 50.0);
+	result.p99FrameMs = GetPercentile(frameMs, 99.0);
+	result.medianBatchMs = GetPercentile(batchMs, 50.0);
+	result.p99BatchMs = GetPercentile(batchMs, 99.0);
+	result.mpixPerSec = (totalTime > 0) ? ((double)numPixels * numFrames) / ((double)totalTime / 1e9) / 1e6 : 0.0;
+
+	// Device times stay zero when profiling is disabled
+	result.queuedMs = 0.0;
+	for (int s = 0; s < SCleanNoiseStats::NUM_STAGES; s++)
+	{
+		result.stageMs[s] = collector.GetStageHistogram(s).GetMean() / 1e6;
+		result.queuedMs += collector.GetQueuedHistogram(s).GetMean() / 1e6;
+	}
+	result.kernelMs = collector.GetKernelHistogram().GetMean() / 1e6;
+	result.transferMs = collector.GetTransferHistogram().GetMean() / 1e6;
+	result.hostMs = collector.GetHostHistogram().GetMean() / 1e6;
+	result.launches = (double)collector.GetNumLaunches() / numFrames;
+	result.bytesToDevice = (double)collector.GetBytesToDevice() / numFrames;
+	result.bytesFromDevice = (double)collector.GetBytesFromDevice() / numFrames;
+}
+//-----------------------------------------------------------------------------------------
+static void WriteJSONString(std::ostream& os, const std::string& str)
+{
+	// The device name comes from the driver and may hold any character
+	os << '"';
+	for (size_t i = 0; i < str.size(); i++)
+	{
+		unsigned char c = (unsigned char)str[i];
+		if (c == '"' || c == '\\')
+			os << '\\' << str[i];
+		else if (c < 0x20)
+		{
+			char escaped[8];
+			sprintf(escaped, "\\u%04x", c);
+			os << escaped;
+		}
+		else
+			os << str[i];
+	}
+	os << '"';
+}
+//-----------------------------------------------------------------------------------------
+static void WriteCSVString(std::ostream& os, const std::string& str)
+{
+	// Quotes inside a quoted field are doubled
+	os << '"';
+	for (size_t i = 0; i < str.size(); i++)
+		os << ((str[i] == '"') ? "\"\"" : std::string(1, str[i]));
+	os << '"';
+}
+//-----------------------------------------------------------------------------------------
+static void WriteCSV(std::ostream& os, const std::vector<SBenchResult>& results)
+{
+	os << "backend,device,width,height,batch,mode,pipeline,precision,psnr_db,device_bytes,frames,median_frame_ms,p99_frame_ms,median_batch_ms,p99_batch_ms,"
+	   << "mpix_per_s,kernel_ms,transfer_ms,host_ms,queued_ms,launches,bytes_to_device,bytes_from_device";
+	for (int s = 0; s < SCleanNoiseStats::NUM_STAGES; s++)
+		os << "," << SCleanNoiseStats::STAGE_NAMES[s] << "_ms";
+	os << "\n";
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const SBenchResult& r = results[i];
+		os << r.backend << ",";
+		WriteCSVString(os, r.device);
+		os << "," << r.width << "," << r.height << "," << r.batch << ","
+		   << (r.isSoftThresh ? "soft" : "hard") << "," << r.pPipeline << ","
+		   << r.pPrecision << ",";
+		WritePSNR(os, r, "");
+		os << "," << r.deviceBytes << "," << r.numFrames << "," << r.medianFrameMs << "," << r.p99FrameMs << ","
+		   << r.medianBatchMs << "," << r.p99BatchMs << "," << r.mpixPerSec << "," << r.kernelMs << "," << r.transferMs << ","
+		   << r.hostMs << "," << r.queuedMs << "," << r.launches << "," << r.bytesToDevice << "," << r.bytesFromDevice;
+		for (int s = 0; s < SCleanNoiseStats::NUM_STAGES; s++)
+			os << "," << r.stageMs[s];
+		os << "\n";
+	}
+}
+//-----------------------------------------------------------------------------------------
+static void WriteJSON(std::ostream& os, const std::vector<SBenchResult>& results)
+{
+	os << "{\n  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const SBenchResult& r = results[i];
+		os << "    {\"backend\": \"" << r.backend << "\", \"device\": ";
+		WriteJSONString(os, r.device);
+		os << ", \"width\": " << r.width
+		   << ", \"height\": " << r.height << ", \"batch\": " << r.batch << ", \"mode\": \"" << (r.isSoftThresh ? "soft" : "hard")
+		   << "\", \"pipeline\": \"" << r.pPipeline << "\", \"precision\": \""
+		   << r.pPrecision << "\", \"psnr_db\": ";
+		WritePSNR(os, r, "null");
+		os << ", \"device_bytes\": " << r.deviceBytes << ", \"frames\": " << r.numFrames << ",\n     \"median_frame_ms\": " << r.medianFrameMs
+		   << ", \"p99_frame_ms\": " << r.p99FrameMs << ", \"median_batch_ms\": " << r.medianBatchMs
+		   << ", \"p99_batch_ms\": " << r.p99BatchMs << ", \"mpix_per_s\": " << r.mpixPerSec
+		   << ",\n     \"kernel_ms\": " << r.kernelMs << ", \"transfer_ms\": " << r.transferMs << ", \"host_ms\": " << r.hostMs
+		   << ", \"queued_ms\": " << r.queuedMs << ",\n     \"launches\": " << r.launches << ", \"bytes_to_device\": "
+		   << r.bytesToDevice << ", \"bytes_from_device\": " << r.bytesFromDevice << ",\n     \"stages_ms\": {";
+		for (int s = 0; s < SCleanNoiseStats::NUM_STAGES; s++)
+			os << (s ? ", " : "") << "\"" << SCleanNoiseStats::STAGE_NAMES[s] << "\": " << r.stageMs[s];
+		os << "}}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	os << "  ]\n}\n";
+}
+//-----------------------------------------------------------------------------------------
+static void WriteTransposeCSV(std::ostream& os, const std::vector<STransposeResult>& results)
+{
+	os << "backend,device,width,height,transpose_gb_per_s,transpose_in_place_gb_per_s,copy_gb_per_s\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const STransposeResult& r = results[i];
+		os << r.backend << ",";
+		WriteCSVString(os, r.device);
+		os << "," << r.width << "," << r.height << "," << r.bandwidth.outOfPlaceGBs << ","
+		   << r.bandwidth.inPlaceGBs << "," << r.bandwidth.copyGBs << "\n";
+	}
+}
+//-----------------------------------------------------------------------------------------
+static void WriteTransposeJSON(std::ostream& os, const std::vector<STransposeResult>& results)
+{
+	os << "{\n  \"transpose\": [\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const STransposeResult& r = results[i];
+		os << "    {\"backend\": \"" << r.backend << "\", \"device\": ";
+		WriteJSONString(os, r.device);
+		os << ", \"width\": " << r.width
+		   << ", \"height\": " << r.height << ", \"transpose_gb_per_s\": " << r.bandwidth.outOfPlaceGBs
+		   << ", \"transpose_in_place_gb_per_s\": " << r.bandwidth.inPlaceGBs << ", \"copy_gb_per_s\": " << r.bandwidth.copyGBs
+		   << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	os << "  ]\n}\n";
+}
+//-----------------------------------------------------------------------------------------
+static void RunCPUTransform(const SBenchConfig& config, int width, int height, bool isBlocked, SCPUTransformResult& result)
+{
+	result.width = width;
+	result.height = height;
+	result.pVersion = isBlocked ? "blocked" : "naive";
+
+	// The image goes through a forward and an inverse transform per sample, which keeps it in range
+	std::vector<unsigned char> image(width*height);
+	MakeTestImage(&image[0], width, height);
+	std::vector<float> buff(width*height);
+	for (int i = 0; i < width*height; i++)
+		buff[i] = (float)image[i] / 255.f;
+	std::vector<float> scratch(CHaarCPU::GetScratchLen(width, height));
+
+	CCacheCounters counters;
+	std::vector<double> samples;
+	for (int i = 0; i < config.warmup + config.iterations; i++)
+	{
+		if (i == config.warmup)
+			counters.Start();
+		cl_ulong startTime = OpenCLEnv::GetHostTime();
+		if (isBlocked)
+		{
+			CHaarCPU::ForwardTransform2D(&buff[0], width, height, &scratch[0]);
+			CHaarCPU::InverseTransform2D(&buff[0], width, height, &scratch[0]);
+		}
+		else
+		{
+			CHaarCPU::ForwardTransform2DNaive(&buff[0], width, height);
+			CHaarCPU::InverseTransform2DNaive(&buff[0], width, height);
+		}
+		if (i >= config.warmup)
+			samples.push_back((double)(OpenCLEnv::GetHostTime() - startTime) / 1e6);
+	}
+	unsigned long long counts[CCacheCounters::NUM_COUNTERS];
+	counters.Stop(counts);
+
+	result.medianMs = GetPercentile(samples, 50.0);
+	result.hasCounters = counters.IsAvailable();
+	result.cacheReferences = (double)counts[CCacheCounters::CACHE_REFERENCES] / config.iterations;
+	result.cacheMisses = (double)counts[CCacheCounters::CACHE_MISSES] / config.iterations;
+	result.l1dReadMisses = (double)counts[CCacheCounters::L1D_READ_MISSES] / config.iterations;
+}
+//-----------------------------------------------------------------------------------------
+static void WriteCPUTransformCSV(std::ostream& os, const std::vector<SCPUTransformResult>& results)
+{
+	// The counters are left empty when they are not available
+	os << "width,height,version,median_ms,cache_references,cache_misses,l1d_read_misses\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const SCPUTransformResult& r = results[i];
+		os << r.width << "," << r.height << "," << r.pVersion << "," << r.medianMs << ",";
+		if (r.hasCounters)
+			os << r.cacheReferences << "," << r.cacheMisses << "," << r.l1dReadMisses;
+		else
+			os << ",,";
+		os << "\n";
+	}
+}
+//-----------------------------------------------------------------------------------------
+static void WriteCPUTransformJSON(std::ostream& os, const std::vector<SCPUTransformResult>& results)
+{
+	os << "{\n  \"cpu_transform\": [\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const SCPUTransformResult& r = results[i];
+		os << "    {\"width\": " << r.width << ", \"height\": " << r.height << ", \"version\": \"" << r.pVersion
+		   << "\", \"median_ms\": " << r.medianMs;
+		if (r.hasCounters)
+			os << ", \"cache_references\": " << r.cacheReferences << ", \"cache_misses\": " << r.cacheMisses
+			   << ", \"l1d_read_misses\": " << r.l1dReadMisses;
+		else
+			os << ", \"cache_references\": null, \"cache_misses\": null, \"l1d_read_misses\": null";
+		os << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	os << "  ]\n}\n";
+}
+//-----------------------------------------------------------------------------------------
+static void PrintMemoryReport(std::ostream& os, const CNoiseCleaner& noiseCleaner, const SBenchConfig& config)
+{
+	os << "Device memory per CleanNoiseBatch call on " << noiseCleaner.GetDeviceName() << " (bytes)\n";
+	os << "size\tframes\tdefault\tin-place\tsaved\n";
+	for (size_t s = 0; s < config.widths.size(); s++)
+	{
+		for (size_t n = 0; n < config.batches.size(); n++)
+		{
+			SDeviceMemoryFootprint defaultFootprint;
+			SDeviceMemoryFootprint inPlaceFootprint;
+			if (!noiseCleaner.GetDeviceMemoryFootprint(config.widths[s], config.heights[s], config.batches[n], false, defaultFootprint) ||
+				!noiseCleaner.GetDeviceMemoryFootprint(config.widths[s], config.heights[s], config.batches[n], true, inPlaceFootprint))
+				continue;
+
+			double saved = 1.0 - (double)inPlaceFootprint.totalBytes / (double)defaultFootprint.totalBytes;
+			os << config.widths[s] << "x" << config.heights[s] << "\t" << config.batches[n] << "\t" << defaultFootprint.totalBytes
+			   << "\t" << inPlaceFootprint.totalBytes << (inPlaceFootprint.isInPlace ? "" : " (not square)") << "\t"
+			   << (int)(saved * 100.0 + 0.5) << "%\n";
+		}
+	}
+}
+//-----------------------------------------------------------------------------------------
+static void PrintUsage(const char* pProgName)
+{
+	std::cerr << "Usage: " << pProgName << " [options]\n"
+			  << "  --sizes LIST      Image sizes, 'N' or 'WxH' separated by commas (default 64,128,256,512,1024)\n"
+			  << "  --batches LIST    Frames per timed sample (default 1,4,16)\n"
+			  << "  --modes LIST      Thresholding modes: hard,soft (default both)\n"
+			  << "  --backends LIST   OpenCL device types: gpu,cpu,accelerator (default gpu,cpu)\n"
+			  << "  --iters N         Timed samples per configuration (default " << DEF_ITERATIONS << ")\n"
+			  << "  --warmup N        Untimed samples per configuration (default " << DEF_WARMUP << ")\n"
+			  << "  --thresh T        Threshold passed to CleanNoise (default " << DEF_THRESH << ")\n"
+			  << "  --no-profiling    Create the queues without profiling, device times are reported as 0\n"
+			  << "  --format FMT      Output format: json or csv (default json)\n"
+			  << "  --out FILE        Output file, '-' for stdout (default bench_results.<format>)\n"
+			  << "  --trace FILE      Also write a Chrome trace (chrome://tracing, ui.perfetto.dev) of all commands\n"
+			  << "  --transpose       Measure the transpose kernels against a device-to-device copy for every size\n"
+			  << "                    (--iters transposes per kernel) instead of denoising\n"
+			  << "  --in-place        Use the single-buffer pipeline (CNoiseCleaner::SetInPlaceMode)\n"
+			  << "  --non-standard    Use the non-standard 2D decomposition (CNoiseCleaner::SetNonStandardMode)\n"
+			  << "  --neigh N         Use the neighbourhood thresholding in NxN windows (CNoiseCleaner::SetNeighThreshMode)\n"
+			  << "  --metrics         Also reduce the quality and sparsity metrics of every frame on the device\n"
+			  << "  --half            Store the coefficients as halves and report the PSNR against the 32-bit pipeline\n"
+			  << "  --integer         Use the integer transform (CleanNoiseInteger) and report the PSNR against the\n"
+			  << "                    32-bit pipeline\n"
+			  << "  --memory          Print the device memory of both pipelines for every size and batch and exit\n"
+			  << "  --tune            Auto-tune the kernels for the sizes (--iters runs per candidate) and save the\n"
+			  << "                    tuning file of every device before the sweep\n"
+			  << "  --cpu-transform   Compare the naive and the cache-blocked 2D transforms on the CPU for every\n"
+			  << "                    power of 2 size, with the cache misses of perf events, instead of denoising\n";
+}
+//-----------------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+	SBenchConfig config;
+	ParseSizes("64,128,256,512,1024", config.widths, config.heights);
+	ParseIntList("1,4,16", config.batches);
+	ParseModes("hard,soft", config.softModes);
+	ParseBackends("gpu,cpu", config.backends);
+	config.iterations = DEF_ITERATIONS;
+	config.warmup = DEF_WARMUP;
+	config.thresh = DEF_THRESH;
+	config.isProfilingEnabled = true;
+	config.isCSV = false;
+	config.isTranspose = false;
+	config.isInPlace = false;
+	config.isNonStandard = false;
+	config.neighWindowSize = 0;
+	config.isMetrics = false;
+	config.isHalfPrecision = false;
+	config.isInteger = false;
+	config.isMemoryReport = false;
+	config.isTune = false;
+	config.isCPUTransform = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char* pArg = argv[i];
+		const char* pValue = (i + 1 < argc) ? argv[i + 1] : NULL;
+		bool isValid = (pValue != NULL);
+		if (!strcmp(pArg, "--no-profiling"))
+		{
+			config.isProfilingEnabled = false;
+			continue;
+		}
+		if (!strcmp(pArg, "--transpose"))
+		{
+			config.isTranspose = true;
+			continue;
+		}
+		if (!strcmp(pArg, "--in-place"))
+		{
+			config.isInPlace = true;
+			continue;
+		}
+		if (!strcmp(pArg, "--non-standard"))
+		{
+			config.isNonStandard = true;
+			continue;
+		}
+		if (!strcmp(pArg, "--metrics"))
+		{
+			config.isMetrics = true;
+			continue;
+		}
+		if (!strcmp(pArg, "--half"))
+		{
+			config.isHalfPrecision = true;
+			continue;
+		}
+		if (!strcmp(pArg, "--integer"))
+		{
+			config.isInteger = true;
+			continue;
+		}
+		if (!strcmp(pArg, "--memory"))
+		{
+			config.isMemoryReport = true;
+			continue;
+		}
+		if (!strcmp(pArg, "--tune"))
+		{
+			config.isTune = true;
+			continue;
+		}
+		if (!strcmp(pArg, "--cpu-transform"))
+		{
+			config.isCPUTransform = true;
+			continue;
+		}
+		if (!strcmp(pArg, "--sizes") && isValid)
+			isValid = ParseSizes(pValue, config.widths, config.heights);
+		else if (!strcmp(pArg, "--batches") && isValid)
+			isValid = ParseIntList(pValue, config.batches);
+		else if (!strcmp(pArg, "--modes") && isValid)
+			isValid = ParseModes(pValue, config.softModes);
+		else if (!strcmp(pArg, "--backends") && isValid)
+			isValid = ParseBackends(pValue, config.backends);
+		else if (!strcmp(pArg, "--iters") && isValid)
+			isValid = ((config.iterations = atoi(pValue)) > 0);
+		else if (!strcmp(pArg, "--warmup") && isValid)
+			isValid = ((config.warmup = atoi(pValue)) >= 0);
+		else if (!strcmp(pArg, "--thresh") && isValid)
+			config.thresh = (float)atof(pValue);
+		else if (!strcmp(pArg, "--neigh") && isValid)
+			isValid = ((config.neighWindowSize = atoi(pValue)) > 0 && config.neighWindowSize % 2 == 1 &&
+					   config.neighWindowSize <= CNoiseCleaner::NEIGH_MAX_WINDOW_SIZE);
+		else if (!strcmp(pArg, "--format") && isValid)
+		{
+			config.isCSV = !strcmp(pValue, "csv");
+			isValid = config.isCSV || !strcmp(pValue, "json");
+		}
+		else if (!strcmp(pArg, "--out") && isValid)
+			config.outFile = pValue;
+		else if (!strcmp(pArg, "--trace") && isValid)
+			config.traceFile = pValue;
+		else
+			isValid = false;
+
+		if (!isValid)
+		{
+			PrintUsage(argv[0]);
+			return -1;
+		}
+		i++;
+	}
+	if (config.outFile.empty())
+		config.outFile = config.isCSV ? "bench_results.csv" : "bench_results.json";
+
+	std::vector<SBenchResult> results;
+	std::vector<STransposeResult> transposeResults;
+	std::vector<SCPUTransformResult> cpuTransformResults;
+	for (size_t s = 0; s < config.widths.size() && config.isCPUTransform; s++)
+	{
+		int width = config.widths[s];
+		int height = config.heights[s];
+		if ((width & (width - 1)) != 0 || (height & (height - 1)) != 0)
+		{
+			std::cerr << "Skipping " << width << "x" << height << ": the sides must be powers of 2" << std::endl;
+			continue;
+		}
+		SCPUTransformResult naive;
+		SCPUTransformResult blocked;
+		RunCPUTransform(config, width, height, false, naive);
+		RunCPUTransform(config, width, height, true, blocked);
+		std::cerr << width << "x" << height << " CPU transform: naive " << naive.medianMs << " ms, blocked " << blocked.medianMs << " ms";
+		if (blocked.hasCounters)
+			std::cerr << ", cache misses " << naive.cacheMisses << " -> " << blocked.cacheMisses << ", L1D read misses "
+					  << naive.l1dReadMisses << " -> " << blocked.l1dReadMisses;
+		else
+			std::cerr << " (no cache counters)";
+		std::cerr << std::endl;
+		cpuTransformResults.push_back(naive);
+		cpuTransformResults.push_back(blocked);
+	}
+	CEventTracer tracer;
+	for (size_t b = 0; b < config.backends.size() && !config.isCPUTransform; b++)
+	{
+		cl_device_type deviceType = config.backends[b];
+		if (!OpenCLEnv::IsDeviceTypeAvailable(deviceType))
+		{
+			std::cerr << "Skipping backend '" << GetBackendName(deviceType) << "': no such OpenCL device" << std::endl;
+			continue;
+		}
+
+		CNoiseCleaner noiseCleaner(deviceType, config.isProfilingEnabled, config.isHalfPrecision);
+		noiseCleaner.SetInPlaceMode(config.isInPlace);
+		noiseCleaner.SetNeighThreshMode(config.neighWindowSize);
+		if (config.isMemoryReport)
+		{
+			PrintMemoryReport(std::cout, noiseCleaner, config);
+			continue;
+		}
+		noiseCleaner.SetNonStandardMode(config.isNonStandard);
+		if (config.isTune)
+		{
+			// Both sides of every size are tuned as row lengths
+			std::vector<int> tuneSizes;
+			for (size_t s = 0; s < config.widths.size(); s++)
+			{
+				tuneSizes.push_back(config.widths[s]);
+				tuneSizes.push_back(config.heights[s]);
+			}
+			if (!noiseCleaner.AutoTune(&tuneSizes[0], (int)tuneSizes.size(), config.iterations))
+			{
+				std::cerr << "Auto-tuning requires profiling and the tuning file to be writable" << std::endl;
+				return -1;
+			}
+			const STuningParams& tuning = noiseCleaner.GetTuning();
+			std::cerr << GetBackendName(deviceType) << " tuning saved to " << noiseCleaner.GetTuningFilename() << ": transpose tile "
+					  << tuning.transposeTileSize << ", thresh work-group " << tuning.threshWorkGroupSize << std::endl;
+		}
+		if (!config.traceFile.empty())
+			noiseCleaner.SetTracer(&tracer);
+		for (size_t s = 0; s < config.widths.size() && config.isTranspose; s++)
+		{
+			STransposeResult result;
+			result.backend = GetBackendName(deviceType);
+			result.device = noiseCleaner.GetDeviceName();
+			result.width = config.widths[s];
+			result.height = config.heights[s];
+			if (!noiseCleaner.MeasureTransposeBandwidth(result.width, result.height, config.iterations, result.bandwidth))
+			{
+				std::cerr << "The transpose measurement requires profiling" << std::endl;
+				return -1;
+			}
+			std::cerr << result.backend << " " << result.width << "x" << result.height << " transpose: "
+					  << result.bandwidth.outOfPlaceGBs << " GB/s, in place " << result.bandwidth.inPlaceGBs << " GB/s, copy "
+					  << result.bandwidth.copyGBs << " GB/s" << std::endl;
+			transposeResults.push_back(result);
+		}
+		// The 32-bit reference only produces the outputs the PSNR is measured against
+		CNoiseCleaner* pRefCleaner = NULL;
+		if ((config.isHalfPrecision || config.isInteger) && !config.isTranspose)
+		{
+			pRefCleaner = new CNoiseCleaner(deviceType, false);
+			pRefCleaner->SetInPlaceMode(config.isInPlace);
+			pRefCleaner->SetNonStandardMode(config.isNonStandard && !config.isInteger);
+			pRefCleaner->SetNeighThreshMode(config.isInteger ? 0 : config.neighWindowSize);
+		}
+		for (size_t s = 0; s < config.widths.size() && !config.isTranspose; s++)
+		{
+			for (size_t n = 0; n < config.batches.size(); n++)
+			{
+				for (size_t m = 0; m < config.softModes.size(); m++)
+				{
+					SBenchResult result;
+					result.backend = GetBackendName(deviceType);
+					result.device = noiseCleaner.GetDeviceName();
+					RunConfig(noiseCleaner, pRefCleaner, config, config.widths[s], config.heights[s], config.batches[n], config.softModes[m], result);
+					std::cerr << result.backend << " " << result.width << "x" << result.height << " batch " << result.batch
+							  << (result.isSoftThresh ? " soft" : " hard") << ": median " << result.medianFrameMs << " ms, p99 "
+							  << result.p99FrameMs << " ms, " << result.mpixPerSec << " MPix/s";
+					if (pRefCleaner)
+						std::cerr << ", PSNR " << result.psnrDb << " dB";
+					std::cerr << std::endl;
+					results.push_back(result);
+				}
+			}
+		}
+		delete pRefCleaner;
+	}
+
+	if (config.isMemoryReport)
+		return 0;
+
+	if (!config.traceFile.empty() && !tracer.WriteChromeTrace(config.traceFile.c_str()))
+		std::cerr << "Failed to write trace file: " << config.traceFile << std::endl;
+
+	std::ofstream outFile;
+	bool isStdout = (config.outFile == "-");
+	if (!isStdout)
+	{
+		outFile.open(config.outFile.c_str());
+		if (!outFile.is_open())
+		{
+			std::cerr << "Failed to open output file: " << config.outFile << std::endl;
+			return -1;
+		}
+	}
+	std::ostream& os = isStdout ? std::cout : outFile;
+	if (config.isCPUTransform)
+	{
+		if (config.isCSV)
+			WriteCPUTransformCSV(os, cpuTransformResults);
+		else
+			WriteCPUTransformJSON(os, cpuTransformResults);
+		return cpuTransformResults.empty() ? -1 : 0;
+	}
+	if (config.isTranspose)
+	{
+		if (config.isCSV)
+			WriteTransposeCSV(os, transposeResults);
+		else
+			WriteTransposeJSON(os, transposeResults);
+		return transposeResults.empty() ? -1 : 0;
+	}
+
+	if (config.isCSV)
+		WriteCSV(os, results);
+	else
+		WriteJSON(os, results);
+
+	return results.empty() ? -1 : 0;
+}
@@ -0,0 +1,137 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <iostream>
+#include <CL/cl.h>
+
+#include "Utils.h"
+#include "NoiseCleaner.h"
+#include "DenoiseServer.h"
+
+
+// -----------------------------------------------------------------------------------------
+// Local denoising daemon. Owns one CNoiseCleaner and serves CDenoiseClient connections on
+// a Unix domain socket, coalescing concurrent same-size requests into batched launches
+// (see DenoiseServer.h). Runs until SIGINT/SIGTERM and prints its statistics at exit.
+// -----------------------------------------------------------------------------------------
+
+#define DEF_WINDOW_US		500
+#define DEF_MAX_BATCH		16
+
+
+static volatile int g_isStopRequested = 0;
+
+//-----------------------------------------------------------------------------------------
+static void OnStopSignal(int)
+{
+	g_isStopRequested = 1;
+}
+//-----------------------------------------------------------------------------------------
+static void PrintUsage(const char* pProgName)
+{
+	std::cerr << "Usage: " << pProgName << " [options]\n"
+			  << "  --socket PATH       Unix domain socket to listen on (default " << DENOISE_DEFAULT_SOCKET << ")\n"
+			  << "  --window-us N       Longest time a request waits for others to batch with (default " << DEF_WINDOW_US << ")\n"
+			  << "  --max-batch N       Most frames launched together (default " << DEF_MAX_BATCH << ")\n"
+			  << "  --backend TYPE      OpenCL device type: gpu, cpu or accelerator (default gpu)\n"
+			  << "  --stats-interval S  Print the server statistics every S seconds (default: only at exit)\n"
+			  << "  --profiling         Create the command queues with profiling and print per-stage stats at exit\n";
+}
+//-----------------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+	SDenoiseServerConfig config;
+	config.socketPath = DENOISE_DEFAULT_SOCKET;
+	config.batchWindow = (cl_ulong)DEF_WINDOW_US * 1000;
+	config.maxBatchSize = DEF_MAX_BATCH;
+	config.statsInterval = 0;
+	cl_device_type deviceType = CL_DEVICE_TYPE_GPU;
+	bool isProfilingEnabled = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char* pArg = argv[i];
+		const char* pValue = (i + 1 < argc) ? argv[i + 1] : NULL;
+		if (!strcmp(pArg, "--profiling"))
+		{
+			isProfilingEnabled = true;
+			continue;
+		}
+
+		bool isValid = (pValue != NULL);
+		if (!strcmp(pArg, "--socket") && isValid)
+			config.socketPath = pValue;
+		else if (!strcmp(pArg, "--window-us") && isValid)
+			config.batchWindow = (cl_ulong)strtoul(pValue, NULL, 10) * 1000;
+		else if (!strcmp(pArg, "--max-batch") && isValid)
+			isValid = ((config.maxBatchSize = atoi(pValue)) > 0);
+		else if (!strcmp(pArg, "--stats-interval") && isValid)
+			config.statsInterval = (cl_ulong)(atof(pValue) * 1e9);
+		else if (!strcmp(pArg, "--backend") && isValid)
+		{
+			if (!strcmp(pValue, "gpu"))
+				deviceType = CL_DEVICE_TYPE_GPU;
+			else if (!strcmp(pValue, "cpu"))
+				deviceType = CL_DEVICE_TYPE_CPU;
+			else if (!strcmp(pValue, "accelerator"))
+				deviceType = CL_DEVICE_TYPE_ACCELERATOR;
+			else
+				isValid = false;
+		}
+		else
+			isValid = false;
+
+		if (!isValid)
+		{
+			PrintUsage(argv[0]);
+			return -1;
+		}
+		i++;
+	}
+
+	// The program is built once here and shared by all clients
+	CNoiseCleaner noiseCleaner(deviceType, isProfilingEnabled);
+	CCleanNoiseStatsCollector statsCollector;
+	if (isProfilingEnabled)
+		noiseCleaner.SetStatsCollector(&statsCollector);
+
+	CDenoiseServer server(noiseCleaner, config);
+	if (!server.Start())
+		return -1;
+
+	signal(SIGINT, OnStopSignal);
+	signal(SIGTERM, OnStopSignal);
+	std::cerr << "Serving on " << config.socketPath << " with " << noiseCleaner.GetDeviceName()
+			  << " (window " << config.batchWindow / 1000 << " micro sec, max batch " << config.maxBatchSize << ")" << std::endl;
+
+	server.Run(&g_isStopRequested);
+	server.Stop();
+
+	server.PrintStats(std::cerr);
+	if (isProfilingEnabled)
+		statsCollector.Print(std::cerr);
+
+	return 0;
+}
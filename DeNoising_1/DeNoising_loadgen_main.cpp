@@ -0,0 +1,285 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <CL/cl.h>
+
+#include "Utils.h"
+#include "NoiseCleanerStats.h"
+#include "DenoiseClient.h"
+
+
+// -----------------------------------------------------------------------------------------
+// Load generator for the local denoising daemon. Every simulated client is a thread with
+// its own CDenoiseClient connection which sends a fixed number of requests back-to-back
+// (optionally pausing between them), cycling through the requested frame sizes. At exit
+// it reports the throughput, the round-trip latency and the batching seen by the clients,
+// followed by the server's own statistics. With '--check' every output is compared to
+// the first output of the same size, which catches results depending on the batch a
+// frame happened to run in.
+// -----------------------------------------------------------------------------------------
+
+#define DEF_THRESH			0.12f
+#define DEF_CLIENTS			8
+#define DEF_REQUESTS		200
+
+
+struct SLoadConfig
+{
+	std::string			socketPath;
+	int					numClients;
+	int					numRequests;
+	std::vector<int>	widths;
+	std::vector<int>	heights;
+	float				thresh;
+	bool				isSoftThresh;
+	int					thinkTimeUs;
+	bool				isCheck;
+};
+
+struct SClientResult
+{
+	CStatsHistogram		latencyHist;		// Nanoseconds
+	CStatsHistogram		batchSizeHist;
+	int					numFailed;
+	int					numMismatches;
+};
+
+
+//-----------------------------------------------------------------------------------------
+static bool ParseSizes(const char* pStr, std::vector<int>& widths, std::vector<int>& heights)
+{
+	// Each entry is either 'N' (a square NxN image) or 'WxH'
+	widths.clear();
+	heights.clear();
+	while (*pStr)
+	{
+		char* pEnd = NULL;
+		long width = strtol(pStr, &pEnd, 10);
+		long height = width;
+		if (pEnd == pStr || width <= 0)
+			return false;
+		if (*pEnd == 'x')
+		{
+			pStr = pEnd + 1;
+			height = strtol(pStr, &pEnd, 10);
+			if (pEnd == pStr || height <= 0)
+				return false;
+		}
+		widths.push_back((int)width);
+		heights.push_back((int)height);
+		if (*pEnd != ',' && *pEnd != '\0')
+			return false;
+		pStr = (*pEnd == ',') ? pEnd + 1 : pEnd;
+	}
+	return !widths.empty();
+}
+//-----------------------------------------------------------------------------------------
+static void MakeTestImage(unsigned char* pImage, int width, int height)
+{
+	// A checkerboard with uniform noise, so the thresholding stage has actual work to do
+	unsigned int seed = 12345;
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			seed = seed * 1103515245 + 12345;
+			int noise = (int)((seed >> 16) % 41) - 20;
+			int value = (((x / 16) + (y / 16)) & 1) * 140 + 50 + noise;
+			pImage[y*width + x] = (unsigned char)value;
+		}
+	}
+}
+//-----------------------------------------------------------------------------------------
+static void RunClient(const SLoadConfig& config, int clientIdx, SClientResult& result)
+{
+	result.numFailed = 0;
+	result.numMismatches = 0;
+
+	size_t maxFramePixels = 0;
+	for (size_t i = 0; i < config.widths.size(); i++)
+	{
+		if ((size_t)config.widths[i] * config.heights[i] > maxFramePixels)
+			maxFramePixels = (size_t)config.widths[i] * config.heights[i];
+	}
+
+	CDenoiseClient client;
+	if (!client.Connect(config.socketPath.c_str(), maxFramePixels))
+	{
+		std::cerr << "Client " << clientIdx << " failed to connect to " << config.socketPath << std::endl;
+		result.numFailed = config.numRequests;
+		return;
+	}
+
+	std::vector<std::vector<unsigned char> > firstOutputs(config.widths.size());
+	for (int i = 0; i < config.numRequests; i++)
+	{
+		// Clients start at different sizes so mixed geometries arrive at the same time
+		size_t sizeIdx = (clientIdx + i) % config.widths.size();
+		int width = config.widths[sizeIdx];
+		int height = config.heights[sizeIdx];
+		size_t numPixels = (size_t)width * height;
+
+		// The frame is generated straight into the shared segment, so nothing is copied
+		MakeTestImage(client.GetInputFrame(), width, height);
+
+		SDenoiseReply reply;
+		cl_ulong startTime = OpenCLEnv::GetHostTime();
+		int status = client.CleanNoise(client.GetInputFrame(), client.GetOutputFrame(), width, height, config.thresh,
+									   config.isSoftThresh, &reply);
+		cl_ulong endTime = OpenCLEnv::GetHostTime();
+		if (status != DENOISE_STATUS_OK)
+		{
+			result.numFailed++;
+			if (status == DENOISE_STATUS_DISCONNECTED)
+			{
+				result.numFailed += config.numRequests - i - 1;
+				break;
+			}
+			continue;
+		}
+
+		result.latencyHist.Add(endTime - startTime);
+		result.batchSizeHist.Add(reply.batchSize);
+		if (config.isCheck)
+		{
+			std::vector<unsigned char>& firstOutput = firstOutputs[sizeIdx];
+			if (firstOutput.empty())
+				firstOutput.assign(client.GetOutputFrame(), client.GetOutputFrame() + numPixels);
+			else if (memcmp(&firstOutput[0], client.GetOutputFrame(), numPixels) != 0)
+				result.numMismatches++;
+		}
+
+		if (config.thinkTimeUs > 0)
+			std::this_thread::sleep_for(std::chrono::microseconds(config.thinkTimeUs));
+	}
+}
+//-----------------------------------------------------------------------------------------
+static void PrintUsage(const char* pProgName)
+{
+	std::cerr << "Usage: " << pProgName << " [options]\n"
+			  << "  --socket PATH       Daemon socket (default " << DENOISE_DEFAULT_SOCKET << ")\n"
+			  << "  --clients N         Concurrent client connections (default " << DEF_CLIENTS << ")\n"
+			  << "  --requests N        Requests sent by every client (default " << DEF_REQUESTS << ")\n"
+			  << "  --sizes LIST        Frame sizes, 'N' or 'WxH' separated by commas (default 64)\n"
+			  << "  --thresh T          Threshold (default " << DEF_THRESH << ")\n"
+			  << "  --mode MODE         Thresholding mode: hard or soft (default soft)\n"
+			  << "  --think-us N        Pause between the requests of a client (default 0)\n"
+			  << "  --check             Verify that equal frames give equal outputs\n";
+}
+//-----------------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+	SLoadConfig config;
+	config.socketPath = DENOISE_DEFAULT_SOCKET;
+	config.numClients = DEF_CLIENTS;
+	config.numRequests = DEF_REQUESTS;
+	ParseSizes("64", config.widths, config.heights);
+	config.thresh = DEF_THRESH;
+	config.isSoftThresh = true;
+	config.thinkTimeUs = 0;
+	config.isCheck = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char* pArg = argv[i];
+		const char* pValue = (i + 1 < argc) ? argv[i + 1] : NULL;
+		if (!strcmp(pArg, "--check"))
+		{
+			config.isCheck = true;
+			continue;
+		}
+
+		bool isValid = (pValue != NULL);
+		if (!strcmp(pArg, "--socket") && isValid)
+			config.socketPath = pValue;
+		else if (!strcmp(pArg, "--clients") && isValid)
+			isValid = ((config.numClients = atoi(pValue)) > 0);
+		else if (!strcmp(pArg, "--requests") && isValid)
+			isValid = ((config.numRequests = atoi(pValue)) > 0);
+		else if (!strcmp(pArg, "--sizes") && isValid)
+			isValid = ParseSizes(pValue, config.widths, config.heights);
+		else if (!strcmp(pArg, "--thresh") && isValid)
+			config.thresh = (float)atof(pValue);
+		else if (!strcmp(pArg, "--mode") && isValid)
+		{
+			config.isSoftThresh = !strcmp(pValue, "soft");
+			isValid = config.isSoftThresh || !strcmp(pValue, "hard");
+		}
+		else if (!strcmp(pArg, "--think-us") && isValid)
+			isValid = ((config.thinkTimeUs = atoi(pValue)) >= 0);
+		else
+			isValid = false;
+
+		if (!isValid)
+		{
+			PrintUsage(argv[0]);
+			return -1;
+		}
+		i++;
+	}
+
+	std::vector<SClientResult> results(config.numClients);
+	std::vector<std::thread> clients;
+	cl_ulong startTime = OpenCLEnv::GetHostTime();
+	for (int i = 0; i < config.numClients; i++)
+		clients.push_back(std::thread(RunClient, std::cref(config), i, std::ref(results[i])));
+	for (size_t i = 0; i < clients.size(); i++)
+		clients[i].join();
+	double elapsedSec = (double)(OpenCLEnv::GetHostTime() - startTime) / 1e9;
+
+	CStatsHistogram latencyHist;
+	CStatsHistogram batchSizeHist;
+	int numFailed = 0;
+	int numMismatches = 0;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		latencyHist.Merge(results[i].latencyHist);
+		batchSizeHist.Merge(results[i].batchSizeHist);
+		numFailed += results[i].numFailed;
+		numMismatches += results[i].numMismatches;
+	}
+
+	std::cout << config.numClients << " clients, " << latencyHist.GetCount() << " frames in " << elapsedSec << " s: "
+			  << (double)latencyHist.GetCount() / elapsedSec << " frames/s, " << numFailed << " failed";
+	if (config.isCheck)
+		std::cout << ", " << numMismatches << " mismatches";
+	std::cout << "\n  latency (micro sec): mean " << latencyHist.GetMean() / 1e3 << ", p50 "
+			  << (double)latencyHist.GetPercentile(50.0) / 1e3 << ", p99 " << (double)latencyHist.GetPercentile(99.0) / 1e3
+			  << "; batch size seen: mean " << batchSizeHist.GetMean() << ", max " << batchSizeHist.GetMax() << std::endl;
+
+	CDenoiseClient statsClient;
+	SDenoiseServerStats serverStats;
+	if (statsClient.Connect(config.socketPath.c_str(), 1) && statsClient.GetServerStats(serverStats))
+	{
+		std::cout << "Server: ";
+		PrintDenoiseServerStats(std::cout, serverStats);
+	}
+
+	return (numFailed == 0 && numMismatches == 0) ? 0 : -1;
+}
@@ -0,0 +1,181 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include "DenoiseClient.h"
+
+
+//-----------------------------------------------------------------------------------------
+CDenoiseClient::CDenoiseClient() :
+m_fd(-1),
+m_pShm(NULL),
+m_shmSize(0),
+m_nextSeq(0)
+{
+}
+//-----------------------------------------------------------------------------------------
+CDenoiseClient::~CDenoiseClient()
+{
+	Disconnect();
+}
+//-----------------------------------------------------------------------------------------
+bool CDenoiseClient::Connect(const char* pSocketPath /*= DENOISE_DEFAULT_SOCKET*/, size_t maxFramePixels /*= 1024*1024*/)
+{
+	Disconnect();
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(pSocketPath) >= sizeof(addr.sun_path))
+		return false;
+	strcpy(addr.sun_path, pSocketPath);
+
+	m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_fd < 0)
+		return false;
+	if (connect(m_fd, (sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		Disconnect();
+		return false;
+	}
+
+	//
+	// Create the segment holding the input frame followed by the output frame
+	//
+	SDenoiseRequest request;
+	memset(&request, 0, sizeof(request));
+	request.type = DENOISE_MSG_ATTACH;
+	request.shmSize = 2 * maxFramePixels;
+	snprintf(request.shmName, DENOISE_SHM_NAME_LEN, "/denoise.%d.%lx", (int)getpid(), (unsigned long)(size_t)this);
+
+	int shmFd = shm_open(request.shmName, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (shmFd < 0)
+	{
+		Disconnect();
+		return false;
+	}
+	void* pShm = MAP_FAILED;
+	if (ftruncate(shmFd, (off_t)request.shmSize) == 0)
+		pShm = mmap(NULL, (size_t)request.shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+	close(shmFd);
+	if (pShm == MAP_FAILED)
+	{
+		shm_unlink(request.shmName);
+		Disconnect();
+		return false;
+	}
+	m_pShm = (unsigned char*)pShm;
+	m_shmSize = (size_t)request.shmSize;
+
+	// Once both sides have it mapped the name is no longer needed, so nothing is left behind
+	SDenoiseReply reply;
+	int status = Transact(request, reply);
+	shm_unlink(request.shmName);
+	if (status != DENOISE_STATUS_OK)
+	{
+		Disconnect();
+		return false;
+	}
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+void CDenoiseClient::Disconnect()
+{
+	if (m_pShm)
+		munmap(m_pShm, m_shmSize);
+	m_pShm = NULL;
+	m_shmSize = 0;
+	if (m_fd >= 0)
+		close(m_fd);
+	m_fd = -1;
+}
+//-----------------------------------------------------------------------------------------
+int CDenoiseClient::Transact(SDenoiseRequest& request, SDenoiseReply& reply)
+{
+	if (m_fd < 0)
+		return DENOISE_STATUS_DISCONNECTED;
+
+	request.version = DENOISE_PROTOCOL_VERSION;
+	request.seq = m_nextSeq++;
+	if (!DenoiseSendAll(m_fd, &request, sizeof(request)) || !DenoiseRecvAll(m_fd, &reply, sizeof(reply)) ||
+		reply.seq != request.seq)
+	{
+		Disconnect();
+		return DENOISE_STATUS_DISCONNECTED;
+	}
+
+	return reply.status;
+}
+//-----------------------------------------------------------------------------------------
+int CDenoiseClient::CleanNoise(const unsigned char* in, unsigned char* out, int width, int height, float thresh,
+							   bool isSoftThresh, SDenoiseReply* pReply /*= NULL*/)
+{
+	if (m_pShm == NULL)
+		return DENOISE_STATUS_DISCONNECTED;
+	if (width <= 0 || height <= 0 || (size_t)width * height > m_shmSize / 2)
+		return DENOISE_STATUS_BAD_REQUEST;
+
+	size_t numPixels = (size_t)width * height;
+	if (in != GetInputFrame())
+		memcpy(GetInputFrame(), in, numPixels);
+
+	SDenoiseRequest request;
+	memset(&request, 0, sizeof(request));
+	request.type = DENOISE_MSG_CLEAN;
+	request.width = width;
+	request.height = height;
+	request.thresh = thresh;
+	request.isSoftThresh = isSoftThresh ? 1 : 0;
+
+	SDenoiseReply reply;
+	int status = Transact(request, reply);
+	if (pReply && status != DENOISE_STATUS_DISCONNECTED)
+		*pReply = reply;
+	if (status == DENOISE_STATUS_OK && out != GetOutputFrame())
+		memcpy(out, GetOutputFrame(), numPixels);
+
+	return status;
+}
+//-----------------------------------------------------------------------------------------
+bool CDenoiseClient::GetServerStats(SDenoiseServerStats& stats)
+{
+	SDenoiseRequest request;
+	memset(&request, 0, sizeof(request));
+	request.type = DENOISE_MSG_STATS;
+
+	SDenoiseReply reply;
+	if (Transact(request, reply) != DENOISE_STATUS_OK)
+		return false;
+	if (!DenoiseRecvAll(m_fd, &stats, sizeof(stats)))
+	{
+		Disconnect();
+		return false;
+	}
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
@@ -0,0 +1,79 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef __DENOISE_CLIENT_H__
+#define __DENOISE_CLIENT_H__
+
+#include <stddef.h>
+#include "DenoiseProtocol.h"
+
+
+// -----------------------------------------------------------------------------------------
+// Client side of the local denoising daemon (see DenoiseServer.h). It offers the same call
+// as CNoiseCleaner::CleanNoise, but the frame is denoised by the daemon's shared
+// CNoiseCleaner, possibly batched with frames of other clients. The frames are passed
+// through a shared memory segment created in 'Connect'; callers which fill
+// 'GetInputFrame' directly and read 'GetOutputFrame' avoid both copies.
+// An instance is a single connection and is not thread-safe, threads should use one
+// instance each. POSIX only.
+// -----------------------------------------------------------------------------------------
+class CDenoiseClient
+{
+public:
+	CDenoiseClient();
+	~CDenoiseClient();
+
+	// -----------------------------------------------------------------------------------------
+	// Connects to the daemon listening on 'pSocketPath' and attaches a shared memory segment
+	// large enough for frames of up to 'maxFramePixels' pixels.
+	// -----------------------------------------------------------------------------------------
+	bool Connect(const char* pSocketPath = DENOISE_DEFAULT_SOCKET, size_t maxFramePixels = 1024*1024);
+	void Disconnect();
+	bool IsConnected() const { return m_fd >= 0; }
+
+	// -----------------------------------------------------------------------------------------
+	// Denoises the 'width' x 'height' frame 'in' into 'out', the parameters have the same
+	// meaning as in CNoiseCleaner::CleanNoise. Returns DENOISE_STATUS_OK (0) on success, or
+	// one of the other EDenoiseStatus values. 'pReply' receives the batching details.
+	// -----------------------------------------------------------------------------------------
+	int CleanNoise(const unsigned char* in, unsigned char* out, int width, int height, float thresh, bool isSoftThresh,
+				   SDenoiseReply* pReply = NULL);
+
+	unsigned char* GetInputFrame() { return m_pShm; }
+	unsigned char* GetOutputFrame() { return m_pShm ? m_pShm + m_shmSize / 2 : NULL; }
+
+	bool GetServerStats(SDenoiseServerStats& stats);
+
+private:
+	CDenoiseClient(const CDenoiseClient&);
+	CDenoiseClient& operator=(const CDenoiseClient&);
+
+	int Transact(SDenoiseRequest& request, SDenoiseReply& reply);
+
+	int					m_fd;
+	unsigned char*		m_pShm;
+	size_t				m_shmSize;
+	cl_uint				m_nextSeq;
+};
+
+
+
+#endif	// __DENOISE_CLIENT_H__
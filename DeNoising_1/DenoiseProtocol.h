@@ -0,0 +1,163 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef __DENOISE_PROTOCOL_H__
+#define __DENOISE_PROTOCOL_H__
+
+#include <CL/cl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <iostream>
+#include <iomanip>
+
+
+// -----------------------------------------------------------------------------------------
+// Wire format shared by the local denoising daemon (CDenoiseServer) and its clients
+// (CDenoiseClient). Both ends run on the same host, so the structures are sent as-is.
+// A client connects to the daemon's Unix domain socket, creates a POSIX shared memory
+// segment and attaches it with DENOISE_MSG_ATTACH. The first half of the segment holds the
+// input frame and the second half the output frame, so a DENOISE_MSG_CLEAN request only
+// carries the frame geometry and the pixels never go through the socket.
+// Every request is answered with one SDenoiseReply, DENOISE_MSG_STATS is followed by an
+// SDenoiseServerStats.
+// -----------------------------------------------------------------------------------------
+
+#define DENOISE_PROTOCOL_VERSION	1
+#define DENOISE_DEFAULT_SOCKET		"/tmp/denoised.sock"
+#define DENOISE_SHM_NAME_LEN		64
+
+enum EDenoiseMsgType
+{
+	DENOISE_MSG_ATTACH = 1,		// Map the client's shared memory segment
+	DENOISE_MSG_CLEAN,			// Denoise the frame in the shared memory segment
+	DENOISE_MSG_STATS			// Query the server statistics
+};
+
+enum EDenoiseStatus
+{
+	DENOISE_STATUS_OK = 0,
+	DENOISE_STATUS_BAD_REQUEST = -1,	// Unknown message, bad geometry or frame larger than the segment
+	DENOISE_STATUS_NOT_ATTACHED = -2,	// DENOISE_MSG_CLEAN before a successful DENOISE_MSG_ATTACH
+	DENOISE_STATUS_SHM_FAILED = -3,		// The server could not map the segment
+	DENOISE_STATUS_FAILED = -4,			// CleanNoise failed or the server is shutting down
+	DENOISE_STATUS_DISCONNECTED = -5	// Client side only, the connection to the server is lost
+};
+
+struct SDenoiseRequest
+{
+	cl_uint		type;				// EDenoiseMsgType
+	cl_uint		version;			// DENOISE_PROTOCOL_VERSION
+	cl_uint		seq;				// Echoed in the reply
+	cl_uint		width;				// DENOISE_MSG_CLEAN only
+	cl_uint		height;
+	cl_float	thresh;
+	cl_uint		isSoftThresh;
+	cl_ulong	shmSize;			// DENOISE_MSG_ATTACH only, in bytes
+	char		shmName[DENOISE_SHM_NAME_LEN];
+};
+
+struct SDenoiseReply
+{
+	cl_int		status;				// EDenoiseStatus
+	cl_uint		seq;
+	cl_uint		batchSize;			// Number of frames launched together with this one
+	cl_uint		queueDepth;			// Requests waiting in the server when the batch was formed
+	cl_ulong	queuedTime;			// Nanoseconds from arrival until the batch was launched
+	cl_ulong	serviceTime;		// Nanoseconds the batch spent in CleanNoiseBatch
+};
+
+struct SDenoiseServerStats
+{
+	cl_ulong	numClients;			// Currently connected
+	cl_ulong	numRequests;		// Frames denoised
+	cl_ulong	numRejected;
+	cl_ulong	numBatches;
+	cl_double	meanBatchSize;
+	cl_uint		maxBatchSize;
+	cl_uint		maxQueueDepth;
+	cl_double	meanQueueDepth;
+	cl_ulong	p50QueuedTime;		// Nanoseconds
+	cl_ulong	p99QueuedTime;
+	cl_ulong	p50ServiceTime;
+	cl_ulong	p99ServiceTime;
+};
+
+
+// -----------------------------------------------------------------------------------------
+// Blocking helpers which send/receive exactly 'size' bytes, false if the peer went away.
+// -----------------------------------------------------------------------------------------
+inline bool DenoiseSendAll(int fd, const void* pData, size_t size)
+{
+	const char* pBytes = (const char*)pData;
+	while (size > 0)
+	{
+		ssize_t numSent = send(fd, pBytes, size, MSG_NOSIGNAL);
+		if (numSent < 0 && errno == EINTR)
+			continue;
+		if (numSent <= 0)
+			return false;
+		pBytes += numSent;
+		size -= numSent;
+	}
+	return true;
+}
+
+inline bool DenoiseRecvAll(int fd, void* pData, size_t size)
+{
+	char* pBytes = (char*)pData;
+	while (size > 0)
+	{
+		ssize_t numReceived = recv(fd, pBytes, size, 0);
+		if (numReceived < 0 && errno == EINTR)
+			continue;
+		if (numReceived <= 0)
+			return false;
+		pBytes += numReceived;
+		size -= numReceived;
+	}
+	return true;
+}
+
+// -----------------------------------------------------------------------------------------
+// Prints 'stats' in a human readable form, times in micro seconds.
+// -----------------------------------------------------------------------------------------
+inline void PrintDenoiseServerStats(std::ostream& os, const SDenoiseServerStats& stats)
+{
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+
+	os << std::fixed << std::setprecision(2);
+	os << "Clients: " << stats.numClients << ", requests: " << stats.numRequests << ", rejected: " << stats.numRejected
+	   << ", batches: " << stats.numBatches << "\n";
+	os << "  batch size: mean " << stats.meanBatchSize << ", max " << stats.maxBatchSize
+	   << "; queue depth: mean " << stats.meanQueueDepth << ", max " << stats.maxQueueDepth << "\n";
+	os << "  queued (micro sec): p50 " << (double)stats.p50QueuedTime / 1e3 << ", p99 " << (double)stats.p99QueuedTime / 1e3
+	   << "; batch service (micro sec): p50 " << (double)stats.p50ServiceTime / 1e3 << ", p99 " << (double)stats.p99ServiceTime / 1e3
+	   << std::endl;
+
+	os.flags(flags);
+	os.precision(precision);
+}
+
+
+
+#endif	// __DENOISE_PROTOCOL_H__
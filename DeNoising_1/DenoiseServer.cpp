@@ -0,0 +1,436 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "Utils.h"
+#include "DenoiseServer.h"
+
+// Longest time 'Run' sleeps before checking the stop flag and the stats interval
+#define POLL_INTERVAL_NS	100000000
+
+
+//-----------------------------------------------------------------------------------------
+CDenoiseServer::CDenoiseServer(CNoiseCleaner& noiseCleaner, const SDenoiseServerConfig& config) :
+m_noiseCleaner(noiseCleaner),
+m_config(config),
+m_listenFd(-1),
+m_isStopping(false),
+m_numRequests(0),
+m_numRejected(0)
+{
+	if (m_config.maxBatchSize < 1)
+		m_config.maxBatchSize = 1;
+}
+//-----------------------------------------------------------------------------------------
+CDenoiseServer::~CDenoiseServer()
+{
+	Stop();
+	if (m_acceptThread.joinable())
+		m_acceptThread.join();
+
+	// Client threads may still be sending their last reply, they exit once their socket fails
+	for (size_t i = 0; i < m_clients.size(); i++)
+	{
+		SClient* pClient = m_clients[i];
+		if (pClient->thread.joinable())
+			pClient->thread.join();
+		if (pClient->pShm)
+			munmap(pClient->pShm, pClient->shmSize);
+		close(pClient->fd);
+		delete pClient;
+	}
+
+	if (m_listenFd >= 0)
+	{
+		close(m_listenFd);
+		unlink(m_config.socketPath.c_str());
+	}
+}
+//-----------------------------------------------------------------------------------------
+bool CDenoiseServer::Start()
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (m_config.socketPath.size() >= sizeof(addr.sun_path))
+	{
+		std::cerr << "Socket path is too long: " << m_config.socketPath << std::endl;
+		return false;
+	}
+	strcpy(addr.sun_path, m_config.socketPath.c_str());
+
+	m_listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_listenFd < 0)
+	{
+		std::cerr << "Failed to create socket: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	// A socket file left behind by a server which did not exit cleanly would make bind fail
+	unlink(m_config.socketPath.c_str());
+	if (bind(m_listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(m_listenFd, SOMAXCONN) != 0)
+	{
+		std::cerr << "Failed to listen on " << m_config.socketPath << ": " << strerror(errno) << std::endl;
+		close(m_listenFd);
+		m_listenFd = -1;
+		return false;
+	}
+
+	m_acceptThread = std::thread(&CDenoiseServer::AcceptLoop, this);
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+void CDenoiseServer::Stop()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_isStopping)
+		return;
+	m_isStopping = true;
+
+	// Requests which did not make it into a batch are failed, so their clients get a reply
+	for (size_t i = 0; i < m_pending.size(); i++)
+	{
+		m_pending[i]->reply.status = DENOISE_STATUS_FAILED;
+		m_pending[i]->isDone = true;
+	}
+	m_pending.clear();
+	m_pendingCond.notify_all();
+	m_doneCond.notify_all();
+
+	// Wakes up the blocking accept and recv calls
+	if (m_listenFd >= 0)
+		shutdown(m_listenFd, SHUT_RDWR);
+	for (size_t i = 0; i < m_clients.size(); i++)
+		shutdown(m_clients[i]->fd, SHUT_RDWR);
+}
+//-----------------------------------------------------------------------------------------
+void CDenoiseServer::AcceptLoop()
+{
+	for (;;)
+	{
+		int fd = accept(m_listenFd, NULL, NULL);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;		// The socket was shut down by 'Stop'
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_isStopping)
+		{
+			close(fd);
+			break;
+		}
+
+		ReapClients();
+		SClient* pClient = new SClient;
+		pClient->fd = fd;
+		pClient->pShm = NULL;
+		pClient->shmSize = 0;
+		pClient->isFinished = false;
+		m_clients.push_back(pClient);
+		pClient->thread = std::thread(&CDenoiseServer::ServeClient, this, pClient);
+	}
+}
+//-----------------------------------------------------------------------------------------
+void CDenoiseServer::ReapClients()
+{
+	size_t numLeft = 0;
+	for (size_t i = 0; i < m_clients.size(); i++)
+	{
+		SClient* pClient = m_clients[i];
+		if (!pClient->isFinished)
+		{
+			m_clients[numLeft++] = pClient;
+			continue;
+		}
+
+		// The thread has nothing left to do but return
+		pClient->thread.join();
+		if (pClient->pShm)
+			munmap(pClient->pShm, pClient->shmSize);
+		close(pClient->fd);
+		delete pClient;
+	}
+	m_clients.resize(numLeft);
+}
+//-----------------------------------------------------------------------------------------
+void CDenoiseServer::ServeClient(SClient* pClient)
+{
+	SDenoiseRequest request;
+	while (DenoiseRecvAll(pClient->fd, &request, sizeof(request)))
+	{
+		SDenoiseReply reply;
+		memset(&reply, 0, sizeof(reply));
+		reply.seq = request.seq;
+		reply.status = DENOISE_STATUS_OK;
+
+		if (request.version != DENOISE_PROTOCOL_VERSION)
+			reply.status = DENOISE_STATUS_BAD_REQUEST;
+		else if (request.type == DENOISE_MSG_ATTACH)
+			HandleAttach(pClient, request, reply);
+		else if (request.type == DENOISE_MSG_CLEAN)
+			HandleClean(pClient, request, reply);
+		else if (request.type != DENOISE_MSG_STATS)
+			reply.status = DENOISE_STATUS_BAD_REQUEST;
+
+		if (!DenoiseSendAll(pClient->fd, &reply, sizeof(reply)))
+			break;
+		if (reply.status == DENOISE_STATUS_OK && request.type == DENOISE_MSG_STATS)
+		{
+			SDenoiseServerStats stats;
+			GetStats(stats);
+			if (!DenoiseSendAll(pClient->fd, &stats, sizeof(stats)))
+				break;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	pClient->isFinished = true;
+}
+//-----------------------------------------------------------------------------------------
+void CDenoiseServer::HandleAttach(SClient* pClient, const SDenoiseRequest& request, SDenoiseReply& reply)
+{
+	if (memchr(request.shmName, '\0', DENOISE_SHM_NAME_LEN) == NULL || request.shmSize == 0 ||
+		request.shmSize > (cl_ulong)(size_t)-1)
+	{
+		reply.status = DENOISE_STATUS_BAD_REQUEST;
+		return;
+	}
+
+	// Only this client's thread uses the mapping, a new segment replaces the old one
+	if (pClient->pShm)
+	{
+		munmap(pClient->pShm, pClient->shmSize);
+		pClient->pShm = NULL;
+		pClient->shmSize = 0;
+	}
+
+	int shmFd = shm_open(request.shmName, O_RDWR, 0);
+	if (shmFd < 0)
+	{
+		reply.status = DENOISE_STATUS_SHM_FAILED;
+		return;
+	}
+
+	// Touching the pages of the mapping past the end of the segment would kill the daemon with SIGBUS
+	struct stat shmStat;
+	if (fstat(shmFd, &shmStat) != 0 || shmStat.st_size < 0 || (cl_ulong)shmStat.st_size < request.shmSize)
+	{
+		close(shmFd);
+		reply.status = DENOISE_STATUS_SHM_FAILED;
+		return;
+	}
+	void* pShm = mmap(NULL, (size_t)request.shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+	close(shmFd);
+	if (pShm == MAP_FAILED)
+	{
+		reply.status = DENOISE_STATUS_SHM_FAILED;
+		return;
+	}
+
+	pClient->pShm = (unsigned char*)pShm;
+	pClient->shmSize = (size_t)request.shmSize;
+}
+//-----------------------------------------------------------------------------------------
+static bool IsPowerOfTwo(cl_uint value)
+{
+	return value > 0 && (value & (value - 1)) == 0;
+}
+//-----------------------------------------------------------------------------------------
+void CDenoiseServer::HandleClean(SClient* pClient, const SDenoiseRequest& request, SDenoiseReply& reply)
+{
+	if (pClient->pShm == NULL)
+		reply.status = DENOISE_STATUS_NOT_ATTACHED;
+	else if (!IsPowerOfTwo(request.width) || !IsPowerOfTwo(request.height) ||
+			 (cl_ulong)request.width * request.height > pClient->shmSize / 2)
+		reply.status = DENOISE_STATUS_BAD_REQUEST;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (reply.status != DENOISE_STATUS_OK)
+	{
+		m_numRejected++;
+		return;
+	}
+	if (m_isStopping)
+	{
+		reply.status = DENOISE_STATUS_FAILED;
+		return;
+	}
+
+	SPendingRequest pending;
+	pending.pClient = pClient;
+	pending.request = request;
+	pending.arrivalTime = OpenCLEnv::GetHostTime();
+	pending.isDone = false;
+	pending.reply = reply;
+	m_pending.push_back(&pending);
+	m_pendingCond.notify_one();
+
+	while (!pending.isDone)
+		m_doneCond.wait(lock);
+	reply = pending.reply;
+}
+//-----------------------------------------------------------------------------------------
+bool CDenoiseServer::IsSameBatch(const SDenoiseRequest& request1, const SDenoiseRequest& request2)
+{
+	return request1.width == request2.width && request1.height == request2.height &&
+		   request1.thresh == request2.thresh && request1.isSoftThresh == request2.isSoftThresh;
+}
+//-----------------------------------------------------------------------------------------
+void CDenoiseServer::Run(volatile const int* pStopFlag /*= NULL*/)
+{
+	std::vector<SPendingRequest*> batch;
+	cl_ulong lastStatsTime = OpenCLEnv::GetHostTime();
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_isStopping && !(pStopFlag && *pStopFlag))
+	{
+		cl_ulong currTime = OpenCLEnv::GetHostTime();
+		if (m_config.statsInterval > 0 && currTime - lastStatsTime >= m_config.statsInterval)
+		{
+			lock.unlock();
+			PrintStats(std::cerr);
+			lock.lock();
+			lastStatsTime = currTime;
+		}
+
+		cl_ulong waitTime = POLL_INTERVAL_NS;
+		if (!m_pending.empty())
+		{
+			// The oldest request decides which requests form the next batch
+			const SPendingRequest* pOldest = m_pending.front();
+			int numMatching = 0;
+			for (size_t i = 0; i < m_pending.size() && numMatching < m_config.maxBatchSize; i++)
+			{
+				if (IsSameBatch(m_pending[i]->request, pOldest->request))
+					numMatching++;
+			}
+
+			cl_ulong deadline = pOldest->arrivalTime + m_config.batchWindow;
+			if (numMatching >= m_config.maxBatchSize || currTime >= deadline)
+			{
+				cl_uint queueDepth = (cl_uint)m_pending.size();
+				batch.clear();
+				for (size_t i = 0; i < m_pending.size() && (int)batch.size() < m_config.maxBatchSize; )
+				{
+					if (IsSameBatch(m_pending[i]->request, pOldest->request))
+					{
+						batch.push_back(m_pending[i]);
+						m_pending.erase(m_pending.begin() + i);
+					}
+					else
+						i++;
+				}
+
+				lock.unlock();
+				LaunchBatch(batch);
+				lock.lock();
+
+				m_batchSizeHist.Add(batch.size());
+				m_queueDepthHist.Add(queueDepth);
+				m_serviceTimeHist.Add(batch[0]->reply.serviceTime);
+				for (size_t i = 0; i < batch.size(); i++)
+				{
+					SPendingRequest* pRequest = batch[i];
+					pRequest->reply.queueDepth = queueDepth;
+					m_queuedTimeHist.Add(pRequest->reply.queuedTime);
+					if (pRequest->reply.status == DENOISE_STATUS_OK)
+						m_numRequests++;
+					pRequest->isDone = true;
+				}
+				m_doneCond.notify_all();
+				continue;
+			}
+
+			if (deadline - currTime < waitTime)
+				waitTime = deadline - currTime;
+		}
+
+		m_pendingCond.wait_for(lock, std::chrono::nanoseconds(waitTime));
+	}
+}
+//-----------------------------------------------------------------------------------------
+void CDenoiseServer::LaunchBatch(std::vector<SPendingRequest*>& batch)
+{
+	// The frames are denoised straight from/into the clients' shared memory segments
+	std::vector<unsigned char*> inFrames(batch.size());
+	std::vector<unsigned char*> outFrames(batch.size());
+	for (size_t i = 0; i < batch.size(); i++)
+	{
+		SClient* pClient = batch[i]->pClient;
+		inFrames[i] = pClient->pShm;
+		outFrames[i] = pClient->pShm + pClient->shmSize / 2;
+	}
+
+	const SDenoiseRequest& request = batch[0]->request;
+	cl_ulong launchTime = OpenCLEnv::GetHostTime();
+	int err = m_noiseCleaner.CleanNoiseBatch(&inFrames[0], &outFrames[0], (int)batch.size(), request.width, request.height,
+											 request.thresh, request.isSoftThresh != 0);
+	cl_ulong serviceTime = OpenCLEnv::GetHostTime() - launchTime;
+
+	for (size_t i = 0; i < batch.size(); i++)
+	{
+		SDenoiseReply& reply = batch[i]->reply;
+		reply.status = err ? DENOISE_STATUS_FAILED : DENOISE_STATUS_OK;
+		reply.batchSize = (cl_uint)batch.size();
+		reply.queuedTime = launchTime - batch[i]->arrivalTime;
+		reply.serviceTime = serviceTime;
+	}
+}
+//-----------------------------------------------------------------------------------------
+void CDenoiseServer::GetStats(SDenoiseServerStats& stats) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	stats.numClients = 0;
+	for (size_t i = 0; i < m_clients.size(); i++)
+	{
+		if (!m_clients[i]->isFinished)
+			stats.numClients++;
+	}
+	stats.numRequests = m_numRequests;
+	stats.numRejected = m_numRejected;
+	stats.numBatches = m_batchSizeHist.GetCount();
+	stats.meanBatchSize = m_batchSizeHist.GetMean();
+	stats.maxBatchSize = (cl_uint)m_batchSizeHist.GetMax();
+	stats.meanQueueDepth = m_queueDepthHist.GetMean();
+	stats.maxQueueDepth = (cl_uint)m_queueDepthHist.GetMax();
+	stats.p50QueuedTime = m_queuedTimeHist.GetPercentile(50.0);
+	stats.p99QueuedTime = m_queuedTimeHist.GetPercentile(99.0);
+	stats.p50ServiceTime = m_serviceTimeHist.GetPercentile(50.0);
+	stats.p99ServiceTime = m_serviceTimeHist.GetPercentile(99.0);
+}
+//-----------------------------------------------------------------------------------------
+void CDenoiseServer::PrintStats(std::ostream& os) const
+{
+	SDenoiseServerStats stats;
+	GetStats(stats);
+	PrintDenoiseServerStats(os, stats);
+}
+//-----------------------------------------------------------------------------------------
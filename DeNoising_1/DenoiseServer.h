@@ -0,0 +1,136 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef __DENOISE_SERVER_H__
+#define __DENOISE_SERVER_H__
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "NoiseCleaner.h"
+#include "DenoiseProtocol.h"
+
+
+// -----------------------------------------------------------------------------------------
+// Local denoising service. One instance owns a single CNoiseCleaner (so the OpenCL program
+// is built once per host instead of once per process) and serves any number of clients
+// connected through a Unix domain socket, see DenoiseProtocol.h for the wire format.
+// Every client connection is served by its own thread which only parses requests, the
+// frames are denoised by the thread calling 'Run'. It coalesces pending requests with the
+// same geometry, threshold and mode into one 'CleanNoiseBatch' launch: a batch is launched
+// once it holds 'maxBatchSize' frames or its oldest request has waited 'batchWindow'
+// nanoseconds, whichever comes first. A window of 0 launches whatever is pending
+// immediately. Queue depth, batch size and latency statistics are kept for the lifetime
+// of the server. POSIX only, requires C++11.
+// -----------------------------------------------------------------------------------------
+struct SDenoiseServerConfig
+{
+	std::string		socketPath;
+	cl_ulong		batchWindow;		// Nanoseconds
+	int				maxBatchSize;
+	cl_ulong		statsInterval;		// Nanoseconds between periodic stats prints, 0 disables them
+};
+
+class CDenoiseServer
+{
+public:
+	CDenoiseServer(CNoiseCleaner& noiseCleaner, const SDenoiseServerConfig& config);
+	~CDenoiseServer();
+
+	// -----------------------------------------------------------------------------------------
+	// Binds and listens on the socket (replacing a stale socket file) and starts accepting
+	// clients. Returns false if the socket could not be created.
+	// -----------------------------------------------------------------------------------------
+	bool Start();
+
+	// -----------------------------------------------------------------------------------------
+	// Forms and launches batches on the calling thread until 'Stop' is called or
+	// '*pStopFlag' (if given, e.g. set by a signal handler) becomes non-zero.
+	// -----------------------------------------------------------------------------------------
+	void Run(volatile const int* pStopFlag = NULL);
+
+	// -----------------------------------------------------------------------------------------
+	// Makes 'Run' return, disconnects all clients and removes the socket file. May be
+	// called from any thread.
+	// -----------------------------------------------------------------------------------------
+	void Stop();
+
+	void GetStats(SDenoiseServerStats& stats) const;
+	void PrintStats(std::ostream& os) const;
+
+private:
+	struct SClient
+	{
+		int				fd;
+		unsigned char*	pShm;
+		size_t			shmSize;
+		bool			isFinished;
+		std::thread		thread;
+	};
+
+	// A DENOISE_MSG_CLEAN request waiting for its batch, lives on the client thread's stack
+	struct SPendingRequest
+	{
+		SClient*		pClient;
+		SDenoiseRequest	request;
+		cl_ulong		arrivalTime;
+		bool			isDone;
+		SDenoiseReply	reply;
+	};
+
+	CDenoiseServer(const CDenoiseServer&);
+	CDenoiseServer& operator=(const CDenoiseServer&);
+
+	void AcceptLoop();
+	void ServeClient(SClient* pClient);
+	void HandleAttach(SClient* pClient, const SDenoiseRequest& request, SDenoiseReply& reply);
+	void HandleClean(SClient* pClient, const SDenoiseRequest& request, SDenoiseReply& reply);
+	void LaunchBatch(std::vector<SPendingRequest*>& batch);
+	void ReapClients();
+
+	static bool IsSameBatch(const SDenoiseRequest& request1, const SDenoiseRequest& request2);
+
+	CNoiseCleaner&					m_noiseCleaner;
+	SDenoiseServerConfig			m_config;
+	int								m_listenFd;
+	bool							m_isStopping;
+	std::thread						m_acceptThread;
+	std::vector<SClient*>			m_clients;
+	std::deque<SPendingRequest*>	m_pending;			// In arrival order
+	mutable std::mutex				m_mutex;			// Guards everything above and the stats
+	std::condition_variable			m_pendingCond;		// Signaled when a request arrives or on 'Stop'
+	std::condition_variable			m_doneCond;			// Signaled when a batch completes
+
+	cl_ulong						m_numRequests;
+	cl_ulong						m_numRejected;
+	CStatsHistogram					m_batchSizeHist;
+	CStatsHistogram					m_queueDepthHist;
+	CStatsHistogram					m_queuedTimeHist;
+	CStatsHistogram					m_serviceTimeHist;
+};
+
+
+
+#endif	// __DENOISE_SERVER_H__
@@ -0,0 +1,256 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "EventTracer.h"
+#include "Utils.h"
+#include <fstream>
+#include <iomanip>
+
+#define NUM_CALIBRATION_ROUNDS	8
+
+// Process ids of the two groups of tracks in the exported trace
+#define HOST_PID				1
+#define DEVICE_PID				2
+
+
+//-----------------------------------------------------------------------------------------
+CEventTracer::CEventTracer()
+{
+}
+//-----------------------------------------------------------------------------------------
+void CEventTracer::AddQueue(cl_command_queue queue, const char* pName)
+{
+	SQueueTrack track;
+	track.queue = queue;
+	track.name = pName;
+	track.clockOffset = 0;
+
+	//
+	// The QUEUED timestamp of a marker is taken on the host while the enqueue call is in
+	// progress, so the middle of the shortest enqueue call gives the best estimate
+	//
+	cl_ulong bestEnqueueTime = (cl_ulong)-1;
+	for (int i = 0; i < NUM_CALIBRATION_ROUNDS; i++)
+	{
+		cl_event markerEvent;
+		cl_ulong hostBefore = OpenCLEnv::GetHostTime();
+		cl_int clErr = clEnqueueMarkerWithWaitList(queue, 0, NULL, &markerEvent);
+		cl_ulong hostAfter = OpenCLEnv::GetHostTime();
+		if (clErr != CL_SUCCESS)
+			break;
+
+		cl_ulong queuedTime = 0;
+		clWaitForEvents(1, &markerEvent);
+		clErr = clGetEventProfilingInfo(markerEvent, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queuedTime, NULL);
+		clReleaseEvent(markerEvent);
+		if (clErr != CL_SUCCESS)
+			break;	// Profiling is disabled on this queue, only host spans can be traced
+
+		if (hostAfter - hostBefore < bestEnqueueTime)
+		{
+			bestEnqueueTime = hostAfter - hostBefore;
+			track.clockOffset = (cl_long)(hostBefore + (hostAfter - hostBefore) / 2) - (cl_long)queuedTime;
+		}
+	}
+
+	CMutexLock lock(m_mutex);
+	m_queues.push_back(track);
+}
+//-----------------------------------------------------------------------------------------
+int CEventTracer::GetTrack(cl_command_queue queue)
+{
+	// Searched backwards, a released queue handle may be reused by a queue registered later
+	for (int i = (int)m_queues.size() - 1; i >= 0; i--)
+	{
+		if (m_queues[i].queue == queue)
+			return i;
+	}
+
+	// An unregistered queue gets a track without clock correction
+	SQueueTrack track;
+	track.queue = queue;
+	track.name = "queue";
+	track.clockOffset = 0;
+	m_queues.push_back(track);
+	return (int)m_queues.size() - 1;
+}
+//-----------------------------------------------------------------------------------------
+int CEventTracer::GetHostTrack(cl_ulong threadID)
+{
+	for (size_t i = 0; i < m_hostThreads.size(); i++)
+	{
+		if (m_hostThreads[i] == threadID)
+			return -1 - (int)i;
+	}
+
+	m_hostThreads.push_back(threadID);
+	return -(int)m_hostThreads.size();
+}
+//-----------------------------------------------------------------------------------------
+void CEventTracer::AddCommand(cl_command_queue queue, const char* pName, const char* pCategory, cl_ulong queuedTime,
+							  cl_ulong submitTime, cl_ulong startTime, cl_ulong endTime, cl_ulong numBytes /*= 0*/)
+{
+	CMutexLock lock(m_mutex);
+	SEntry entry;
+	entry.pName = pName;
+	entry.pCategory = pCategory;
+	entry.track = GetTrack(queue);
+	cl_long clockOffset = m_queues[entry.track].clockOffset;
+	entry.queuedTime = queuedTime + clockOffset;
+	entry.submitTime = submitTime + clockOffset;
+	entry.startTime = startTime + clockOffset;
+	entry.endTime = endTime + clockOffset;
+	entry.numBytes = numBytes;
+	m_entries.push_back(entry);
+}
+//-----------------------------------------------------------------------------------------
+void CEventTracer::AddHostSpan(const char* pName, cl_ulong startTime, cl_ulong endTime)
+{
+	cl_ulong threadID = CThread::GetCurrentID();
+	CMutexLock lock(m_mutex);
+	SEntry entry;
+	entry.pName = pName;
+	entry.pCategory = "host";
+	entry.track = GetHostTrack(threadID);
+	entry.queuedTime = startTime;
+	entry.submitTime = startTime;
+	entry.startTime = startTime;
+	entry.endTime = endTime;
+	entry.numBytes = 0;
+	m_entries.push_back(entry);
+}
+//-----------------------------------------------------------------------------------------
+void CEventTracer::Clear()
+{
+	CMutexLock lock(m_mutex);
+	m_entries.clear();
+}
+//-----------------------------------------------------------------------------------------
+size_t CEventTracer::GetNumEvents() const
+{
+	CMutexLock lock(m_mutex);
+	return m_entries.size();
+}
+//-----------------------------------------------------------------------------------------
+static void WriteString(std::ostream& os, const char* pStr)
+{
+	os << '"';
+	for (; *pStr; pStr++)
+	{
+		if (*pStr == '"' || *pStr == '\\')
+			os << '\\';
+		if ((unsigned char)*pStr >= 0x20)
+			os << *pStr;
+	}
+	os << '"';
+}
+//-----------------------------------------------------------------------------------------
+static void WriteAsyncEvent(std::ostream& os, const char* pName, char phase, size_t id, int tid, double ts)
+{
+	os << ",\n{\"name\": ";
+	WriteString(os, pName);
+	os << ", \"cat\": \"pending\", \"ph\": \"" << phase << "\", \"id\": " << id << ", \"pid\": " << DEVICE_PID
+	   << ", \"tid\": " << tid << ", \"ts\": " << ts << "}";
+}
+//-----------------------------------------------------------------------------------------
+void CEventTracer::WriteChromeTrace(std::ostream& os) const
+{
+	CMutexLock lock(m_mutex);
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+
+	// Timestamps are written in microseconds relative to the earliest recorded time
+	cl_ulong originTime = 0;
+	for (size_t i = 0; i < m_entries.size(); i++)
+	{
+		if (i == 0 || m_entries[i].queuedTime < originTime)
+			originTime = m_entries[i].queuedTime;
+	}
+
+	os << std::fixed << std::setprecision(3);
+	os << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+	os << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << HOST_PID << ", \"args\": {\"name\": \"host\"}},\n";
+	for (size_t i = 0; i < m_hostThreads.size(); i++)
+	{
+		os << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << HOST_PID << ", \"tid\": " << i
+		   << ", \"args\": {\"name\": \"host thread " << i + 1 << "\"}},\n";
+	}
+	os << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << DEVICE_PID << ", \"args\": {\"name\": \"OpenCL\"}}";
+	for (size_t i = 0; i < m_queues.size(); i++)
+	{
+		os << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << DEVICE_PID << ", \"tid\": " << i + 1
+		   << ", \"args\": {\"name\": ";
+		WriteString(os, m_queues[i].name.c_str());
+		os << "}}";
+	}
+
+	for (size_t i = 0; i < m_entries.size(); i++)
+	{
+		const SEntry& entry = m_entries[i];
+		double startTs = (double)(entry.startTime - originTime) / 1e3;
+		double duration = (double)(entry.endTime - entry.startTime) / 1e3;
+		int pid = (entry.track < 0) ? HOST_PID : DEVICE_PID;
+		int tid = (entry.track < 0) ? (-1 - entry.track) : (entry.track + 1);
+
+		os << ",\n{\"name\": ";
+		WriteString(os, entry.pName);
+		os << ", \"cat\": ";
+		WriteString(os, entry.pCategory);
+		os << ", \"ph\": \"X\", \"pid\": " << pid << ", \"tid\": " << tid << ", \"ts\": " << startTs << ", \"dur\": " << duration;
+		if (entry.track < 0)
+		{
+			os << "}";
+			continue;
+		}
+
+		cl_long clockOffset = m_queues[entry.track].clockOffset;
+		os << ", \"args\": {\"queued_ns\": " << (cl_ulong)(entry.queuedTime - clockOffset)
+		   << ", \"submit_ns\": " << (cl_ulong)(entry.submitTime - clockOffset)
+		   << ", \"start_ns\": " << (cl_ulong)(entry.startTime - clockOffset)
+		   << ", \"end_ns\": " << (cl_ulong)(entry.endTime - clockOffset)
+		   << ", \"bytes\": " << entry.numBytes << "}}";
+
+		// The waiting phases of consecutive commands overlap, so they are written as async spans
+		WriteAsyncEvent(os, "queued", 'b', i, tid, (double)(entry.queuedTime - originTime) / 1e3);
+		WriteAsyncEvent(os, "queued", 'e', i, tid, (double)(entry.submitTime - originTime) / 1e3);
+		WriteAsyncEvent(os, "submitted", 'b', i, tid, (double)(entry.submitTime - originTime) / 1e3);
+		WriteAsyncEvent(os, "submitted", 'e', i, tid, startTs);
+	}
+	os << "\n]}\n";
+
+	os.flags(flags);
+	os.precision(precision);
+}
+//-----------------------------------------------------------------------------------------
+bool CEventTracer::WriteChromeTrace(const char* pFilename) const
+{
+	if (pFilename == NULL)
+		return false;
+
+	std::ofstream fh(pFilename);
+	if (!fh.good())
+		return false;
+
+	WriteChromeTrace(fh);
+	fh.close();
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
@@ -0,0 +1,103 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef __EVENT_TRACER_H__
+#define __EVENT_TRACER_H__
+
+#include <CL/cl.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "Utils.h"
+
+
+// -----------------------------------------------------------------------------------------
+// Records a timeline of OpenCL commands (all four CL_PROFILING_COMMAND_* timestamps) and
+// host-side spans, and exports it in the Chrome trace event format, which can be opened in
+// chrome://tracing or ui.perfetto.dev.
+// Every registered command queue gets its own track. Execution (START->END) is drawn as a
+// regular span on the queue track, the QUEUED->SUBMIT and SUBMIT->START phases are drawn as
+// async spans next to it, so gaps between commands (pipeline bubbles) are easy to spot.
+// Device timestamps are moved to the host clock using an offset estimated per queue in
+// 'AddQueue'. Command timestamps are only available on queues created with profiling.
+// Command and span names are not copied and must outlive the tracer (string literals,
+// kernel and stage name tables). All methods may be called from several threads, host
+// spans are drawn on one track per calling thread.
+// -----------------------------------------------------------------------------------------
+class CEventTracer
+{
+public:
+	CEventTracer();
+
+	// -----------------------------------------------------------------------------------------
+	// Registers 'queue' as a new track named 'pName' and estimates the offset between its
+	// device clock and 'OpenCLEnv::GetHostTime' by timing a few marker commands.
+	// -----------------------------------------------------------------------------------------
+	void AddQueue(cl_command_queue queue, const char* pName);
+
+	// -----------------------------------------------------------------------------------------
+	// Records one completed command. The times are the raw device profiling timestamps.
+	// -----------------------------------------------------------------------------------------
+	void AddCommand(cl_command_queue queue, const char* pName, const char* pCategory, cl_ulong queuedTime,
+					cl_ulong submitTime, cl_ulong startTime, cl_ulong endTime, cl_ulong numBytes = 0);
+
+	// -----------------------------------------------------------------------------------------
+	// Records a host-side span, times are taken from 'OpenCLEnv::GetHostTime'.
+	// -----------------------------------------------------------------------------------------
+	void AddHostSpan(const char* pName, cl_ulong startTime, cl_ulong endTime);
+
+	void Clear();
+	size_t GetNumEvents() const;
+
+	void WriteChromeTrace(std::ostream& os) const;
+	bool WriteChromeTrace(const char* pFilename) const;
+
+private:
+	struct SQueueTrack
+	{
+		cl_command_queue	queue;
+		std::string			name;
+		cl_long				clockOffset;	// host time = device time + clockOffset
+	};
+
+	struct SEntry
+	{
+		const char*		pName;
+		const char*		pCategory;
+		int				track;			// Index into m_queues, or -1 - index into m_hostThreads for host spans
+		cl_ulong		queuedTime;		// Host clock, only 'startTime'/'endTime' are used by host spans
+		cl_ulong		submitTime;
+		cl_ulong		startTime;
+		cl_ulong		endTime;
+		cl_ulong		numBytes;
+	};
+
+	int GetTrack(cl_command_queue queue);
+	int GetHostTrack(cl_ulong threadID);
+
+	std::vector<SQueueTrack>	m_queues;
+	std::vector<cl_ulong>		m_hostThreads;		// 'CThread::GetCurrentID' of every thread with host spans
+	std::vector<SEntry>			m_entries;
+	mutable CMutex				m_mutex;
+};
+
+
+
+#endif	// __EVENT_TRACER_H__
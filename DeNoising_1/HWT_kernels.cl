@@ -22,212 +22,1348 @@
 #define SQRT_2			1.41421356237309504880f
 #define LOG_NUM_BANKS	4
 #define BLOCK_ROWS		8
+#define MAX_LEVELS		31		// Rows of up to 2^31 samples
+
+// Index into local memory padded with one element every NUM_BANKS elements, so that the
+// strided accesses of the reduction steps fall into different banks
+#define PAD(i)			((i) + ((i) >> LOG_NUM_BANKS))
+
+// The coefficients are stored in global memory as floats, or as halves when the program is
+// built with -D COEF_HALF. Halves are only converted with vload_half/vstore_half (which don't
+// need cl_khr_fp16), all the arithmetic is done on floats.
+#ifdef COEF_HALF
+typedef half coef_t;
+#define LOAD_COEF(p, i)			vload_half(i, p)
+#define LOAD_COEF4(p, i)		vload_half4(i, p)
+#define STORE_COEF(v, p, i)		vstore_half(v, i, p)
+#define STORE_COEF2(v, p, i)	vstore_half2(v, i, p)
+#define STORE_COEF4(v, p, i)	vstore_half4(v, i, p)
+#else
+typedef float coef_t;
+#define LOAD_COEF(p, i)			((p)[i])
+#define LOAD_COEF4(p, i)		vload4(i, p)
+#define STORE_COEF(v, p, i)		((p)[i] = (v))
+#define STORE_COEF2(v, p, i)	vstore2(v, i, p)
+#define STORE_COEF4(v, p, i)	vstore4(v, i, p)
+#endif
 
 
 //
-// This is the kernel for the 1D forward Haar wavelet transform
+// This is the kernel for the 1D forward Haar wavelet transform. One launch performs 'levels'
+// decomposition steps and may be one of several passes: every work-group reduces a block of
+// 2^levels consecutive elements of an input of length 'inLen' to a single approximation
+// coefficient, which is written to 'approxBuff' for the next pass (or as the top coefficient
+// by the last one). The detail coefficients go straight to their final place in 'outBuff'.
+// Each work-item loads 8 samples with vector loads and performs the first three steps in
+// registers, so a work-group of N work-items covers 8N samples and only the remaining steps
+// go through local memory, which is padded to avoid bank conflicts.
+// The work-groups of one row are consecutive, each row has inLen / 2^levels of them. When a
+// single work-group covers a whole row, 'inBuff' and 'outBuff' may be the same buffer.
 //
-__kernel void FWT_kernel(__global float* inBuff, __global float* outBuff, __global float* partialBuff,
-						 __local float* localBuff, const uint levels, const uint buffOffset, const uint buffLen)
+__kernel void FWT_kernel(__global const coef_t* inBuff, __global coef_t* outBuff, __global coef_t* approxBuff,
+						 __local float* localBuff, const uint levels, const uint inLen, const uint inOffset,
+						 const uint inStride, const uint outOffset, const uint outStride, const uint approxOffset,
+						 const uint approxStride)
 {
 	uint localId = get_local_id(0);
-    uint groupId = get_group_id(0);
-    uint localSize = get_local_size(0);
-   
-    uint buffOffset1 = buffOffset + groupId*buffLen;
-    
-    localBuff[localId] = inBuff[buffOffset1 + localId];
-    localBuff[localId + localSize] = inBuff[buffOffset1 + localId + localSize];
-    
-    barrier(CLK_LOCAL_MEM_FENCE);
-    
-    // This will result in a bank conflict
-	float data0 = localBuff[2 * localId];
-	float data1 = localBuff[2 * localId + 1];
-	
-	// Detail coefficient, not further referenced in this kernel so directly store in global memory
-	outBuff[buffOffset1 + localId + localSize] = (data0 - data1) * INV_SQRT_2;
-	
-	// Approximation coefficient: store in local memory for further decomposition steps in this global step
-    localBuff[localId] = (data0 + data1) * INV_SQRT_2;
-    
-    // All threads have to write approximation coefficient to shared memory before 
-    // next steps can take place
-    barrier(CLK_LOCAL_MEM_FENCE);
-    
-	// Offset to second element in local element which has to be used for the 
-	// decomposition, effectively 2^(i - 1)
-	uint offsetNeighbor = 1;
+	uint localSize = get_local_size(0);
+	uint groupId = get_group_id(0);
+	uint numBlocks = inLen >> levels;
+	uint row = groupId / numBlocks;
+	uint block = groupId - row*numBlocks;
+	uint blockStart = block << levels;
+
+	__global const coef_t* rowIn = inBuff + inOffset + row*inStride;
+	__global coef_t* rowOut = outBuff + outOffset + row*outStride;
+
+	if (levels < 3)
+	{
+		// Blocks shorter than 8 samples (the top of the pyramid) are done by a single work-item
+		float data[4];
+		uint len = 1 << levels;
+		for (uint k = 0; k < len; ++k)
+			data[k] = LOAD_COEF(rowIn, blockStart + k);
+
+		for (uint i = 1; i <= levels; ++i)
+		{
+			len >>= 1;
+			for (uint k = 0; k < len; ++k)
+			{
+				float data0 = data[2 * k];
+				float data1 = data[2 * k + 1];
+				STORE_COEF((data0 - data1) * INV_SQRT_2, rowOut, (inLen >> i) + (blockStart >> i) + k);
+				data[k] = (data0 + data1) * INV_SQRT_2;
+			}
+		}
+
+		STORE_COEF(data[0], approxBuff, approxOffset + row*approxStride + block);
+		return;
+	}
+
+	// First three steps in registers, the detail coefficients of each step are stored with
+	// vector stores at their place in the output
+	uint pos = blockStart + (localId << 3);
+	float4 in0 = LOAD_COEF4(rowIn + pos, 0);
+	float4 in1 = LOAD_COEF4(rowIn + pos, 1);
+
+	// All the samples of the block are read before any coefficient is written, which is what
+	// allows transforming a row in place
+	barrier(CLK_GLOBAL_MEM_FENCE);
+
+	float4 even1 = (float4)(in0.s0, in0.s2, in1.s0, in1.s2);
+	float4 odd1 = (float4)(in0.s1, in0.s3, in1.s1, in1.s3);
+	float4 approx1 = (even1 + odd1) * INV_SQRT_2;
+	STORE_COEF4((even1 - odd1) * INV_SQRT_2, rowOut + (inLen >> 1) + (pos >> 1), 0);
+
+	float2 even2 = (float2)(approx1.s0, approx1.s2);
+	float2 odd2 = (float2)(approx1.s1, approx1.s3);
+	float2 approx2 = (even2 + odd2) * INV_SQRT_2;
+	STORE_COEF2((even2 - odd2) * INV_SQRT_2, rowOut + (inLen >> 2) + (pos >> 2), 0);
+
+	STORE_COEF((approx2.s0 - approx2.s1) * INV_SQRT_2, rowOut, (inLen >> 3) + (pos >> 3));
+	localBuff[PAD(localId)] = (approx2.s0 + approx2.s1) * INV_SQRT_2;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// The remaining steps work in place on local memory, with the distance between the two
+	// elements of a pair growing by a factor of 2 in each step. The work-items that have
+	// nothing to do in a step must still reach the barrier.
+	uint stride = 1;
 	uint activeThreads = localSize >> 1;
-	uint midOutPos = localSize >> 1;
-	// Index for the first element of the pair to process, the representation is still compact (and therefore
-	// still localId * 2) because the first step operated on registers and only the result has been written
-	// to shared memory
-	uint idata0 = localId * 2;
-	
-	for(uint i = 1; i < levels; ++i)
-    {
-		if  (localId >= activeThreads)
-			return;
-			
-		// Update stride, with each decomposition level the stride grows by a factor of 2
-		uint idata1 = idata0 + offsetNeighbor;
-						
-		// position of write into global memory
-		uint globalWritePos = midOutPos + localId;
-			
-		data0 = localBuff[idata0];
-		data1 = localBuff[idata1];
-			
-		// Detail coefficient, not further referenced in this kernel so directly store in global memory
-		outBuff[buffOffset1 + globalWritePos] = (data0 - data1) * INV_SQRT_2;
-			
-		// Approximation coefficient: store in local memory for further decomposition steps in this global step
-		localBuff[idata0] = (data0 + data1) * INV_SQRT_2;
-				
-		midOutPos >>= 1;
-		activeThreads >>= 1;
-		offsetNeighbor <<= 1;
-		idata0 <<= 1;
-                
-        barrier(CLK_LOCAL_MEM_FENCE); 
-    }
-    
-	// Write the top most level element for the next decomposition steps
-	// which are performed after an interblock syncronization on host side
-	if (0 == localId) 
+	for (uint i = 4; i <= levels; ++i)
 	{
-		//partialBuff[groupId] = localBuff[0];
-		outBuff[buffOffset1] = localBuff[0];
+		if (localId < activeThreads)
+		{
+			uint idata0 = (localId * 2) * stride;
+			float data0 = localBuff[PAD(idata0)];
+			float data1 = localBuff[PAD(idata0 + stride)];
+			STORE_COEF((data0 - data1) * INV_SQRT_2, rowOut, (inLen >> i) + (blockStart >> i) + localId);
+			localBuff[PAD(idata0)] = (data0 + data1) * INV_SQRT_2;
+		}
+		stride <<= 1;
+		activeThreads >>= 1;
+
+		barrier(CLK_LOCAL_MEM_FENCE);
 	}
+
+	if (localId == 0)
+		STORE_COEF(localBuff[0], approxBuff, approxOffset + row*approxStride + block);
 }
 
 
 //
-// This is the kernel for the 1D inverse Haar wavelet transform
+// This is the kernel for the 1D inverse Haar wavelet transform. One launch performs 'levels'
+// reconstruction steps and may be one of several passes: every work-group expands one
+// element of the approximation of length 'approxLen' into 2^levels elements, reading the
+// detail coefficients of each step from 'coefBuff' (which is in the layout produced by
+// FWT_kernel). The first pass starts from the single top approximation coefficient, so it
+// passes 'coefBuff' as 'approxBuff' with 'approxLen' = 1. The result is written straight to
+// 'outBuff', which must not be the buffer the approximation is read from, unless there is
+// a single work-group per row ('approxLen' = 1), which may overwrite its row in place.
+// The work-groups of one row are consecutive, each row has 'approxLen' of them.
 //
-__kernel void IWT_kernel(__global float* inBuff, __local float* localBuff, __local float* localBuff1, 
-								   __local float* flipBuffFlag, const uint levels, const uint buffOffset, const uint buffLen)
+__kernel void IWT_kernel(__global const coef_t* coefBuff, __global const coef_t* approxBuff, __global coef_t* outBuff,
+						 __local float* localBuff, __local float* localBuff1, const uint levels, const uint approxLen,
+						 const uint coefOffset, const uint coefStride, const uint approxOffset, const uint approxStride,
+						 const uint outOffset, const uint outStride)
 {
 	uint localId = get_local_id(0);
-    uint localSize = get_local_size(0);
-    uint groupId = get_group_id(0);
-    
-    uint buffOffset1 = buffOffset + groupId*buffLen;
-    
-    float data0 = inBuff[buffOffset1 + localId];
-    float data1 = inBuff[buffOffset1 + localId + localSize];
-    localBuff[localId] = data0;
-    localBuff[localId + localSize] = data1;
-    localBuff1[localId] = data0;
-    localBuff1[localId + localSize] = data1;
-    *flipBuffFlag = 0.f;
-    
-    barrier(CLK_LOCAL_MEM_FENCE);
-    
-    uint activeThreads = 1;
-	float res = 0.f;
-         
-    for(uint i = 0; i < levels; ++i)
-    {
-		if(localId < activeThreads)
-        {
-			uint i_idata0 = localId; 
-			uint i_idata1 = localId+activeThreads; 
-			uint o_idata0 = localId << 1; 
-			uint o_idata1 = o_idata0 + 1; 
-			
-			if (*flipBuffFlag > 0.f)
-			{
-				data0 = localBuff1[i_idata0];
-				data1 = localBuff1[i_idata1];
-				res = (data0 + data1) * SQRT_2 * 0.5f;
-				localBuff[o_idata0] = res;
-				localBuff[o_idata1] = (data0 * SQRT_2) - res;
-			}
-			else
-			{
-				data0 = localBuff[i_idata0];
-				data1 = localBuff[i_idata1];
-				res = (data0 + data1) * SQRT_2 * 0.5f;
-				localBuff1[o_idata0] = res;
-				localBuff1[o_idata1] = (data0 * SQRT_2) - res;
-			}
-        }
-        activeThreads <<= 1;
-        
-        barrier(CLK_LOCAL_MEM_FENCE);
-        
-        if (localId == 0)
-        {
-			*flipBuffFlag = 1.f - *flipBuffFlag;
-        }
-    }
-    
-    if (*flipBuffFlag > 0.f)
-	{
-		data0 = localBuff1[localId];
-		data1 = localBuff1[localId + localSize];
-	}
-	else
+	uint localSize = get_local_size(0);
+	uint groupId = get_group_id(0);
+	uint row = groupId / approxLen;
+	uint block = groupId - row*approxLen;
+
+	__global const coef_t* rowCoef = coefBuff + coefOffset + row*coefStride;
+	if (localId == 0)
+		localBuff[0] = LOAD_COEF(approxBuff, approxOffset + row*approxStride + block);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Step i reads the approximation from one local buffer and writes the next one to the
+	// other, so which buffer holds the data only depends on the parity of i
+	uint currLen = approxLen;
+	uint activeThreads = 1;
+	for (uint i = 0; i < levels; ++i)
 	{
-		data0 = localBuff[localId];
-		data1 = localBuff[localId + localSize];
+		__local float* srcBuff = (i & 1) ? localBuff1 : localBuff;
+		__local float* dstBuff = (i & 1) ? localBuff : localBuff1;
+		if (localId < activeThreads)
+		{
+			float data0 = srcBuff[localId];
+			float data1 = LOAD_COEF(rowCoef, currLen + block*activeThreads + localId);
+			float res = (data0 + data1) * SQRT_2 * 0.5f;
+			dstBuff[localId << 1] = res;
+			dstBuff[(localId << 1) + 1] = (data0 * SQRT_2) - res;
+		}
+		currLen <<= 1;
+		activeThreads <<= 1;
+
+		// The global fence orders the coefficient reads before the writes of the result
+		barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
 	}
-    
-	inBuff[buffOffset1 + localId] = data0;
-	inBuff[buffOffset1 + localId + localSize] = data1;
-    
+
+	__local float* resBuff = (levels & 1) ? localBuff1 : localBuff;
+	__global coef_t* blockOut = outBuff + outOffset + row*outStride + block*(localSize << 1);
+	STORE_COEF(resBuff[localId], blockOut, localId);
+	STORE_COEF(resBuff[localId + localSize], blockOut, localId + localSize);
 }
 
 
 //
-// This kernel is used to transpose a matrix
+// This kernel is used to transpose a matrix, the third dimension of the NDRange
+// selects one of several matrices of the same size stored one after the other.
+// Rows of the tile in local memory are padded by one element, so that reading the
+// tile by columns hits a different bank in every row. Matrices whose sides are not
+// multiples of the tile size only read and write the valid part of the edge tiles.
 //
-__kernel void Mat_Transpose_kernel(__global float* inBuff, __global float* outBuff, 
+__kernel void Mat_Transpose_kernel(__global coef_t* inBuff, __global coef_t* outBuff, 
 								   __local float* localBuff, int width, int height)
 {
-	uint globalIdX = get_global_id(0);
-	uint globalIdY = get_global_id(1);
 	uint localIdX = get_local_id(0);
 	uint localIdY = get_local_id(1);
 	uint groupIdX = get_group_id(0);
 	uint groupIdY = get_group_id(1);
 	uint locSizeX = get_local_size(0);
 	uint locSizeY = get_local_size(1);
+	uint tileStride = locSizeX + 1;
+	uint matOffset = get_global_id(2)*width*height;
 	
-	uint inIdx = (groupIdY*locSizeY+localIdY)*width + groupIdX*locSizeX + localIdX;
-	localBuff[localIdY*locSizeX + localIdX] = inBuff[inIdx];
+	uint inX = groupIdX*locSizeX + localIdX;
+	uint inY = groupIdY*locSizeY + localIdY;
+	if (inX < (uint)width && inY < (uint)height)
+		localBuff[localIdY*tileStride + localIdX] = LOAD_COEF(inBuff, matOffset + inY*width + inX);
 	
 	barrier(CLK_LOCAL_MEM_FENCE);
 	
-	uint outIdx = (groupIdX*locSizeX+localIdY)*height + groupIdY*locSizeY + localIdX;
-	outBuff[outIdx] = localBuff[localIdX*locSizeX + localIdY];
+	uint outX = groupIdY*locSizeY + localIdX;
+	uint outY = groupIdX*locSizeX + localIdY;
+	if (outX < (uint)height && outY < (uint)width)
+		STORE_COEF(localBuff[localIdX*tileStride + localIdY], outBuff, matOffset + outY*height + outX);
+}
+
+
+//
+// This kernel is used to transpose square matrices in place. Every work-group swaps a pair
+// of tiles mirrored across the diagonal, the tiles on the diagonal are transposed within
+// themselves. The NDRange covers all the tiles like for 'Mat_Transpose_kernel' and the
+// work-groups below the diagonal leave at once since their pair is handled by the mirror
+// work-group. The local tiles are padded the same way.
+//
+__kernel void Mat_Transpose_InPlace_kernel(__global coef_t* buff, __local float* localBuff, __local float* localBuff1,
+										   int size)
+{
+	uint localIdX = get_local_id(0);
+	uint localIdY = get_local_id(1);
+	uint groupIdX = get_group_id(0);
+	uint groupIdY = get_group_id(1);
+	uint locSize = get_local_size(0);
+	if (groupIdX < groupIdY)
+		return;		// The whole work-group leaves, so no barrier is skipped by a part of it
+
+	uint tileStride = locSize + 1;
+	uint matOffset = get_global_id(2)*size*size;
+	bool isDiagonal = (groupIdX == groupIdY);
+
+	// Tile A is in the upper triangle and tile B is its mirror
+	uint aX = groupIdX*locSize + localIdX;
+	uint aY = groupIdY*locSize + localIdY;
+	uint bX = groupIdY*locSize + localIdX;
+	uint bY = groupIdX*locSize + localIdY;
+	if (aX < (uint)size && aY < (uint)size)
+		localBuff[localIdY*tileStride + localIdX] = LOAD_COEF(buff, matOffset + aY*size + aX);
+	if (!isDiagonal && bX < (uint)size && bY < (uint)size)
+		localBuff1[localIdY*tileStride + localIdX] = LOAD_COEF(buff, matOffset + bY*size + bX);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// The transposed tile A goes where tile B was and vice versa
+	if (bX < (uint)size && bY < (uint)size)
+		STORE_COEF(localBuff[localIdX*tileStride + localIdY], buff, matOffset + bY*size + bX);
+	if (!isDiagonal && aX < (uint)size && aY < (uint)size)
+		STORE_COEF(localBuff1[localIdX*tileStride + localIdY], buff, matOffset + aY*size + aX);
 }
 
 
 //
 // This kernel is used to apply hard threshold on the values
 //
-__kernel void Mat_HT_Threshold_kernel(__global float* inBuff, __global float* outBuff, float thresh)
+__kernel void Mat_HT_Threshold_kernel(__global coef_t* inBuff, __global coef_t* outBuff, float thresh, const uint dataLen)
 {
 	uint globalId = get_global_id(0);
+	if (globalId >= dataLen)
+		return;
 
-	float inVal = inBuff[globalId];
-	outBuff[globalId] = (fabs(inVal) > thresh) * inVal;
+	float inVal = LOAD_COEF(inBuff, globalId);
+	STORE_COEF((fabs(inVal) > thresh) * inVal, outBuff, globalId);
 }
 
 
 //
 // This kernel is used to apply soft threshold on the values
 //
-__kernel void Mat_ST_Threshold_kernel(__global float* inBuff, __global float* outBuff, float thresh)
+__kernel void Mat_ST_Threshold_kernel(__global coef_t* inBuff, __global coef_t* outBuff, float thresh, const uint dataLen)
 {
 	uint globalId = get_global_id(0);
+	if (globalId >= dataLen)
+		return;
 
-	float inVal = inBuff[globalId];
+	float inVal = LOAD_COEF(inBuff, globalId);
 	float res = fabs(inVal) - thresh;
 	res = (res + fabs(res)) * 0.5f;
-	outBuff[globalId] = copysign(res, inVal);
+	STORE_COEF(copysign(res, inVal), outBuff, globalId);
+}
+
+
+//
+// This kernel evaluates 'numThresholds' thresholds on the same coefficients without writing
+// them. For every threshold each work-group writes the energy the thresholding removes and the
+// number of coefficients it leaves at zero to 'groupErrBuff' and 'groupZerosBuff', at
+// [groupId*numThresholds + thresholdIdx], and the host adds up the groups. The work-items
+// stride over the coefficients, so any number of work-groups covers them all.
+//
+__kernel void Mat_Thresh_Metrics_kernel(__global coef_t* inBuff, __global const float* thresholds, const uint numThresholds,
+										const uint isSoftThresh, const uint dataLen, __local float* localErr,
+										__local uint* localZeros, __global float* groupErrBuff, __global uint* groupZerosBuff)
+{
+	uint globalId = get_global_id(0);
+	uint globalSize = get_global_size(0);
+	uint localId = get_local_id(0);
+	uint localSize = get_local_size(0);
+
+	for (uint t = 0; t < numThresholds; t++)
+	{
+		float thresh = thresholds[t];
+		float err = 0.f;
+		uint zeros = 0;
+		for (uint i = globalId; i < dataLen; i += globalSize)
+		{
+			float inVal = LOAD_COEF(inBuff, i);
+			float res;
+			if (isSoftThresh)
+			{
+				res = fabs(inVal) - thresh;
+				res = copysign((res + fabs(res)) * 0.5f, inVal);
+			}
+			else
+				res = (fabs(inVal) > thresh) * inVal;
+			err += (inVal - res) * (inVal - res);
+			zeros += (res == 0.f);
+		}
+		localErr[localId] = err;
+		localZeros[localId] = zeros;
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		// The work-group size is a power of two
+		for (uint stride = localSize / 2; stride > 0; stride /= 2)
+		{
+			if (localId < stride)
+			{
+				localErr[localId] += localErr[localId + stride];
+				localZeros[localId] += localZeros[localId + stride];
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+		if (localId == 0)
+		{
+			groupErrBuff[get_group_id(0)*numThresholds + t] = localErr[0];
+			groupZerosBuff[get_group_id(0)*numThresholds + t] = localZeros[0];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+
+//
+// The kernels below compact the thresholded coefficients into (index, value) pairs. Every
+// work-group covers a block of SPARSE_ITEMS consecutive coefficients per work-item, and every
+// work-item SPARSE_ITEMS consecutive ones of its block, so the pairs come out in the order of
+// the coefficients. 'Sparse_Count_kernel' counts the survivors of every block,
+// 'Sparse_Scan_kernel' turns the counts into the offsets of the blocks in the output and
+// 'Sparse_Compact_kernel' writes the pairs of every block from its offset on.
+//
+#define SPARSE_ITEMS	8
+
+// The thresholding of 'Mat_HT_Threshold_kernel' and 'Mat_ST_Threshold_kernel'
+float ThresholdCoef(float inVal, float thresh, uint isSoftThresh)
+{
+	if (!isSoftThresh)
+		return (fabs(inVal) > thresh) * inVal;
+	float res = fabs(inVal) - thresh;
+	return copysign((res + fabs(res)) * 0.5f, inVal);
+}
+
+// Exclusive prefix sum of 'val' over the work-group (Hillis-Steele), 'localBuff' holds one
+// element per work-item and the total of the work-group is written to '*pTotal'
+uint WorkGroupExclusiveScan(uint val, __local uint* localBuff, uint* pTotal)
+{
+	uint localId = get_local_id(0);
+	uint localSize = get_local_size(0);
+
+	localBuff[localId] = val;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint offset = 1; offset < localSize; offset *= 2)
+	{
+		uint prevVal = (localId >= offset) ? localBuff[localId - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		localBuff[localId] += prevVal;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	uint inclusive = localBuff[localId];
+	*pTotal = localBuff[localSize - 1];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return inclusive - val;
+}
+
+__kernel void Sparse_Count_kernel(__global coef_t* inBuff, float thresh, const uint isSoftThresh, const uint dataLen,
+								  __local uint* localBuff, __global uint* groupCounts)
+{
+	uint firstIdx = get_global_id(0) * SPARSE_ITEMS;
+	uint count = 0;
+	for (uint i = firstIdx; i < firstIdx + SPARSE_ITEMS && i < dataLen; i++)
+		count += (ThresholdCoef(LOAD_COEF(inBuff, i), thresh, isSoftThresh) != 0.f);
+
+	uint total;
+	WorkGroupExclusiveScan(count, localBuff, &total);
+	if (get_local_id(0) == 0)
+		groupCounts[get_group_id(0)] = total;
+}
+
+// A single work-group walks over the counts in chunks of its size. 'groupOffsets' has
+// numGroups + 1 elements, the last one is the number of pairs.
+__kernel void Sparse_Scan_kernel(__global const uint* groupCounts, const uint numGroups, __local uint* localBuff,
+								 __global uint* groupOffsets)
+{
+	uint localId = get_local_id(0);
+	uint carry = 0;
+	for (uint chunk = 0; chunk < numGroups; chunk += get_local_size(0))
+	{
+		uint i = chunk + localId;
+		uint count = (i < numGroups) ? groupCounts[i] : 0;
+		uint total;
+		uint offset = WorkGroupExclusiveScan(count, localBuff, &total);
+		if (i < numGroups)
+			groupOffsets[i] = carry + offset;
+		carry += total;
+	}
+	if (localId == 0)
+		groupOffsets[numGroups] = carry;
+}
+
+__kernel void Sparse_Compact_kernel(__global coef_t* inBuff, float thresh, const uint isSoftThresh, const uint dataLen,
+									__global const uint* groupOffsets, __local uint* localBuff, __global uint* outIndices,
+									__global float* outValues)
+{
+	uint firstIdx = get_global_id(0) * SPARSE_ITEMS;
+	float values[SPARSE_ITEMS];
+	uint count = 0;
+	for (uint k = 0; k < SPARSE_ITEMS; k++)
+	{
+		uint i = firstIdx + k;
+		values[k] = (i < dataLen) ? ThresholdCoef(LOAD_COEF(inBuff, i), thresh, isSoftThresh) : 0.f;
+		count += (values[k] != 0.f);
+	}
+
+	uint total;
+	uint outIdx = groupOffsets[get_group_id(0)] + WorkGroupExclusiveScan(count, localBuff, &total);
+	for (uint k = 0; k < SPARSE_ITEMS; k++)
+	{
+		if (values[k] != 0.f)
+		{
+			outIndices[outIdx] = firstIdx + k;
+			outValues[outIdx] = values[k];
+			outIdx++;
+		}
+	}
+}
+
+//
+// Scatters 'numValues' (index, value) pairs into a matrix of coefficients which is otherwise zero
+//
+__kernel void Sparse_Scatter_kernel(__global const uint* indices, __global const float* values, const uint numValues,
+									__global coef_t* outBuff)
+{
+	uint globalId = get_global_id(0);
+	if (globalId >= numValues)
+		return;
+
+	STORE_COEF(values[globalId], outBuff, indices[globalId]);
+}
+
+
+//
+// The kernels below are the integer-to-integer version of the transform (the S-transform),
+// for 'int' coefficients of 8-bit or 16-bit samples. Every step is a lifting step:
+//		d = even - odd, s = odd + (d >> 1)
+// which the inverse undoes exactly with odd = s - (d >> 1), even = odd + d, so a forward
+// and an inverse transform reproduce the samples bit for bit. 's' is the floor of the mean
+// of the pair rather than the scaled sum, see 'GetIntScaleExp' for the relation to the
+// orthonormal coefficients. The layout of the coefficients, the blocks and the passes are
+// exactly those of FWT_kernel and IWT_kernel.
+//
+__kernel void FWT_Int_kernel(__global const int* inBuff, __global int* outBuff, __global int* approxBuff,
+							 __local int* localBuff, const uint levels, const uint inLen, const uint inOffset,
+							 const uint inStride, const uint outOffset, const uint outStride, const uint approxOffset,
+							 const uint approxStride)
+{
+	uint localId = get_local_id(0);
+	uint localSize = get_local_size(0);
+	uint groupId = get_group_id(0);
+	uint numBlocks = inLen >> levels;
+	uint row = groupId / numBlocks;
+	uint block = groupId - row*numBlocks;
+	uint blockStart = block << levels;
+
+	__global const int* rowIn = inBuff + inOffset + row*inStride;
+	__global int* rowOut = outBuff + outOffset + row*outStride;
+
+	if (levels < 3)
+	{
+		int data[4];
+		uint len = 1 << levels;
+		for (uint k = 0; k < len; ++k)
+			data[k] = rowIn[blockStart + k];
+
+		for (uint i = 1; i <= levels; ++i)
+		{
+			len >>= 1;
+			for (uint k = 0; k < len; ++k)
+			{
+				int detail = data[2 * k] - data[2 * k + 1];
+				rowOut[(inLen >> i) + (blockStart >> i) + k] = detail;
+				data[k] = data[2 * k + 1] + (detail >> 1);
+			}
+		}
+
+		approxBuff[approxOffset + row*approxStride + block] = data[0];
+		return;
+	}
+
+	uint pos = blockStart + (localId << 3);
+	int4 in0 = vload4(0, rowIn + pos);
+	int4 in1 = vload4(1, rowIn + pos);
+
+	barrier(CLK_GLOBAL_MEM_FENCE);
+
+	int4 odd1 = (int4)(in0.s1, in0.s3, in1.s1, in1.s3);
+	int4 detail1 = (int4)(in0.s0, in0.s2, in1.s0, in1.s2) - odd1;
+	int4 approx1 = odd1 + (detail1 >> 1);
+	vstore4(detail1, 0, rowOut + (inLen >> 1) + (pos >> 1));
+
+	int2 odd2 = (int2)(approx1.s1, approx1.s3);
+	int2 detail2 = (int2)(approx1.s0, approx1.s2) - odd2;
+	int2 approx2 = odd2 + (detail2 >> 1);
+	vstore2(detail2, 0, rowOut + (inLen >> 2) + (pos >> 2));
+
+	int detail3 = approx2.s0 - approx2.s1;
+	rowOut[(inLen >> 3) + (pos >> 3)] = detail3;
+	localBuff[PAD(localId)] = approx2.s1 + (detail3 >> 1);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint stride = 1;
+	uint activeThreads = localSize >> 1;
+	for (uint i = 4; i <= levels; ++i)
+	{
+		if (localId < activeThreads)
+		{
+			uint idata0 = (localId * 2) * stride;
+			int data1 = localBuff[PAD(idata0 + stride)];
+			int detail = localBuff[PAD(idata0)] - data1;
+			rowOut[(inLen >> i) + (blockStart >> i) + localId] = detail;
+			localBuff[PAD(idata0)] = data1 + (detail >> 1);
+		}
+		stride <<= 1;
+		activeThreads >>= 1;
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (localId == 0)
+		approxBuff[approxOffset + row*approxStride + block] = localBuff[0];
+}
+
+
+//
+// The inverse of FWT_Int_kernel, with the arguments of IWT_kernel
+//
+__kernel void IWT_Int_kernel(__global const int* coefBuff, __global const int* approxBuff, __global int* outBuff,
+							 __local int* localBuff, __local int* localBuff1, const uint levels, const uint approxLen,
+							 const uint coefOffset, const uint coefStride, const uint approxOffset, const uint approxStride,
+							 const uint outOffset, const uint outStride)
+{
+	uint localId = get_local_id(0);
+	uint localSize = get_local_size(0);
+	uint groupId = get_group_id(0);
+	uint row = groupId / approxLen;
+	uint block = groupId - row*approxLen;
+
+	__global const int* rowCoef = coefBuff + coefOffset + row*coefStride;
+	if (localId == 0)
+		localBuff[0] = approxBuff[approxOffset + row*approxStride + block];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint currLen = approxLen;
+	uint activeThreads = 1;
+	for (uint i = 0; i < levels; ++i)
+	{
+		__local int* srcBuff = (i & 1) ? localBuff1 : localBuff;
+		__local int* dstBuff = (i & 1) ? localBuff : localBuff1;
+		if (localId < activeThreads)
+		{
+			int detail = rowCoef[currLen + block*activeThreads + localId];
+			int odd = srcBuff[localId] - (detail >> 1);
+			dstBuff[localId << 1] = odd + detail;
+			dstBuff[(localId << 1) + 1] = odd;
+		}
+		currLen <<= 1;
+		activeThreads <<= 1;
+
+		barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+	}
+
+	__local int* resBuff = (levels & 1) ? localBuff1 : localBuff;
+	__global int* blockOut = outBuff + outOffset + row*outStride + block*(localSize << 1);
+	blockOut[localId] = resBuff[localId];
+	blockOut[localId + localSize] = resBuff[localId + localSize];
+}
+
+
+//
+// Same as Mat_Transpose_kernel for 'int' coefficients
+//
+__kernel void Mat_Transpose_Int_kernel(__global const int* inBuff, __global int* outBuff, __local int* localBuff,
+									   int width, int height)
+{
+	uint localIdX = get_local_id(0);
+	uint localIdY = get_local_id(1);
+	uint groupIdX = get_group_id(0);
+	uint groupIdY = get_group_id(1);
+	uint locSizeX = get_local_size(0);
+	uint locSizeY = get_local_size(1);
+	uint tileStride = locSizeX + 1;
+	uint matOffset = get_global_id(2)*width*height;
+
+	uint inX = groupIdX*locSizeX + localIdX;
+	uint inY = groupIdY*locSizeY + localIdY;
+	if (inX < (uint)width && inY < (uint)height)
+		localBuff[localIdY*tileStride + localIdX] = inBuff[matOffset + inY*width + inX];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint outX = groupIdY*locSizeY + localIdX;
+	uint outY = groupIdX*locSizeX + localIdY;
+	if (outX < (uint)height && outY < (uint)width)
+		outBuff[matOffset + outY*height + outX] = localBuff[localIdX*tileStride + localIdY];
+}
+
+
+//
+// An S-transform coefficient at 'pos' of a transform over 2^levels samples, multiplied by
+// 2^(e/2), is the coefficient of the orthonormal transform: e = levels for the approximation
+// (a mean of 2^levels samples) and j - 2 for a detail of level j (1 is the finest level).
+//
+int GetIntScaleExp(uint pos, uint levels)
+{
+	if (pos == 0)
+		return (int)levels;
+	return (int)levels - (31 - (int)clz(pos)) - 2;
+}
+
+
+//
+// The threshold of the orthonormal transform in the units of a coefficient with the
+// combined exponent 'scaleExp', i.e. thresh / 2^(scaleExp/2). Only exact operations
+// follow the single rounded multiplication, so the host computes the same value.
+//
+float GetIntThreshold(float thresh, int scaleExp)
+{
+	if (scaleExp & 1)
+		return ldexp(thresh * INV_SQRT_2, -(scaleExp - 1) / 2);
+	return ldexp(thresh, -scaleExp / 2);
+}
+
+
+//
+// These kernels threshold the coefficients of the 2D S-transform as they are laid out
+// after the forward column transform: 'dataLen' / 2^(levelsX + levelsY) matrices whose
+// rows are the columns of the frames, i.e. 2^levelsX rows of 2^levelsY coefficients.
+// 'thresh' is the threshold of the orthonormal transform in sample units, it is scaled to
+// every coefficient, so the result follows the floating point pipeline.
+//
+__kernel void Mat_HT_Threshold_Int_kernel(__global const int* inBuff, __global int* outBuff, float thresh,
+										  const uint dataLen, const uint levelsX, const uint levelsY)
+{
+	uint globalId = get_global_id(0);
+	if (globalId >= dataLen)
+		return;
+
+	uint posY = globalId & ((1 << levelsY) - 1);
+	uint posX = (globalId >> levelsY) & ((1 << levelsX) - 1);
+	float intThresh = GetIntThreshold(thresh, GetIntScaleExp(posX, levelsX) + GetIntScaleExp(posY, levelsY));
+	int inVal = inBuff[globalId];
+	outBuff[globalId] = (fabs((float)inVal) > intThresh) ? inVal : 0;
+}
+
+
+__kernel void Mat_ST_Threshold_Int_kernel(__global const int* inBuff, __global int* outBuff, float thresh,
+										  const uint dataLen, const uint levelsX, const uint levelsY)
+{
+	uint globalId = get_global_id(0);
+	if (globalId >= dataLen)
+		return;
+
+	uint posY = globalId & ((1 << levelsY) - 1);
+	uint posX = (globalId >> levelsY) & ((1 << levelsX) - 1);
+	float intThresh = GetIntThreshold(thresh, GetIntScaleExp(posX, levelsX) + GetIntScaleExp(posY, levelsY));
+	int inVal = inBuff[globalId];
+	int res = (int)rint(fmax(fabs((float)inVal) - intThresh, 0.f));
+	outBuff[globalId] = (inVal < 0) ? -res : res;
+}
+
+
+//
+// These kernels serve the incremental mode, which keeps the coefficients of the previous
+// frame on the device. 'Tile_Diff_kernel' flags every square tile of 'tileSize' in which
+// the new frame differs from the previous one. The flags are cleared before the launch and
+// all the work-items which find a difference in a tile write the same value.
+//
+__kernel void Tile_Diff_kernel(__global coef_t* frameBuff, __global coef_t* prevBuff, __global uint* dirtyFlags,
+							   const uint width, const uint tileSize, const uint dataLen)
+{
+	uint globalId = get_global_id(0);
+	if (globalId >= dataLen)
+		return;
+
+	if (LOAD_COEF(frameBuff, globalId) != LOAD_COEF(prevBuff, globalId))
+	{
+		uint tileX = (globalId % width) / tileSize;
+		uint tileY = (globalId / width) / tileSize;
+		dirtyFlags[tileY*(width / tileSize) + tileX] = 1;
+	}
+}
+
+
+//
+// Fills 'idx' and 'weights' with the coefficients on the path of 'pos' in a Haar transform of
+// 2^levels samples (laid out like the output of 'FWT_kernel'), and the values of their basis
+// functions at 'pos': the approximation and one detail of every level.
+//
+void GetHaarPath(uint pos, uint levels, uint* idx, float* weights)
+{
+	for (uint level = 0; level <= levels; level++)
+	{
+		// The basis functions of level 'level' are 2^(level - levels) high, the approximation is as high as level 0
+		uint scaleExp = levels - (level > 0 ? level - 1 : 0);
+		float amplitude = ldexp((scaleExp & 1) ? INV_SQRT_2 : 1.f, -(int)(scaleExp >> 1));
+		if (level == 0)
+		{
+			idx[0] = 0;
+			weights[0] = amplitude;
+			continue;
+		}
+		uint shift = levels - level + 1;
+		idx[level] = (1 << (level - 1)) + (pos >> shift);
+		weights[level] = ((pos >> (shift - 1)) & 1) ? -amplitude : amplitude;
+	}
+}
+
+
+//
+// This kernel reconstructs the pixels of the tiles in 'tileList' directly from the thresholded
+// coefficients of the whole frame (the layout after the forward column transform, a row of
+// 2^levelsY coefficients for every one of the 2^levelsX row coefficients). A pixel only
+// depends on the (levelsX + 1) x (levelsY + 1) coefficients on its paths, so each work-item
+// sums those for one pixel. The pixels are written packed, tile after tile.
+//
+__kernel void IWT_Tiles_kernel(__global coef_t* coefBuff, __global const uint* tileList, __global float* outBuff,
+							   float thresh, const uint isSoftThresh, const uint levelsX, const uint levelsY,
+							   const uint tileSize)
+{
+	uint globalId = get_global_id(0);
+	uint tilePixels = tileSize*tileSize;
+	uint tile = tileList[globalId / tilePixels];
+	uint tilesPerRow = (1 << levelsX) / tileSize;
+	uint x = (tile % tilesPerRow)*tileSize + globalId % tileSize;
+	uint y = (tile / tilesPerRow)*tileSize + (globalId % tilePixels) / tileSize;
+
+	uint idxX[MAX_LEVELS + 1];
+	uint idxY[MAX_LEVELS + 1];
+	float weightsX[MAX_LEVELS + 1];
+	float weightsY[MAX_LEVELS + 1];
+	GetHaarPath(x, levelsX, idxX, weightsX);
+	GetHaarPath(y, levelsY, idxY, weightsY);
+
+	// The same thresholding as 'Mat_HT_Threshold_kernel' and 'Mat_ST_Threshold_kernel'
+	float res = 0.f;
+	for (uint i = 0; i <= levelsX; i++)
+	{
+		uint rowOffset = idxX[i] << levelsY;
+		float rowRes = 0.f;
+		for (uint j = 0; j <= levelsY; j++)
+		{
+			float coef = LOAD_COEF(coefBuff, rowOffset + idxY[j]);
+			if (isSoftThresh)
+			{
+				float soft = fabs(coef) - thresh;
+				coef = copysign((soft + fabs(soft)) * 0.5f, coef);
+			}
+			else
+				coef = (fabs(coef) > thresh) * coef;
+			rowRes += weightsY[j] * coef;
+		}
+		res += weightsX[i] * rowRes;
+	}
+	outBuff[globalId] = res;
+}
+
+
+//
+// The kernels below perform the non-standard (Mallat) 2D decomposition. Every level does one
+// step along the rows and one along the columns of the current approximation only, which is
+// divided into four quadrants in place, and the next level works on the LL quadrant:
+//		LL | HL
+//		---+---
+//		LH | HH
+// A 2x2 block (a b; c d) gives LL = (a+b+c+d)/2, HL = (a-b+c-d)/2, LH = (a+b-c-d)/2 and
+// HH = (a-b-c+d)/2, which is a step of the 1D transform along the rows and then along the
+// columns. Every work-group loads a tile of 2*get_local_size(0) x 2*get_local_size(1) of the
+// current approximation into local memory once and does 'levels' levels on it, each one on
+// the top-left quarter of the tile the previous one left. The global size is a quarter of the
+// current approximation (every work-item does a 2x2 block of the first level) and the third
+// dimension indexes the frames. The frames are row-major and the pitches are in coefficients.
+//
+__kernel void NS_FWT_Tile_kernel(__global coef_t* srcBuff, const uint srcOffset, const uint srcPitch, const uint srcFrameLen,
+								 __global coef_t* dstBuff, const uint dstPitch, const uint dstFrameLen,
+								 __global coef_t* approxBuff, const uint approxOffset, const uint approxPitch,
+								 const uint approxFrameLen, const uint levels, __local float* tile)
+{
+	uint localX = get_local_id(0);
+	uint localY = get_local_id(1);
+	uint tileW = get_local_size(0) * 2;
+	uint tileH = get_local_size(1) * 2;
+	uint tileX = get_group_id(0);
+	uint tileY = get_group_id(1);
+	uint frame = get_global_id(2);
+
+	uint srcBase = srcOffset + frame*srcFrameLen + tileY*tileH*srcPitch + tileX*tileW;
+	for (uint y = localY; y < tileH; y += get_local_size(1))
+	{
+		for (uint x = localX; x < tileW; x += get_local_size(0))
+			tile[y*tileW + x] = LOAD_COEF(srcBuff, srcBase + y*srcPitch + x);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// The approximation this level divides and the blocks the tile has in it
+	uint width = get_global_size(0) * 2;
+	uint height = get_global_size(1) * 2;
+	uint blocksX = get_local_size(0);
+	uint blocksY = get_local_size(1);
+	uint dstBase = frame*dstFrameLen;
+	for (uint level = 0; level < levels; level++)
+	{
+		bool isActive = (localX < blocksX && localY < blocksY);
+		float ll = 0.f;
+		if (isActive)
+		{
+			float a = tile[2*localY*tileW + 2*localX];
+			float b = tile[2*localY*tileW + 2*localX + 1];
+			float c = tile[(2*localY + 1)*tileW + 2*localX];
+			float d = tile[(2*localY + 1)*tileW + 2*localX + 1];
+			ll = (a + b + c + d) * 0.5f;
+
+			uint x = tileX*blocksX + localX;
+			uint y = tileY*blocksY + localY;
+			STORE_COEF((a - b + c - d) * 0.5f, dstBuff, dstBase + y*dstPitch + width/2 + x);
+			STORE_COEF((a + b - c - d) * 0.5f, dstBuff, dstBase + (height/2 + y)*dstPitch + x);
+			STORE_COEF((a - b - c + d) * 0.5f, dstBuff, dstBase + (height/2 + y)*dstPitch + width/2 + x);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (isActive)
+			tile[localY*tileW + localX] = ll;
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		width /= 2;
+		height /= 2;
+		blocksX /= 2;
+		blocksY /= 2;
+	}
+
+	// The approximation left in the tile goes to 'approxBuff' for the next launch
+	uint approxW = tileW >> levels;
+	uint approxH = tileH >> levels;
+	uint approxBase = approxOffset + frame*approxFrameLen + tileY*approxH*approxPitch + tileX*approxW;
+	for (uint y = localY; y < approxH; y += get_local_size(1))
+	{
+		for (uint x = localX; x < approxW; x += get_local_size(0))
+			STORE_COEF(tile[y*tileW + x], approxBuff, approxBase + y*approxPitch + x);
+	}
+}
+
+
+//
+// The inverse of 'NS_FWT_Tile_kernel': every work-group loads the approximation of its tile from
+// 'approxBuff', reconstructs 'levels' levels in local memory with the detail quadrants from
+// 'coefsBuff', and writes the tile to 'dstBuff'. The global size is a quarter of the
+// approximation it reconstructs.
+//
+__kernel void NS_IWT_Tile_kernel(__global coef_t* approxBuff, const uint approxOffset, const uint approxPitch,
+								 const uint approxFrameLen, __global coef_t* coefsBuff, const uint coefsPitch,
+								 const uint coefsFrameLen, __global coef_t* dstBuff, const uint dstOffset, const uint dstPitch,
+								 const uint dstFrameLen, const uint levels, __local float* tile)
+{
+	uint localX = get_local_id(0);
+	uint localY = get_local_id(1);
+	uint tileW = get_local_size(0) * 2;
+	uint tileH = get_local_size(1) * 2;
+	uint tileX = get_group_id(0);
+	uint tileY = get_group_id(1);
+	uint frame = get_global_id(2);
+
+	uint approxW = tileW >> levels;
+	uint approxH = tileH >> levels;
+	uint approxBase = approxOffset + frame*approxFrameLen + tileY*approxH*approxPitch + tileX*approxW;
+	for (uint y = localY; y < approxH; y += get_local_size(1))
+	{
+		for (uint x = localX; x < approxW; x += get_local_size(0))
+			tile[y*tileW + x] = LOAD_COEF(approxBuff, approxBase + y*approxPitch + x);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint coefsBase = frame*coefsFrameLen;
+	for (uint level = levels; level-- > 0; )
+	{
+		// The approximation this level reconstructs and the blocks the tile has in it
+		uint width = (get_global_size(0) * 2) >> level;
+		uint height = (get_global_size(1) * 2) >> level;
+		uint blocksX = get_local_size(0) >> level;
+		uint blocksY = get_local_size(1) >> level;
+
+		bool isActive = (localX < blocksX && localY < blocksY);
+		float a, b, c, d;
+		if (isActive)
+		{
+			uint x = tileX*blocksX + localX;
+			uint y = tileY*blocksY + localY;
+			float ll = tile[localY*tileW + localX];
+			float hl = LOAD_COEF(coefsBuff, coefsBase + y*coefsPitch + width/2 + x);
+			float lh = LOAD_COEF(coefsBuff, coefsBase + (height/2 + y)*coefsPitch + x);
+			float hh = LOAD_COEF(coefsBuff, coefsBase + (height/2 + y)*coefsPitch + width/2 + x);
+			a = (ll + hl + lh + hh) * 0.5f;
+			b = (ll - hl + lh - hh) * 0.5f;
+			c = (ll + hl - lh - hh) * 0.5f;
+			d = (ll - hl - lh + hh) * 0.5f;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (isActive)
+		{
+			tile[2*localY*tileW + 2*localX] = a;
+			tile[2*localY*tileW + 2*localX + 1] = b;
+			tile[(2*localY + 1)*tileW + 2*localX] = c;
+			tile[(2*localY + 1)*tileW + 2*localX + 1] = d;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	uint dstBase = dstOffset + frame*dstFrameLen + tileY*tileH*dstPitch + tileX*tileW;
+	for (uint y = localY; y < tileH; y += get_local_size(1))
+	{
+		for (uint x = localX; x < tileW; x += get_local_size(0))
+			STORE_COEF(tile[y*tileW + x], dstBuff, dstBase + y*dstPitch + x);
+	}
+}
+
+
+//
+// The kernels below denoise an image patch by patch. 'Patch_Clean_kernel' runs the whole
+// pipeline of 'CleanNoise' on one square patch of 'patchSize' (a power of 2 up to
+// PATCH_MAX_SIZE) per work-group: the forward transforms of the rows and of the columns, the
+// thresholding and the inverse transforms, in local memory and with the same arithmetic as
+// FWT_kernel and IWT_kernel. The work-group has one work-item per row, which transforms its
+// row and then its column, and the rows in local memory are padded by one element so that
+// neither walk has bank conflicts. The patches start every 'step' pixels, and the last ones
+// are moved to the right and bottom edges of the image. Patches which do not overlap are
+// written straight to 'outBuff'. Overlapping ones are added to 'sumBuff' in fixed point with
+// PATCH_FIXED_SCALE steps per gray level, which makes the sums independent of the order of
+// the atomic additions, and 'Patch_Normalize_kernel' divides every sum by the patches
+// covering the pixel.
+//
+#define PATCH_MAX_SIZE		64
+#define PATCH_FIXED_SCALE	256.f
+
+// The first pixel of the patch 'idx' along a side of 'len' pixels
+uint GetPatchStart(uint idx, uint len, uint patchSize, uint step)
+{
+	return min(idx*step, len - patchSize);
+}
+
+// The number of patches along a side of 'len' pixels which cover pixel 'pos'
+uint GetPatchCoverage(uint pos, uint len, uint patchSize, uint step, uint numPatches)
+{
+	// The patches but the last one start at multiples of 'step'
+	int first = ((int)pos - (int)patchSize) / (int)step + 1;
+	if ((int)pos < (int)patchSize)
+		first = 0;
+	int last = min((int)(pos / step), (int)numPatches - 2);
+	uint coverage = (last >= first) ? (uint)(last - first + 1) : 0;
+	return coverage + (pos >= len - patchSize);
+}
+
+// Transforms one row (stride 1) or column (stride 'pitch') of the patch in local memory
+void PatchForwardHaar(__local float* data, uint stride, uint len, float* temp)
+{
+	for (uint currLen = len; currLen > 1; currLen >>= 1)
+	{
+		uint halfLen = currLen >> 1;
+		for (uint k = 0; k < halfLen; k++)
+		{
+			float data0 = data[2*k*stride];
+			float data1 = data[(2*k + 1)*stride];
+			temp[k] = (data0 + data1) * INV_SQRT_2;
+			temp[halfLen + k] = (data0 - data1) * INV_SQRT_2;
+		}
+		for (uint k = 0; k < currLen; k++)
+			data[k*stride] = temp[k];
+	}
+}
+
+void PatchInverseHaar(__local float* data, uint stride, uint len, float* temp)
+{
+	for (uint currLen = 1; currLen < len; currLen <<= 1)
+	{
+		for (uint k = 0; k < currLen; k++)
+		{
+			float data0 = data[k*stride];
+			float data1 = data[(currLen + k)*stride];
+			float res = (data0 + data1) * SQRT_2 * 0.5f;
+			temp[2*k] = res;
+			temp[2*k + 1] = (data0 * SQRT_2) - res;
+		}
+		for (uint k = 0; k < 2*currLen; k++)
+			data[k*stride] = temp[k];
+	}
+}
+
+__kernel void Patch_Clean_kernel(__global const uchar* inBuff, __global uchar* outBuff, __global int* sumBuff,
+								 const uint width, const uint height, const uint patchSize, const uint step,
+								 float thresh, const uint isSoftThresh, const uint isOverlapping, __local float* patch)
+{
+	uint localId = get_local_id(0);
+	uint pitch = patchSize + 1;
+	uint startX = GetPatchStart(get_group_id(0), width, patchSize, step);
+	uint startY = GetPatchStart(get_group_id(1), height, patchSize, step);
+	float temp[PATCH_MAX_SIZE];
+
+	// Every work-item loads a column, so the reads of each row are coalesced
+	for (uint y = 0; y < patchSize; y++)
+		patch[y*pitch + localId] = (float)inBuff[(startY + y)*width + startX + localId] / 255.f;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	PatchForwardHaar(patch + localId*pitch, 1, patchSize, temp);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// The column of this work-item goes through the forward transform, the thresholding
+	// and the inverse transform without touching the other columns
+	__local float* column = patch + localId;
+	PatchForwardHaar(column, pitch, patchSize, temp);
+	for (uint k = 0; k < patchSize; k++)
+	{
+		float inVal = column[k*pitch];
+		float res;
+		if (isSoftThresh)
+		{
+			res = fabs(inVal) - thresh;
+			res = copysign((res + fabs(res)) * 0.5f, inVal);
+		}
+		else
+			res = (fabs(inVal) > thresh) * inVal;
+		column[k*pitch] = res;
+	}
+	PatchInverseHaar(column, pitch, patchSize, temp);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	PatchInverseHaar(patch + localId*pitch, 1, patchSize, temp);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint y = 0; y < patchSize; y++)
+	{
+		uint idx = (startY + y)*width + startX + localId;
+		float res = patch[y*pitch + localId] * 255.f;
+		if (isOverlapping)
+			atomic_add(&sumBuff[idx], convert_int_rte(res * PATCH_FIXED_SCALE));
+		else
+			outBuff[idx] = convert_uchar_sat(res);
+	}
+}
+
+__kernel void Patch_Normalize_kernel(__global const int* sumBuff, __global uchar* outBuff, const uint width, const uint height,
+									 const uint patchSize, const uint step, const uint numPatchesX, const uint numPatchesY)
+{
+	uint idx = get_global_id(0);
+	if (idx >= width*height)
+		return;
+
+	uint x = idx % width;
+	uint y = idx / width;
+	uint coverage = GetPatchCoverage(x, width, patchSize, step, numPatchesX) * GetPatchCoverage(y, height, patchSize, step, numPatchesY);
+	outBuff[idx] = convert_uchar_sat((float)sumBuff[idx] / (coverage * PATCH_FIXED_SCALE));
+}
+
+
+//
+// 'Bytes_To_Coef_kernel' and 'Coef_To_Bytes_kernel' convert between the gray levels of a
+// packed region and the coefficients on the device, the same way 'ConvertToCoefs' and
+// 'ConvertFromCoefs' do on the host, so a region is transferred as bytes.
+//
+__kernel void Bytes_To_Coef_kernel(__global const uchar* inBuff, __global coef_t* outBuff, const uint dataLen)
+{
+	uint idx = get_global_id(0);
+	if (idx < dataLen)
+		STORE_COEF((float)inBuff[idx] / 255.f, outBuff, idx);
+}
+
+__kernel void Coef_To_Bytes_kernel(__global const coef_t* inBuff, __global uchar* outBuff, const uint dataLen)
+{
+	uint idx = get_global_id(0);
+	if (idx < dataLen)
+		outBuff[idx] = (uchar)convert_int(LOAD_COEF(inBuff, idx) * 255.f);
+}
+
+
+//
+// NeighShrink thresholding: every detail coefficient is scaled by max(0, 1 - thresh^2/S^2),
+// where S^2 is the energy of the coefficients of the same subband in the (2*radius+1)^2
+// window around it, so isolated coefficients are removed and those in textured or edge
+// regions are kept. The matrices are 'numRows' rows of 'rowLen' coefficients, the third
+// dimension selects the matrix. A work-group loads its tile with a halo of 'radius'
+// coefficients on every side into local memory once and sums the windows from there.
+// The subbands are the products of a dyadic interval of each axis in the standard
+// decomposition and the three quadrants of every level in the non-standard one, the
+// approximation is kept as it is.
+//
+bool GetNeighSubband(uint x, uint y, uint rowLen, uint numRows, uint isNonStandard, uint* pStartX, uint* pEndX, uint* pStartY,
+					 uint* pEndY)
+{
+	if (!isNonStandard)
+	{
+		if (x == 0 && y == 0)
+			return false;
+		*pStartX = (x == 0) ? 0 : (1u << (31 - clz(x)));
+		*pEndX = (x == 0) ? 1 : (*pStartX << 1);
+		*pStartY = (y == 0) ? 0 : (1u << (31 - clz(y)));
+		*pEndY = (y == 0) ? 1 : (*pStartY << 1);
+		return true;
+	}
+
+	// Find the finest level whose quadrants hold the coefficient
+	uint levelWidth = rowLen >> 1;
+	uint levelHeight = numRows >> 1;
+	while (levelWidth > 0 && levelHeight > 0)
+	{
+		if (x >= levelWidth || y >= levelHeight)
+		{
+			*pStartX = (x >= levelWidth) ? levelWidth : 0;
+			*pEndX = *pStartX + levelWidth;
+			*pStartY = (y >= levelHeight) ? levelHeight : 0;
+			*pEndY = *pStartY + levelHeight;
+			return true;
+		}
+		levelWidth >>= 1;
+		levelHeight >>= 1;
+	}
+	return false;
+}
+
+__kernel void Mat_Neigh_Threshold_kernel(__global const coef_t* inBuff, __global coef_t* outBuff, __local float* tile,
+										 const uint rowLen, const uint numRows, const float thresh, const uint radius,
+										 const uint isNonStandard)
+{
+	uint localX = get_local_id(0);
+	uint localY = get_local_id(1);
+	uint tileWidth = get_local_size(0);
+	uint tileHeight = get_local_size(1);
+	uint x = get_global_id(0);
+	uint y = get_global_id(1);
+	uint matrixOffset = get_global_id(2)*rowLen*numRows;
+	int originX = (int)(get_group_id(0)*tileWidth) - (int)radius;
+	int originY = (int)(get_group_id(1)*tileHeight) - (int)radius;
+	uint pitch = tileWidth + 2*radius;
+	uint haloHeight = tileHeight + 2*radius;
+
+	// The halo is clamped to the matrix, the coefficients outside it are never summed
+	for (uint j = localY; j < haloHeight; j += tileHeight)
+	{
+		uint srcY = (uint)clamp(originY + (int)j, 0, (int)numRows - 1);
+		for (uint i = localX; i < pitch; i += tileWidth)
+		{
+			uint srcX = (uint)clamp(originX + (int)i, 0, (int)rowLen - 1);
+			tile[j*pitch + i] = LOAD_COEF(inBuff, matrixOffset + srcY*rowLen + srcX);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (x >= rowLen || y >= numRows)
+		return;
+
+	float coef = tile[(localY + radius)*pitch + localX + radius];
+	uint startX, endX, startY, endY;
+	if (!GetNeighSubband(x, y, rowLen, numRows, isNonStandard, &startX, &endX, &startY, &endY))
+	{
+		STORE_COEF(coef, outBuff, matrixOffset + y*rowLen + x);
+		return;
+	}
+
+	// The window is clipped to the subband
+	uint winStartX = (x >= startX + radius) ? x - radius : startX;
+	uint winEndX = (x + radius + 1 < endX) ? x + radius + 1 : endX;
+	uint winStartY = (y >= startY + radius) ? y - radius : startY;
+	uint winEndY = (y + radius + 1 < endY) ? y + radius + 1 : endY;
+	float energy = 0.f;
+	for (uint winY = winStartY; winY < winEndY; winY++)
+	{
+		uint rowStart = ((int)winY - originY)*pitch + (int)winStartX - originX;
+		for (uint i = 0; i < winEndX - winStartX; i++)
+			energy += tile[rowStart + i] * tile[rowStart + i];
+	}
+
+	float shrink = (energy > 0.f) ? fmax(1.f - thresh*thresh / energy, 0.f) : 0.f;
+	STORE_COEF(coef * shrink, outBuff, matrixOffset + y*rowLen + x);
+}
+
+
+//
+// 'Coef_To_Thumbnails_kernel' converts a frame to gray levels like 'Coef_To_Bytes_kernel' and
+// also writes its approximations at the levels set in 'levelMask' after it, the smaller ones
+// last. Every work-group keeps its square tile in local memory and averages 2x2 blocks of the
+// previous level in place, an average of a 2^level block is the LL coefficient of the level
+// divided by 2^level. The tiles must cover 2^level pixels on a side for every level.
+//
+__kernel void Coef_To_Thumbnails_kernel(__global const coef_t* inBuff, __global uchar* outBuff, __local float* tile,
+										const uint width, const uint height, const uint levelMask)
+{
+	uint x = get_global_id(0);
+	uint y = get_global_id(1);
+	uint side = get_local_size(0);
+	uint localIdx = get_local_id(1)*side + get_local_id(0);
+
+	float val = LOAD_COEF(inBuff, y*width + x);
+	outBuff[y*width + x] = (uchar)convert_int(val * 255.f);
+	tile[localIdx] = val;
+
+	// An active work-item only reads the averages of the previous level, which the work-items
+	// at odd multiples of half the block wrote
+	uint offset = width*height;
+	for (uint level = 1; (levelMask >> level) != 0; level++)
+	{
+		barrier(CLK_LOCAL_MEM_FENCE);
+		uint blockMask = (1u << level) - 1;
+		uint half = 1u << (level - 1);
+		bool isActive = ((get_local_id(0) & blockMask) == 0) && ((get_local_id(1) & blockMask) == 0);
+		if (isActive)
+			tile[localIdx] = (tile[localIdx] + tile[localIdx + half] + tile[localIdx + half*side] + tile[localIdx + half*side + half]) * 0.25f;
+
+		uint levelWidth = width >> level;
+		if (levelMask & (1u << level))
+		{
+			if (isActive)
+				outBuff[offset + (y >> level)*levelWidth + (x >> level)] = convert_uchar_sat_rte(tile[localIdx] * 255.f);
+			offset += levelWidth * (height >> level);
+		}
+	}
+}
+
+
+//
+// 'Coef_Metrics_kernel' reduces the metrics of a batch of frames of 'CleanNoise' after the
+// thresholding: the energy the thresholding removed, the number of zero coefficients, the
+// energy of the approximation and that of the three orientations of every level, in this
+// order. The levels coarser than 'numLevels' (at most METRICS_MAX_LEVELS) are added to the
+// last one. The second dimension selects the frame, and every work-group writes its sums to
+// 'groupSumsBuff' at [(frame*numGroups + groupId)*numSums + sumIdx]. If 'threshMode' is not
+// 0 the coefficients are not thresholded yet, and 1 or 2 applies the hard or the soft
+// thresholding to them here.
+//
+#define METRICS_MAX_LEVELS	16
+
+// The level of a coefficient of a 'width' x 'height' frame (1 is the finest) and whether it is a
+// detail along x only (0), along y only (1) or along both (2), false for the approximation. In
+// the standard decomposition the subbands of two scales count in the finer one.
+bool GetMetricsSubband(uint x, uint y, uint width, uint height, uint isNonStandard, uint* pLevel, uint* pOrientation)
+{
+	if (isNonStandard)
+	{
+		uint level = 1;
+		for (uint levelWidth = width >> 1, levelHeight = height >> 1; levelWidth > 0 && levelHeight > 0;
+			 levelWidth >>= 1, levelHeight >>= 1, level++)
+		{
+			if (x >= levelWidth || y >= levelHeight)
+			{
+				*pLevel = level;
+				*pOrientation = (x >= levelWidth) ? ((y >= levelHeight) ? 2 : 0) : 1;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	if (x == 0 && y == 0)
+		return false;
+	uint levelX = (x == 0) ? UINT_MAX : (uint)(clz(x) - clz(width));
+	uint levelY = (y == 0) ? UINT_MAX : (uint)(clz(y) - clz(height));
+	*pLevel = min(levelX, levelY);
+	*pOrientation = (levelX == levelY) ? 2 : ((levelX < levelY) ? 0 : 1);
+	return true;
+}
+
+__kernel void Coef_Metrics_kernel(__global const coef_t* coefsBuff, __global const coef_t* threshedBuff, const float thresh,
+								  const uint threshMode, const uint rowLen, const uint numRows, const uint isNonStandard,
+								  const uint numLevels, __local float* localSums, __global float* groupSumsBuff)
+{
+	uint localId = get_local_id(0);
+	uint localSize = get_local_size(0);
+	uint frameLen = rowLen*numRows;
+	uint frameOffset = get_global_id(1)*frameLen;
+	uint numSums = 3 + 3*numLevels;
+
+	// The standard decomposition leaves the frames transposed
+	uint width = isNonStandard ? rowLen : numRows;
+	uint height = isNonStandard ? numRows : rowLen;
+	float sums[3 + 3*METRICS_MAX_LEVELS];
+	for (uint s = 0; s < numSums; s++)
+		sums[s] = 0.f;
+	for (uint i = get_global_id(0); i < frameLen; i += get_global_size(0))
+	{
+		float inVal = LOAD_COEF(coefsBuff, frameOffset + i);
+		float res = (threshMode == 0) ? LOAD_COEF(threshedBuff, frameOffset + i) : ThresholdCoef(inVal, thresh, threshMode == 2);
+		sums[0] += (inVal - res) * (inVal - res);
+		sums[1] += (res == 0.f);
+
+		uint row = i / rowLen;
+		uint col = i % rowLen;
+		uint level, orientation;
+		bool isDetail = GetMetricsSubband(isNonStandard ? col : row, isNonStandard ? row : col, width, height, isNonStandard, &level,
+										  &orientation);
+		sums[isDetail ? 3 + (min(level, numLevels) - 1)*3 + orientation : 2] += res * res;
+	}
+
+	// All the sums are reduced together, 'localSums' holds 'numSums' rows of the work-group
+	// size, which is a power of two
+	for (uint s = 0; s < numSums; s++)
+		localSums[s*localSize + localId] = sums[s];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint stride = localSize / 2; stride > 0; stride /= 2)
+	{
+		if (localId < stride)
+		{
+			for (uint s = 0; s < numSums; s++)
+				localSums[s*localSize + localId] += localSums[s*localSize + localId + stride];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	uint groupIdx = get_global_id(1)*get_num_groups(0) + get_group_id(0);
+	for (uint s = localId; s < numSums; s += localSize)
+		groupSumsBuff[groupIdx*numSums + s] = localSums[s*localSize];
 }
 //-----------------------------------------------------------------------------------------
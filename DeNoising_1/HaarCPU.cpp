@@ -0,0 +1,317 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "HaarCPU.h"
+#include <string.h>
+#include <vector>
+
+#define SQRT_2				1.4142135623730950488f
+#define INV_SQRT_2			0.70710678118654752440f
+// The cache a strip of columns should fit in, the L2 of most CPUs
+#ifndef HAAR_CPU_CACHE_BYTES
+#define HAAR_CPU_CACHE_BYTES	(256*1024)
+#endif
+// A strip is at least a cache line wide
+#define MIN_BLOCK_WIDTH		16
+
+
+//-----------------------------------------------------------------------------------------
+static bool IsPowerOf2(int len)
+{
+	return len > 0 && (len & (len - 1)) == 0;
+}
+//-----------------------------------------------------------------------------------------
+// All the levels of one row. The approximation of every level goes to one of the halves of
+// 'pScratch' (len floats), the details straight to their final place in the row. The first
+// level runs from the end of the row, so every detail lands on samples already read.
+//-----------------------------------------------------------------------------------------
+static void ForwardRow(float* pRow, int len, float* pScratch)
+{
+	int halfLen = len / 2;
+	float* pApprox = pScratch;
+	float* pNext = pScratch + halfLen;
+	for (int k = halfLen - 1; k >= 0; k--)
+	{
+		float even = pRow[2*k];
+		float odd = pRow[2*k + 1];
+		pApprox[k] = (even + odd) * INV_SQRT_2;
+		pRow[halfLen + k] = (even - odd) * INV_SQRT_2;
+	}
+	for (int currLen = halfLen; currLen > 1; currLen >>= 1)
+	{
+		int nextLen = currLen / 2;
+		for (int k = 0; k < nextLen; k++)
+		{
+			pNext[k] = (pApprox[2*k] + pApprox[2*k + 1]) * INV_SQRT_2;
+			pRow[nextLen + k] = (pApprox[2*k] - pApprox[2*k + 1]) * INV_SQRT_2;
+		}
+		float* pTemp = pApprox;
+		pApprox = pNext;
+		pNext = pTemp;
+	}
+	pRow[0] = pApprox[0];
+}
+//-----------------------------------------------------------------------------------------
+// The reverse of 'ForwardRow'. The last level runs from the start of the row, so every
+// sample lands on details already read.
+//-----------------------------------------------------------------------------------------
+static void InverseRow(float* pRow, int len, float* pScratch)
+{
+	int halfLen = len / 2;
+	float* pApprox = pScratch;
+	float* pNext = pScratch + halfLen;
+	pApprox[0] = pRow[0];
+	for (int currLen = 1; currLen < halfLen; currLen <<= 1)
+	{
+		for (int k = 0; k < currLen; k++)
+		{
+			float res = (pApprox[k] + pRow[currLen + k]) * SQRT_2 * 0.5f;
+			pNext[2*k] = res;
+			pNext[2*k + 1] = (pApprox[k] * SQRT_2) - res;
+		}
+		float* pTemp = pApprox;
+		pApprox = pNext;
+		pNext = pTemp;
+	}
+	for (int k = 0; k < halfLen; k++)
+	{
+		float approx = pApprox[k];
+		float res = (approx + pRow[halfLen + k]) * SQRT_2 * 0.5f;
+		pRow[2*k] = res;
+		pRow[2*k + 1] = (approx * SQRT_2) - res;
+	}
+}
+//-----------------------------------------------------------------------------------------
+// 'ForwardRow' on a strip of 'blockWidth' columns, where a sample is a row of the strip. The
+// approximations are kept in 'pScratch' ('height' x 'blockWidth' floats) with rows of 'blockWidth'.
+//-----------------------------------------------------------------------------------------
+static void ForwardStrip(float* pStrip, int width, int height, int blockWidth, float* pScratch)
+{
+	int halfLen = height / 2;
+	float* pApprox = pScratch;
+	float* pNext = pScratch + halfLen*blockWidth;
+	for (int k = halfLen - 1; k >= 0; k--)
+	{
+		const float* pEven = pStrip + 2*k*width;
+		const float* pOdd = pEven + width;
+		float* pOutApprox = pApprox + k*blockWidth;
+		float* pOutDetail = pStrip + (halfLen + k)*width;
+		for (int i = 0; i < blockWidth; i++)
+		{
+			float even = pEven[i];
+			float odd = pOdd[i];
+			pOutApprox[i] = (even + odd) * INV_SQRT_2;
+			pOutDetail[i] = (even - odd) * INV_SQRT_2;
+		}
+	}
+	for (int currLen = halfLen; currLen > 1; currLen >>= 1)
+	{
+		int nextLen = currLen / 2;
+		for (int k = 0; k < nextLen; k++)
+		{
+			const float* pEven = pApprox + 2*k*blockWidth;
+			const float* pOdd = pEven + blockWidth;
+			float* pOutApprox = pNext + k*blockWidth;
+			float* pOutDetail = pStrip + (nextLen + k)*width;
+			for (int i = 0; i < blockWidth; i++)
+			{
+				pOutApprox[i] = (pEven[i] + pOdd[i]) * INV_SQRT_2;
+				pOutDetail[i] = (pEven[i] - pOdd[i]) * INV_SQRT_2;
+			}
+		}
+		float* pTemp = pApprox;
+		pApprox = pNext;
+		pNext = pTemp;
+	}
+	memcpy(pStrip, pApprox, blockWidth * sizeof(float));
+}
+//-----------------------------------------------------------------------------------------
+static void InverseStrip(float* pStrip, int width, int height, int blockWidth, float* pScratch)
+{
+	int halfLen = height / 2;
+	float* pApprox = pScratch;
+	float* pNext = pScratch + halfLen*blockWidth;
+	memcpy(pApprox, pStrip, blockWidth * sizeof(float));
+	for (int currLen = 1; currLen < halfLen; currLen <<= 1)
+	{
+		for (int k = 0; k < currLen; k++)
+		{
+			const float* pInApprox = pApprox + k*blockWidth;
+			const float* pInDetail = pStrip + (currLen + k)*width;
+			float* pEven = pNext + 2*k*blockWidth;
+			float* pOdd = pEven + blockWidth;
+			for (int i = 0; i < blockWidth; i++)
+			{
+				float res = (pInApprox[i] + pInDetail[i]) * SQRT_2 * 0.5f;
+				pEven[i] = res;
+				pOdd[i] = (pInApprox[i] * SQRT_2) - res;
+			}
+		}
+		float* pTemp = pApprox;
+		pApprox = pNext;
+		pNext = pTemp;
+	}
+	for (int k = 0; k < halfLen; k++)
+	{
+		const float* pInApprox = pApprox + k*blockWidth;
+		const float* pInDetail = pStrip + (halfLen + k)*width;
+		float* pEven = pStrip + 2*k*width;
+		float* pOdd = pEven + width;
+		for (int i = 0; i < blockWidth; i++)
+		{
+			float approx = pInApprox[i];
+			float res = (approx + pInDetail[i]) * SQRT_2 * 0.5f;
+			pEven[i] = res;
+			pOdd[i] = (approx * SQRT_2) - res;
+		}
+	}
+}
+//-----------------------------------------------------------------------------------------
+int CHaarCPU::GetColumnBlockWidth(int width, int height)
+{
+	// The strip and its scratch take 2 * height * blockWidth floats
+	int blockWidth = MIN_BLOCK_WIDTH;
+	while (blockWidth < width && 2 * (size_t)height * (blockWidth * 2) * sizeof(float) <= HAAR_CPU_CACHE_BYTES)
+		blockWidth *= 2;
+	return (blockWidth < width) ? blockWidth : width;
+}
+//-----------------------------------------------------------------------------------------
+int CHaarCPU::GetScratchLen(int width, int height)
+{
+	int columnsLen = height * GetColumnBlockWidth(width, height);
+	return (width > columnsLen) ? width : columnsLen;
+}
+//-----------------------------------------------------------------------------------------
+bool CHaarCPU::ForwardTransform2D(float* pBuff, int width, int height, float* pScratch /*= NULL*/)
+{
+	if (!IsPowerOf2(width) || !IsPowerOf2(height))
+		return false;
+
+	std::vector<float> scratch;
+	if (pScratch == NULL)
+	{
+		scratch.resize(GetScratchLen(width, height));
+		pScratch = &scratch[0];
+	}
+	for (int y = 0; y < height && width > 1; y++)
+		ForwardRow(pBuff + y*width, width, pScratch);
+
+	int blockWidth = GetColumnBlockWidth(width, height);
+	for (int x = 0; x < width && height > 1; x += blockWidth)
+		ForwardStrip(pBuff + x, width, height, blockWidth, pScratch);
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+bool CHaarCPU::InverseTransform2D(float* pBuff, int width, int height, float* pScratch /*= NULL*/)
+{
+	if (!IsPowerOf2(width) || !IsPowerOf2(height))
+		return false;
+
+	std::vector<float> scratch;
+	if (pScratch == NULL)
+	{
+		scratch.resize(GetScratchLen(width, height));
+		pScratch = &scratch[0];
+	}
+	int blockWidth = GetColumnBlockWidth(width, height);
+	for (int x = 0; x < width && height > 1; x += blockWidth)
+		InverseStrip(pBuff + x, width, height, blockWidth, pScratch);
+
+	for (int y = 0; y < height && width > 1; y++)
+		InverseRow(pBuff + y*width, width, pScratch);
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+// The 1D reference algorithm of 'CNoiseCleaner::ForwardHaarTransformCPU'
+//-----------------------------------------------------------------------------------------
+static void ForwardLineNaive(float* pLine, int len)
+{
+	float* pTemp = new float[len];
+	memcpy(pTemp, pLine, len * sizeof(float));
+	for (int w = len / 2; w >= 1; w /= 2)
+	{
+		for (int i = 0; i < w; i++)
+		{
+			pLine[i] = (pTemp[2*i] + pTemp[2*i + 1]) * INV_SQRT_2;
+			pLine[i + w] = (pTemp[2*i] - pTemp[2*i + 1]) * INV_SQRT_2;
+		}
+		memcpy(pTemp, pLine, w * 2 * sizeof(float));
+	}
+	delete[] pTemp;
+}
+//-----------------------------------------------------------------------------------------
+static void InverseLineNaive(float* pLine, int len)
+{
+	float* pTemp = new float[len];
+	memcpy(pTemp, pLine, len * sizeof(float));
+	for (int w = 1; w < len; w *= 2)
+	{
+		for (int i = 0; i < w; i++)
+		{
+			pLine[2*i] = (pTemp[i] + pTemp[i + w]) * SQRT_2 * 0.5f;
+			pLine[2*i + 1] = (pTemp[i] * SQRT_2) - pLine[2*i];
+		}
+		memcpy(pTemp, pLine, w * 2 * sizeof(float));
+	}
+	delete[] pTemp;
+}
+//-----------------------------------------------------------------------------------------
+bool CHaarCPU::ForwardTransform2DNaive(float* pBuff, int width, int height)
+{
+	if (!IsPowerOf2(width) || !IsPowerOf2(height))
+		return false;
+
+	for (int y = 0; y < height; y++)
+		ForwardLineNaive(pBuff + y*width, width);
+
+	std::vector<float> column(height);
+	for (int x = 0; x < width; x++)
+	{
+		for (int y = 0; y < height; y++)
+			column[y] = pBuff[y*width + x];
+		ForwardLineNaive(&column[0], height);
+		for (int y = 0; y < height; y++)
+			pBuff[y*width + x] = column[y];
+	}
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+bool CHaarCPU::InverseTransform2DNaive(float* pBuff, int width, int height)
+{
+	if (!IsPowerOf2(width) || !IsPowerOf2(height))
+		return false;
+
+	std::vector<float> column(height);
+	for (int x = 0; x < width; x++)
+	{
+		for (int y = 0; y < height; y++)
+			column[y] = pBuff[y*width + x];
+		InverseLineNaive(&column[0], height);
+		for (int y = 0; y < height; y++)
+			pBuff[y*width + x] = column[y];
+	}
+
+	for (int y = 0; y < height; y++)
+		InverseLineNaive(pBuff + y*width, width);
+	return true;
+}
+//-----------------------------------------------------------------------------------------
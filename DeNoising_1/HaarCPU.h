@@ -0,0 +1,65 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef __HAAR_CPU_H__
+#define __HAAR_CPU_H__
+
+#include <stddef.h>
+
+
+// -----------------------------------------------------------------------------------------
+// CPU implementation of the 2D Haar transform of 'CNoiseCleaner::CleanNoise' (all the levels
+// of the rows and then all the levels of the columns) in floats, for images which are
+// processed on the host. The naive version transforms one row or one column at a time with
+// the 1D reference algorithm: every level copies the whole line into a temporary buffer, and
+// every column is gathered with a stride of a full row, which touches a new cache line for
+// every sample. The cache-blocked version
+//	* transforms a row in a single pass per level between the row and a scratch buffer, the
+//	  details go straight to their final place and only the approximation is carried on;
+//	* transforms the columns in strips of 'GetColumnBlockWidth' adjacent columns, where a
+//	  level is a step between whole rows of the strip (a bundle of cache lines), and a strip
+//	  goes through all of its levels while it fits in the L2 cache;
+//	* uses one scratch buffer of 'GetScratchLen' floats for everything.
+// Both versions do the same arithmetic on every coefficient, so their results agree.
+// -----------------------------------------------------------------------------------------
+class CHaarCPU
+{
+public:
+	// -----------------------------------------------------------------------------------------
+	// Cache-blocked 2D transforms of a 'width' x 'height' matrix in place, both must be powers
+	// of 2. Element (y, x) of the result is coefficient y of the column transform of row
+	// coefficient x. 'pScratch' must hold 'GetScratchLen' floats, with NULL it is allocated
+	// for the call. Return false if the size is not supported.
+	// -----------------------------------------------------------------------------------------
+	static bool ForwardTransform2D(float* pBuff, int width, int height, float* pScratch = NULL);
+	static bool InverseTransform2D(float* pBuff, int width, int height, float* pScratch = NULL);
+	static int GetScratchLen(int width, int height);
+
+	/** The naive transforms, one row and then one strided column at a time **/
+	static bool ForwardTransform2DNaive(float* pBuff, int width, int height);
+	static bool InverseTransform2DNaive(float* pBuff, int width, int height);
+
+	/** The number of columns transformed together, a strip of them and its scratch fit in HAAR_CPU_CACHE_BYTES **/
+	static int GetColumnBlockWidth(int width, int height);
+};
+
+
+
+#endif	// __HAAR_CPU_H__
@@ -0,0 +1,313 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <algorithm>
+#if defined(_WIN32) || defined(_WIN64) || defined(_WINDOWS)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "ImageIO.h"
+
+
+// Pages are at least this large, 'Prefetch' touches one byte in each of them
+#define PREFETCH_STRIDE		4096
+// The largest width or height in a header, which keeps the sizes from overflowing
+#define MAX_IMAGE_SIDE		(1 << 24)
+
+
+//-----------------------------------------------------------------------------------------
+CImageFile::CImageFile() :
+m_format(FORMAT_RAW),
+m_isWritable(false),
+m_width(0),
+m_height(0),
+m_pMapping(NULL),
+m_mappingSize(0),
+m_headerLen(0),
+m_pPixels(NULL)
+#if defined(_WIN32) || defined(_WIN64) || defined(_WINDOWS)
+, m_hFile(NULL),
+m_hMapping(NULL)
+#endif
+{
+}
+//-----------------------------------------------------------------------------------------
+CImageFile::~CImageFile()
+{
+	Close();
+}
+//-----------------------------------------------------------------------------------------
+bool CImageFile::GetFormat(const char* pPath, EFormat& format)
+{
+	const char* pDot = strrchr(pPath, '.');
+	if (!pDot)
+		return false;
+	std::string ext = pDot;
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	if (ext == ".raw" || ext == ".gray")
+		format = FORMAT_RAW;
+	else if (ext == ".pgm")
+		format = FORMAT_PGM;
+	else if (ext == ".ppm")
+		format = FORMAT_PPM;
+	else
+		return false;
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+bool CImageFile::OpenRead(const char* pPath, int rawWidth /*= 0*/, int rawHeight /*= 0*/)
+{
+	Close();
+	if (!GetFormat(pPath, m_format) || !Map(pPath, false, 0))
+		return false;
+
+	// The header, not the extension, tells a PGM file from a PPM file
+	size_t headerLen = 0;
+	bool isValid = true;
+	if (m_format == FORMAT_RAW)
+	{
+		m_width = rawWidth;
+		m_height = rawHeight;
+	}
+	else
+		isValid = ParseHeader(headerLen);
+
+	size_t numChannels = (m_format == FORMAT_PPM) ? 3 : 1;
+	size_t dataLen = (size_t)m_width * m_height * numChannels;
+	isValid = isValid && m_width > 0 && m_height > 0 && m_width <= MAX_IMAGE_SIDE && m_height <= MAX_IMAGE_SIDE;
+	isValid = isValid && (headerLen + dataLen <= m_mappingSize) && (m_format != FORMAT_RAW || dataLen == m_mappingSize);
+	if (!isValid)
+	{
+		Close();
+		return false;
+	}
+	m_headerLen = headerLen;
+	m_pPixels = m_pMapping + headerLen;
+	if (m_format != FORMAT_PPM)
+		return true;
+
+	// The weights of cvCvtColor (ITU-R BT.601) in 14-bit fixed point
+	const unsigned char* pRGB = m_pPixels;
+	m_grayPixels.resize((size_t)m_width * m_height);
+	for (size_t i = 0; i < m_grayPixels.size(); i++, pRGB += 3)
+		m_grayPixels[i] = (unsigned char)((pRGB[0]*4899 + pRGB[1]*9617 + pRGB[2]*1868 + (1 << 13)) >> 14);
+	m_pPixels = &m_grayPixels[0];
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+bool CImageFile::Create(const char* pPath, EFormat format, int width, int height)
+{
+	Close();
+	if (width <= 0 || height <= 0 || width > MAX_IMAGE_SIDE || height > MAX_IMAGE_SIDE)
+		return false;
+
+	char header[64];
+	size_t headerLen = 0;
+	if (format != FORMAT_RAW)
+		headerLen = sprintf(header, "P%c\n%d %d\n255\n", (format == FORMAT_PGM) ? '5' : '6', width, height);
+	size_t numChannels = (format == FORMAT_PPM) ? 3 : 1;
+	if (!Map(pPath, true, headerLen + (size_t)width * height * numChannels))
+		return false;
+
+	memcpy(m_pMapping, header, headerLen);
+	m_format = format;
+	m_width = width;
+	m_height = height;
+	m_headerLen = headerLen;
+	m_pPixels = m_pMapping + headerLen;
+	if (format == FORMAT_PPM)
+	{
+		m_grayPixels.resize((size_t)width * height);
+		m_pPixels = &m_grayPixels[0];
+	}
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+void CImageFile::Prefetch()
+{
+	if (!m_pMapping)
+		return;
+
+	// Writing the pages maps them writable, which a read would not do. The pixels of a PPM
+	// file which is read have been converted already.
+	unsigned char* pData = m_pMapping + m_headerLen;
+	size_t dataLen = m_mappingSize - m_headerLen;
+	if (m_isWritable)
+	{
+		for (size_t i = 0; i < dataLen; i += PREFETCH_STRIDE)
+			((volatile unsigned char*)pData)[i] = 0;
+	}
+	else if (m_format != FORMAT_PPM)
+	{
+		unsigned char sum = 0;
+		for (size_t i = 0; i < dataLen; i += PREFETCH_STRIDE)
+			sum += ((volatile const unsigned char*)pData)[i];
+		(void)sum;
+	}
+}
+//-----------------------------------------------------------------------------------------
+void CImageFile::Close()
+{
+	if (m_pMapping && m_isWritable && m_format == FORMAT_PPM)
+	{
+		unsigned char* pRGB = m_pMapping + m_headerLen;
+		for (size_t i = 0; i < m_grayPixels.size(); i++, pRGB += 3)
+			pRGB[0] = pRGB[1] = pRGB[2] = m_grayPixels[i];
+	}
+
+#if defined(_WIN32) || defined(_WIN64) || defined(_WINDOWS)
+	if (m_pMapping)
+		UnmapViewOfFile(m_pMapping);
+	if (m_hMapping)
+		CloseHandle((HANDLE)m_hMapping);
+	if (m_hFile)
+		CloseHandle((HANDLE)m_hFile);
+	m_hMapping = NULL;
+	m_hFile = NULL;
+#else
+	if (m_pMapping)
+		munmap(m_pMapping, m_mappingSize);
+#endif
+	m_pMapping = NULL;
+	m_mappingSize = 0;
+	m_headerLen = 0;
+	m_pPixels = NULL;
+	m_width = 0;
+	m_height = 0;
+	m_isWritable = false;
+	std::vector<unsigned char>().swap(m_grayPixels);
+}
+//-----------------------------------------------------------------------------------------
+bool CImageFile::Map(const char* pPath, bool isWritable, size_t fileSize)
+{
+	// Files which are read are mapped whole, 'fileSize' is the size of a file which is created
+#if defined(_WIN32) || defined(_WIN64) || defined(_WINDOWS)
+	HANDLE hFile = CreateFileA(pPath, isWritable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, isWritable ? 0 : FILE_SHARE_READ,
+							   NULL, isWritable ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+	if (!isWritable)
+	{
+		LARGE_INTEGER size;
+		fileSize = GetFileSizeEx(hFile, &size) ? (size_t)size.QuadPart : 0;
+	}
+
+	// Mapping a created file extends it to 'fileSize'
+	HANDLE hMapping = NULL;
+	void* pMapping = NULL;
+	if (fileSize > 0)
+		hMapping = CreateFileMappingA(hFile, NULL, isWritable ? PAGE_READWRITE : PAGE_READONLY,
+									  (DWORD)((unsigned long long)fileSize >> 32), (DWORD)fileSize, NULL);
+	if (hMapping)
+		pMapping = MapViewOfFile(hMapping, isWritable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, fileSize);
+	if (!pMapping)
+	{
+		if (hMapping)
+			CloseHandle(hMapping);
+		CloseHandle(hFile);
+		return false;
+	}
+	m_hFile = hFile;
+	m_hMapping = hMapping;
+#else
+	int fd = open(pPath, isWritable ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0644);
+	if (fd < 0)
+		return false;
+	bool isValid = true;
+	if (isWritable)
+	{
+		isValid = (ftruncate(fd, (off_t)fileSize) == 0);
+#ifdef __linux__
+		// Without allocating the blocks a full disk would raise SIGBUS when the pixels are written
+		isValid = isValid && (posix_fallocate(fd, 0, (off_t)fileSize) == 0);
+#endif
+	}
+	else
+	{
+		struct stat fileStat;
+		isValid = (fstat(fd, &fileStat) == 0);
+		fileSize = isValid ? (size_t)fileStat.st_size : 0;
+	}
+
+	void* pMapping = MAP_FAILED;
+	if (isValid && fileSize > 0)
+		pMapping = mmap(NULL, fileSize, isWritable ? (PROT_READ | PROT_WRITE) : PROT_READ, isWritable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (pMapping == MAP_FAILED)
+		return false;
+#endif
+
+	m_pMapping = (unsigned char*)pMapping;
+	m_mappingSize = fileSize;
+	m_isWritable = isWritable;
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+bool CImageFile::ParseHeader(size_t& headerLen)
+{
+	const unsigned char* pData = m_pMapping;
+	size_t size = m_mappingSize;
+	if (size < 2 || pData[0] != 'P' || (pData[1] != '5' && pData[1] != '6'))
+		return false;
+	m_format = (pData[1] == '5') ? FORMAT_PGM : FORMAT_PPM;
+
+	// The width, the height and the maximum value, separated by white space and comments
+	size_t pos = 2;
+	int values[3];
+	for (int v = 0; v < 3; v++)
+	{
+		while (pos < size && (isspace(pData[pos]) || pData[pos] == '#'))
+		{
+			if (pData[pos] == '#')
+			{
+				while (pos < size && pData[pos] != '\n')
+					pos++;
+			}
+			else
+				pos++;
+		}
+		if (pos == size || !isdigit(pData[pos]))
+			return false;
+		values[v] = 0;
+		while (pos < size && isdigit(pData[pos]))
+		{
+			if (values[v] > MAX_IMAGE_SIDE)
+				return false;
+			values[v] = values[v] * 10 + (pData[pos++] - '0');
+		}
+	}
+
+	// A single white space character separates the header from the pixels
+	if (pos == size || !isspace(pData[pos]) || values[2] != 255)
+		return false;
+	m_width = values[0];
+	m_height = values[1];
+	headerLen = pos + 1;
+	return true;
+}
+//-----------------------------------------------------------------------------------------
@@ -0,0 +1,103 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef __IMAGE_IO_H__
+#define __IMAGE_IO_H__
+
+#include <stddef.h>
+#include <vector>
+
+
+// -----------------------------------------------------------------------------------------
+// Memory-mapped image files in the formats which need no codec: binary PGM (P5), binary
+// PPM (P6) and raw 8-bit gray levels without a header. 'OpenRead' maps an existing file and
+// 'GetPixels' points at the pixels inside the mapping, so a PGM or raw frame is passed to
+// CNoiseCleaner::CleanNoise without being copied. 'Create' sizes and maps a new file with its
+// header already written, so 'CleanNoise' writes its output straight into the file.
+// CleanNoise works on gray levels, so the pixels of a PPM file are converted to gray levels
+// when it is opened (like cvLoadImage with CV_LOAD_IMAGE_GRAYSCALE) and written to all three
+// channels when it is closed, through a buffer of the instance.
+// Only 8-bit samples (a maximum value of 255) are supported. An instance is one file and
+// is not thread-safe, but it may be handed from one thread to another.
+// -----------------------------------------------------------------------------------------
+class CImageFile
+{
+public:
+	enum EFormat { FORMAT_RAW, FORMAT_PGM, FORMAT_PPM };
+
+	CImageFile();
+	~CImageFile();
+
+	/** The format of 'pPath' by its extension ('.raw', '.gray', '.pgm' or '.ppm'), false for other files **/
+	static bool GetFormat(const char* pPath, EFormat& format);
+
+	// -----------------------------------------------------------------------------------------
+	// Maps the image file 'pPath' for reading, the format is taken from the extension. Raw
+	// files have no header, they must hold exactly 'rawWidth' x 'rawHeight' pixels.
+	// -----------------------------------------------------------------------------------------
+	bool OpenRead(const char* pPath, int rawWidth = 0, int rawHeight = 0);
+
+	// -----------------------------------------------------------------------------------------
+	// Creates (or truncates) 'pPath' for a 'width' x 'height' image in 'format' and maps it for
+	// writing. The blocks of the file are allocated here, so running out of disk space fails
+	// here rather than when the pixels are written through the mapping.
+	// -----------------------------------------------------------------------------------------
+	bool Create(const char* pPath, EFormat format, int width, int height);
+
+	// -----------------------------------------------------------------------------------------
+	// Touches every page of the pixels, so the page faults (and the reads of the file) happen
+	// in the calling thread rather than in the one which reads or writes the pixels later.
+	// -----------------------------------------------------------------------------------------
+	void Prefetch();
+
+	/** Writes the pixels of a created PPM file and unmaps the file **/
+	void Close();
+
+	bool IsOpen() const { return m_pMapping != NULL; }
+	unsigned char* GetPixels() { return m_pPixels; }
+	int GetWidth() const { return m_width; }
+	int GetHeight() const { return m_height; }
+	EFormat GetFormat() const { return m_format; }
+
+private:
+	CImageFile(const CImageFile&);
+	CImageFile& operator=(const CImageFile&);
+
+	bool Map(const char* pPath, bool isWritable, size_t fileSize);
+	bool ParseHeader(size_t& headerLen);
+
+	EFormat						m_format;
+	bool						m_isWritable;
+	int							m_width;
+	int							m_height;
+	unsigned char*				m_pMapping;
+	size_t						m_mappingSize;
+	size_t						m_headerLen;
+	unsigned char*				m_pPixels;		// In the mapping, or in 'm_grayPixels' for PPM files
+	std::vector<unsigned char>	m_grayPixels;
+#if defined(_WIN32) || defined(_WIN64) || defined(_WINDOWS)
+	void*						m_hFile;
+	void*						m_hMapping;
+#endif
+};
+
+
+
+#endif	// __IMAGE_IO_H__
@@ -0,0 +1,333 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "IntegerHaar.h"
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define INV_SQRT_2			0.70710678118654752440f
+#define TRANSPOSE_BLOCK		16
+
+
+//-----------------------------------------------------------------------------------------
+// Lifting steps between whole rows: the pair (pEven[i], pOdd[i]) becomes (pApprox[i], pDetail[i])
+// and back, for 'len' columns at once
+//-----------------------------------------------------------------------------------------
+static void LiftForward(const short* pEven, const short* pOdd, short* pApprox, short* pDetail, int len)
+{
+	int i = 0;
+#ifdef USE_SSE2
+	for (; i + 8 <= len; i += 8)
+	{
+		__m128i even = _mm_loadu_si128((const __m128i*)(pEven + i));
+		__m128i odd = _mm_loadu_si128((const __m128i*)(pOdd + i));
+		__m128i detail = _mm_sub_epi16(even, odd);
+		_mm_storeu_si128((__m128i*)(pDetail + i), detail);
+		_mm_storeu_si128((__m128i*)(pApprox + i), _mm_add_epi16(odd, _mm_srai_epi16(detail, 1)));
+	}
+#endif
+	for (; i < len; i++)
+	{
+		short detail = (short)(pEven[i] - pOdd[i]);
+		pDetail[i] = detail;
+		pApprox[i] = (short)(pOdd[i] + (detail >> 1));
+	}
+}
+//-----------------------------------------------------------------------------------------
+static void LiftForward(const int* pEven, const int* pOdd, int* pApprox, int* pDetail, int len)
+{
+	int i = 0;
+#ifdef USE_SSE2
+	for (; i + 4 <= len; i += 4)
+	{
+		__m128i even = _mm_loadu_si128((const __m128i*)(pEven + i));
+		__m128i odd = _mm_loadu_si128((const __m128i*)(pOdd + i));
+		__m128i detail = _mm_sub_epi32(even, odd);
+		_mm_storeu_si128((__m128i*)(pDetail + i), detail);
+		_mm_storeu_si128((__m128i*)(pApprox + i), _mm_add_epi32(odd, _mm_srai_epi32(detail, 1)));
+	}
+#endif
+	for (; i < len; i++)
+	{
+		int detail = pEven[i] - pOdd[i];
+		pDetail[i] = detail;
+		pApprox[i] = pOdd[i] + (detail >> 1);
+	}
+}
+//-----------------------------------------------------------------------------------------
+static void LiftInverse(const short* pApprox, const short* pDetail, short* pEven, short* pOdd, int len)
+{
+	int i = 0;
+#ifdef USE_SSE2
+	for (; i + 8 <= len; i += 8)
+	{
+		__m128i approx = _mm_loadu_si128((const __m128i*)(pApprox + i));
+		__m128i detail = _mm_loadu_si128((const __m128i*)(pDetail + i));
+		__m128i odd = _mm_sub_epi16(approx, _mm_srai_epi16(detail, 1));
+		_mm_storeu_si128((__m128i*)(pOdd + i), odd);
+		_mm_storeu_si128((__m128i*)(pEven + i), _mm_add_epi16(odd, detail));
+	}
+#endif
+	for (; i < len; i++)
+	{
+		short odd = (short)(pApprox[i] - (pDetail[i] >> 1));
+		pOdd[i] = odd;
+		pEven[i] = (short)(odd + pDetail[i]);
+	}
+}
+//-----------------------------------------------------------------------------------------
+static void LiftInverse(const int* pApprox, const int* pDetail, int* pEven, int* pOdd, int len)
+{
+	int i = 0;
+#ifdef USE_SSE2
+	for (; i + 4 <= len; i += 4)
+	{
+		__m128i approx = _mm_loadu_si128((const __m128i*)(pApprox + i));
+		__m128i detail = _mm_loadu_si128((const __m128i*)(pDetail + i));
+		__m128i odd = _mm_sub_epi32(approx, _mm_srai_epi32(detail, 1));
+		_mm_storeu_si128((__m128i*)(pOdd + i), odd);
+		_mm_storeu_si128((__m128i*)(pEven + i), _mm_add_epi32(odd, detail));
+	}
+#endif
+	for (; i < len; i++)
+	{
+		int odd = pApprox[i] - (pDetail[i] >> 1);
+		pOdd[i] = odd;
+		pEven[i] = odd + pDetail[i];
+	}
+}
+//-----------------------------------------------------------------------------------------
+// All the levels of the transform of the columns of a matrix with 'numRows' rows of 'rowLen',
+// every level leaves the approximation in the first half of the rows it starts from and the
+// details in the second half, which is the layout of the 1D transform. 'pTemp' holds the matrix.
+//-----------------------------------------------------------------------------------------
+template<class T>
+static void ForwardColumns(T* pBuff, int rowLen, int numRows, T* pTemp)
+{
+	for (int len = numRows; len > 1; len >>= 1)
+	{
+		int halfLen = len >> 1;
+		for (int i = 0; i < halfLen; i++)
+			LiftForward(pBuff + (2*i)*rowLen, pBuff + (2*i + 1)*rowLen, pTemp + i*rowLen, pTemp + (halfLen + i)*rowLen, rowLen);
+		memcpy(pBuff, pTemp, (size_t)len*rowLen*sizeof(T));
+	}
+}
+//-----------------------------------------------------------------------------------------
+template<class T>
+static void InverseColumns(T* pBuff, int rowLen, int numRows, T* pTemp)
+{
+	for (int len = 2; len <= numRows; len <<= 1)
+	{
+		int halfLen = len >> 1;
+		memcpy(pTemp, pBuff, (size_t)len*rowLen*sizeof(T));
+		for (int i = 0; i < halfLen; i++)
+			LiftInverse(pTemp + i*rowLen, pTemp + (halfLen + i)*rowLen, pBuff + (2*i)*rowLen, pBuff + (2*i + 1)*rowLen, rowLen);
+	}
+}
+//-----------------------------------------------------------------------------------------
+template<class T>
+static void Transpose(const T* pIn, T* pOut, int width, int height)
+{
+	for (int y0 = 0; y0 < height; y0 += TRANSPOSE_BLOCK)
+	{
+		for (int x0 = 0; x0 < width; x0 += TRANSPOSE_BLOCK)
+		{
+			int yEnd = (y0 + TRANSPOSE_BLOCK < height) ? y0 + TRANSPOSE_BLOCK : height;
+			int xEnd = (x0 + TRANSPOSE_BLOCK < width) ? x0 + TRANSPOSE_BLOCK : width;
+			for (int y = y0; y < yEnd; y++)
+				for (int x = x0; x < xEnd; x++)
+					pOut[x*height + y] = pIn[y*width + x];
+		}
+	}
+}
+//-----------------------------------------------------------------------------------------
+static bool IsPowerOfTwo(int value)
+{
+	return (value > 0) && ((value & (value - 1)) == 0);
+}
+//-----------------------------------------------------------------------------------------
+template<class T>
+static bool ForwardTransform2DImpl(T* pBuff, int width, int height)
+{
+	if (!IsPowerOfTwo(width) || !IsPowerOfTwo(height))
+		return false;
+
+	// The rows are transformed as the columns of the transposed matrix
+	std::vector<T> transposed((size_t)width*height);
+	std::vector<T> temp((size_t)width*height);
+	Transpose(pBuff, &transposed[0], width, height);
+	ForwardColumns(&transposed[0], height, width, &temp[0]);
+	Transpose(&transposed[0], pBuff, height, width);
+	ForwardColumns(pBuff, width, height, &temp[0]);
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+template<class T>
+static bool InverseTransform2DImpl(T* pBuff, int width, int height)
+{
+	if (!IsPowerOfTwo(width) || !IsPowerOfTwo(height))
+		return false;
+
+	std::vector<T> transposed((size_t)width*height);
+	std::vector<T> temp((size_t)width*height);
+	InverseColumns(pBuff, width, height, &temp[0]);
+	Transpose(pBuff, &transposed[0], width, height);
+	InverseColumns(&transposed[0], height, width, &temp[0]);
+	Transpose(&transposed[0], pBuff, height, width);
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+template<class T>
+static void ThresholdImpl(T* pBuff, int width, int height, float thresh, bool isSoftThresh)
+{
+	unsigned int levelsX = 0;
+	unsigned int levelsY = 0;
+	while ((1 << levelsX) < width)
+		levelsX++;
+	while ((1 << levelsY) < height)
+		levelsY++;
+
+	// The exponents of a row are between -1 (the finest details) and 'levelsX' (the approximation)
+	std::vector<int> scaleExpsX(width);
+	for (int x = 0; x < width; x++)
+		scaleExpsX[x] = CIntegerHaar::GetScaleExp(x, levelsX);
+	std::vector<float> rowThresh(levelsX + 2);
+
+	for (int y = 0; y < height; y++)
+	{
+		int scaleExpY = CIntegerHaar::GetScaleExp(y, levelsY);
+		for (unsigned int e = 0; e < levelsX + 2; e++)
+			rowThresh[e] = CIntegerHaar::GetThreshold(thresh, (int)e - 1 + scaleExpY);
+
+		T* pRow = pBuff + (size_t)y*width;
+		for (int x = 0; x < width; x++)
+		{
+			int inVal = pRow[x];
+			float intThresh = rowThresh[scaleExpsX[x] + 1];
+			if (!isSoftThresh)
+			{
+				pRow[x] = (fabsf((float)inVal) > intThresh) ? (T)inVal : (T)0;
+				continue;
+			}
+			float res = fabsf((float)inVal) - intThresh;
+			int mag = (int)rintf(res > 0.f ? res : 0.f);
+			pRow[x] = (T)((inVal < 0) ? -mag : mag);
+		}
+	}
+}
+//-----------------------------------------------------------------------------------------
+template<class S, class T>
+static int CleanNoiseImpl(const S* in, S* out, int width, int height, float thresh, bool isSoftThresh, int maxValue)
+{
+	if (!IsPowerOfTwo(width) || !IsPowerOfTwo(height))
+		return 1;
+
+	size_t numPixels = (size_t)width*height;
+	std::vector<T> coefs(numPixels);
+	for (size_t i = 0; i < numPixels; i++)
+		coefs[i] = (T)in[i];
+
+	ForwardTransform2DImpl(&coefs[0], width, height);
+	ThresholdImpl(&coefs[0], width, height, thresh * (float)maxValue, isSoftThresh);
+	InverseTransform2DImpl(&coefs[0], width, height);
+
+	// Thresholding may move the samples slightly out of range
+	for (size_t i = 0; i < numPixels; i++)
+	{
+		int value = coefs[i];
+		out[i] = (S)((value < 0) ? 0 : ((value > maxValue) ? maxValue : value));
+	}
+	return 0;
+}
+//-----------------------------------------------------------------------------------------
+bool CIntegerHaar::ForwardTransform2D(short* pBuff, int width, int height)
+{
+	return ForwardTransform2DImpl(pBuff, width, height);
+}
+//-----------------------------------------------------------------------------------------
+bool CIntegerHaar::ForwardTransform2D(int* pBuff, int width, int height)
+{
+	return ForwardTransform2DImpl(pBuff, width, height);
+}
+//-----------------------------------------------------------------------------------------
+bool CIntegerHaar::InverseTransform2D(short* pBuff, int width, int height)
+{
+	return InverseTransform2DImpl(pBuff, width, height);
+}
+//-----------------------------------------------------------------------------------------
+bool CIntegerHaar::InverseTransform2D(int* pBuff, int width, int height)
+{
+	return InverseTransform2DImpl(pBuff, width, height);
+}
+//-----------------------------------------------------------------------------------------
+void CIntegerHaar::Threshold(short* pBuff, int width, int height, float thresh, bool isSoftThresh)
+{
+	ThresholdImpl(pBuff, width, height, thresh, isSoftThresh);
+}
+//-----------------------------------------------------------------------------------------
+void CIntegerHaar::Threshold(int* pBuff, int width, int height, float thresh, bool isSoftThresh)
+{
+	ThresholdImpl(pBuff, width, height, thresh, isSoftThresh);
+}
+//-----------------------------------------------------------------------------------------
+int CIntegerHaar::CleanNoise(const unsigned char* in, unsigned char* out, int width, int height, float thresh, bool isSoftThresh)
+{
+	return CleanNoiseImpl<unsigned char, short>(in, out, width, height, thresh, isSoftThresh, 255);
+}
+//-----------------------------------------------------------------------------------------
+int CIntegerHaar::CleanNoise(const unsigned short* in, unsigned short* out, int width, int height, float thresh, bool isSoftThresh)
+{
+	return CleanNoiseImpl<unsigned short, int>(in, out, width, height, thresh, isSoftThresh, 65535);
+}
+//-----------------------------------------------------------------------------------------
+int CIntegerHaar::GetScaleExp(unsigned int pos, unsigned int levels)
+{
+	if (pos == 0)
+		return (int)levels;		// The approximation is the mean of 2^levels samples
+
+	// A detail of level j (1 is the finest) is at 2^(levels - j) <= pos < 2^(levels - j + 1)
+	int highBit = 0;
+	while ((pos >> (highBit + 1)) != 0)
+		highBit++;
+	return (int)levels - highBit - 2;
+}
+//-----------------------------------------------------------------------------------------
+float CIntegerHaar::GetThreshold(float thresh, int scaleExp)
+{
+	if (scaleExp & 1)
+		return ldexpf(thresh * INV_SQRT_2, -(scaleExp - 1) / 2);
+	return ldexpf(thresh, -scaleExp / 2);
+}
+//-----------------------------------------------------------------------------------------
+bool CIntegerHaar::IsSIMDEnabled()
+{
+#ifdef USE_SSE2
+	return true;
+#else
+	return false;
+#endif
+}
+//-----------------------------------------------------------------------------------------
@@ -0,0 +1,80 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef __INTEGER_HAAR_H__
+#define __INTEGER_HAAR_H__
+
+
+// -----------------------------------------------------------------------------------------
+// CPU implementation of the integer-to-integer Haar transform (the S-transform) which the
+// integer path of CNoiseCleaner runs on the device ('CleanNoiseInteger'). Every step is a
+// lifting step on a pair of samples:
+//		d = even - odd, s = odd + (d >> 1)
+// which is undone exactly by odd = s - (d >> 1), even = odd + d, so a forward and an
+// inverse transform reproduce the input bit for bit. 8-bit samples use 16-bit coefficients
+// and 16-bit samples 32-bit ones, none of them overflows.
+// The transform of the columns is a lifting step between whole rows, which is vectorized
+// (SSE2 when available), and the rows are transformed the same way after a transpose.
+// The results are identical to the device kernels for any threshold.
+// -----------------------------------------------------------------------------------------
+class CIntegerHaar
+{
+public:
+	// -----------------------------------------------------------------------------------------
+	// 2D transforms of a 'width' x 'height' matrix in place, both must be powers of 2. The
+	// forward transform goes over all the levels of the rows and then of the columns, element
+	// (y, x) of the result is coefficient y of the column transform of row coefficient x.
+	// -----------------------------------------------------------------------------------------
+	static bool ForwardTransform2D(short* pBuff, int width, int height);
+	static bool ForwardTransform2D(int* pBuff, int width, int height);
+	static bool InverseTransform2D(short* pBuff, int width, int height);
+	static bool InverseTransform2D(int* pBuff, int width, int height);
+
+	// -----------------------------------------------------------------------------------------
+	// Hard or soft thresholding of the coefficients of 'ForwardTransform2D'. 'thresh' is the
+	// threshold of the orthonormal transform in sample units, it is scaled to every
+	// coefficient (see 'GetScaleExp'), so the result follows the floating point pipeline.
+	// -----------------------------------------------------------------------------------------
+	static void Threshold(short* pBuff, int width, int height, float thresh, bool isSoftThresh);
+	static void Threshold(int* pBuff, int width, int height, float thresh, bool isSoftThresh);
+
+	// -----------------------------------------------------------------------------------------
+	// The whole denoising algorithm of 'CNoiseCleaner::CleanNoise' on the CPU with the integer
+	// transform. 'thresh' is relative to the full scale, like for 'CleanNoise'. With a zero
+	// threshold 'out' is identical to 'in'. Returns 0 on success.
+	// -----------------------------------------------------------------------------------------
+	static int CleanNoise(const unsigned char* in, unsigned char* out, int width, int height, float thresh, bool isSoftThresh);
+	static int CleanNoise(const unsigned short* in, unsigned short* out, int width, int height, float thresh, bool isSoftThresh);
+
+	// -----------------------------------------------------------------------------------------
+	// A coefficient at 'pos' of a transform over 2^levels samples multiplied by 2^(e/2) is the
+	// coefficient of the orthonormal transform, this returns e. 'GetThreshold' returns
+	// 'thresh' / 2^(e/2) exactly as the device kernels compute it.
+	// -----------------------------------------------------------------------------------------
+	static int GetScaleExp(unsigned int pos, unsigned int levels);
+	static float GetThreshold(float thresh, int scaleExp);
+
+	/** True if the lifting steps are vectorized in this build **/
+	static bool IsSIMDEnabled();
+};
+
+
+
+#endif	// __INTEGER_HAAR_H__
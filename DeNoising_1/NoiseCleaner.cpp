@@ -20,8 +20,12 @@
 
 #include <math.h>
 #include <float.h>
+#include <string.h>
+#include <stdio.h>
 #include "Utils.h"
 #include "NoiseCleaner.h"
+#include "IntegerHaar.h"
+#include "HaarCPU.h"
 
 // Windows headers are only needed for accurate profiling of the CPU-based testing routines
 #if defined(_WIN32) || defined(_WIN64) || defined(_WINDOWS)
@@ -29,11 +33,30 @@
 #endif
 
 #define NUM_BANKS		16
+// The launch parameters used when there is no tuning file for the device
 #define TILE_SIZE		16
+#define THRESH_WORK_GROUP_SIZE	256
 #define BLOCK_ROWS		8
+// The scratch of the in-place pipeline holds at most this many floats and this fraction of
+// the rows, but at least one row
+#define IN_PLACE_SCRATCH_LEN	(1 << 20)
+#define IN_PLACE_SCRATCH_DIV	8
+// The most work-groups adding up the metrics of 'EvaluateThresholds' and 'CleanNoise', each one covers a stride of the coefficients
+#define METRICS_MAX_GROUPS		64
+// The local memory of 'Coef_Metrics_kernel', the least OpenCL 1.2 guarantees
+#define METRICS_LOCAL_MEM_SIZE	32768
+// Coefficients every work-item of the sparse kernels covers, the same as SPARSE_ITEMS in HWT_kernels.cl
+#define SPARSE_ITEMS			8
+// The largest side of the tiles of the non-standard decomposition
+#define NS_MAX_TILE_SIZE		32
+// The lowest PSNR (in dB) the self test accepts for the transforms in the half precision mode
+#define HALF_MIN_PSNR_DB		50.0
 #define INV_SQRT_2      0.70710678118654752440f
 #define SQRT_2			1.41421356237309504880f
 
+// Levels per pass candidates of 'AutoTune' below the most a work-group can do
+#define TUNE_LEVELS_RANGE		4
+
 #define TEST_SIGNAL_FILE_1		"signal_2_14.dat"
 #define TEST_REGRESS_FILE_1		"regression_2_14.gold.dat"
 
@@ -46,245 +69,3666 @@
 
 
 char* CNoiseCleaner::KERNEL_NAMES[NUM_KERNELS] = 
-	{"FWT_kernel", "IWT_kernel", "Mat_Transpose_kernel", "Mat_HT_Threshold_kernel", "Mat_ST_Threshold_kernel"};
+	{"FWT_kernel", "IWT_kernel", "Mat_Transpose_kernel", "Mat_HT_Threshold_kernel", "Mat_ST_Threshold_kernel",
+	 "Mat_Transpose_InPlace_kernel", "FWT_Int_kernel", "IWT_Int_kernel", "Mat_Transpose_Int_kernel",
+	 "Mat_HT_Threshold_Int_kernel", "Mat_ST_Threshold_Int_kernel", "Tile_Diff_kernel", "IWT_Tiles_kernel",
+	 "Mat_Thresh_Metrics_kernel", "Sparse_Count_kernel", "Sparse_Scan_kernel", "Sparse_Compact_kernel",
+	 "Sparse_Scatter_kernel", "NS_FWT_Tile_kernel", "NS_IWT_Tile_kernel", "Patch_Clean_kernel", "Patch_Normalize_kernel",
+	 "Bytes_To_Coef_kernel", "Coef_To_Bytes_kernel", "Mat_Neigh_Threshold_kernel",
+	 "Coef_To_Thumbnails_kernel", "Coef_Metrics_kernel"};
 
 //-----------------------------------------------------------------------------------------
-CNoiseCleaner::CNoiseCleaner() : 
-m_oclEnv("HWT_kernels.cl", NUM_KERNELS, KERNEL_NAMES)
+CNoiseCleaner::CNoiseCleaner(cl_device_type deviceType /*= CL_DEVICE_TYPE_GPU*/, bool isProfilingEnabled /*= true*/,
+							 bool isHalfPrecision /*= false*/) : 
+m_oclEnv("HWT_kernels.cl", NUM_KERNELS, KERNEL_NAMES, deviceType, isProfilingEnabled, isHalfPrecision ? "-D COEF_HALF" : NULL),
+m_pStatsCollector(NULL),
+m_pTracer(NULL),
+m_isInPlace(false),
+m_isNonStandard(false),
+m_neighWindowSize(0),
+m_isHalfPrecision(isHalfPrecision),
+m_coefSize(isHalfPrecision ? sizeof(cl_half) : sizeof(float))
 {
+	memset(&m_tuning, 0, sizeof(m_tuning));
+
+	// Characters which are not portable in file names are replaced
+	int len = sprintf(m_tuningFilename, "HWT_tuning_%.200s%s.txt", m_oclEnv.m_deviceName, isHalfPrecision ? "_half" : "");
+	for (int i = (int)strlen("HWT_tuning_"); i < len - 4; i++)
+	{
+		char c = m_tuningFilename[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-'))
+			m_tuningFilename[i] = '_';
+	}
+	LoadTuning();
 }
 //-----------------------------------------------------------------------------------------
 CNoiseCleaner::~CNoiseCleaner()
 {
+	for (size_t i = 0; i < m_workers.size(); i++)
+	{
+		SWorker* pWorker = m_workers[i];
+		if (pWorker->buffLen > 0)
+			clReleaseMemObject(pWorker->gInBuff);
+		if (pWorker->outBuffLen > 0)
+			clReleaseMemObject(pWorker->gOutBuff);
+		if (pWorker->partialBuffLen > 0)
+			clReleaseMemObject(pWorker->gPartialBuff);
+		if (pWorker->bytesBuffLen > 0)
+			clReleaseMemObject(pWorker->gBytesBuff);
+		if (pWorker->metricsBuffLen > 0)
+			clReleaseMemObject(pWorker->gMetricsBuff);
+		delete[] pWorker->pHostBuff;
+		// The first worker borrows the queue and kernels of the environment
+		if (i > 0)
+		{
+			for (int j = 0; j < NUM_KERNELS; j++)
+				clReleaseKernel(pWorker->kernels[j]);
+			clReleaseCommandQueue(pWorker->cmdQ);
+		}
+		delete pWorker;
+	}
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::SetTracer(CEventTracer* pTracer)
+{
+	CMutexLock lock(m_workersMutex);
+	m_pTracer = pTracer;
+	if (m_pTracer == NULL)
+		return;
+
+	m_pTracer->AddQueue(m_oclEnv.m_cmdQ, m_oclEnv.m_deviceName);
+	for (size_t i = 1; i < m_workers.size(); i++)
+		AddWorkerQueueToTracer(i);
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::AddWorkerQueueToTracer(size_t workerIdx)
+{
+	char queueName[256];
+	sprintf(queueName, "%.200s queue %u", m_oclEnv.m_deviceName, (unsigned int)workerIdx + 1);
+	m_pTracer->AddQueue(m_workers[workerIdx]->cmdQ, queueName);
+}
+//-----------------------------------------------------------------------------------------
+CNoiseCleaner::SWorker* CNoiseCleaner::AcquireWorker()
+{
+	CMutexLock lock(m_workersMutex);
+	if (!m_freeWorkers.empty())
+	{
+		SWorker* pWorker = m_freeWorkers.back();
+		m_freeWorkers.pop_back();
+		return pWorker;
+	}
+
+	SWorker* pWorker = new SWorker;
+	if (m_workers.empty())
+	{
+		pWorker->cmdQ = m_oclEnv.m_cmdQ;
+		for (int i = 0; i < NUM_KERNELS; i++)
+			pWorker->kernels[i] = m_oclEnv.m_kernels[i];
+	}
+	else
+	{
+		pWorker->cmdQ = m_oclEnv.CreateCommandQueue();
+		m_oclEnv.CreateKernels(pWorker->kernels);
+	}
+	pWorker->gInBuff = NULL;
+	pWorker->gOutBuff = NULL;
+	pWorker->gPartialBuff = NULL;
+	pWorker->gBytesBuff = NULL;
+	pWorker->buffLen = 0;
+	pWorker->outBuffLen = 0;
+	pWorker->partialBuffLen = 0;
+	pWorker->bytesBuffLen = 0;
+	pWorker->pHostBuff = NULL;
+	pWorker->isMetricsRequested = false;
+	pWorker->gMetricsBuff = NULL;
+	pWorker->metricsBuffLen = 0;
+	m_workers.push_back(pWorker);
+	if (m_pTracer && m_workers.size() > 1)
+		AddWorkerQueueToTracer(m_workers.size() - 1);
+
+	return pWorker;
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::ReleaseWorker(SWorker* pWorker)
+{
+	CMutexLock lock(m_workersMutex);
+	m_freeWorkers.push_back(pWorker);
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::ReserveWorkspace(SWorker& worker, size_t buffLen, size_t outBuffLen, size_t partialBuffLen,
+									 size_t bytesBuffLen /*= 0*/)
+{
+	cl_int clErr;
+	if (worker.buffLen < buffLen)
+	{
+		if (worker.buffLen > 0)
+			clReleaseMemObject(worker.gInBuff);
+		delete[] worker.pHostBuff;
+		worker.gInBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, buffLen * m_coefSize, NULL, &clErr);
+		OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+		worker.pHostBuff = new float[buffLen];
+		worker.buffLen = buffLen;
+	}
+	if (worker.outBuffLen < outBuffLen)
+	{
+		if (worker.outBuffLen > 0)
+			clReleaseMemObject(worker.gOutBuff);
+		worker.gOutBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, outBuffLen * m_coefSize, NULL, &clErr);
+		OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+		worker.outBuffLen = outBuffLen;
+	}
+	if (worker.partialBuffLen < partialBuffLen)
+	{
+		if (worker.partialBuffLen > 0)
+			clReleaseMemObject(worker.gPartialBuff);
+		worker.gPartialBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, partialBuffLen * m_coefSize, NULL, &clErr);
+		OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+		worker.partialBuffLen = partialBuffLen;
+	}
+	if (worker.bytesBuffLen < bytesBuffLen)
+	{
+		if (worker.bytesBuffLen > 0)
+			clReleaseMemObject(worker.gBytesBuff);
+		worker.gBytesBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, bytesBuffLen, NULL, &clErr);
+		OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+		worker.bytesBuffLen = bytesBuffLen;
+	}
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::GetWorkspaceLens(int width, int height, int numFrames, bool& isInPlace, size_t& buffLen, size_t& outBuffLen,
+									 size_t& partialBuffLen, bool isNonStandard /*= false*/) const
+{
+	unsigned int numLevelsWidth = 0;
+	unsigned int numLevelsHeight = 0;
+	CNoiseCleaner::GetNumLevels(width, numLevelsWidth);
+	CNoiseCleaner::GetNumLevels(height, numLevelsHeight);
+	buffLen = (size_t)width*height*numFrames;
+
+	if (isNonStandard)
+	{
+		isInPlace = false;
+		outBuffLen = buffLen;
+		partialBuffLen = GetNonStandardPartialLen(width, height, numFrames);
+		return;
+	}
+
+	// The in-place transposes only handle square matrices, and the neighbourhood thresholding
+	// reads the coefficients around those it writes
+	isInPlace = isInPlace && (width == height) && (m_neighWindowSize == 0);
+	if (!isInPlace)
+	{
+		outBuffLen = buffLen;
+		size_t partialBuffLenRows = GetPartialBuffLen(numLevelsWidth, width, height*numFrames);
+		size_t partialBuffLenCols = GetPartialBuffLen(numLevelsHeight, height, width*numFrames);
+		partialBuffLen = partialBuffLenRows > partialBuffLenCols ? partialBuffLenRows : partialBuffLenCols;
+		return;
+	}
+
+	// The scratch is only needed for rows transformed in several passes, and holds one chunk
+	// of them, as do the intermediate approximations
+	unsigned int maxLevelsFWT = GetLevelsPerPass(FWT_KERNEL_IDX, width);
+	unsigned int maxLevelsIWT = GetLevelsPerPass(IWT_KERNEL, width);
+	unsigned int maxLevels = maxLevelsFWT < maxLevelsIWT ? maxLevelsFWT : maxLevelsIWT;
+	int chunkRows = GetInPlaceChunkRows(width, height*numFrames);
+	outBuffLen = (numLevelsWidth > maxLevels) ? (size_t)chunkRows*width : 1;
+	partialBuffLen = GetPartialBuffLen(numLevelsWidth, width, chunkRows);
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::GetInPlaceChunkRows(unsigned int dataLen, int numRows)
+{
+	int chunkRows = (int)(IN_PLACE_SCRATCH_LEN / dataLen);
+	if (chunkRows > numRows / IN_PLACE_SCRATCH_DIV)
+		chunkRows = numRows / IN_PLACE_SCRATCH_DIV;
+	if (chunkRows < 1)
+		chunkRows = 1;
+	return (chunkRows < numRows) ? chunkRows : numRows;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::GetDeviceMemoryFootprint(int width, int height, int numFrames, bool isInPlace,
+											 SDeviceMemoryFootprint& footprint) const
+{
+	unsigned int numLevels = 0;
+	if (numFrames < 1 || !CNoiseCleaner::GetNumLevels(width, numLevels) || !CNoiseCleaner::GetNumLevels(height, numLevels))
+		return false;
+
+	size_t buffLen, outBuffLen, partialBuffLen;
+	GetWorkspaceLens(width, height, numFrames, isInPlace, buffLen, outBuffLen, partialBuffLen, IsNonStandardUsed(width, height));
+	footprint.isInPlace = isInPlace;
+	footprint.frameBytes = buffLen * m_coefSize;
+	footprint.outBytes = outBuffLen * m_coefSize;
+	footprint.partialBytes = partialBuffLen * m_coefSize;
+	footprint.totalBytes = footprint.frameBytes + footprint.outBytes + footprint.partialBytes;
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::SetNeighThreshMode(int windowSize)
+{
+	if (windowSize < 0 || windowSize > NEIGH_MAX_WINDOW_SIZE || (windowSize > 0 && windowSize % 2 == 0))
+		return false;
+	m_neighWindowSize = windowSize;
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::CleanNoise(unsigned char *in, unsigned char *out, int width, int height, float thresh, bool isSoftThresh,
+							  SCleanNoiseStats* pStats /*= NULL*/, SCleanNoiseMetrics* pMetrics /*= NULL*/)
+{
+	return CleanNoiseBatch(&in, &out, 1, width, height, thresh, isSoftThresh, pStats, pMetrics);
 }
 //-----------------------------------------------------------------------------------------
-int CNoiseCleaner::CleanNoise(unsigned char *in, unsigned char *out, int width, int height, float thresh, bool isSoftThresh)
+int CNoiseCleaner::CleanNoiseBatch(unsigned char** ppIn, unsigned char** ppOut, int numFrames, int width, int height, float thresh,
+								   bool isSoftThresh, SCleanNoiseStats* pStats /*= NULL*/, SCleanNoiseMetrics* pMetrics /*= NULL*/)
 {
+	if (numFrames < 1 || width < 1 || height < 1)
+		return 1;
+
 	unsigned int numLevelsWidth = 0;
 	unsigned int numLevelsHeight = 0;
 	if (!CNoiseCleaner::GetNumLevels(width, numLevelsWidth))
-		return false;	// The buffer length is not a power of two
+		return 1;	// The buffer length is not a power of two
 	if (!CNoiseCleaner::GetNumLevels(height, numLevelsHeight))
-		return false;	// The buffer length is not a power of two
+		return 1;	// The buffer length is not a power of two
 
+	SCleanNoiseStats stats;
+	stats.isProfiled = m_oclEnv.m_isProfilingEnabled;
+	cl_ulong callStartTime = OpenCLEnv::GetHostTime();
 
-	// ------------------------------------------
-	// Convert given buffer to a matrix of floats
-	// ------------------------------------------
-	unsigned int numPixels = width*height;
-	float* pInFloatsMatrix = new float[numPixels];
-	for (unsigned int i = 0; i < numPixels; i++)
-		pInFloatsMatrix[i] = (float)in[i] / 255.f;
+	// -----------------------------------------------------------------------------
+	// Take a worker (queue, kernels and workspaces) for the duration of this call,
+	// this is what allows several threads to run 'CleanNoise' at the same time
+	// -----------------------------------------------------------------------------
+	unsigned int frameLen = width*height;
+	unsigned int numPixels = frameLen*numFrames;
+	unsigned int gBuffSize = numPixels * (unsigned int)m_coefSize;
+	SWorker* pWorker = AcquireWorker();
+	bool isNonStandard = IsNonStandardUsed(width, height);
+	bool isInPlace = m_isInPlace && !isNonStandard;
+	size_t buffLen, outBuffLen, partialBuffLen;
+	GetWorkspaceLens(width, height, numFrames, isInPlace, buffLen, outBuffLen, partialBuffLen, isNonStandard);
+	ReserveWorkspace(*pWorker, buffLen, outBuffLen, partialBuffLen);
+	cl_ulong hostEndTime = OpenCLEnv::GetHostTime();
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("acquire worker", callStartTime, hostEndTime);
+
+	// ---------------------------------------------------------------------------
+	// Convert given buffers to matrices of floats (or halves), the frames are stacked
+	// one after the other, so the row transforms see a single matrix with
+	// numFrames*height rows
+	// ---------------------------------------------------------------------------
+	cl_ulong hostStartTime = hostEndTime;
+	float* pInFloatsMatrix = pWorker->pHostBuff;
+	for (int frame = 0; frame < numFrames; frame++)
+		ConvertToCoefs(ppIn[frame], pInFloatsMatrix, frame*frameLen, frameLen);
+	hostEndTime = OpenCLEnv::GetHostTime();
+	stats.hostTime += hostEndTime - hostStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("convert to float", hostStartTime, hostEndTime);
 	
 	cl_int                  clErr;
-	cl_mem					gInBuff;
-	cl_mem					gOutBuff;
-	cl_mem					gPartialBuff;
-	cl_ulong				kernelTime = 0;
-	cl_ulong				totalKernelTime = 0;
-
-	// -----------------------------------------------------------
-	// Allocate device buffers and copy the whole matrix to device
-	// -----------------------------------------------------------
-	unsigned int gBuffSize = numPixels * sizeof(float);
-	gInBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, gBuffSize, NULL, NULL);
-	gOutBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, gBuffSize, NULL, NULL);
-	gPartialBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_WRITE_ONLY, width*sizeof(float), NULL, NULL);
-
-	clErr = clEnqueueWriteBuffer(m_oclEnv.m_cmdQ, gInBuff, CL_TRUE, 0, gBuffSize, pInFloatsMatrix, 0, NULL, NULL);
+	cl_event				transferEvent = NULL;
+	cl_mem					gInBuff = pWorker->gInBuff;
+	cl_mem					gResultBuff = isInPlace ? pWorker->gInBuff : pWorker->gOutBuff;
+
+	// ---------------------------------
+	// Copy the whole matrix to device
+	// ---------------------------------
+	clErr = clEnqueueWriteBuffer(pWorker->cmdQ, gInBuff, CL_TRUE, 0, gBuffSize, pInFloatsMatrix, 0, NULL, GetEventSlot(&transferEvent));
 	OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::UPLOAD, "write", gBuffSize);
 
 
-	// -------------------------------------------------------------------------------------
-	// Invoke ForwardHaarTransformGPU on all the rows in the matrix simultaneously (which works on 1D buffers)
-	// -------------------------------------------------------------------------------------
-	bool bResult = true;
-	bResult = bResult && ForwardHaarTransformGPU(gInBuff, gOutBuff, gPartialBuff, height, numLevelsWidth, width, 0, kernelTime);
-	totalKernelTime += kernelTime;
+	pWorker->isMetricsRequested = (pMetrics != NULL);
+	bool bResult = isInPlace ? CleanNoiseInPlaceGPU(*pWorker, numFrames, width, height, thresh, isSoftThresh, stats)
+							 : CleanNoiseGPU(*pWorker, numFrames, width, height, thresh, isSoftThresh, stats);
+	pWorker->isMetricsRequested = false;
 	if (!bResult)
+	{
+		clFinish(pWorker->cmdQ);
+		ReleaseWorker(pWorker);
 		return 1;
-	
-	OpenCLEnv::PrintProfilingInfo(totalKernelTime, "Forward transform on rows");
+	}
 
 
-	// ---------------------------------------------------------------------------------------
-	// Transpose the matrix by invoking a kernel which will transpose the matrix on the device
-	// w/o bringing it back to the host memory
-	// ---------------------------------------------------------------------------------------
-	bResult = TransposeMatrixGPU(gOutBuff, gInBuff, width, height, totalKernelTime);
-	if (!bResult)
-		return 1;
+	// -----------------------------------------------------------------
+	// Read the results from the device
+	// -----------------------------------------------------------------
+	clErr = clEnqueueReadBuffer(pWorker->cmdQ, gResultBuff, CL_TRUE, 0, gBuffSize, pInFloatsMatrix, 0, NULL, GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "reading data from device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", gBuffSize);
 
-	OpenCLEnv::PrintProfilingInfo(totalKernelTime, "Matrix transpose");
-		
-	// -----------------------------------------------------------------------------------------------------
-	// For all of the rows in the transposed matrix (i.e. column in the original one) invoke ForwardHaarTransformGPU
-	// -----------------------------------------------------------------------------------------------------
-	bResult = true;
-	totalKernelTime = 0;
-	bResult = bResult && ForwardHaarTransformGPU(gInBuff, gOutBuff, gPartialBuff, width, numLevelsHeight, height, 0, kernelTime);
-	totalKernelTime += kernelTime;
-	if (!bResult)
-		return 1;
 
-	OpenCLEnv::PrintProfilingInfo(totalKernelTime, "Forward transform on columns");
+	// ------------------------------------------------
+	// Convert given buffer to a matrix of gray levels
+	// ------------------------------------------------
+	hostStartTime = OpenCLEnv::GetHostTime();
+	for (int frame = 0; frame < numFrames; frame++)
+		ConvertFromCoefs(pInFloatsMatrix, frame*frameLen, frameLen, ppOut[frame]);
+	if (pMetrics)
+		FinishMetrics(*pWorker, numFrames, width, height, isNonStandard, pMetrics);
+	hostEndTime = OpenCLEnv::GetHostTime();
+	stats.hostTime += hostEndTime - hostStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("convert to gray levels", hostStartTime, hostEndTime);
 
+	ReleaseWorker(pWorker);
 
-	// -----------------------------------------------------------------
-	// Apply threshold on the results of the Forward Haar Transform
-	// -----------------------------------------------------------------
-	bResult = MatrixThreshGPU(gOutBuff, gInBuff, numPixels, thresh, totalKernelTime, isSoftThresh);
-	if (!bResult)
+	stats.totalTime = OpenCLEnv::GetHostTime() - callStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("CleanNoise", callStartTime, callStartTime + stats.totalTime);
+	if (pStats)
+		*pStats = stats;
+	if (m_pStatsCollector)
+		m_pStatsCollector->Add(stats);
+
+	return 0;
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::CleanNoiseRegion(const unsigned char* in, int inPitch, unsigned char* out, int outPitch, int roiX, int roiY,
+									int roiWidth, int roiHeight, float thresh, bool isSoftThresh, SCleanNoiseStats* pStats /*= NULL*/)
+{
+	unsigned int numLevels = 0;
+	if (!CNoiseCleaner::GetNumLevels(roiWidth, numLevels) || !CNoiseCleaner::GetNumLevels(roiHeight, numLevels))
+		return 1;	// The region sides are not powers of two
+	if (roiX < 0 || roiY < 0 || inPitch < roiX + roiWidth || outPitch < roiX + roiWidth)
 		return 1;
 
-	OpenCLEnv::PrintProfilingInfo(totalKernelTime, "Matrix threshold");
+	SCleanNoiseStats stats;
+	stats.isProfiled = m_oclEnv.m_isProfilingEnabled;
+	cl_ulong callStartTime = OpenCLEnv::GetHostTime();
 
+	unsigned int numPixels = roiWidth*roiHeight;
+	SWorker* pWorker = AcquireWorker();
+	bool isNonStandard = IsNonStandardUsed(roiWidth, roiHeight);
+	bool isInPlace = m_isInPlace && !isNonStandard;
+	size_t buffLen, outBuffLen, partialBuffLen;
+	GetWorkspaceLens(roiWidth, roiHeight, 1, isInPlace, buffLen, outBuffLen, partialBuffLen, isNonStandard);
+	ReserveWorkspace(*pWorker, buffLen, outBuffLen, partialBuffLen, numPixels);
 
-	// ------------------------------------------------------------------------------------------------------
-	// For all of the rows in the transposed matrix (i.e. column in the original one) invoke InverseHaarTransformGPU
-	// ------------------------------------------------------------------------------------------------------
-	totalKernelTime = 0;
-	bResult = bResult && InverseHaarTransformGPU(gInBuff, gOutBuff, gPartialBuff, width, numLevelsHeight, height, 0, kernelTime);
-	totalKernelTime += kernelTime;
-	if (!bResult)
-		return 1;
+	// ---------------------------------------------------------------------------------------
+	// Copy the rows of the region into a packed buffer of gray levels and convert them
+	// ---------------------------------------------------------------------------------------
+	cl_int clErr;
+	cl_event transferEvent = NULL;
+	cl_event kernelEvent = NULL;
+	size_t bufferOrigin[3] = {0, 0, 0};
+	size_t hostOrigin[3] = {(size_t)roiX, (size_t)roiY, 0};
+	size_t region[3] = {(size_t)roiWidth, (size_t)roiHeight, 1};
+	clErr = clEnqueueWriteBufferRect(pWorker->cmdQ, pWorker->gBytesBuff, CL_FALSE, bufferOrigin, hostOrigin, region, roiWidth, 0,
+									 inPitch, 0, in, 0, NULL, GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::UPLOAD, "write", numPixels);
 
-	OpenCLEnv::PrintProfilingInfo(totalKernelTime, "Inverse transform on columns");
+	size_t localWorkItems = GetThreshWorkGroupSize();
+	size_t globalWorkItems = ((numPixels - 1) / localWorkItems + 1) * localWorkItems;
+	cl_kernel kernel = pWorker->kernels[BYTES_TO_COEF_KERNEL];
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), &pWorker->gBytesBuff);
+	clSetKernelArg(kernel, 1, sizeof(cl_mem), &pWorker->gInBuff);
+	clSetKernelArg(kernel, 2, sizeof(unsigned int), &numPixels);
+	clErr = clEnqueueNDRangeKernel(pWorker->cmdQ, kernel, 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing conversion kernel");
+	RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::UPLOAD, KERNEL_NAMES[BYTES_TO_COEF_KERNEL]);
 
+	bool bResult = isInPlace ? CleanNoiseInPlaceGPU(*pWorker, 1, roiWidth, roiHeight, thresh, isSoftThresh, stats)
+							 : CleanNoiseGPU(*pWorker, 1, roiWidth, roiHeight, thresh, isSoftThresh, stats);
+	if (!bResult)
+	{
+		clFinish(pWorker->cmdQ);
+		ReleaseWorker(pWorker);
+		return 1;
+	}
 
 	// ---------------------------------------------------------------------------------------
-	// Transpose the matrix by invoking a kernel which will transpose the matrix on the device
-	// w/o bringing it back to the host memory
+	// Convert the result back to gray levels and copy them into the rows of the region
 	// ---------------------------------------------------------------------------------------
-	bResult = TransposeMatrixGPU(gOutBuff, gInBuff, height, width, totalKernelTime);
-	if (!bResult)
+	kernel = pWorker->kernels[COEF_TO_BYTES_KERNEL];
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), isInPlace ? &pWorker->gInBuff : &pWorker->gOutBuff);
+	clSetKernelArg(kernel, 1, sizeof(cl_mem), &pWorker->gBytesBuff);
+	clSetKernelArg(kernel, 2, sizeof(unsigned int), &numPixels);
+	clErr = clEnqueueNDRangeKernel(pWorker->cmdQ, kernel, 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing conversion kernel");
+	RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::DOWNLOAD, KERNEL_NAMES[COEF_TO_BYTES_KERNEL]);
+
+	clErr = clEnqueueReadBufferRect(pWorker->cmdQ, pWorker->gBytesBuff, CL_TRUE, bufferOrigin, hostOrigin, region, roiWidth, 0,
+									outPitch, 0, out, 0, NULL, GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "reading data from device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", numPixels);
+	ReleaseWorker(pWorker);
+
+	stats.totalTime = OpenCLEnv::GetHostTime() - callStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("CleanNoiseRegion", callStartTime, callStartTime + stats.totalTime);
+	if (pStats)
+		*pStats = stats;
+	if (m_pStatsCollector)
+		m_pStatsCollector->Add(stats);
+
+	return 0;
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::CleanNoiseThumbnails(const unsigned char* in, unsigned char* out, int width, int height, float thresh,
+										bool isSoftThresh, const int* pLevels, int numThumbnails, unsigned char** ppThumbnails,
+										SCleanNoiseStats* pStats /*= NULL*/)
+{
+	unsigned int numLevels = 0;
+	if (!CNoiseCleaner::GetNumLevels(width, numLevels) || !CNoiseCleaner::GetNumLevels(height, numLevels))
+		return 1;	// The sides are not powers of two
+	if (numThumbnails < 0 || (numThumbnails > 0 && (pLevels == NULL || ppThumbnails == NULL)))
 		return 1;
 
-	OpenCLEnv::PrintProfilingInfo(totalKernelTime, "Matrix transpose");
+	// The tiles of the work-groups are square, as large as the device allows up to the largest
+	// level which can be reduced in one of them
+	unsigned int tileSide = 1u << THUMBNAIL_MAX_LEVEL;
+	while (tileSide*tileSide > m_oclEnv.m_kernelWorkGroupSizes[COEF_TO_THUMBNAILS_KERNEL])
+		tileSide /= 2;
+	tileSide = ((unsigned int)width < tileSide) ? width : tileSide;
+	tileSide = ((unsigned int)height < tileSide) ? height : tileSide;
+	unsigned int levelMask = 0;
+	for (int i = 0; i < numThumbnails; i++)
+	{
+		if (pLevels[i] < 1 || pLevels[i] > THUMBNAIL_MAX_LEVEL || (1u << pLevels[i]) > tileSide || (levelMask & (1u << pLevels[i])))
+			return 1;
+		levelMask |= 1u << pLevels[i];
+	}
 
+	SCleanNoiseStats stats;
+	stats.isProfiled = m_oclEnv.m_isProfilingEnabled;
+	cl_ulong callStartTime = OpenCLEnv::GetHostTime();
 
-	// -----------------------------------------------------------------
-	// Invoke InverseHaarTransformGPU for all the rows simltaneously
-	// -----------------------------------------------------------------
-	totalKernelTime = 0;
-	bResult = bResult && InverseHaarTransformGPU(gInBuff, gOutBuff, gPartialBuff, height, numLevelsWidth, width, 0, kernelTime);
-	totalKernelTime += kernelTime;
+	// The gray levels of the frame are followed by the thumbnails in ascending levels
+	unsigned int numPixels = width*height;
+	unsigned int numBytes = numPixels;
+	for (unsigned int level = 1; level <= THUMBNAIL_MAX_LEVEL; level++)
+		numBytes += (levelMask & (1u << level)) ? (width >> level)*(height >> level) : 0;
+	SWorker* pWorker = AcquireWorker();
+	bool isNonStandard = IsNonStandardUsed(width, height);
+	bool isInPlace = m_isInPlace && !isNonStandard;
+	size_t buffLen, outBuffLen, partialBuffLen;
+	GetWorkspaceLens(width, height, 1, isInPlace, buffLen, outBuffLen, partialBuffLen, isNonStandard);
+	ReserveWorkspace(*pWorker, buffLen, outBuffLen, partialBuffLen, numBytes);
+
+	cl_int clErr;
+	cl_event transferEvent = NULL;
+	cl_event kernelEvent = NULL;
+	clErr = clEnqueueWriteBuffer(pWorker->cmdQ, pWorker->gBytesBuff, CL_FALSE, 0, numPixels, in, 0, NULL, GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::UPLOAD, "write", numPixels);
+
+	size_t localWorkItems = GetThreshWorkGroupSize();
+	size_t globalWorkItems = ((numPixels - 1) / localWorkItems + 1) * localWorkItems;
+	cl_kernel kernel = pWorker->kernels[BYTES_TO_COEF_KERNEL];
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), &pWorker->gBytesBuff);
+	clSetKernelArg(kernel, 1, sizeof(cl_mem), &pWorker->gInBuff);
+	clSetKernelArg(kernel, 2, sizeof(unsigned int), &numPixels);
+	clErr = clEnqueueNDRangeKernel(pWorker->cmdQ, kernel, 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing conversion kernel");
+	RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::UPLOAD, KERNEL_NAMES[BYTES_TO_COEF_KERNEL]);
+
+	bool bResult = isInPlace ? CleanNoiseInPlaceGPU(*pWorker, 1, width, height, thresh, isSoftThresh, stats)
+							 : CleanNoiseGPU(*pWorker, 1, width, height, thresh, isSoftThresh, stats);
 	if (!bResult)
+	{
+		clFinish(pWorker->cmdQ);
+		ReleaseWorker(pWorker);
 		return 1;
-	
-	OpenCLEnv::PrintProfilingInfo(totalKernelTime, "Inverse transform on rows");
+	}
 
+	// ---------------------------------------------------------------------------------------
+	// Convert the result to gray levels with the thumbnails after it and read them together
+	// ---------------------------------------------------------------------------------------
+	kernel = pWorker->kernels[COEF_TO_THUMBNAILS_KERNEL];
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), isInPlace ? &pWorker->gInBuff : &pWorker->gOutBuff);
+	clSetKernelArg(kernel, 1, sizeof(cl_mem), &pWorker->gBytesBuff);
+	clSetKernelArg(kernel, 2, tileSide * tileSide * sizeof(cl_float), NULL);
+	clSetKernelArg(kernel, 3, sizeof(unsigned int), &width);
+	clSetKernelArg(kernel, 4, sizeof(unsigned int), &height);
+	clSetKernelArg(kernel, 5, sizeof(unsigned int), &levelMask);
+	size_t thumbGlobalWorkItems[2] = {(size_t)width, (size_t)height};
+	size_t thumbLocalWorkItems[2] = {tileSide, tileSide};
+	clErr = clEnqueueNDRangeKernel(pWorker->cmdQ, kernel, 2, NULL, thumbGlobalWorkItems, thumbLocalWorkItems, 0, NULL,
+								   GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing thumbnails kernel");
+	RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::DOWNLOAD, KERNEL_NAMES[COEF_TO_THUMBNAILS_KERNEL]);
 
-	// -----------------------------------------------------------------
-	// Read the results from the device
-	// -----------------------------------------------------------------
-	clErr = clEnqueueReadBuffer(m_oclEnv.m_cmdQ, gOutBuff, CL_TRUE, 0, gBuffSize, pInFloatsMatrix, 0, NULL, NULL);
+	unsigned char* pBytes = (unsigned char*)pWorker->pHostBuff;
+	clErr = clEnqueueReadBuffer(pWorker->cmdQ, pWorker->gBytesBuff, CL_TRUE, 0, numBytes, pBytes, 0, NULL, GetEventSlot(&transferEvent));
 	OpenCLEnv::CheckForError(clErr, "reading data from device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", numBytes);
 
+	cl_ulong hostStartTime = OpenCLEnv::GetHostTime();
+	memcpy(out, pBytes, numPixels);
+	for (int i = 0; i < numThumbnails; i++)
+	{
+		size_t offset = numPixels;
+		for (int level = 1; level < pLevels[i]; level++)
+			offset += (levelMask & (1u << level)) ? (width >> level)*(height >> level) : 0;
+		memcpy(ppThumbnails[i], pBytes + offset, (width >> pLevels[i])*(height >> pLevels[i]));
+	}
+	stats.hostTime += OpenCLEnv::GetHostTime() - hostStartTime;
+	ReleaseWorker(pWorker);
 
-	// ------------------------------------------------
-	// Convert given buffer to a matrix of gray levels
-	// ------------------------------------------------
-	for (unsigned int i = 0; i < numPixels; i++)
-		out[i] = (char)(pInFloatsMatrix[i] * 255.f);
+	stats.totalTime = OpenCLEnv::GetHostTime() - callStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("CleanNoiseThumbnails", callStartTime, callStartTime + stats.totalTime);
+	if (pStats)
+		*pStats = stats;
+	if (m_pStatsCollector)
+		m_pStatsCollector->Add(stats);
+
+	return 0;
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::CleanNoiseInteger(const unsigned char* in, unsigned char* out, int width, int height, float thresh,
+									 bool isSoftThresh, SCleanNoiseStats* pStats /*= NULL*/)
+{
+	return CleanNoiseIntegerImpl(in, out, false, width, height, thresh, isSoftThresh, pStats);
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::CleanNoiseInteger(const unsigned short* in, unsigned short* out, int width, int height, float thresh,
+									 bool isSoftThresh, SCleanNoiseStats* pStats /*= NULL*/)
+{
+	return CleanNoiseIntegerImpl(in, out, true, width, height, thresh, isSoftThresh, pStats);
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::CleanNoiseIntegerImpl(const void* pIn, void* pOut, bool is16Bit, int width, int height, float thresh,
+										 bool isSoftThresh, SCleanNoiseStats* pStats)
+{
+	unsigned int numLevelsWidth = 0;
+	unsigned int numLevelsHeight = 0;
+	if (!CNoiseCleaner::GetNumLevels(width, numLevelsWidth) || !CNoiseCleaner::GetNumLevels(height, numLevelsHeight))
+		return 1;	// The buffer length is not a power of two
 
+	SCleanNoiseStats stats;
+	stats.isProfiled = m_oclEnv.m_isProfilingEnabled;
+	cl_ulong callStartTime = OpenCLEnv::GetHostTime();
 
-	clReleaseMemObject(gInBuff);
-	clReleaseMemObject(gOutBuff);
-	clReleaseMemObject(gPartialBuff);
+	// The workspaces are sized in the coefficients of this instance, which may be halves
+	unsigned int numPixels = width*height;
+	unsigned int gBuffSize = numPixels * sizeof(cl_int);
+	size_t intLen = sizeof(cl_int) / m_coefSize;
+	size_t partialBuffLenRows = GetPartialBuffLen(numLevelsWidth, width, height, true);
+	size_t partialBuffLenCols = GetPartialBuffLen(numLevelsHeight, height, width, true);
+	size_t partialBuffLen = partialBuffLenRows > partialBuffLenCols ? partialBuffLenRows : partialBuffLenCols;
+	SWorker* pWorker = AcquireWorker();
+	ReserveWorkspace(*pWorker, numPixels*intLen, numPixels*intLen, partialBuffLen*intLen);
+
+	cl_ulong hostStartTime = OpenCLEnv::GetHostTime();
+	cl_int* pInts = (cl_int*)pWorker->pHostBuff;
+	if (is16Bit)
+	{
+		const unsigned short* in = (const unsigned short*)pIn;
+		for (unsigned int i = 0; i < numPixels; i++)
+			pInts[i] = in[i];
+	}
+	else
+	{
+		const unsigned char* in = (const unsigned char*)pIn;
+		for (unsigned int i = 0; i < numPixels; i++)
+			pInts[i] = in[i];
+	}
+	stats.hostTime += OpenCLEnv::GetHostTime() - hostStartTime;
 
+	cl_int                  clErr;
+	cl_event				transferEvent = NULL;
+	clErr = clEnqueueWriteBuffer(pWorker->cmdQ, pWorker->gInBuff, CL_TRUE, 0, gBuffSize, pInts, 0, NULL, GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::UPLOAD, "write", gBuffSize);
+
+	// The threshold is relative to the full scale, the kernels take it in sample units
+	int maxValue = is16Bit ? 65535 : 255;
+	if (!CleanNoiseIntegerGPU(*pWorker, width, height, thresh * (float)maxValue, isSoftThresh, stats))
+	{
+		clFinish(pWorker->cmdQ);
+		ReleaseWorker(pWorker);
+		return 1;
+	}
+
+	clErr = clEnqueueReadBuffer(pWorker->cmdQ, pWorker->gOutBuff, CL_TRUE, 0, gBuffSize, pInts, 0, NULL, GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "reading data from device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", gBuffSize);
+
+	// Thresholding may move the samples slightly out of range
+	hostStartTime = OpenCLEnv::GetHostTime();
+	for (unsigned int i = 0; i < numPixels; i++)
+	{
+		int value = pInts[i];
+		value = (value < 0) ? 0 : ((value > maxValue) ? maxValue : value);
+		if (is16Bit)
+			((unsigned short*)pOut)[i] = (unsigned short)value;
+		else
+			((unsigned char*)pOut)[i] = (unsigned char)value;
+	}
+	stats.hostTime += OpenCLEnv::GetHostTime() - hostStartTime;
+
+	ReleaseWorker(pWorker);
+
+	stats.totalTime = OpenCLEnv::GetHostTime() - callStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("CleanNoiseInteger", callStartTime, callStartTime + stats.totalTime);
+	if (pStats)
+		*pStats = stats;
+	if (m_pStatsCollector)
+		m_pStatsCollector->Add(stats);
 
 	return 0;
 }
 //-----------------------------------------------------------------------------------------
-bool CNoiseCleaner::PerformSelfTest()
+bool CNoiseCleaner::CleanNoiseIntegerGPU(SWorker& worker, int width, int height, float thresh, bool isSoftThresh,
+										 SCleanNoiseStats& stats)
 {
-	bool result1 = TestHaarTransformGPU();
-	bool result2 = TestMatTransposeGPU();
-	bool result3 = TestMatThreshGPU();
+	// The same stages as 'CleanNoiseGPU' with the integer kernels
+	unsigned int numLevelsWidth = 0;
+	unsigned int numLevelsHeight = 0;
+	CNoiseCleaner::GetNumLevels(width, numLevelsWidth);
+	CNoiseCleaner::GetNumLevels(height, numLevelsHeight);
+	cl_mem gInBuff = worker.gInBuff;
+	cl_mem gOutBuff = worker.gOutBuff;
+	cl_mem gPartialBuff = worker.gPartialBuff;
 
-	return result1 && result2 && result3;
+	bool bResult = ForwardHaarTransformGPU(worker, gInBuff, gOutBuff, gPartialBuff, height, numLevelsWidth, width, 0, 0,
+										   stats, SCleanNoiseStats::FWT_ROWS, FWT_INT_KERNEL);
+	bResult = bResult && TransposeMatrixGPU(worker, gOutBuff, gInBuff, width, height, 1, stats, SCleanNoiseStats::TRANSPOSE_ROWS, true);
+	bResult = bResult && ForwardHaarTransformGPU(worker, gInBuff, gOutBuff, gPartialBuff, width, numLevelsHeight, height, 0, 0,
+												 stats, SCleanNoiseStats::FWT_COLS, FWT_INT_KERNEL);
+	bResult = bResult && MatrixThreshIntGPU(worker, gOutBuff, gInBuff, width, height, 1, thresh, stats, SCleanNoiseStats::THRESHOLD,
+											isSoftThresh);
+	bResult = bResult && InverseHaarTransformGPU(worker, gInBuff, gOutBuff, gPartialBuff, width, numLevelsHeight, height, 0, 0,
+												 stats, SCleanNoiseStats::IWT_COLS, IWT_INT_KERNEL);
+	bResult = bResult && TransposeMatrixGPU(worker, gOutBuff, gInBuff, height, width, 1, stats, SCleanNoiseStats::TRANSPOSE_COLS, true);
+	bResult = bResult && InverseHaarTransformGPU(worker, gInBuff, gOutBuff, gPartialBuff, height, numLevelsWidth, width, 0, 0,
+												 stats, SCleanNoiseStats::IWT_ROWS, IWT_INT_KERNEL);
+
+	return bResult;
 }
 //-----------------------------------------------------------------------------------------
-bool CNoiseCleaner::TestMatTransposeGPU()
+struct CNoiseCleaner::SIncrementalStream
 {
-	const int TEMP_BUFF_SIZE = 512*512;
-	float*		pTempBuff = new float[TEMP_BUFF_SIZE];
-	float*		pResBuff = new float[TEMP_BUFF_SIZE];
-	float*		pCorrectBuff = new float[TEMP_BUFF_SIZE];
-	cl_int      clErr;
-	cl_mem		gInBuff;
-	cl_mem		gOutBuff;
-	cl_ulong	matTransposeKernelTime = 0;
+	int							width;
+	int							height;
+	int							tileSize;
+	int							numTiles;
+	int							maxDirtyTiles;		// More dirty tiles than this are recomputed with the whole frame
+	bool						isValid;			// The resident buffers hold the previous frame
+	float						thresh;
+	bool						isSoftThresh;
+	cl_mem						gFrameBuff;			// The previous frame
+	cl_mem						gNewFrameBuff;		// The uploaded frame, swapped with 'gFrameBuff' once compared
+	cl_mem						gRowCoefsBuff;		// The row transforms of the frame, transposed
+	cl_mem						gCoefsBuff;			// The coefficients before the thresholding
+	cl_mem						gDirtyFlagsBuff;
+	cl_mem						gTileListBuff;
+	cl_mem						gTileOutBuff;		// The reconstructed pixels of the dirty tiles, packed
+	std::vector<cl_uint>		dirtyFlags;
+	std::vector<cl_uint>		tileList;
+	std::vector<float>			tileOut;
+	std::vector<unsigned char>	prevOut;
+};
+//-----------------------------------------------------------------------------------------
+CNoiseCleaner::SIncrementalStream* CNoiseCleaner::CreateIncrementalStream(int width, int height, int tileSize /*= 32*/,
+																		  float maxDirtyFraction /*= 0.25f*/)
+{
+	unsigned int numLevels = 0;
+	if (width <= 0 || height <= 0 || tileSize <= 0 || tileSize > width || tileSize > height)
+		return NULL;
+	if (!CNoiseCleaner::GetNumLevels(width, numLevels) || !CNoiseCleaner::GetNumLevels(height, numLevels) ||
+		!CNoiseCleaner::GetNumLevels(tileSize, numLevels))
+		return NULL;	// Not powers of two
+	if (IsNonStandardUsed(width, height) || m_neighWindowSize != 0)
+		return NULL;	// The tiles are reconstructed along the paths of the standard decomposition, pointwise
 
-	int cnt = 0;
-	for (int i = 0; i < 512; i++)
-		for (int j = 0; j < 512; j++)
-			pTempBuff[i*512 + j] = (float)cnt++;
+	SIncrementalStream* pStream = new SIncrementalStream;
+	pStream->width = width;
+	pStream->height = height;
+	pStream->tileSize = tileSize;
+	pStream->numTiles = (width / tileSize) * (height / tileSize);
+	pStream->maxDirtyTiles = (int)(maxDirtyFraction * pStream->numTiles);
+	if (pStream->maxDirtyTiles > pStream->numTiles)
+		pStream->maxDirtyTiles = pStream->numTiles;
+	if (pStream->maxDirtyTiles < 0)
+		pStream->maxDirtyTiles = 0;
+	pStream->isValid = false;
+	pStream->thresh = 0.f;
+	pStream->isSoftThresh = false;
+	pStream->dirtyFlags.resize(pStream->numTiles);
+	pStream->tileList.reserve(pStream->numTiles);
+	pStream->tileOut.resize((pStream->maxDirtyTiles > 0 ? pStream->maxDirtyTiles : 1) * tileSize * tileSize);
+	pStream->prevOut.resize((size_t)width*height);
 
-	cnt = 0;
-	for (int i = 0; i < 512; i++)
-		for (int j = 0; j < 512; j++)
-			pCorrectBuff[j*512 + i] = (float)cnt++;
+	cl_int clErr;
+	size_t frameSize = (size_t)width*height*m_coefSize;
+	cl_mem* pFrameBuffs[4] = {&pStream->gFrameBuff, &pStream->gNewFrameBuff, &pStream->gRowCoefsBuff, &pStream->gCoefsBuff};
+	for (int i = 0; i < 4; i++)
+	{
+		*pFrameBuffs[i] = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, frameSize, NULL, &clErr);
+		OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+	}
+	pStream->gDirtyFlagsBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, pStream->numTiles * sizeof(cl_uint), NULL, &clErr);
+	OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+	pStream->gTileListBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_ONLY, pStream->numTiles * sizeof(cl_uint), NULL, &clErr);
+	OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+	pStream->gTileOutBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_WRITE_ONLY, pStream->tileOut.size() * sizeof(float), NULL, &clErr);
+	OpenCLEnv::CheckForError(clErr, "allocating device buffer");
 
-	unsigned int gBuffSize = TEMP_BUFF_SIZE * sizeof(float);
-	gInBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_ONLY, gBuffSize, NULL, NULL);
-	gOutBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_WRITE_ONLY, gBuffSize, NULL, NULL);
+	return pStream;
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::ReleaseIncrementalStream(SIncrementalStream* pStream)
+{
+	if (pStream == NULL)
+		return;
+
+	clReleaseMemObject(pStream->gFrameBuff);
+	clReleaseMemObject(pStream->gNewFrameBuff);
+	clReleaseMemObject(pStream->gRowCoefsBuff);
+	clReleaseMemObject(pStream->gCoefsBuff);
+	clReleaseMemObject(pStream->gDirtyFlagsBuff);
+	clReleaseMemObject(pStream->gTileListBuff);
+	clReleaseMemObject(pStream->gTileOutBuff);
+	delete pStream;
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::CleanNoiseIncremental(SIncrementalStream* pStream, const unsigned char* in, unsigned char* out, float thresh,
+										 bool isSoftThresh, SCleanNoiseStats* pStats /*= NULL*/, SIncrementalInfo* pInfo /*= NULL*/)
+{
+	if (pStream == NULL || IsNonStandardUsed(pStream->width, pStream->height) || m_neighWindowSize != 0)
+		return 1;
+
+	SIncrementalStream& stream = *pStream;
+	SCleanNoiseStats stats;
+	stats.isProfiled = m_oclEnv.m_isProfilingEnabled;
+	cl_ulong callStartTime = OpenCLEnv::GetHostTime();
 
-	clErr = clEnqueueWriteBuffer(m_oclEnv.m_cmdQ, gInBuff, CL_TRUE, 0, gBuffSize, pTempBuff, 0, NULL, NULL);
+	unsigned int frameLen = stream.width*stream.height;
+	unsigned int gBuffSize = frameLen * (unsigned int)m_coefSize;
+	SWorker* pWorker = AcquireWorker();
+	bool isInPlace = false;
+	size_t buffLen, outBuffLen, partialBuffLen;
+	GetWorkspaceLens(stream.width, stream.height, 1, isInPlace, buffLen, outBuffLen, partialBuffLen);
+	ReserveWorkspace(*pWorker, buffLen, outBuffLen, partialBuffLen);
+
+	cl_ulong hostStartTime = OpenCLEnv::GetHostTime();
+	ConvertToCoefs(in, pWorker->pHostBuff, 0, frameLen);
+	stats.hostTime += OpenCLEnv::GetHostTime() - hostStartTime;
+
+	cl_int clErr;
+	cl_event transferEvent = NULL;
+	clErr = clEnqueueWriteBuffer(pWorker->cmdQ, stream.gNewFrameBuff, CL_TRUE, 0, gBuffSize, pWorker->pHostBuff, 0, NULL,
+								 GetEventSlot(&transferEvent));
 	OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::UPLOAD, "write", gBuffSize);
 
-	bool bResult = TransposeMatrixGPU(gInBuff, gOutBuff, 512, 512, matTransposeKernelTime);
-	OpenCLEnv::PrintProfilingInfo(matTransposeKernelTime, "Matrix transpose");
-	if (bResult)
+	// ---------------------------------------------------------------------------------------
+	// Compare the frame with the previous one on the device, only the flags of the tiles are
+	// read back. The comparison is accounted to the upload.
+	// ---------------------------------------------------------------------------------------
+	bool isFullRecompute = !stream.isValid || thresh != stream.thresh || isSoftThresh != stream.isSoftThresh;
+	int numDirtyTiles = stream.numTiles;
+	if (!isFullRecompute)
 	{
-		clErr = clEnqueueReadBuffer(m_oclEnv.m_cmdQ, gOutBuff, CL_TRUE, 0, gBuffSize, pResBuff, 0, NULL, NULL);
+		cl_event kernelEvent = NULL;
+		cl_uint zero = 0;
+		clErr = clEnqueueFillBuffer(pWorker->cmdQ, stream.gDirtyFlagsBuff, &zero, sizeof(zero), 0, stream.numTiles * sizeof(cl_uint),
+									0, NULL, GetEventSlot(&kernelEvent));
+		OpenCLEnv::CheckForError(clErr, "enqueuing buffer fill");
+		RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::UPLOAD, "fill");
+
+		cl_kernel kernel = pWorker->kernels[TILE_DIFF_KERNEL];
+		unsigned int width = stream.width;
+		unsigned int tileSize = stream.tileSize;
+		clSetKernelArg(kernel, 0, sizeof(cl_mem), &stream.gNewFrameBuff);
+		clSetKernelArg(kernel, 1, sizeof(cl_mem), &stream.gFrameBuff);
+		clSetKernelArg(kernel, 2, sizeof(cl_mem), &stream.gDirtyFlagsBuff);
+		clSetKernelArg(kernel, 3, sizeof(unsigned int), &width);
+		clSetKernelArg(kernel, 4, sizeof(unsigned int), &tileSize);
+		clSetKernelArg(kernel, 5, sizeof(unsigned int), &frameLen);
+		size_t localWorkItems = GetThreshWorkGroupSize();
+		size_t globalWorkItems = ((frameLen - 1) / localWorkItems + 1) * localWorkItems;
+		clErr = clEnqueueNDRangeKernel(pWorker->cmdQ, kernel, 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
+		OpenCLEnv::CheckForError(clErr, "enqueuing tile diff kernel");
+		RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::UPLOAD, KERNEL_NAMES[TILE_DIFF_KERNEL]);
+
+		size_t flagsSize = stream.numTiles * sizeof(cl_uint);
+		clErr = clEnqueueReadBuffer(pWorker->cmdQ, stream.gDirtyFlagsBuff, CL_TRUE, 0, flagsSize, &stream.dirtyFlags[0], 0, NULL,
+									GetEventSlot(&transferEvent));
 		OpenCLEnv::CheckForError(clErr, "reading data from device");
-		if (!OpenCLEnv::CompareFloatBuffers(pCorrectBuff, pResBuff, TEMP_BUFF_SIZE))
-				bResult = false;
+		RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", flagsSize);
+
+		stream.tileList.clear();
+		for (int i = 0; i < stream.numTiles; i++)
+		{
+			if (stream.dirtyFlags[i])
+				stream.tileList.push_back(i);
+		}
+		numDirtyTiles = (int)stream.tileList.size();
+		isFullRecompute = (numDirtyTiles > stream.maxDirtyTiles);
+	}
+
+	// The new frame becomes the previous one
+	cl_mem gPrevFrameBuff = stream.gFrameBuff;
+	stream.gFrameBuff = stream.gNewFrameBuff;
+	stream.gNewFrameBuff = gPrevFrameBuff;
+
+	bool bResult = true;
+	if (isFullRecompute)
+	{
+		stream.isValid = false;
+		bResult = CleanNoiseFullGPU(*pWorker, stream, thresh, isSoftThresh, stats);
+		if (bResult)
+		{
+			clErr = clEnqueueReadBuffer(pWorker->cmdQ, pWorker->gOutBuff, CL_TRUE, 0, gBuffSize, pWorker->pHostBuff, 0, NULL,
+										GetEventSlot(&transferEvent));
+			OpenCLEnv::CheckForError(clErr, "reading data from device");
+			RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", gBuffSize);
+
+			hostStartTime = OpenCLEnv::GetHostTime();
+			ConvertFromCoefs(pWorker->pHostBuff, 0, frameLen, &stream.prevOut[0]);
+			stats.hostTime += OpenCLEnv::GetHostTime() - hostStartTime;
+			stream.isValid = true;
+			stream.thresh = thresh;
+			stream.isSoftThresh = isSoftThresh;
+		}
+	}
+	else if (numDirtyTiles > 0)
+	{
+		bResult = CleanNoiseTilesGPU(*pWorker, stream, numDirtyTiles, thresh, isSoftThresh, stats);
+		if (bResult)
+		{
+			int tilePixels = stream.tileSize*stream.tileSize;
+			size_t tileOutSize = (size_t)numDirtyTiles * tilePixels * sizeof(float);
+			clErr = clEnqueueReadBuffer(pWorker->cmdQ, stream.gTileOutBuff, CL_TRUE, 0, tileOutSize, &stream.tileOut[0], 0, NULL,
+										GetEventSlot(&transferEvent));
+			OpenCLEnv::CheckForError(clErr, "reading data from device");
+			RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", tileOutSize);
+
+			// The tiles are unpacked into the output of the previous frame
+			hostStartTime = OpenCLEnv::GetHostTime();
+			int tilesPerRow = stream.width / stream.tileSize;
+			for (int i = 0; i < numDirtyTiles; i++)
+			{
+				int tile = (int)stream.tileList[i];
+				const float* pTileOut = &stream.tileOut[(size_t)i*tilePixels];
+				unsigned char* pOut = &stream.prevOut[((size_t)(tile / tilesPerRow)*stream.width + tile % tilesPerRow) * stream.tileSize];
+				for (int y = 0; y < stream.tileSize; y++)
+				{
+					for (int x = 0; x < stream.tileSize; x++)
+						pOut[y*stream.width + x] = (char)(pTileOut[y*stream.tileSize + x] * 255.f);
+				}
+			}
+			stats.hostTime += OpenCLEnv::GetHostTime() - hostStartTime;
+		}
+	}
+	ReleaseWorker(pWorker);
+	if (!bResult)
+		return 1;
+
+	memcpy(out, &stream.prevOut[0], frameLen);
+
+	stats.totalTime = OpenCLEnv::GetHostTime() - callStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("CleanNoiseIncremental", callStartTime, callStartTime + stats.totalTime);
+	if (pStats)
+		*pStats = stats;
+	if (m_pStatsCollector)
+		m_pStatsCollector->Add(stats);
+	if (pInfo)
+	{
+		pInfo->numTiles = stream.numTiles;
+		pInfo->numDirtyTiles = numDirtyTiles;
+		pInfo->isFullRecompute = isFullRecompute;
+	}
+
+	return 0;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::CleanNoiseFullGPU(SWorker& worker, SIncrementalStream& stream, float thresh, bool isSoftThresh,
+									  SCleanNoiseStats& stats)
+{
+	// The stages of 'CleanNoiseGPU', except that the transposed row transforms and the coefficients
+	// are kept in the stream for the following frames
+	unsigned int numLevelsWidth = 0;
+	unsigned int numLevelsHeight = 0;
+	CNoiseCleaner::GetNumLevels(stream.width, numLevelsWidth);
+	CNoiseCleaner::GetNumLevels(stream.height, numLevelsHeight);
+	int width = stream.width;
+	int height = stream.height;
+	cl_mem gInBuff = worker.gInBuff;
+	cl_mem gPartialBuff = worker.gPartialBuff;
+
+	bool bResult = ForwardHaarTransformGPU(worker, stream.gFrameBuff, gInBuff, gPartialBuff, height, numLevelsWidth, width, 0, 0,
+										   stats, SCleanNoiseStats::FWT_ROWS);
+	bResult = bResult && TransposeMatrixGPU(worker, gInBuff, stream.gRowCoefsBuff, width, height, 1, stats, SCleanNoiseStats::TRANSPOSE_ROWS);
+	bResult = bResult && ForwardHaarTransformGPU(worker, stream.gRowCoefsBuff, stream.gCoefsBuff, gPartialBuff, width, numLevelsHeight,
+												 height, 0, 0, stats, SCleanNoiseStats::FWT_COLS);
+
+	return bResult && InverseTransform2DGPU(worker, stream.gCoefsBuff, 1, width, height, thresh, isSoftThresh, stats);
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::CleanNoiseTilesGPU(SWorker& worker, SIncrementalStream& stream, int numDirtyTiles, float thresh, bool isSoftThresh,
+									   SCleanNoiseStats& stats)
+{
+	unsigned int numLevelsWidth = 0;
+	unsigned int numLevelsHeight = 0;
+	CNoiseCleaner::GetNumLevels(stream.width, numLevelsWidth);
+	CNoiseCleaner::GetNumLevels(stream.height, numLevelsHeight);
+	int width = stream.width;
+	int height = stream.height;
+	int tileSize = stream.tileSize;
+	int tilesPerRow = width / tileSize;
+
+	// ---------------------------------------------------------------------------------------
+	// A dirty tile changes the row transforms of its rows at the fine coefficients inside the
+	// tile and at the coarse coefficients whose support covers it, every other row coefficient
+	// only depends on pixels which did not change. The rows of the tiles are transformed again
+	// a band of tile rows at a time, and only the columns of the changed row coefficients.
+	// ---------------------------------------------------------------------------------------
+	std::vector<bool> isBandDirty(height / tileSize, false);
+	std::vector<bool> isColumnDirty(width, false);
+	isColumnDirty[0] = true;
+	for (int i = 0; i < numDirtyTiles; i++)
+	{
+		int tile = (int)stream.tileList[i];
+		isBandDirty[tile / tilesPerRow] = true;
+		unsigned int firstX = (tile % tilesPerRow) * tileSize;
+		unsigned int lastX = firstX + tileSize - 1;
+		for (unsigned int level = 0; level < numLevelsWidth; level++)
+		{
+			unsigned int shift = numLevelsWidth - level;
+			for (unsigned int k = firstX >> shift; k <= (lastX >> shift); k++)
+				isColumnDirty[(1 << level) + k] = true;
+		}
+	}
+
+	bool bResult = true;
+	cl_int clErr;
+	for (int band = 0; band < (int)isBandDirty.size() && bResult; band++)
+	{
+		if (!isBandDirty[band])
+			continue;
+		int lastBand = band;
+		while (lastBand + 1 < (int)isBandDirty.size() && isBandDirty[lastBand + 1])
+			lastBand++;
+		int firstRow = band*tileSize;
+		int numRows = (lastBand - band + 1)*tileSize;
+		band = lastBand;
+
+		bResult = ForwardHaarTransformGPU(worker, stream.gFrameBuff, worker.gInBuff, worker.gPartialBuff, numRows, numLevelsWidth, width,
+										  firstRow*width, 0, stats, SCleanNoiseStats::FWT_ROWS);
+		bResult = bResult && TransposeMatrixGPU(worker, worker.gInBuff, worker.gOutBuff, width, numRows, 1, stats, SCleanNoiseStats::TRANSPOSE_ROWS);
+
+		// The transposed band is a column band of the transposed row transforms
+		cl_event copyEvent = NULL;
+		size_t srcOrigin[3] = {0, 0, 0};
+		size_t dstOrigin[3] = {firstRow*m_coefSize, 0, 0};
+		size_t region[3] = {numRows*m_coefSize, (size_t)width, 1};
+		clErr = clEnqueueCopyBufferRect(worker.cmdQ, worker.gOutBuff, stream.gRowCoefsBuff, srcOrigin, dstOrigin, region,
+										numRows*m_coefSize, 0, height*m_coefSize, 0, 0, NULL, GetEventSlot(&copyEvent));
+		OpenCLEnv::CheckForError(clErr, "enqueuing buffer copy");
+		RecordCommand(worker, copyEvent, stats, SCleanNoiseStats::TRANSPOSE_ROWS, "copy", region[0]*region[1]);
+	}
+
+	for (int column = 0; column < width && bResult; column++)
+	{
+		if (!isColumnDirty[column])
+			continue;
+		int lastColumn = column;
+		while (lastColumn + 1 < width && isColumnDirty[lastColumn + 1])
+			lastColumn++;
+		unsigned int offset = column*height;
+		bResult = ForwardHaarTransformGPU(worker, stream.gRowCoefsBuff, stream.gCoefsBuff, worker.gPartialBuff, lastColumn - column + 1,
+										  numLevelsHeight, height, offset, offset, stats, SCleanNoiseStats::FWT_COLS);
+		column = lastColumn;
+	}
+	if (!bResult)
+		return false;
+
+	// ---------------------------------------------------------------------------------------
+	// Reconstruct the pixels of the dirty tiles, the thresholding is done on the way
+	// ---------------------------------------------------------------------------------------
+	cl_event transferEvent = NULL;
+	size_t tileListSize = numDirtyTiles * sizeof(cl_uint);
+	clErr = clEnqueueWriteBuffer(worker.cmdQ, stream.gTileListBuff, CL_TRUE, 0, tileListSize, &stream.tileList[0], 0, NULL,
+								 GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+	RecordCommand(worker, transferEvent, stats, SCleanNoiseStats::UPLOAD, "write", tileListSize);
+
+	cl_event kernelEvent = NULL;
+	cl_kernel kernel = worker.kernels[IWT_TILES_KERNEL];
+	unsigned int isSoft = isSoftThresh ? 1 : 0;
+	unsigned int tileSizeArg = tileSize;
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), &stream.gCoefsBuff);
+	clSetKernelArg(kernel, 1, sizeof(cl_mem), &stream.gTileListBuff);
+	clSetKernelArg(kernel, 2, sizeof(cl_mem), &stream.gTileOutBuff);
+	clSetKernelArg(kernel, 3, sizeof(float), &thresh);
+	clSetKernelArg(kernel, 4, sizeof(unsigned int), &isSoft);
+	clSetKernelArg(kernel, 5, sizeof(unsigned int), &numLevelsWidth);
+	clSetKernelArg(kernel, 6, sizeof(unsigned int), &numLevelsHeight);
+	clSetKernelArg(kernel, 7, sizeof(unsigned int), &tileSizeArg);
+
+	// Both are powers of two, so the work-groups never straddle the end of the range
+	size_t tilePixels = (size_t)tileSize*tileSize;
+	size_t localWorkItems = GetThreshWorkGroupSize();
+	if (localWorkItems > tilePixels)
+		localWorkItems = tilePixels;
+	size_t globalWorkItems = numDirtyTiles*tilePixels;
+	clErr = clEnqueueNDRangeKernel(worker.cmdQ, kernel, 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing tile IWT kernel");
+	RecordCommand(worker, kernelEvent, stats, SCleanNoiseStats::IWT_ROWS, KERNEL_NAMES[IWT_TILES_KERNEL]);
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+struct CNoiseCleaner::SSignalStream
+{
+	int						numChannels;
+	int						blockLen;
+	int						numCarried;			// Samples of the incomplete block of every channel
+	std::vector<float>		carry;				// 'blockLen' samples per channel
+};
+//-----------------------------------------------------------------------------------------
+CNoiseCleaner::SSignalStream* CNoiseCleaner::CreateSignalStream(int numChannels, int blockLen /*= 1024*/)
+{
+	unsigned int numLevels = 0;
+	if (numChannels <= 0 || blockLen < 2 || !CNoiseCleaner::GetNumLevels(blockLen, numLevels))
+		return NULL;
+
+	SSignalStream* pStream = new SSignalStream;
+	pStream->numChannels = numChannels;
+	pStream->blockLen = blockLen;
+	pStream->numCarried = 0;
+	pStream->carry.resize((size_t)numChannels * blockLen);
+	return pStream;
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::ReleaseSignalStream(SSignalStream* pStream)
+{
+	delete pStream;
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::CleanNoiseSignal(SSignalStream* pStream, const float* const* ppIn, int numSamples, float* const* ppOut,
+									float thresh, bool isSoftThresh, SCleanNoiseStats* pStats /*= NULL*/)
+{
+	if (pStream == NULL || ppIn == NULL || ppOut == NULL || numSamples < 0)
+		return -1;
+
+	SCleanNoiseStats stats;
+	stats.isProfiled = m_oclEnv.m_isProfilingEnabled;
+	cl_ulong callStartTime = OpenCLEnv::GetHostTime();
+
+	SSignalStream& stream = *pStream;
+	int blockLen = stream.blockLen;
+	int numTotal = stream.numCarried + numSamples;
+	int numBlocks = numTotal / blockLen;
+	int numOut = numBlocks * blockLen;
+	if (numBlocks > 0 && !CleanNoiseSignalGPU(stream, ppIn, numBlocks, ppOut, numOut, thresh, isSoftThresh, stats))
+		return -1;
+
+	// Only the samples after the last complete block are carried to the next call. When a block
+	// was completed they all come from 'ppIn', since fewer than 'blockLen' samples were carried
+	int numRemaining = numTotal - numOut;
+	int firstRemaining = numBlocks > 0 ? numSamples - numRemaining : 0;
+	int carryOffset = numBlocks > 0 ? 0 : stream.numCarried;
+	for (int c = 0; c < stream.numChannels; c++)
+	{
+		float* pCarry = &stream.carry[(size_t)c*blockLen + carryOffset];
+		for (int i = 0; i < numSamples - firstRemaining; i++)
+			pCarry[i] = ppIn[c][firstRemaining + i];
+	}
+	stream.numCarried = numRemaining;
+
+	stats.totalTime = OpenCLEnv::GetHostTime() - callStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("CleanNoiseSignal", callStartTime, callStartTime + stats.totalTime);
+	if (pStats)
+		*pStats = stats;
+	if (m_pStatsCollector)
+		m_pStatsCollector->Add(stats);
+
+	return numOut;
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::FlushSignalStream(SSignalStream* pStream, float* const* ppOut, float thresh, bool isSoftThresh,
+									 SCleanNoiseStats* pStats /*= NULL*/)
+{
+	if (pStream == NULL || ppOut == NULL)
+		return -1;
+
+	SCleanNoiseStats stats;
+	stats.isProfiled = m_oclEnv.m_isProfilingEnabled;
+	cl_ulong callStartTime = OpenCLEnv::GetHostTime();
+
+	// The incomplete blocks are extended with their last sample, which adds no detail at the end
+	// of the signal, and cleaned as one complete block of carried samples
+	SSignalStream& stream = *pStream;
+	int blockLen = stream.blockLen;
+	int numOut = stream.numCarried;
+	if (numOut > 0)
+	{
+		for (int c = 0; c < stream.numChannels; c++)
+		{
+			float* pCarry = &stream.carry[(size_t)c*blockLen];
+			for (int i = numOut; i < blockLen; i++)
+				pCarry[i] = pCarry[numOut - 1];
+		}
+		stream.numCarried = blockLen;
+		bool bResult = CleanNoiseSignalGPU(stream, NULL, 1, ppOut, numOut, thresh, isSoftThresh, stats);
+		stream.numCarried = 0;
+		if (!bResult)
+			return -1;
+	}
+
+	stats.totalTime = OpenCLEnv::GetHostTime() - callStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("FlushSignalStream", callStartTime, callStartTime + stats.totalTime);
+	if (pStats)
+		*pStats = stats;
+	if (m_pStatsCollector)
+		m_pStatsCollector->Add(stats);
+
+	return numOut;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::CleanNoiseSignalGPU(SSignalStream& stream, const float* const* ppIn, int numBlocks, float* const* ppOut, int numOut,
+										float thresh, bool isSoftThresh, SCleanNoiseStats& stats)
+{
+	// The blocks of a channel are consecutive rows and the channels follow each other, so every
+	// stage is a single launch over all the blocks of all the channels
+	unsigned int numLevels = 0;
+	CNoiseCleaner::GetNumLevels(stream.blockLen, numLevels);
+	int numRows = stream.numChannels * numBlocks;
+	size_t channelLen = (size_t)numBlocks * stream.blockLen;
+	size_t numCoefs = (size_t)numRows * stream.blockLen;
+	size_t gBuffSize = numCoefs * m_coefSize;
+	SWorker* pWorker = AcquireWorker();
+	ReserveWorkspace(*pWorker, numCoefs, numCoefs, GetPartialBuffLen(numLevels, stream.blockLen, numRows));
+
+	cl_ulong hostStartTime = OpenCLEnv::GetHostTime();
+	cl_half* pHalves = (cl_half*)pWorker->pHostBuff;
+	float* pFloats = pWorker->pHostBuff;
+	for (int c = 0; c < stream.numChannels; c++)
+	{
+		const float* pCarry = &stream.carry[(size_t)c*stream.blockLen];
+		size_t rowStart = c * channelLen;
+		for (size_t i = 0; i < channelLen; i++)
+		{
+			float sample = (int)i < stream.numCarried ? pCarry[i] : ppIn[c][i - stream.numCarried];
+			if (m_isHalfPrecision)
+				pHalves[rowStart + i] = OpenCLEnv::FloatToHalf(sample);
+			else
+				pFloats[rowStart + i] = sample;
+		}
+	}
+	stats.hostTime += OpenCLEnv::GetHostTime() - hostStartTime;
+
+	cl_int clErr;
+	cl_event transferEvent = NULL;
+	clErr = clEnqueueWriteBuffer(pWorker->cmdQ, pWorker->gInBuff, CL_FALSE, 0, gBuffSize, pWorker->pHostBuff, 0, NULL,
+								 GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::UPLOAD, "write", gBuffSize);
+
+	bool bResult = ForwardHaarTransformGPU(*pWorker, pWorker->gInBuff, pWorker->gOutBuff, pWorker->gPartialBuff, numRows, numLevels,
+										   stream.blockLen, 0, 0, stats, SCleanNoiseStats::FWT_ROWS);
+	bResult = bResult && MatrixThreshGPU(*pWorker, pWorker->gOutBuff, pWorker->gInBuff, (unsigned int)numCoefs, thresh, stats,
+										 SCleanNoiseStats::THRESHOLD, isSoftThresh);
+	bResult = bResult && InverseHaarTransformGPU(*pWorker, pWorker->gInBuff, pWorker->gOutBuff, pWorker->gPartialBuff, numRows,
+												 numLevels, stream.blockLen, 0, 0, stats, SCleanNoiseStats::IWT_ROWS);
+	if (bResult)
+	{
+		clErr = clEnqueueReadBuffer(pWorker->cmdQ, pWorker->gOutBuff, CL_TRUE, 0, gBuffSize, pWorker->pHostBuff, 0, NULL,
+									GetEventSlot(&transferEvent));
+		OpenCLEnv::CheckForError(clErr, "reading data from device");
+		RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", gBuffSize);
+
+		hostStartTime = OpenCLEnv::GetHostTime();
+		for (int c = 0; c < stream.numChannels; c++)
+		{
+			size_t rowStart = c * channelLen;
+			for (int i = 0; i < numOut; i++)
+				ppOut[c][i] = m_isHalfPrecision ? OpenCLEnv::HalfToFloat(pHalves[rowStart + i]) : pFloats[rowStart + i];
+		}
+		stats.hostTime += OpenCLEnv::GetHostTime() - hostStartTime;
+	}
+	ReleaseWorker(pWorker);
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+struct CNoiseCleaner::SCoefficients
+{
+	int			width;
+	int			height;
+	bool		isNonStandard;		// The decomposition selected when the coefficients were computed
+	cl_mem		gCoefsBuff;
+};
+//-----------------------------------------------------------------------------------------
+CNoiseCleaner::SCoefficients* CNoiseCleaner::ForwardTransform(const unsigned char* in, int width, int height,
+															   SCleanNoiseStats* pStats /*= NULL*/)
+{
+	unsigned int numLevels = 0;
+	if (width <= 0 || height <= 0 || !CNoiseCleaner::GetNumLevels(width, numLevels) || !CNoiseCleaner::GetNumLevels(height, numLevels))
+		return NULL;	// The buffer length is not a power of two
+
+	SCleanNoiseStats stats;
+	stats.isProfiled = m_oclEnv.m_isProfilingEnabled;
+	cl_ulong callStartTime = OpenCLEnv::GetHostTime();
+
+	unsigned int frameLen = width*height;
+	unsigned int gBuffSize = frameLen * (unsigned int)m_coefSize;
+	bool isNonStandard = IsNonStandardUsed(width, height);
+	SWorker* pWorker = AcquireWorker();
+	bool isInPlace = false;
+	size_t buffLen, outBuffLen, partialBuffLen;
+	GetWorkspaceLens(width, height, 1, isInPlace, buffLen, outBuffLen, partialBuffLen, isNonStandard);
+	ReserveWorkspace(*pWorker, buffLen, outBuffLen, partialBuffLen);
+
+	cl_int clErr;
+	SCoefficients* pCoefs = new SCoefficients;
+	pCoefs->width = width;
+	pCoefs->height = height;
+	pCoefs->isNonStandard = isNonStandard;
+	pCoefs->gCoefsBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, gBuffSize, NULL, &clErr);
+	OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+
+	cl_ulong hostStartTime = OpenCLEnv::GetHostTime();
+	ConvertToCoefs(in, pWorker->pHostBuff, 0, frameLen);
+	stats.hostTime += OpenCLEnv::GetHostTime() - hostStartTime;
+
+	cl_event transferEvent = NULL;
+	clErr = clEnqueueWriteBuffer(pWorker->cmdQ, pWorker->gInBuff, CL_TRUE, 0, gBuffSize, pWorker->pHostBuff, 0, NULL,
+								 GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::UPLOAD, "write", gBuffSize);
+
+	bool bResult;
+	if (isNonStandard)
+		bResult = ForwardNonStandardGPU(*pWorker, pWorker->gInBuff, pCoefs->gCoefsBuff, 1, width, height, stats);
+	else
+		bResult = ForwardTransform2DGPU(*pWorker, pWorker->gInBuff, pCoefs->gCoefsBuff, 1, width, height, stats);
+	// The coefficients are used later on the queue of another worker
+	clFinish(pWorker->cmdQ);
+	ReleaseWorker(pWorker);
+	if (!bResult)
+	{
+		ReleaseCoefficients(pCoefs);
+		return NULL;
+	}
+
+	stats.totalTime = OpenCLEnv::GetHostTime() - callStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("ForwardTransform", callStartTime, callStartTime + stats.totalTime);
+	if (pStats)
+		*pStats = stats;
+	if (m_pStatsCollector)
+		m_pStatsCollector->Add(stats);
+
+	return pCoefs;
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::ReleaseCoefficients(SCoefficients* pCoefs)
+{
+	if (pCoefs == NULL)
+		return;
+
+	clReleaseMemObject(pCoefs->gCoefsBuff);
+	delete pCoefs;
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::Reconstruct(SCoefficients* pCoefs, unsigned char* out, float thresh, bool isSoftThresh,
+							   SCleanNoiseStats* pStats /*= NULL*/)
+{
+	if (pCoefs == NULL)
+		return 1;
+
+	SCleanNoiseStats stats;
+	stats.isProfiled = m_oclEnv.m_isProfilingEnabled;
+	cl_ulong callStartTime = OpenCLEnv::GetHostTime();
+
+	unsigned int frameLen = pCoefs->width*pCoefs->height;
+	unsigned int gBuffSize = frameLen * (unsigned int)m_coefSize;
+	SWorker* pWorker = AcquireWorker();
+	bool isInPlace = false;
+	size_t buffLen, outBuffLen, partialBuffLen;
+	GetWorkspaceLens(pCoefs->width, pCoefs->height, 1, isInPlace, buffLen, outBuffLen, partialBuffLen, pCoefs->isNonStandard);
+	ReserveWorkspace(*pWorker, buffLen, outBuffLen, partialBuffLen);
+
+	// The stages of 'CleanNoiseGPU' after the forward transforms
+	bool bResult;
+	if (pCoefs->isNonStandard)
+	{
+		bResult = ThresholdCoefsGPU(*pWorker, pCoefs->gCoefsBuff, pWorker->gInBuff, 1, pCoefs->width, pCoefs->height, true, thresh,
+									isSoftThresh, stats);
+		bResult = bResult && InverseNonStandardGPU(*pWorker, pWorker->gInBuff, pWorker->gOutBuff, 1, pCoefs->width, pCoefs->height, stats);
+	}
+	else
+		bResult = InverseTransform2DGPU(*pWorker, pCoefs->gCoefsBuff, 1, pCoefs->width, pCoefs->height, thresh, isSoftThresh, stats);
+	if (!bResult)
+	{
+		clFinish(pWorker->cmdQ);
+		ReleaseWorker(pWorker);
+		return 1;
+	}
+
+	cl_event transferEvent = NULL;
+	cl_int clErr = clEnqueueReadBuffer(pWorker->cmdQ, pWorker->gOutBuff, CL_TRUE, 0, gBuffSize, pWorker->pHostBuff, 0, NULL,
+									   GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "reading data from device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", gBuffSize);
+
+	cl_ulong hostStartTime = OpenCLEnv::GetHostTime();
+	ConvertFromCoefs(pWorker->pHostBuff, 0, frameLen, out);
+	stats.hostTime += OpenCLEnv::GetHostTime() - hostStartTime;
+	ReleaseWorker(pWorker);
+
+	stats.totalTime = OpenCLEnv::GetHostTime() - callStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("Reconstruct", callStartTime, callStartTime + stats.totalTime);
+	if (pStats)
+		*pStats = stats;
+	if (m_pStatsCollector)
+		m_pStatsCollector->Add(stats);
+
+	return 0;
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::EvaluateThresholds(SCoefficients* pCoefs, const float* pThresholds, int numThresholds, bool isSoftThresh,
+									  SThresholdMetrics* pMetrics, SCleanNoiseStats* pStats /*= NULL*/)
+{
+	if (pCoefs == NULL || pThresholds == NULL || numThresholds <= 0 || pMetrics == NULL)
+		return 1;
+
+	SCleanNoiseStats stats;
+	stats.isProfiled = m_oclEnv.m_isProfilingEnabled;
+	cl_ulong callStartTime = OpenCLEnv::GetHostTime();
+	SWorker* pWorker = AcquireWorker();
+	bool bResult;
+	if (m_neighWindowSize == 0)
+		bResult = EvaluateThresholdsGPU(*pWorker, *pCoefs, pThresholds, numThresholds, isSoftThresh, pMetrics, stats);
+	else
+		bResult = EvaluateNeighThresholdsGPU(*pWorker, *pCoefs, pThresholds, numThresholds, pMetrics, stats);
+	ReleaseWorker(pWorker);
+	if (!bResult)
+		return 1;
+
+	stats.totalTime = OpenCLEnv::GetHostTime() - callStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("EvaluateThresholds", callStartTime, callStartTime + stats.totalTime);
+	if (pStats)
+		*pStats = stats;
+	if (m_pStatsCollector)
+		m_pStatsCollector->Add(stats);
+
+	return 0;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::EvaluateThresholdsGPU(SWorker& worker, const SCoefficients& coefs, const float* pThresholds, int numThresholds,
+										  bool isSoftThresh, SThresholdMetrics* pMetrics, SCleanNoiseStats& stats)
+{
+	// Every work-group adds up its share of the coefficients for all the thresholds
+	unsigned int dataLen = coefs.width*coefs.height;
+	size_t localWorkItems = GetThreshWorkGroupSize();
+	size_t numGroups = (dataLen - 1) / localWorkItems + 1;
+	if (numGroups > METRICS_MAX_GROUPS)
+		numGroups = METRICS_MAX_GROUPS;
+	size_t globalWorkItems = numGroups*localWorkItems;
+	size_t numPartials = numGroups*numThresholds;
+
+	cl_int clErr;
+	size_t thresholdsSize = numThresholds * sizeof(float);
+	cl_mem gThresholdsBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_ONLY, thresholdsSize, NULL, &clErr);
+	OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+	cl_mem gGroupErrBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_WRITE_ONLY, numPartials * sizeof(float), NULL, &clErr);
+	OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+	cl_mem gGroupZerosBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_WRITE_ONLY, numPartials * sizeof(cl_uint), NULL, &clErr);
+	OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+
+	cl_event transferEvent = NULL;
+	clErr = clEnqueueWriteBuffer(worker.cmdQ, gThresholdsBuff, CL_TRUE, 0, thresholdsSize, pThresholds, 0, NULL,
+								 GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+	RecordCommand(worker, transferEvent, stats, SCleanNoiseStats::UPLOAD, "write", thresholdsSize);
+
+	cl_event kernelEvent = NULL;
+	cl_kernel kernel = worker.kernels[MAT_THRESH_METRICS_KERNEL];
+	unsigned int numThresholdsArg = numThresholds;
+	unsigned int isSoft = isSoftThresh ? 1 : 0;
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), &coefs.gCoefsBuff);
+	clSetKernelArg(kernel, 1, sizeof(cl_mem), &gThresholdsBuff);
+	clSetKernelArg(kernel, 2, sizeof(unsigned int), &numThresholdsArg);
+	clSetKernelArg(kernel, 3, sizeof(unsigned int), &isSoft);
+	clSetKernelArg(kernel, 4, sizeof(unsigned int), &dataLen);
+	clSetKernelArg(kernel, 5, localWorkItems * sizeof(cl_float), NULL);
+	clSetKernelArg(kernel, 6, localWorkItems * sizeof(cl_uint), NULL);
+	clSetKernelArg(kernel, 7, sizeof(cl_mem), &gGroupErrBuff);
+	clSetKernelArg(kernel, 8, sizeof(cl_mem), &gGroupZerosBuff);
+	clErr = clEnqueueNDRangeKernel(worker.cmdQ, kernel, 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing threshold metrics kernel");
+	RecordCommand(worker, kernelEvent, stats, SCleanNoiseStats::THRESHOLD, KERNEL_NAMES[MAT_THRESH_METRICS_KERNEL]);
+
+	std::vector<float> groupErr(numPartials);
+	std::vector<cl_uint> groupZeros(numPartials);
+	clErr = clEnqueueReadBuffer(worker.cmdQ, gGroupErrBuff, CL_TRUE, 0, numPartials * sizeof(float), &groupErr[0], 0, NULL,
+								GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "reading data from device");
+	RecordCommand(worker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", numPartials * sizeof(float));
+	clErr = clEnqueueReadBuffer(worker.cmdQ, gGroupZerosBuff, CL_TRUE, 0, numPartials * sizeof(cl_uint), &groupZeros[0], 0, NULL,
+								GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "reading data from device");
+	RecordCommand(worker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", numPartials * sizeof(cl_uint));
+
+	clReleaseMemObject(gThresholdsBuff);
+	clReleaseMemObject(gGroupErrBuff);
+	clReleaseMemObject(gGroupZerosBuff);
+
+	// The coefficients are in gray levels divided by 255
+	for (int t = 0; t < numThresholds; t++)
+	{
+		double sumSqErr = 0.0;
+		double numZeros = 0.0;
+		for (size_t g = 0; g < numGroups; g++)
+		{
+			sumSqErr += groupErr[g*numThresholds + t];
+			numZeros += groupZeros[g*numThresholds + t];
+		}
+		SThresholdMetrics& metrics = pMetrics[t];
+		metrics.thresh = pThresholds[t];
+		metrics.sparsity = numZeros / dataLen;
+		metrics.mse = sumSqErr * 255.0 * 255.0 / dataLen;
+		metrics.psnrDb = (metrics.mse > 0.0) ? 10.0 * log10(255.0 * 255.0 / metrics.mse) : HUGE_VAL;
+	}
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::EvaluateNeighThresholdsGPU(SWorker& worker, const SCoefficients& coefs, const float* pThresholds, int numThresholds,
+											   SThresholdMetrics* pMetrics, SCleanNoiseStats& stats)
+{
+	// The shrink of a coefficient depends on those around it, so every threshold goes through the
+	// thresholding of 'Reconstruct' into the scratch and the metrics kernel of 'CleanNoiseBatch'
+	bool isInPlace = false;
+	size_t buffLen, outBuffLen, partialBuffLen;
+	GetWorkspaceLens(coefs.width, coefs.height, 1, isInPlace, buffLen, outBuffLen, partialBuffLen, coefs.isNonStandard);
+	ReserveWorkspace(worker, buffLen, outBuffLen, partialBuffLen);
+
+	bool bResult = true;
+	worker.isMetricsRequested = true;
+	for (int t = 0; t < numThresholds; t++)
+	{
+		bResult = ThresholdCoefsGPU(worker, coefs.gCoefsBuff, worker.gInBuff, 1, coefs.width, coefs.height, coefs.isNonStandard,
+									pThresholds[t], false, stats);
+		clFinish(worker.cmdQ);
+		if (!bResult)
+			break;
+
+		SCleanNoiseMetrics frameMetrics;
+		FinishMetrics(worker, 1, coefs.width, coefs.height, coefs.isNonStandard, &frameMetrics);
+		SThresholdMetrics& metrics = pMetrics[t];
+		metrics.thresh = pThresholds[t];
+		metrics.sparsity = frameMetrics.sparsity;
+		metrics.mse = frameMetrics.mse;
+		metrics.psnrDb = frameMetrics.psnrDb;
+	}
+	worker.isMetricsRequested = false;
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::CompactCoefficients(SCoefficients* pCoefs, float thresh, bool isSoftThresh, SSparseCoefficients* pSparse,
+									   SCleanNoiseStats* pStats /*= NULL*/)
+{
+	if (pCoefs == NULL || pSparse == NULL)
+		return 1;
+
+	SCleanNoiseStats stats;
+	stats.isProfiled = m_oclEnv.m_isProfilingEnabled;
+	cl_ulong callStartTime = OpenCLEnv::GetHostTime();
+	SWorker* pWorker = AcquireWorker();
+
+	// Every work-item covers SPARSE_ITEMS consecutive coefficients
+	unsigned int dataLen = pCoefs->width*pCoefs->height;
+	size_t localWorkItems = GetThreshWorkGroupSize();
+	unsigned int numGroups = (unsigned int)((dataLen - 1) / (localWorkItems * SPARSE_ITEMS) + 1);
+	size_t globalWorkItems = numGroups*localWorkItems;
+	cl_mem gSrcBuff = pCoefs->gCoefsBuff;
+	unsigned int isSoft = isSoftThresh ? 1 : 0;
+
+	// The neighbourhood thresholding of 'Reconstruct' goes to the scratch first, and only its
+	// nonzero coefficients are compacted
+	if (m_neighWindowSize != 0)
+	{
+		bool isInPlace = false;
+		size_t buffLen, outBuffLen, partialBuffLen;
+		GetWorkspaceLens(pCoefs->width, pCoefs->height, 1, isInPlace, buffLen, outBuffLen, partialBuffLen, pCoefs->isNonStandard);
+		ReserveWorkspace(*pWorker, buffLen, outBuffLen, partialBuffLen);
+		if (!ThresholdCoefsGPU(*pWorker, pCoefs->gCoefsBuff, pWorker->gInBuff, 1, pCoefs->width, pCoefs->height, pCoefs->isNonStandard,
+							   thresh, false, stats))
+		{
+			clFinish(pWorker->cmdQ);
+			ReleaseWorker(pWorker);
+			return 1;
+		}
+		gSrcBuff = pWorker->gInBuff;
+		thresh = 0.f;
+		isSoft = 0;
+	}
+
+	cl_int clErr;
+	cl_mem gGroupCountsBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, numGroups * sizeof(cl_uint), NULL, &clErr);
+	OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+	cl_mem gGroupOffsetsBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, (numGroups + 1) * sizeof(cl_uint), NULL, &clErr);
+	OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+
+	// ---------------------------------------------------------------------------------------
+	// Count the coefficients which survive the threshold in every block and turn the counts
+	// into the offsets of the blocks in the output
+	// ---------------------------------------------------------------------------------------
+	cl_event kernelEvent = NULL;
+	cl_kernel kernel = pWorker->kernels[SPARSE_COUNT_KERNEL];
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), &gSrcBuff);
+	clSetKernelArg(kernel, 1, sizeof(float), &thresh);
+	clSetKernelArg(kernel, 2, sizeof(unsigned int), &isSoft);
+	clSetKernelArg(kernel, 3, sizeof(unsigned int), &dataLen);
+	clSetKernelArg(kernel, 4, localWorkItems * sizeof(cl_uint), NULL);
+	clSetKernelArg(kernel, 5, sizeof(cl_mem), &gGroupCountsBuff);
+	clErr = clEnqueueNDRangeKernel(pWorker->cmdQ, kernel, 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing sparse count kernel");
+	RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::THRESHOLD, KERNEL_NAMES[SPARSE_COUNT_KERNEL]);
+
+	kernel = pWorker->kernels[SPARSE_SCAN_KERNEL];
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), &gGroupCountsBuff);
+	clSetKernelArg(kernel, 1, sizeof(unsigned int), &numGroups);
+	clSetKernelArg(kernel, 2, localWorkItems * sizeof(cl_uint), NULL);
+	clSetKernelArg(kernel, 3, sizeof(cl_mem), &gGroupOffsetsBuff);
+	clErr = clEnqueueNDRangeKernel(pWorker->cmdQ, kernel, 1, NULL, &localWorkItems, &localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing sparse scan kernel");
+	RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::THRESHOLD, KERNEL_NAMES[SPARSE_SCAN_KERNEL]);
+
+	cl_uint numPairs = 0;
+	cl_event transferEvent = NULL;
+	clErr = clEnqueueReadBuffer(pWorker->cmdQ, gGroupOffsetsBuff, CL_TRUE, numGroups * sizeof(cl_uint), sizeof(cl_uint), &numPairs,
+								0, NULL, GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "reading data from device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", sizeof(cl_uint));
+
+	pSparse->width = pCoefs->width;
+	pSparse->height = pCoefs->height;
+	pSparse->isNonStandard = pCoefs->isNonStandard;
+	pSparse->indices.resize(numPairs);
+	pSparse->values.resize(numPairs);
+
+	// ---------------------------------------------------------------------------------------
+	// Write the pairs of every block from its offset on, and read back only those
+	// ---------------------------------------------------------------------------------------
+	if (numPairs > 0)
+	{
+		cl_mem gIndicesBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_WRITE_ONLY, numPairs * sizeof(cl_uint), NULL, &clErr);
+		OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+		cl_mem gValuesBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_WRITE_ONLY, numPairs * sizeof(float), NULL, &clErr);
+		OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+
+		kernel = pWorker->kernels[SPARSE_COMPACT_KERNEL];
+		clSetKernelArg(kernel, 0, sizeof(cl_mem), &gSrcBuff);
+		clSetKernelArg(kernel, 1, sizeof(float), &thresh);
+		clSetKernelArg(kernel, 2, sizeof(unsigned int), &isSoft);
+		clSetKernelArg(kernel, 3, sizeof(unsigned int), &dataLen);
+		clSetKernelArg(kernel, 4, sizeof(cl_mem), &gGroupOffsetsBuff);
+		clSetKernelArg(kernel, 5, localWorkItems * sizeof(cl_uint), NULL);
+		clSetKernelArg(kernel, 6, sizeof(cl_mem), &gIndicesBuff);
+		clSetKernelArg(kernel, 7, sizeof(cl_mem), &gValuesBuff);
+		clErr = clEnqueueNDRangeKernel(pWorker->cmdQ, kernel, 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL,
+									   GetEventSlot(&kernelEvent));
+		OpenCLEnv::CheckForError(clErr, "enqueuing sparse compact kernel");
+		RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::THRESHOLD, KERNEL_NAMES[SPARSE_COMPACT_KERNEL]);
+
+		clErr = clEnqueueReadBuffer(pWorker->cmdQ, gIndicesBuff, CL_TRUE, 0, numPairs * sizeof(cl_uint), &pSparse->indices[0], 0, NULL,
+									GetEventSlot(&transferEvent));
+		OpenCLEnv::CheckForError(clErr, "reading data from device");
+		RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", numPairs * sizeof(cl_uint));
+		clErr = clEnqueueReadBuffer(pWorker->cmdQ, gValuesBuff, CL_TRUE, 0, numPairs * sizeof(float), &pSparse->values[0], 0, NULL,
+									GetEventSlot(&transferEvent));
+		OpenCLEnv::CheckForError(clErr, "reading data from device");
+		RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", numPairs * sizeof(float));
+
+		clReleaseMemObject(gIndicesBuff);
+		clReleaseMemObject(gValuesBuff);
+	}
+	ReleaseWorker(pWorker);
+
+	clReleaseMemObject(gGroupCountsBuff);
+	clReleaseMemObject(gGroupOffsetsBuff);
+
+	stats.totalTime = OpenCLEnv::GetHostTime() - callStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("CompactCoefficients", callStartTime, callStartTime + stats.totalTime);
+	if (pStats)
+		*pStats = stats;
+	if (m_pStatsCollector)
+		m_pStatsCollector->Add(stats);
+
+	return 0;
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::ReconstructSparse(const SSparseCoefficients* pSparse, unsigned char* out, SCleanNoiseStats* pStats /*= NULL*/)
+{
+	unsigned int numLevels = 0;
+	if (pSparse == NULL || pSparse->width <= 0 || pSparse->height <= 0 || !CNoiseCleaner::GetNumLevels(pSparse->width, numLevels) ||
+		!CNoiseCleaner::GetNumLevels(pSparse->height, numLevels) || pSparse->indices.size() != pSparse->values.size() ||
+		(pSparse->isNonStandard && (pSparse->width == 1 || pSparse->height == 1)))
+		return 1;
+
+	int width = pSparse->width;
+	int height = pSparse->height;
+	unsigned int frameLen = width*height;
+	cl_uint numPairs = (cl_uint)pSparse->indices.size();
+	for (cl_uint i = 0; i < numPairs; i++)
+	{
+		if (pSparse->indices[i] >= frameLen)
+			return 1;
+	}
+
+	SCleanNoiseStats stats;
+	stats.isProfiled = m_oclEnv.m_isProfilingEnabled;
+	cl_ulong callStartTime = OpenCLEnv::GetHostTime();
+
+	unsigned int gBuffSize = frameLen * (unsigned int)m_coefSize;
+	SWorker* pWorker = AcquireWorker();
+	bool isInPlace = false;
+	size_t buffLen, outBuffLen, partialBuffLen;
+	GetWorkspaceLens(width, height, 1, isInPlace, buffLen, outBuffLen, partialBuffLen, pSparse->isNonStandard);
+	ReserveWorkspace(*pWorker, buffLen, outBuffLen, partialBuffLen);
+
+	// ---------------------------------------------------------------------------------------
+	// Scatter the pairs into a zeroed matrix, which takes the place of the thresholded one
+	// ---------------------------------------------------------------------------------------
+	cl_int clErr;
+	cl_event kernelEvent = NULL;
+	cl_uchar zero = 0;
+	clErr = clEnqueueFillBuffer(pWorker->cmdQ, pWorker->gInBuff, &zero, sizeof(zero), 0, gBuffSize, 0, NULL, GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing buffer fill");
+	RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::UPLOAD, "fill");
+
+	cl_mem gIndicesBuff = NULL;
+	cl_mem gValuesBuff = NULL;
+	if (numPairs > 0)
+	{
+		gIndicesBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_ONLY, numPairs * sizeof(cl_uint), NULL, &clErr);
+		OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+		gValuesBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_ONLY, numPairs * sizeof(float), NULL, &clErr);
+		OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+
+		cl_event transferEvent = NULL;
+		clErr = clEnqueueWriteBuffer(pWorker->cmdQ, gIndicesBuff, CL_FALSE, 0, numPairs * sizeof(cl_uint), &pSparse->indices[0], 0, NULL,
+									 GetEventSlot(&transferEvent));
+		OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+		RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::UPLOAD, "write", numPairs * sizeof(cl_uint));
+		clErr = clEnqueueWriteBuffer(pWorker->cmdQ, gValuesBuff, CL_FALSE, 0, numPairs * sizeof(float), &pSparse->values[0], 0, NULL,
+									 GetEventSlot(&transferEvent));
+		OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+		RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::UPLOAD, "write", numPairs * sizeof(float));
+
+		cl_kernel kernel = pWorker->kernels[SPARSE_SCATTER_KERNEL];
+		clSetKernelArg(kernel, 0, sizeof(cl_mem), &gIndicesBuff);
+		clSetKernelArg(kernel, 1, sizeof(cl_mem), &gValuesBuff);
+		clSetKernelArg(kernel, 2, sizeof(unsigned int), &numPairs);
+		clSetKernelArg(kernel, 3, sizeof(cl_mem), &pWorker->gInBuff);
+		size_t localWorkItems = GetThreshWorkGroupSize();
+		size_t globalWorkItems = ((numPairs - 1) / localWorkItems + 1) * localWorkItems;
+		clErr = clEnqueueNDRangeKernel(pWorker->cmdQ, kernel, 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL,
+									   GetEventSlot(&kernelEvent));
+		OpenCLEnv::CheckForError(clErr, "enqueuing sparse scatter kernel");
+		RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::THRESHOLD, KERNEL_NAMES[SPARSE_SCATTER_KERNEL]);
+	}
+
+	bool bResult;
+	if (pSparse->isNonStandard)
+		bResult = InverseNonStandardGPU(*pWorker, pWorker->gInBuff, pWorker->gOutBuff, 1, width, height, stats);
+	else
+		bResult = InverseThresholded2DGPU(*pWorker, 1, width, height, stats);
+	if (bResult)
+	{
+		cl_event transferEvent = NULL;
+		clErr = clEnqueueReadBuffer(pWorker->cmdQ, pWorker->gOutBuff, CL_TRUE, 0, gBuffSize, pWorker->pHostBuff, 0, NULL,
+									GetEventSlot(&transferEvent));
+		OpenCLEnv::CheckForError(clErr, "reading data from device");
+		RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", gBuffSize);
+
+		cl_ulong hostStartTime = OpenCLEnv::GetHostTime();
+		ConvertFromCoefs(pWorker->pHostBuff, 0, frameLen, out);
+		stats.hostTime += OpenCLEnv::GetHostTime() - hostStartTime;
+	}
+	else
+		clFinish(pWorker->cmdQ);
+	ReleaseWorker(pWorker);
+
+	if (gIndicesBuff != NULL)
+	{
+		clReleaseMemObject(gIndicesBuff);
+		clReleaseMemObject(gValuesBuff);
+	}
+	if (!bResult)
+		return 1;
+
+	stats.totalTime = OpenCLEnv::GetHostTime() - callStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("ReconstructSparse", callStartTime, callStartTime + stats.totalTime);
+	if (pStats)
+		*pStats = stats;
+	if (m_pStatsCollector)
+		m_pStatsCollector->Add(stats);
+
+	return 0;
+}
+//-----------------------------------------------------------------------------------------
+int CNoiseCleaner::CleanNoisePatches(const unsigned char* in, unsigned char* out, int width, int height, int patchSize, int step,
+									 float thresh, bool isSoftThresh, SCleanNoiseStats* pStats /*= NULL*/)
+{
+	unsigned int numLevels = 0;
+	if (patchSize < 2 || patchSize > PATCH_MAX_SIZE || !CNoiseCleaner::GetNumLevels(patchSize, numLevels) || step < 1 ||
+		step > patchSize || width < patchSize || height < patchSize)
+		return 1;
+	// A work-group has a work-item per row of the patch
+	if ((size_t)patchSize > m_oclEnv.m_kernelWorkGroupSizes[PATCH_CLEAN_KERNEL])
+		return 1;
+
+	SCleanNoiseStats stats;
+	stats.isProfiled = m_oclEnv.m_isProfilingEnabled;
+	cl_ulong callStartTime = OpenCLEnv::GetHostTime();
+
+	// The pixels are uploaded and read back as bytes. The overlapping patches are summed in
+	// 'gOutBuff' and the output goes to 'gPartialBuff'.
+	unsigned int numPixels = width*height;
+	unsigned int numPatchesX = (width - patchSize + step - 1) / step + 1;
+	unsigned int numPatchesY = (height - patchSize + step - 1) / step + 1;
+	unsigned int isOverlapping = (step != patchSize || width % patchSize != 0 || height % patchSize != 0) ? 1 : 0;
+	size_t byteLen = (numPixels - 1) / m_coefSize + 1;
+	size_t sumLen = isOverlapping ? numPixels * sizeof(cl_int) / m_coefSize : 0;
+	SWorker* pWorker = AcquireWorker();
+	ReserveWorkspace(*pWorker, byteLen, sumLen, byteLen);
+
+	cl_int clErr;
+	cl_event transferEvent = NULL;
+	cl_event kernelEvent = NULL;
+	clErr = clEnqueueWriteBuffer(pWorker->cmdQ, pWorker->gInBuff, CL_FALSE, 0, numPixels, in, 0, NULL, GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::UPLOAD, "write", numPixels);
+	if (isOverlapping)
+	{
+		cl_int zero = 0;
+		clErr = clEnqueueFillBuffer(pWorker->cmdQ, pWorker->gOutBuff, &zero, sizeof(zero), 0, numPixels * sizeof(cl_int), 0, NULL,
+									GetEventSlot(&kernelEvent));
+		OpenCLEnv::CheckForError(clErr, "enqueuing buffer fill");
+		RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::UPLOAD, "fill");
+	}
+
+	// ---------------------------------------------------------------------------------------
+	// One work-group per patch
+	// ---------------------------------------------------------------------------------------
+	unsigned int patchLen = patchSize;
+	unsigned int patchStep = step;
+	unsigned int isSoft = isSoftThresh ? 1 : 0;
+	cl_kernel kernel = pWorker->kernels[PATCH_CLEAN_KERNEL];
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), &pWorker->gInBuff);
+	clSetKernelArg(kernel, 1, sizeof(cl_mem), &pWorker->gPartialBuff);
+	clSetKernelArg(kernel, 2, sizeof(cl_mem), isOverlapping ? &pWorker->gOutBuff : &pWorker->gPartialBuff);
+	clSetKernelArg(kernel, 3, sizeof(unsigned int), &width);
+	clSetKernelArg(kernel, 4, sizeof(unsigned int), &height);
+	clSetKernelArg(kernel, 5, sizeof(unsigned int), &patchLen);
+	clSetKernelArg(kernel, 6, sizeof(unsigned int), &patchStep);
+	clSetKernelArg(kernel, 7, sizeof(float), &thresh);
+	clSetKernelArg(kernel, 8, sizeof(unsigned int), &isSoft);
+	clSetKernelArg(kernel, 9, sizeof(unsigned int), &isOverlapping);
+	clSetKernelArg(kernel, 10, patchSize * (patchSize + 1) * sizeof(cl_float), NULL);
+	size_t globalWorkItems[2] = {numPatchesX*patchSize, numPatchesY};
+	size_t localWorkItems[2] = {(size_t)patchSize, 1};
+	clErr = clEnqueueNDRangeKernel(pWorker->cmdQ, kernel, 2, NULL, globalWorkItems, localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing patch kernel");
+	RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::FWT_ROWS, KERNEL_NAMES[PATCH_CLEAN_KERNEL]);
+
+	// ---------------------------------------------------------------------------------------
+	// Divide the sums by the number of patches covering every pixel
+	// ---------------------------------------------------------------------------------------
+	if (isOverlapping)
+	{
+		kernel = pWorker->kernels[PATCH_NORMALIZE_KERNEL];
+		clSetKernelArg(kernel, 0, sizeof(cl_mem), &pWorker->gOutBuff);
+		clSetKernelArg(kernel, 1, sizeof(cl_mem), &pWorker->gPartialBuff);
+		clSetKernelArg(kernel, 2, sizeof(unsigned int), &width);
+		clSetKernelArg(kernel, 3, sizeof(unsigned int), &height);
+		clSetKernelArg(kernel, 4, sizeof(unsigned int), &patchLen);
+		clSetKernelArg(kernel, 5, sizeof(unsigned int), &patchStep);
+		clSetKernelArg(kernel, 6, sizeof(unsigned int), &numPatchesX);
+		clSetKernelArg(kernel, 7, sizeof(unsigned int), &numPatchesY);
+		size_t normLocalWorkItems = GetThreshWorkGroupSize();
+		size_t normGlobalWorkItems = ((numPixels - 1) / normLocalWorkItems + 1) * normLocalWorkItems;
+		clErr = clEnqueueNDRangeKernel(pWorker->cmdQ, kernel, 1, NULL, &normGlobalWorkItems, &normLocalWorkItems, 0, NULL,
+									   GetEventSlot(&kernelEvent));
+		OpenCLEnv::CheckForError(clErr, "enqueuing patch normalize kernel");
+		RecordCommand(*pWorker, kernelEvent, stats, SCleanNoiseStats::IWT_ROWS, KERNEL_NAMES[PATCH_NORMALIZE_KERNEL]);
+	}
+
+	clErr = clEnqueueReadBuffer(pWorker->cmdQ, pWorker->gPartialBuff, CL_TRUE, 0, numPixels, out, 0, NULL, GetEventSlot(&transferEvent));
+	OpenCLEnv::CheckForError(clErr, "reading data from device");
+	RecordCommand(*pWorker, transferEvent, stats, SCleanNoiseStats::DOWNLOAD, "read", numPixels);
+	ReleaseWorker(pWorker);
+
+	stats.totalTime = OpenCLEnv::GetHostTime() - callStartTime;
+	if (m_pTracer)
+		m_pTracer->AddHostSpan("CleanNoisePatches", callStartTime, callStartTime + stats.totalTime);
+	if (pStats)
+		*pStats = stats;
+	if (m_pStatsCollector)
+		m_pStatsCollector->Add(stats);
+
+	return 0;
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::ConvertToCoefs(const unsigned char* in, float* pHostBuff, unsigned int offset, unsigned int len) const
+{
+	if (m_isHalfPrecision)
+	{
+		cl_half halfLevels[256];
+		for (int i = 0; i < 256; i++)
+			halfLevels[i] = OpenCLEnv::FloatToHalf((float)i / 255.f);
+		cl_half* pHalves = (cl_half*)pHostBuff + offset;
+		for (unsigned int i = 0; i < len; i++)
+			pHalves[i] = halfLevels[in[i]];
+		return;
+	}
+	float* pFloats = pHostBuff + offset;
+	for (unsigned int i = 0; i < len; i++)
+		pFloats[i] = (float)in[i] / 255.f;
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::ConvertFromCoefs(const float* pHostBuff, unsigned int offset, unsigned int len, unsigned char* out) const
+{
+	if (m_isHalfPrecision)
+	{
+		const cl_half* pHalves = (const cl_half*)pHostBuff + offset;
+		for (unsigned int i = 0; i < len; i++)
+			out[i] = (char)(OpenCLEnv::HalfToFloat(pHalves[i]) * 255.f);
+		return;
+	}
+	const float* pFloats = pHostBuff + offset;
+	for (unsigned int i = 0; i < len; i++)
+		out[i] = (char)(pFloats[i] * 255.f);
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::CleanNoiseGPU(SWorker& worker, int numFrames, int width, int height, float thresh, bool isSoftThresh,
+								  SCleanNoiseStats& stats)
+{
+	if (IsNonStandardUsed(width, height))
+	{
+		bool bResult = ForwardNonStandardGPU(worker, worker.gInBuff, worker.gOutBuff, numFrames, width, height, stats);
+		bResult = bResult && ThresholdCoefsGPU(worker, worker.gOutBuff, worker.gInBuff, numFrames, width, height, true, thresh,
+											   isSoftThresh, stats);
+		return bResult && InverseNonStandardGPU(worker, worker.gInBuff, worker.gOutBuff, numFrames, width, height, stats);
+	}
+
+	bool bResult = ForwardTransform2DGPU(worker, worker.gInBuff, worker.gOutBuff, numFrames, width, height, stats);
+	return bResult && InverseTransform2DGPU(worker, worker.gOutBuff, numFrames, width, height, thresh, isSoftThresh, stats);
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::ForwardTransform2DGPU(SWorker& worker, cl_mem gSrcBuff, cl_mem gCoefsBuff, int numFrames, int width, int height,
+										  SCleanNoiseStats& stats)
+{
+	unsigned int numLevelsWidth = 0;
+	unsigned int numLevelsHeight = 0;
+	CNoiseCleaner::GetNumLevels(width, numLevelsWidth);
+	CNoiseCleaner::GetNumLevels(height, numLevelsHeight);
+	cl_mem gInBuff = worker.gInBuff;
+	cl_mem gOutBuff = worker.gOutBuff;
+	cl_mem gPartialBuff = worker.gPartialBuff;
+
+	// -------------------------------------------------------------------------------------
+	// Invoke ForwardHaarTransformGPU on all the rows in the matrix simultaneously (which works on 1D buffers)
+	// -------------------------------------------------------------------------------------
+	bool bResult = ForwardHaarTransformGPU(worker, gSrcBuff, gOutBuff, gPartialBuff, height*numFrames, numLevelsWidth, width, 0, 0,
+										   stats, SCleanNoiseStats::FWT_ROWS);
+
+	// ---------------------------------------------------------------------------------------
+	// Transpose the matrix by invoking a kernel which will transpose the matrix on the device
+	// w/o bringing it back to the host memory
+	// ---------------------------------------------------------------------------------------
+	bResult = bResult && TransposeMatrixGPU(worker, gOutBuff, gInBuff, width, height, numFrames, stats, SCleanNoiseStats::TRANSPOSE_ROWS);
+
+	// -----------------------------------------------------------------------------------------------------
+	// For all of the rows in the transposed matrix (i.e. column in the original one) invoke ForwardHaarTransformGPU
+	// -----------------------------------------------------------------------------------------------------
+	bResult = bResult && ForwardHaarTransformGPU(worker, gInBuff, gCoefsBuff, gPartialBuff, width*numFrames, numLevelsHeight, height, 0, 0,
+												 stats, SCleanNoiseStats::FWT_COLS);
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::InverseTransform2DGPU(SWorker& worker, cl_mem gCoefsBuff, int numFrames, int width, int height, float thresh,
+										  bool isSoftThresh, SCleanNoiseStats& stats)
+{
+	// -----------------------------------------------------------------
+	// Apply threshold on the results of the Forward Haar Transform
+	// -----------------------------------------------------------------
+	bool bResult = ThresholdCoefsGPU(worker, gCoefsBuff, worker.gInBuff, numFrames, width, height, false, thresh, isSoftThresh, stats);
+
+	return bResult && InverseThresholded2DGPU(worker, numFrames, width, height, stats);
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::InverseThresholded2DGPU(SWorker& worker, int numFrames, int width, int height, SCleanNoiseStats& stats)
+{
+	unsigned int numLevelsWidth = 0;
+	unsigned int numLevelsHeight = 0;
+	CNoiseCleaner::GetNumLevels(width, numLevelsWidth);
+	CNoiseCleaner::GetNumLevels(height, numLevelsHeight);
+	cl_mem gInBuff = worker.gInBuff;
+	cl_mem gOutBuff = worker.gOutBuff;
+	cl_mem gPartialBuff = worker.gPartialBuff;
+
+	// ------------------------------------------------------------------------------------------------------
+	// For all of the rows in the transposed matrix (i.e. column in the original one) invoke InverseHaarTransformGPU
+	// ------------------------------------------------------------------------------------------------------
+	bool bResult = InverseHaarTransformGPU(worker, gInBuff, gOutBuff, gPartialBuff, width*numFrames, numLevelsHeight, height, 0, 0,
+										   stats, SCleanNoiseStats::IWT_COLS);
+
+	// ---------------------------------------------------------------------------------------
+	// Transpose the matrix by invoking a kernel which will transpose the matrix on the device
+	// w/o bringing it back to the host memory
+	// ---------------------------------------------------------------------------------------
+	bResult = bResult && TransposeMatrixGPU(worker, gOutBuff, gInBuff, height, width, numFrames, stats, SCleanNoiseStats::TRANSPOSE_COLS);
+
+	// -----------------------------------------------------------------
+	// Invoke InverseHaarTransformGPU for all the rows simltaneously
+	// -----------------------------------------------------------------
+	bResult = bResult && InverseHaarTransformGPU(worker, gInBuff, gOutBuff, gPartialBuff, height*numFrames, numLevelsWidth, width, 0, 0,
+												 stats, SCleanNoiseStats::IWT_ROWS);
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::GetNonStandardLaunches(int kernelIdx, int width, int height, std::vector<SNonStandardLaunch>& launches) const
+{
+	// The work-groups are square, with a 2x2 block of the first level for every work-item
+	unsigned int log2WorkGroupSize = 0;
+	CNoiseCleaner::GetNumLevels((unsigned int)m_oclEnv.m_kernelWorkGroupSizes[kernelIdx], log2WorkGroupSize);
+	unsigned int maxTileSize = 2 << (log2WorkGroupSize / 2);
+	if (maxTileSize > NS_MAX_TILE_SIZE)
+		maxTileSize = NS_MAX_TILE_SIZE;
+
+	unsigned int numLevelsWidth = 0;
+	unsigned int numLevelsHeight = 0;
+	CNoiseCleaner::GetNumLevels(width, numLevelsWidth);
+	CNoiseCleaner::GetNumLevels(height, numLevelsHeight);
+	unsigned int remainingLevels = numLevelsWidth < numLevelsHeight ? numLevelsWidth : numLevelsHeight;
+
+	launches.clear();
+	SNonStandardLaunch launch;
+	launch.width = width;
+	launch.height = height;
+	while (remainingLevels > 0)
+	{
+		launch.tileWidth = launch.width < maxTileSize ? launch.width : maxTileSize;
+		launch.tileHeight = launch.height < maxTileSize ? launch.height : maxTileSize;
+		unsigned int tileLevelsWidth = 0;
+		unsigned int tileLevelsHeight = 0;
+		CNoiseCleaner::GetNumLevels(launch.tileWidth, tileLevelsWidth);
+		CNoiseCleaner::GetNumLevels(launch.tileHeight, tileLevelsHeight);
+		launch.levels = tileLevelsWidth < tileLevelsHeight ? tileLevelsWidth : tileLevelsHeight;
+		if (launch.levels > remainingLevels)
+			launch.levels = remainingLevels;
+		launches.push_back(launch);
+
+		launch.width >>= launch.levels;
+		launch.height >>= launch.levels;
+		remainingLevels -= launch.levels;
+	}
+}
+//-----------------------------------------------------------------------------------------
+size_t CNoiseCleaner::GetNonStandardPartialLen(int width, int height, int numFrames) const
+{
+	// The approximations between the launches alternate between the two halves, the first one
+	// holds the largest, which the second launch starts from
+	size_t partialBuffLen = 0;
+	for (int kernelIdx = NS_FWT_TILE_KERNEL; kernelIdx <= NS_IWT_TILE_KERNEL; kernelIdx++)
+	{
+		std::vector<SNonStandardLaunch> launches;
+		GetNonStandardLaunches(kernelIdx, width, height, launches);
+		size_t len = 0;
+		for (size_t b = 1; b < launches.size() && b <= 2; b++)
+			len += (size_t)launches[b].width*launches[b].height*numFrames;
+		partialBuffLen = len > partialBuffLen ? len : partialBuffLen;
+	}
+	return partialBuffLen;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::ForwardNonStandardGPU(SWorker& worker, cl_mem gSrcBuff, cl_mem gCoefsBuff, int numFrames, int width, int height,
+										  SCleanNoiseStats& stats)
+{
+	std::vector<SNonStandardLaunch> launches;
+	GetNonStandardLaunches(NS_FWT_TILE_KERNEL, width, height, launches);
+	unsigned int frameLen = width*height;
+	unsigned int halfOffset = (launches.size() > 1) ? launches[1].width*launches[1].height*numFrames : 0;
+	unsigned int pitch = width;
+	cl_kernel kernel = worker.kernels[NS_FWT_TILE_KERNEL];
+
+	for (size_t b = 0; b < launches.size(); b++)
+	{
+		const SNonStandardLaunch& launch = launches[b];
+		bool isFirst = (b == 0);
+		bool isLast = (b + 1 == launches.size());
+
+		// The approximation comes from the frames or the half the previous launch wrote, and what is
+		// left of it goes to the other half, or to its place in the coefficients after the last launch
+		cl_mem gApproxSrcBuff = isFirst ? gSrcBuff : worker.gPartialBuff;
+		unsigned int srcOffset = isFirst ? 0 : (unsigned int)((b - 1) % 2) * halfOffset;
+		unsigned int srcPitch = isFirst ? width : launch.width;
+		unsigned int srcFrameLen = isFirst ? frameLen : launch.width*launch.height;
+		unsigned int approxWidth = launch.width >> launch.levels;
+		unsigned int approxHeight = launch.height >> launch.levels;
+		cl_mem gApproxDstBuff = isLast ? gCoefsBuff : worker.gPartialBuff;
+		unsigned int approxOffset = isLast ? 0 : (unsigned int)(b % 2) * halfOffset;
+		unsigned int approxPitch = isLast ? width : approxWidth;
+		unsigned int approxFrameLen = isLast ? frameLen : approxWidth*approxHeight;
+
+		clSetKernelArg(kernel, 0, sizeof(cl_mem), &gApproxSrcBuff);
+		clSetKernelArg(kernel, 1, sizeof(unsigned int), &srcOffset);
+		clSetKernelArg(kernel, 2, sizeof(unsigned int), &srcPitch);
+		clSetKernelArg(kernel, 3, sizeof(unsigned int), &srcFrameLen);
+		clSetKernelArg(kernel, 4, sizeof(cl_mem), &gCoefsBuff);
+		clSetKernelArg(kernel, 5, sizeof(unsigned int), &pitch);
+		clSetKernelArg(kernel, 6, sizeof(unsigned int), &frameLen);
+		clSetKernelArg(kernel, 7, sizeof(cl_mem), &gApproxDstBuff);
+		clSetKernelArg(kernel, 8, sizeof(unsigned int), &approxOffset);
+		clSetKernelArg(kernel, 9, sizeof(unsigned int), &approxPitch);
+		clSetKernelArg(kernel, 10, sizeof(unsigned int), &approxFrameLen);
+		clSetKernelArg(kernel, 11, sizeof(unsigned int), &launch.levels);
+		clSetKernelArg(kernel, 12, launch.tileWidth * launch.tileHeight * sizeof(float), NULL);
+
+		cl_event kernelEvent = NULL;
+		size_t localWorkItems[3] = {launch.tileWidth / 2, launch.tileHeight / 2, 1};
+		size_t globalWorkItems[3] = {launch.width / 2, launch.height / 2, (size_t)numFrames};
+		cl_int clErr = clEnqueueNDRangeKernel(worker.cmdQ, kernel, 3, NULL, globalWorkItems, localWorkItems, 0, NULL,
+											  GetEventSlot(&kernelEvent));
+		OpenCLEnv::CheckForError(clErr, "enqueuing non-standard FWT kernel");
+		RecordCommand(worker, kernelEvent, stats, SCleanNoiseStats::FWT_ROWS, KERNEL_NAMES[NS_FWT_TILE_KERNEL]);
+	}
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::InverseNonStandardGPU(SWorker& worker, cl_mem gCoefsBuff, cl_mem gDstBuff, int numFrames, int width, int height,
+										  SCleanNoiseStats& stats)
+{
+	std::vector<SNonStandardLaunch> launches;
+	GetNonStandardLaunches(NS_IWT_TILE_KERNEL, width, height, launches);
+	unsigned int frameLen = width*height;
+	unsigned int halfOffset = (launches.size() > 1) ? launches[1].width*launches[1].height*numFrames : 0;
+	unsigned int pitch = width;
+	cl_kernel kernel = worker.kernels[NS_IWT_TILE_KERNEL];
+
+	// The launches run from the coarsest levels to the finest
+	for (size_t b = launches.size(); b-- > 0; )
+	{
+		const SNonStandardLaunch& launch = launches[b];
+		bool isFirst = (b == 0);
+		bool isLast = (b + 1 == launches.size());
+
+		unsigned int approxWidth = launch.width >> launch.levels;
+		unsigned int approxHeight = launch.height >> launch.levels;
+		cl_mem gApproxBuff = isLast ? gCoefsBuff : worker.gPartialBuff;
+		unsigned int approxOffset = isLast ? 0 : (unsigned int)(b % 2) * halfOffset;
+		unsigned int approxPitch = isLast ? width : approxWidth;
+		unsigned int approxFrameLen = isLast ? frameLen : approxWidth*approxHeight;
+		cl_mem gApproxDstBuff = isFirst ? gDstBuff : worker.gPartialBuff;
+		unsigned int dstOffset = isFirst ? 0 : (unsigned int)((b - 1) % 2) * halfOffset;
+		unsigned int dstPitch = isFirst ? width : launch.width;
+		unsigned int dstFrameLen = isFirst ? frameLen : launch.width*launch.height;
+
+		clSetKernelArg(kernel, 0, sizeof(cl_mem), &gApproxBuff);
+		clSetKernelArg(kernel, 1, sizeof(unsigned int), &approxOffset);
+		clSetKernelArg(kernel, 2, sizeof(unsigned int), &approxPitch);
+		clSetKernelArg(kernel, 3, sizeof(unsigned int), &approxFrameLen);
+		clSetKernelArg(kernel, 4, sizeof(cl_mem), &gCoefsBuff);
+		clSetKernelArg(kernel, 5, sizeof(unsigned int), &pitch);
+		clSetKernelArg(kernel, 6, sizeof(unsigned int), &frameLen);
+		clSetKernelArg(kernel, 7, sizeof(cl_mem), &gApproxDstBuff);
+		clSetKernelArg(kernel, 8, sizeof(unsigned int), &dstOffset);
+		clSetKernelArg(kernel, 9, sizeof(unsigned int), &dstPitch);
+		clSetKernelArg(kernel, 10, sizeof(unsigned int), &dstFrameLen);
+		clSetKernelArg(kernel, 11, sizeof(unsigned int), &launch.levels);
+		clSetKernelArg(kernel, 12, launch.tileWidth * launch.tileHeight * sizeof(float), NULL);
+
+		cl_event kernelEvent = NULL;
+		size_t localWorkItems[3] = {launch.tileWidth / 2, launch.tileHeight / 2, 1};
+		size_t globalWorkItems[3] = {launch.width / 2, launch.height / 2, (size_t)numFrames};
+		cl_int clErr = clEnqueueNDRangeKernel(worker.cmdQ, kernel, 3, NULL, globalWorkItems, localWorkItems, 0, NULL,
+											  GetEventSlot(&kernelEvent));
+		OpenCLEnv::CheckForError(clErr, "enqueuing non-standard IWT kernel");
+		RecordCommand(worker, kernelEvent, stats, SCleanNoiseStats::IWT_ROWS, KERNEL_NAMES[NS_IWT_TILE_KERNEL]);
+	}
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::CleanNoiseInPlaceGPU(SWorker& worker, int numFrames, int width, int height, float thresh, bool isSoftThresh,
+										 SCleanNoiseStats& stats)
+{
+	// The frames are square, so the rows and the columns are transformed the same way
+	unsigned int numLevels = 0;
+	CNoiseCleaner::GetNumLevels(width, numLevels);
+	int numRows = height*numFrames;
+
+	bool bResult = HaarTransformInPlaceGPU(worker, true, numRows, numLevels, width, stats, SCleanNoiseStats::FWT_ROWS);
+	bResult = bResult && TransposeMatrixGPU(worker, worker.gInBuff, worker.gInBuff, width, height, numFrames, stats, SCleanNoiseStats::TRANSPOSE_ROWS);
+	bResult = bResult && HaarTransformInPlaceGPU(worker, true, numRows, numLevels, height, stats, SCleanNoiseStats::FWT_COLS);
+	bResult = bResult && ThresholdCoefsGPU(worker, worker.gInBuff, worker.gInBuff, numFrames, width, height, false, thresh, isSoftThresh, stats);
+	bResult = bResult && HaarTransformInPlaceGPU(worker, false, numRows, numLevels, height, stats, SCleanNoiseStats::IWT_COLS);
+	bResult = bResult && TransposeMatrixGPU(worker, worker.gInBuff, worker.gInBuff, height, width, numFrames, stats, SCleanNoiseStats::TRANSPOSE_COLS);
+	bResult = bResult && HaarTransformInPlaceGPU(worker, false, numRows, numLevels, width, stats, SCleanNoiseStats::IWT_ROWS);
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::HaarTransformInPlaceGPU(SWorker& worker, bool isForward, int numRows, unsigned int numLevels, unsigned int dataLen,
+											SCleanNoiseStats& stats, int stage)
+{
+	// A row which one work-group covers is transformed in place
+	unsigned int maxLevelsOnDevice = GetLevelsPerPass(isForward ? FWT_KERNEL_IDX : IWT_KERNEL, dataLen);
+	if (numLevels <= maxLevelsOnDevice)
+	{
+		if (isForward)
+			return ForwardHaarTransformGPU(worker, worker.gInBuff, worker.gInBuff, worker.gPartialBuff, numRows, numLevels, dataLen, 0, 0, stats, stage);
+		return InverseHaarTransformGPU(worker, worker.gInBuff, worker.gInBuff, worker.gPartialBuff, numRows, numLevels, dataLen, 0, 0, stats, stage);
+	}
+
+	// -------------------------------------------------------------------------------------
+	// Longer rows take several passes whose work-groups overwrite each other's input, so they
+	// are transformed into the scratch in 'gOutBuff' a chunk of rows at a time and copied back
+	// -------------------------------------------------------------------------------------
+	int chunkRows = GetInPlaceChunkRows(dataLen, numRows);
+	bool bResult = true;
+	for (int firstRow = 0; firstRow < numRows && bResult; firstRow += chunkRows)
+	{
+		int currRows = (numRows - firstRow < chunkRows) ? numRows - firstRow : chunkRows;
+		unsigned int offset = firstRow*dataLen;
+		if (isForward)
+			bResult = ForwardHaarTransformGPU(worker, worker.gInBuff, worker.gOutBuff, worker.gPartialBuff, currRows, numLevels, dataLen, offset, 0, stats, stage);
+		else
+			bResult = InverseHaarTransformGPU(worker, worker.gInBuff, worker.gOutBuff, worker.gPartialBuff, currRows, numLevels, dataLen, offset, 0, stats, stage);
+
+		cl_event copyEvent = NULL;
+		size_t chunkSize = currRows*dataLen*m_coefSize;
+		cl_int clErr = clEnqueueCopyBuffer(worker.cmdQ, worker.gOutBuff, worker.gInBuff, 0, offset*m_coefSize, chunkSize, 0, NULL,
+										   GetEventSlot(&copyEvent));
+		OpenCLEnv::CheckForError(clErr, "enqueuing buffer copy");
+		RecordCommand(worker, copyEvent, stats, stage, "copy", chunkSize);
+	}
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::PerformSelfTest()
+{
+	bool result1 = TestHaarTransformGPU();
+	bool result2 = TestMatTransposeGPU();
+	bool result3 = TestMatThreshGPU();
+	bool result4 = TestConcurrencyGPU();
+	bool result5 = TestInPlaceGPU();
+	bool result6 = TestIntegerGPU();
+	bool result7 = TestIncrementalGPU();
+	bool result8 = TestThresholdSweepGPU();
+	bool result9 = TestSparseGPU();
+	bool result10 = TestNonStandardGPU();
+	bool result11 = TestPatchesGPU();
+	bool result12 = TestHaarTransform2DCPU();
+	bool result13 = TestRegionGPU();
+	bool result14 = TestSignalStreamGPU();
+	bool result15 = TestNeighThreshGPU();
+	bool result16 = TestThumbnailsGPU();
+	bool result17 = TestMetricsGPU();
+
+	return result1 && result2 && result3 && result4 && result5 && result6 && result7 && result8 && result9 && result10 && result11 &&
+		   result12 && result13 && result14 && result15 && result16 && result17;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestMatTransposeGPU()
+{
+	// Sizes which are not multiples of the tile size exercise the edge tiles
+	const int NUM_CASES = 5;
+	const int widths[NUM_CASES] = {512, 37, 512, 45, 16};
+	const int heights[NUM_CASES] = {512, 21, 512, 45, 16};
+	const bool isInPlace[NUM_CASES] = {false, false, true, true, true};
+	SWorker* pWorker = AcquireWorker();
+	bool bResult = true;
+
+	for (int c = 0; c < NUM_CASES && bResult; c++)
+	{
+		int width = widths[c];
+		int height = heights[c];
+		int numElements = width*height;
+		float*		pTempBuff = new float[numElements];
+		float*		pResBuff = new float[numElements];
+		float*		pCorrectBuff = new float[numElements];
+		cl_int      clErr;
+		cl_mem		gInBuff;
+		cl_mem		gOutBuff;
+		SCleanNoiseStats stats;
+
+		// Halves hold the integers up to 2048 exactly
+		int maxValue = m_isHalfPrecision ? 2048 : numElements;
+		int cnt = 0;
+		for (int i = 0; i < height; i++)
+			for (int j = 0; j < width; j++)
+				pTempBuff[i*width + j] = (float)(cnt++ % maxValue);
+
+		cnt = 0;
+		for (int i = 0; i < height; i++)
+			for (int j = 0; j < width; j++)
+				pCorrectBuff[j*height + i] = (float)(cnt++ % maxValue);
+
+		unsigned int gBuffSize = numElements * (unsigned int)m_coefSize;
+		gInBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, gBuffSize, NULL, &clErr);
+		OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+		gOutBuff = isInPlace[c] ? gInBuff : clCreateBuffer(m_oclEnv.m_context, CL_MEM_WRITE_ONLY, gBuffSize, NULL, NULL);
+
+		WriteCoefBuffer(*pWorker, gInBuff, pTempBuff, numElements);
+
+		bResult = TransposeMatrixGPU(*pWorker, gInBuff, gOutBuff, width, height, 1, stats, SCleanNoiseStats::TRANSPOSE_ROWS);
+		OpenCLEnv::PrintProfilingInfo(stats.stageTimes[SCleanNoiseStats::TRANSPOSE_ROWS],
+									  isInPlace[c] ? "Matrix transpose in place" : "Matrix transpose");
+		if (bResult)
+		{
+			ReadCoefBuffer(*pWorker, gOutBuff, pResBuff, numElements);
+			if (!OpenCLEnv::CompareFloatBuffers(pCorrectBuff, pResBuff, numElements))
+				bResult = false;
+		}
+
+		delete[] pTempBuff;
+		delete[] pResBuff;
+		delete[] pCorrectBuff;
+		clReleaseMemObject(gInBuff);
+		if (!isInPlace[c])
+			clReleaseMemObject(gOutBuff);
+	}
+
+	ReleaseWorker(pWorker);
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::MeasureTransposeBandwidth(int width, int height, int numIterations, STransposeBandwidth& result)
+{
+	result.outOfPlaceGBs = 0.0;
+	result.inPlaceGBs = 0.0;
+	result.copyGBs = 0.0;
+	if (!m_oclEnv.m_isProfilingEnabled || width <= 0 || height <= 0 || numIterations <= 0)
+		return false;
+
+	SWorker* pWorker = AcquireWorker();
+	size_t numElements = (size_t)width*height;
+	ReserveWorkspace(*pWorker, numElements, numElements, 1);
+
+	// Every element is read once and written once by all three. The stats are private to this
+	// call, so their stages only serve to keep the three measurements apart.
+	double numBytes = 2.0 * numElements * m_coefSize * numIterations;
+	SCleanNoiseStats stats;
+	for (int i = 0; i < numIterations; i++)
+		TransposeMatrixGPU(*pWorker, pWorker->gInBuff, pWorker->gOutBuff, width, height, 1, stats, SCleanNoiseStats::TRANSPOSE_ROWS);
+	if (width == height)
+	{
+		for (int i = 0; i < numIterations; i++)
+			TransposeMatrixGPU(*pWorker, pWorker->gInBuff, pWorker->gInBuff, width, height, 1, stats, SCleanNoiseStats::TRANSPOSE_COLS);
+	}
+	for (int i = 0; i < numIterations; i++)
+	{
+		cl_event copyEvent = NULL;
+		cl_int clErr = clEnqueueCopyBuffer(pWorker->cmdQ, pWorker->gInBuff, pWorker->gOutBuff, 0, 0, numElements * m_coefSize,
+										   0, NULL, &copyEvent);
+		OpenCLEnv::CheckForError(clErr, "enqueuing buffer copy");
+		RecordCommand(*pWorker, copyEvent, stats, SCleanNoiseStats::THRESHOLD, "copy");
+	}
+	ReleaseWorker(pWorker);
+
+	cl_ulong outOfPlaceTime = stats.stageTimes[SCleanNoiseStats::TRANSPOSE_ROWS];
+	cl_ulong inPlaceTime = stats.stageTimes[SCleanNoiseStats::TRANSPOSE_COLS];
+	cl_ulong copyTime = stats.stageTimes[SCleanNoiseStats::THRESHOLD];
+	result.outOfPlaceGBs = (outOfPlaceTime > 0) ? numBytes / (double)outOfPlaceTime : 0.0;
+	result.inPlaceGBs = (inPlaceTime > 0) ? numBytes / (double)inPlaceTime : 0.0;
+	result.copyGBs = (copyTime > 0) ? numBytes / (double)copyTime : 0.0;
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+cl_ulong CNoiseCleaner::TimeStageGPU(SWorker& worker, int stage, int size, int numIterations)
+{
+	unsigned int numLevels = 0;
+	CNoiseCleaner::GetNumLevels(size, numLevels);
+
+	// The fastest run is the least disturbed by other work on the device
+	cl_ulong bestTime = 0;
+	for (int i = 0; i < numIterations; i++)
+	{
+		SCleanNoiseStats stats;
+		switch (stage)
+		{
+		case SCleanNoiseStats::FWT_ROWS:
+			ForwardHaarTransformGPU(worker, worker.gInBuff, worker.gOutBuff, worker.gPartialBuff, size, numLevels, size, 0, 0, stats, stage);
+			break;
+		case SCleanNoiseStats::IWT_ROWS:
+			InverseHaarTransformGPU(worker, worker.gInBuff, worker.gOutBuff, worker.gPartialBuff, size, numLevels, size, 0, 0, stats, stage);
+			break;
+		case SCleanNoiseStats::THRESHOLD:
+			MatrixThreshGPU(worker, worker.gInBuff, worker.gOutBuff, size*size, 0.1f, stats, stage);
+			break;
+		default:
+			TransposeMatrixGPU(worker, worker.gInBuff, worker.gOutBuff, size, size, 1, stats, stage);
+			break;
+		}
+		if (i == 0 || stats.stageTimes[stage] < bestTime)
+			bestTime = stats.stageTimes[stage];
+	}
+	return bestTime;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::AutoTune(const int* pSizes, int numSizes, int numIterations, const char* pFilename /*= NULL*/)
+{
+	if (!m_oclEnv.m_isProfilingEnabled || pSizes == NULL || numSizes <= 0 || numIterations <= 0)
+		return false;
+
+	int maxSize = 0;
+	for (int i = 0; i < numSizes; i++)
+	{
+		unsigned int numLevels = 0;
+		if (pSizes[i] < 2 || !CNoiseCleaner::GetNumLevels(pSizes[i], numLevels) || numLevels >= STuningParams::MAX_LOG2_LEN)
+			return false;
+		if (pSizes[i] > maxSize)
+			maxSize = pSizes[i];
+	}
+
+	// The timings do not depend on the values, any frame will do
+	SWorker* pWorker = AcquireWorker();
+	size_t numElements = (size_t)maxSize*maxSize;
+	ReserveWorkspace(*pWorker, numElements, numElements, 1);
+	for (size_t i = 0; i < numElements; i++)
+		pWorker->pHostBuff[i] = (float)(i % 251) / 251.f;
+	WriteCoefBuffer(*pWorker, pWorker->gInBuff, pWorker->pHostBuff, numElements);
+
+	// ---------------------------------------------------------------------------------------
+	// The transpose tile and the thresholding work-group are the same for all sizes, so the
+	// candidate with the lowest total time over the sizes wins. Candidates which do not fit
+	// the kernels on this device are skipped (the getters fall back to the defaults for them).
+	// ---------------------------------------------------------------------------------------
+	const int NUM_TILE_SIZES = 3;
+	const unsigned int tileSizes[NUM_TILE_SIZES] = {8, 16, 32};
+	unsigned int bestTileSize = 0;
+	cl_ulong bestTime = 0;
+	for (int i = 0; i < NUM_TILE_SIZES; i++)
+	{
+		m_tuning.transposeTileSize = tileSizes[i];
+		if (GetTransposeTileSize() != tileSizes[i])
+			continue;
+		cl_ulong totalTime = 0;
+		for (int j = 0; j < numSizes; j++)
+			totalTime += TimeStageGPU(*pWorker, SCleanNoiseStats::TRANSPOSE_ROWS, pSizes[j], numIterations);
+		if (bestTileSize == 0 || totalTime < bestTime)
+		{
+			bestTileSize = tileSizes[i];
+			bestTime = totalTime;
+		}
+	}
+	m_tuning.transposeTileSize = bestTileSize;
+
+	const int NUM_THRESH_SIZES = 5;
+	const unsigned int threshSizes[NUM_THRESH_SIZES] = {64, 128, 256, 512, 1024};
+	unsigned int bestThreshSize = 0;
+	for (int i = 0; i < NUM_THRESH_SIZES; i++)
+	{
+		m_tuning.threshWorkGroupSize = threshSizes[i];
+		if (GetThreshWorkGroupSize() != threshSizes[i])
+			continue;
+		cl_ulong totalTime = 0;
+		for (int j = 0; j < numSizes; j++)
+			totalTime += TimeStageGPU(*pWorker, SCleanNoiseStats::THRESHOLD, pSizes[j], numIterations);
+		if (bestThreshSize == 0 || totalTime < bestTime)
+		{
+			bestThreshSize = threshSizes[i];
+			bestTime = totalTime;
+		}
+	}
+	m_tuning.threshWorkGroupSize = bestThreshSize;
+
+	// ---------------------------------------------------------------------------------------
+	// The levels per pass are tuned for every row length. Fewer levels per pass mean smaller
+	// work-groups and more passes, which pays off on devices that run many small work-groups
+	// better than a few large ones. Zero is kept when the most levels win.
+	// ---------------------------------------------------------------------------------------
+	for (int i = 0; i < numSizes; i++)
+	{
+		unsigned int numLevels = 0;
+		CNoiseCleaner::GetNumLevels(pSizes[i], numLevels);
+		for (int dir = 0; dir < 2; dir++)
+		{
+			bool isForward = (dir == 0);
+			unsigned int* pLevelsPerPass = isForward ? m_tuning.fwtLevelsPerPass : m_tuning.iwtLevelsPerPass;
+			int stage = isForward ? SCleanNoiseStats::FWT_ROWS : SCleanNoiseStats::IWT_ROWS;
+			unsigned int maxLevels = GetMaxLevelsOnDevice(isForward ? FWT_KERNEL_IDX : IWT_KERNEL);
+			if (maxLevels > numLevels)
+				maxLevels = numLevels;
+			unsigned int minLevels = (maxLevels > TUNE_LEVELS_RANGE) ? maxLevels - TUNE_LEVELS_RANGE : 1;
+
+			unsigned int bestLevels = 0;
+			for (unsigned int levels = minLevels; levels <= maxLevels; levels++)
+			{
+				pLevelsPerPass[numLevels] = levels;
+				ReserveWorkspace(*pWorker, 0, 0, GetPartialBuffLen(numLevels, pSizes[i], pSizes[i]));
+				cl_ulong time = TimeStageGPU(*pWorker, stage, pSizes[i], numIterations);
+				if (bestLevels == 0 || time < bestTime)
+				{
+					bestLevels = levels;
+					bestTime = time;
+				}
+			}
+			pLevelsPerPass[numLevels] = (bestLevels == maxLevels) ? 0 : bestLevels;
+		}
+	}
+	ReleaseWorker(pWorker);
+
+	return SaveTuning(pFilename);
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::LoadTuning(const char* pFilename /*= NULL*/)
+{
+	FILE* pFile = fopen(pFilename ? pFilename : m_tuningFilename, "r");
+	if (pFile == NULL)
+		return false;
+
+	STuningParams tuning;
+	memset(&tuning, 0, sizeof(tuning));
+	bool isDeviceMatched = false;
+	char line[512];
+	while (fgets(line, sizeof(line), pFile))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		unsigned int log2Len = 0;
+		unsigned int value = 0;
+		if (strncmp(line, "device ", 7) == 0)
+			isDeviceMatched = (strcmp(line + 7, m_oclEnv.m_deviceName) == 0);
+		else if (sscanf(line, "transpose_tile %u", &value) == 1)
+			tuning.transposeTileSize = value;
+		else if (sscanf(line, "thresh_work_group %u", &value) == 1)
+			tuning.threshWorkGroupSize = value;
+		else if (sscanf(line, "fwt_levels %u %u", &log2Len, &value) == 2 && log2Len < STuningParams::MAX_LOG2_LEN)
+			tuning.fwtLevelsPerPass[log2Len] = value;
+		else if (sscanf(line, "iwt_levels %u %u", &log2Len, &value) == 2 && log2Len < STuningParams::MAX_LOG2_LEN)
+			tuning.iwtLevelsPerPass[log2Len] = value;
+	}
+	fclose(pFile);
+
+	if (!isDeviceMatched)
+		return false;
+	m_tuning = tuning;
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::SaveTuning(const char* pFilename /*= NULL*/) const
+{
+	FILE* pFile = fopen(pFilename ? pFilename : m_tuningFilename, "w");
+	if (pFile == NULL)
+		return false;
+
+	// Only the parameters which differ from the defaults are written
+	fprintf(pFile, "device %s\n", m_oclEnv.m_deviceName);
+	if (m_tuning.transposeTileSize > 0)
+		fprintf(pFile, "transpose_tile %u\n", m_tuning.transposeTileSize);
+	if (m_tuning.threshWorkGroupSize > 0)
+		fprintf(pFile, "thresh_work_group %u\n", m_tuning.threshWorkGroupSize);
+	for (unsigned int i = 0; i < STuningParams::MAX_LOG2_LEN; i++)
+	{
+		if (m_tuning.fwtLevelsPerPass[i] > 0)
+			fprintf(pFile, "fwt_levels %u %u\n", i, m_tuning.fwtLevelsPerPass[i]);
+		if (m_tuning.iwtLevelsPerPass[i] > 0)
+			fprintf(pFile, "iwt_levels %u %u\n", i, m_tuning.iwtLevelsPerPass[i]);
+	}
+
+	bool bResult = (ferror(pFile) == 0);
+	fclose(pFile);
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestMatThreshGPU()
+{
+	const int TEMP_BUFF_SIZE = 5;
+	float tempBuff[TEMP_BUFF_SIZE] = {0.f, -1.f, 2.f, -3.f, 4.f};
+	float resBuff[TEMP_BUFF_SIZE];
+	float correctBuff[TEMP_BUFF_SIZE] = {0.f, 0.f, 2.f, -3.f, 4.f};
+	float thresh = 1.f;
+
+	cl_int      clErr;
+	cl_mem		gInBuff;
+	cl_mem		gOutBuff;
+	SCleanNoiseStats stats;
+	SWorker* pWorker = AcquireWorker();
+
+	unsigned int gBuffSize = TEMP_BUFF_SIZE * (unsigned int)m_coefSize;
+	gInBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_ONLY, gBuffSize, NULL, &clErr);
+	OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+	gOutBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_WRITE_ONLY, gBuffSize, NULL, NULL);
+
+	WriteCoefBuffer(*pWorker, gInBuff, tempBuff, TEMP_BUFF_SIZE);
+
+	bool bResult = MatrixThreshGPU(*pWorker, gInBuff, gOutBuff, TEMP_BUFF_SIZE, thresh, stats, SCleanNoiseStats::THRESHOLD);
+	OpenCLEnv::PrintProfilingInfo(stats.stageTimes[SCleanNoiseStats::THRESHOLD], "Matrix thresh");
+	if (bResult)
+	{
+		ReadCoefBuffer(*pWorker, gOutBuff, resBuff, TEMP_BUFF_SIZE);
+		if (!OpenCLEnv::CompareFloatBuffers(correctBuff, resBuff, TEMP_BUFF_SIZE))
+				bResult = false;
+	}
+
+	clReleaseMemObject(gInBuff);
+	clReleaseMemObject(gOutBuff);
+
+	ReleaseWorker(pWorker);
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+struct SStressCase
+{
+	int				width;
+	int				height;
+	bool			isSoftThresh;
+	unsigned char*	pIn;
+	unsigned char*	pRef;		// Output of a single-threaded 'CleanNoise' call
+};
+
+struct SStressArg
+{
+	CNoiseCleaner*	pCleaner;
+	SStressCase*	pCases;
+	int				numCases;
+	int				firstCase;
+	int				numIterations;
+	int				numMismatches;
+};
+
+static void StressThreadFunc(void* pArg)
+{
+	SStressArg* pStressArg = (SStressArg*)pArg;
+	for (int iter = 0; iter < pStressArg->numIterations; iter++)
+	{
+		// Every thread walks the cases in a different order, so different geometries overlap
+		const SStressCase& stressCase = pStressArg->pCases[(pStressArg->firstCase + iter) % pStressArg->numCases];
+		int numPixels = stressCase.width * stressCase.height;
+		unsigned char* pOut = new unsigned char[numPixels];
+		int err = pStressArg->pCleaner->CleanNoise(stressCase.pIn, pOut, stressCase.width, stressCase.height, 0.1f,
+												   stressCase.isSoftThresh);
+		if (err != 0 || memcmp(pOut, stressCase.pRef, numPixels) != 0)
+			pStressArg->numMismatches++;
+		delete[] pOut;
+	}
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestConcurrencyGPU()
+{
+	const int NUM_THREADS = 8;
+	const int NUM_ITERATIONS = 4;
+	const int NUM_GEOMETRIES = 5;
+	const int geometries[NUM_GEOMETRIES][2] = {{64, 64}, {128, 32}, {32, 256}, {256, 256}, {512, 16}};
+	const int NUM_CASES = NUM_GEOMETRIES * 2;
+	SStressCase cases[NUM_CASES];
+
+	// Compute the reference outputs sequentially
+	unsigned int seed = 12345;
+	for (int i = 0; i < NUM_CASES; i++)
+	{
+		cases[i].width = geometries[i / 2][0];
+		cases[i].height = geometries[i / 2][1];
+		cases[i].isSoftThresh = (i % 2) == 1;
+		int numPixels = cases[i].width * cases[i].height;
+		cases[i].pIn = new unsigned char[numPixels];
+		cases[i].pRef = new unsigned char[numPixels];
+		for (int j = 0; j < numPixels; j++)
+		{
+			seed = seed * 1103515245 + 12345;
+			cases[i].pIn[j] = (unsigned char)(seed >> 16);
+		}
+		CleanNoise(cases[i].pIn, cases[i].pRef, cases[i].width, cases[i].height, 0.1f, cases[i].isSoftThresh);
+	}
+
+	SStressArg args[NUM_THREADS];
+	CThread threads[NUM_THREADS];
+	cl_ulong startTime = OpenCLEnv::GetHostTime();
+	for (int i = 0; i < NUM_THREADS; i++)
+	{
+		args[i].pCleaner = this;
+		args[i].pCases = cases;
+		args[i].numCases = NUM_CASES;
+		args[i].firstCase = i;
+		args[i].numIterations = NUM_ITERATIONS;
+		args[i].numMismatches = 0;
+		if (!threads[i].Start(StressThreadFunc, &args[i]))
+			StressThreadFunc(&args[i]);		// Could not start a thread, run the same work inline
+	}
+
+	int numMismatches = 0;
+	for (int i = 0; i < NUM_THREADS; i++)
+	{
+		threads[i].Join();
+		numMismatches += args[i].numMismatches;
+	}
+	cl_ulong endTime = OpenCLEnv::GetHostTime();
+
+	std::cout << "Concurrent CleanNoise: " << NUM_THREADS << " threads x " << NUM_ITERATIONS << " calls, "
+			  << numMismatches << " mismatches, " << (double)(endTime - startTime) / 1e6 << " ms" << std::endl;
+
+	for (int i = 0; i < NUM_CASES; i++)
+	{
+		delete[] cases[i].pIn;
+		delete[] cases[i].pRef;
+	}
+
+	return (numMismatches == 0);
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestInPlaceGPU()
+{
+	// The in-place pipeline performs the same arithmetic, so the outputs must be identical
+	const int NUM_SIZES = 4;
+	const int sizes[NUM_SIZES] = {8, 64, 256, 512};
+	const int NUM_FRAMES = 2;
+	CTestModeGuard modeGuard(*this);
+	bool bResult = true;
+
+	unsigned int seed = 54321;
+	for (int i = 0; i < NUM_SIZES * 2 && bResult; i++)
+	{
+		int size = sizes[i / 2];
+		bool isSoftThresh = (i % 2) == 1;
+		int numPixels = size*size;
+		unsigned char* ppIn[NUM_FRAMES];
+		unsigned char* ppRef[NUM_FRAMES];
+		unsigned char* ppOut[NUM_FRAMES];
+		for (int frame = 0; frame < NUM_FRAMES; frame++)
+		{
+			ppIn[frame] = new unsigned char[numPixels];
+			ppRef[frame] = new unsigned char[numPixels];
+			ppOut[frame] = new unsigned char[numPixels];
+			for (int j = 0; j < numPixels; j++)
+			{
+				seed = seed * 1103515245 + 12345;
+				ppIn[frame][j] = (unsigned char)(seed >> 16);
+			}
+		}
+
+		m_isInPlace = false;
+		bResult = (CleanNoiseBatch(ppIn, ppRef, NUM_FRAMES, size, size, 0.1f, isSoftThresh) == 0);
+		m_isInPlace = true;
+		bResult = bResult && (CleanNoiseBatch(ppIn, ppOut, NUM_FRAMES, size, size, 0.1f, isSoftThresh) == 0);
+		for (int frame = 0; frame < NUM_FRAMES; frame++)
+		{
+			if (bResult && memcmp(ppRef[frame], ppOut[frame], numPixels) != 0)
+				bResult = false;
+			delete[] ppIn[frame];
+			delete[] ppRef[frame];
+			delete[] ppOut[frame];
+		}
+	}
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestIncrementalGPU()
+{
+	// ---------------------------------------------------------------------------------------
+	// A sequence of frames: the first one and one which changes everywhere are recomputed and
+	// must match 'CleanNoise' exactly, a small change must only touch the dirty tiles and
+	// reconstruct them to within a gray level of 'CleanNoise' (they are summed in another
+	// order), and a repeated frame must change nothing. 4096 samples need two passes.
+	// ---------------------------------------------------------------------------------------
+	const int NUM_CASES = 2;
+	const int sizes[NUM_CASES][3] = {{128, 64, 16}, {4096, 16, 8}};
+	const int NUM_STEPS = 4;
+	const float THRESH = 0.1f;
+	// The half precision pipeline rounds the coefficients between its stages
+	const int maxDiff = m_isHalfPrecision ? 3 : 1;
+	bool bResult = true;
+
+	for (int c = 0; c < NUM_CASES && bResult; c++)
+	{
+		int width = sizes[c][0];
+		int height = sizes[c][1];
+		int tileSize = sizes[c][2];
+		int numPixels = width*height;
+		bool isSoftThresh = (c % 2) == 1;
+		unsigned char* pFrame = new unsigned char[numPixels];
+		unsigned char* pPrevFrame = new unsigned char[numPixels];
+		unsigned char* pRef = new unsigned char[numPixels];
+		unsigned char* pOut = new unsigned char[numPixels];
+		unsigned char* pPrevOut = new unsigned char[numPixels];
+		SIncrementalStream* pStream = CreateIncrementalStream(width, height, tileSize);
+		bResult = (pStream != NULL);
+
+		// A smooth frame which stays away from the ends of the range, so the gray levels do not wrap
+		for (int i = 0; i < numPixels; i++)
+			pFrame[i] = (unsigned char)(128 + 60*sin(0.05*(i % width)) + 40*cos(0.11*(i / width)) + (i*7919 % 17));
+
+		for (int step = 0; step < NUM_STEPS && bResult; step++)
+		{
+			memcpy(pPrevFrame, pFrame, numPixels);
+			if (step == 1)
+			{
+				// A small rectangle which straddles the edges of its tiles
+				for (int y = tileSize - 3; y < tileSize + 5; y++)
+				{
+					for (int x = width / 2 - 2; x < width / 2 + 6; x++)
+						pFrame[y*width + x] = (unsigned char)(255 - pFrame[y*width + x]) / 2 + 64;
+				}
+			}
+			else if (step == 3)
+			{
+				for (int i = 0; i < numPixels; i++)
+					pFrame[i] = (unsigned char)(255 - pFrame[i]);
+			}
+
+			SIncrementalInfo info;
+			bResult = (CleanNoise(pFrame, pRef, width, height, THRESH, isSoftThresh) == 0);
+			bResult = bResult && (CleanNoiseIncremental(pStream, pFrame, pOut, THRESH, isSoftThresh, NULL, &info) == 0);
+			if (!bResult)
+				break;
+
+			int tilesPerRow = width / tileSize;
+			int numDirtyTiles = 0;
+			int numMismatches = 0;
+			for (int tile = 0; tile < info.numTiles; tile++)
+			{
+				int tileOffset = ((tile / tilesPerRow)*width + tile % tilesPerRow) * tileSize;
+				bool isDirty = false;
+				for (int y = 0; y < tileSize; y++)
+				{
+					for (int x = 0; x < tileSize; x++)
+						isDirty = isDirty || (pFrame[tileOffset + y*width + x] != pPrevFrame[tileOffset + y*width + x]);
+				}
+				numDirtyTiles += isDirty;
+				for (int y = 0; y < tileSize; y++)
+				{
+					for (int x = 0; x < tileSize; x++)
+					{
+						int i = tileOffset + y*width + x;
+						if (info.isFullRecompute)
+							numMismatches += (pOut[i] != pRef[i]);
+						else if (isDirty)
+							numMismatches += (abs((int)pOut[i] - (int)pRef[i]) > maxDiff);
+						else
+							numMismatches += (pOut[i] != pPrevOut[i]);
+					}
+				}
+			}
+
+			bool isFullExpected = (step == 0 || step == 3);
+			if (info.isFullRecompute != isFullExpected || (step > 0 && info.numDirtyTiles != numDirtyTiles) || numMismatches > 0)
+				bResult = false;
+			std::cout << "Incremental CleanNoise " << width << "x" << height << " frame " << step << ": " << info.numDirtyTiles << "/"
+					  << info.numTiles << " tiles" << (info.isFullRecompute ? " (full)" : "") << ", " << numMismatches
+					  << " mismatches\n";
+			memcpy(pPrevOut, pOut, numPixels);
+		}
+
+		ReleaseIncrementalStream(pStream);
+		delete[] pFrame;
+		delete[] pPrevFrame;
+		delete[] pRef;
+		delete[] pOut;
+		delete[] pPrevOut;
+	}
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestThresholdSweepGPU()
+{
+	// 'Reconstruct' from resident coefficients must match 'CleanNoise' exactly, and the metrics of
+	// 'EvaluateThresholds' must match those computed on the CPU from the same coefficients, with
+	// both decompositions. The non-standard coefficients also go through the sparse round trip.
+	const int WIDTH = 256;
+	const int HEIGHT = 128;
+	const int NUM_THRESHOLDS = 6;
+	const float thresholds[NUM_THRESHOLDS] = {0.f, 0.02f, 0.05f, 0.1f, 0.2f, 0.4f};
+	const int numPixels = WIDTH*HEIGHT;
+	bool bResult = true;
+
+	std::vector<unsigned char> in(numPixels), out(numPixels), ref(numPixels);
+	unsigned int seed = 13579;
+	MakeTestFrame(&in[0], numPixels, WIDTH, 80, 0.03, 30, 0.07, 21, seed);
+
+	CTestModeGuard modeGuard(*this);
+	for (int mode = 0; mode < 2 && bResult; mode++)
+	{
+		m_isNonStandard = (mode == 1);
+		SCoefficients* pCoefs = ForwardTransform(&in[0], WIDTH, HEIGHT);
+		if (pCoefs == NULL)
+		{
+			bResult = false;
+			break;
+		}
+
+		std::vector<float> coefs(numPixels);
+		SWorker* pWorker = AcquireWorker();
+		ReadCoefBuffer(*pWorker, pCoefs->gCoefsBuff, &coefs[0], numPixels);
+		ReleaseWorker(pWorker);
+
+		for (int soft = 0; soft < 2 && bResult; soft++)
+		{
+			bool isSoftThresh = (soft == 1);
+			int numMismatches = 0;
+			for (int t = 1; t < NUM_THRESHOLDS && bResult; t += 2)
+			{
+				bResult = (CleanNoise(&in[0], &ref[0], WIDTH, HEIGHT, thresholds[t], isSoftThresh) == 0);
+				bResult = bResult && (Reconstruct(pCoefs, &out[0], thresholds[t], isSoftThresh) == 0);
+				for (int i = 0; i < numPixels; i++)
+					numMismatches += (out[i] != ref[i]);
+				if (mode == 1)
+				{
+					SSparseCoefficients sparse;
+					bResult = bResult && (CompactCoefficients(pCoefs, thresholds[t], isSoftThresh, &sparse) == 0) &&
+							  sparse.isNonStandard && (ReconstructSparse(&sparse, &out[0]) == 0);
+					for (int i = 0; i < numPixels; i++)
+						numMismatches += (out[i] != ref[i]);
+				}
+			}
+
+			SThresholdMetrics metrics[NUM_THRESHOLDS];
+			bResult = bResult && (numMismatches == 0) &&
+					  (EvaluateThresholds(pCoefs, thresholds, NUM_THRESHOLDS, isSoftThresh, metrics) == 0);
+			for (int t = 0; t < NUM_THRESHOLDS && bResult; t++)
+			{
+				double sumSqErr = 0.0;
+				int numZeros = 0;
+				for (int i = 0; i < numPixels; i++)
+				{
+					float res;
+					if (isSoftThresh)
+						res = (fabs(coefs[i]) > thresholds[t]) ? coefs[i] - (coefs[i] > 0.f ? thresholds[t] : -thresholds[t]) : 0.f;
+					else
+						res = (fabs(coefs[i]) > thresholds[t]) ? coefs[i] : 0.f;
+					sumSqErr += (double)(coefs[i] - res) * (coefs[i] - res);
+					numZeros += (res == 0.f);
+				}
+				double mse = sumSqErr * 255.0 * 255.0 / numPixels;
+				bResult = (fabs(metrics[t].sparsity - (double)numZeros / numPixels) < 1e-6) && (fabs(metrics[t].mse - mse) <= 1e-3 * mse + 1e-6) &&
+						  (t == 0 || metrics[t].sparsity >= metrics[t - 1].sparsity);
+				std::cout << "Threshold sweep " << (m_isNonStandard ? "non-standard " : "") << (isSoftThresh ? "soft " : "hard ")
+						  << thresholds[t] << ": sparsity " << metrics[t].sparsity << ", PSNR " << metrics[t].psnrDb << " dB"
+						  << (bResult ? "" : " (mismatch)") << std::endl;
+			}
+		}
+
+		ReleaseCoefficients(pCoefs);
+	}
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestSparseGPU()
+{
+	// The pairs must be exactly the nonzero coefficients after the thresholding on the CPU, in
+	// ascending order, and 'ReconstructSparse' must match 'Reconstruct'. 1024x1024 needs more
+	// blocks than the scan work-group has work-items.
+	const int NUM_SIZES = 3;
+	const int sizes[NUM_SIZES][2] = {{8, 4}, {256, 128}, {1024, 1024}};
+	const float THRESH = 0.05f;
+	bool bResult = true;
+
+	unsigned int seed = 97531;
+	for (int s = 0; s < NUM_SIZES && bResult; s++)
+	{
+		int width = sizes[s][0];
+		int height = sizes[s][1];
+		int numPixels = width*height;
+		std::vector<unsigned char> in(numPixels), out(numPixels), ref(numPixels);
+		MakeTestFrame(&in[0], numPixels, width, 80, 0.02, 30, 0.05, 21, seed);
+
+		SCoefficients* pCoefs = ForwardTransform(&in[0], width, height);
+		if (pCoefs == NULL)
+			return false;
+		std::vector<float> coefs(numPixels);
+		SWorker* pWorker = AcquireWorker();
+		ReadCoefBuffer(*pWorker, pCoefs->gCoefsBuff, &coefs[0], numPixels);
+		ReleaseWorker(pWorker);
+
+		for (int soft = 0; soft < 2 && bResult; soft++)
+		{
+			bool isSoftThresh = (soft == 1);
+			SSparseCoefficients sparse;
+			bResult = (CompactCoefficients(pCoefs, THRESH, isSoftThresh, &sparse) == 0);
+
+			size_t numPairs = 0;
+			for (int i = 0; i < numPixels && bResult; i++)
+			{
+				float res;
+				if (isSoftThresh)
+					res = (fabs(coefs[i]) > THRESH) ? coefs[i] - (coefs[i] > 0.f ? THRESH : -THRESH) : 0.f;
+				else
+					res = (fabs(coefs[i]) > THRESH) ? coefs[i] : 0.f;
+				if (res == 0.f)
+					continue;
+				bResult = (numPairs < sparse.indices.size()) && (sparse.indices[numPairs] == (cl_uint)i) &&
+						  (fabs(sparse.values[numPairs] - res) <= 1e-6f * fabs(res));
+				numPairs++;
+			}
+			bResult = bResult && (numPairs == sparse.indices.size());
+
+			bResult = bResult && (Reconstruct(pCoefs, &ref[0], THRESH, isSoftThresh) == 0);
+			bResult = bResult && (ReconstructSparse(&sparse, &out[0]) == 0) && (out == ref);
+			std::cout << "Sparse " << (isSoftThresh ? "soft " : "hard ") << width << "x" << height << ": " << sparse.indices.size()
+					  << " of " << numPixels << " coefficients" << (bResult ? "" : " (mismatch)") << std::endl;
+		}
+		ReleaseCoefficients(pCoefs);
+	}
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestNonStandardGPU()
+{
+	// The coefficients must match the CPU reference and the inverse must reproduce the frames.
+	// 1024x1024 takes several launches of the tile kernels, the frames which are not square
+	// keep a strip of the approximation. 'CleanNoise' must agree with the CPU within a gray level.
+	const int NUM_SIZES = 5;
+	const int sizes[NUM_SIZES][2] = {{2, 2}, {64, 64}, {256, 32}, {8, 512}, {1024, 1024}};
+	const int NUM_FRAMES = 2;
+	const float THRESH = 0.05f;
+	// The half precision pipeline rounds the coefficients between its stages
+	const int maxDiff = m_isHalfPrecision ? 3 : 1;
+	CTestModeGuard modeGuard(*this);
+	bool bResult = true;
+
+	unsigned int seed = 86420;
+	for (int s = 0; s < NUM_SIZES && bResult; s++)
+	{
+		int width = sizes[s][0];
+		int height = sizes[s][1];
+		int frameLen = width*height;
+		int numElements = frameLen*NUM_FRAMES;
+		std::vector<unsigned char> in(numElements), out(frameLen);
+		std::vector<float> frames(numElements), refCoefs(numElements), coefs(numElements), res(numElements);
+		MakeTestFrame(&in[0], numElements, width, 80, 0.02, 30, 0.05, 21, seed);
+		for (int i = 0; i < numElements; i++)
+			frames[i] = (float)in[i] / 255.f;
+		for (int frame = 0; frame < NUM_FRAMES; frame++)
+			ForwardNonStandardCPU(&frames[frame*frameLen], width, height, &refCoefs[frame*frameLen]);
+
+		SCleanNoiseStats stats;
+		SWorker* pWorker = AcquireWorker();
+		bool isInPlace = false;
+		size_t buffLen, outBuffLen, partialBuffLen;
+		GetWorkspaceLens(width, height, NUM_FRAMES, isInPlace, buffLen, outBuffLen, partialBuffLen, true);
+		ReserveWorkspace(*pWorker, buffLen, outBuffLen, partialBuffLen);
+		WriteCoefBuffer(*pWorker, pWorker->gInBuff, &frames[0], numElements);
+		bResult = ForwardNonStandardGPU(*pWorker, pWorker->gInBuff, pWorker->gOutBuff, NUM_FRAMES, width, height, stats);
+		ReadCoefBuffer(*pWorker, pWorker->gOutBuff, &coefs[0], numElements);
+		bResult = bResult && CompareTransformResult(&refCoefs[0], &coefs[0], numElements, "Non-standard FWT");
+		bResult = bResult && InverseNonStandardGPU(*pWorker, pWorker->gOutBuff, pWorker->gInBuff, NUM_FRAMES, width, height, stats);
+		ReadCoefBuffer(*pWorker, pWorker->gInBuff, &res[0], numElements);
+		bResult = bResult && CompareTransformResult(&frames[0], &res[0], numElements, "Non-standard IWT");
+		ReleaseWorker(pWorker);
+
+		// The CPU reference of 'CleanNoise' on the first frame, thresholding the coefficients of the
+		// device so that those at the threshold go the same way in the half precision mode
+		for (int i = 0; i < frameLen; i++)
+			refCoefs[i] = (fabs(coefs[i]) > THRESH) * coefs[i];
+		InverseNonStandardCPU(&refCoefs[0], width, height, &res[0]);
+		m_isNonStandard = true;
+		bResult = bResult && (CleanNoise(&in[0], &out[0], width, height, THRESH, false) == 0);
+		int numMismatches = 0;
+		for (int i = 0; i < frameLen; i++)
+			numMismatches += (abs((int)out[i] - (int)(unsigned char)(char)(res[i] * 255.f)) > maxDiff);
+		bResult = bResult && (numMismatches == 0);
+		std::cout << "Non-standard decomposition " << width << "x" << height << ": " << numMismatches << " mismatches" << std::endl;
+	}
+
+	// Frames with a side of 1 have no levels along it and use the standard decomposition in both
+	// modes, which transforms only the other side. The buffers hold the frames of the cases above.
+	const int NUM_LINES = 2;
+	const int lines[NUM_LINES][2] = {{1, 64}, {64, 1}};
+	for (int c = 0; c < NUM_LINES*2 && bResult; c++)
+	{
+		int width = lines[c / 2][0];
+		int height = lines[c / 2][1];
+		int frameLen = width*height;
+		std::vector<unsigned char> in(frameLen), out(frameLen);
+		std::vector<float> res(frameLen);
+		MakeTestFrame(&in[0], frameLen, width, 80, 0.02, 30, 0.05, 21, seed);
+		for (int i = 0; i < frameLen; i++)
+			res[i] = (float)in[i] / 255.f;
+		CHaarCPU::ForwardTransform2DNaive(&res[0], width, height);
+		for (int i = 0; i < frameLen; i++)
+			res[i] = (fabs(res[i]) > THRESH) * res[i];
+		CHaarCPU::InverseTransform2DNaive(&res[0], width, height);
+
+		m_isNonStandard = (c % 2) == 1;
+		bResult = (CleanNoise(&in[0], &out[0], width, height, THRESH, false) == 0);
+		int numMismatches = 0;
+		for (int i = 0; i < frameLen; i++)
+			numMismatches += (abs((int)out[i] - (int)(unsigned char)(char)(res[i] * 255.f)) > maxDiff);
+		bResult = bResult && (numMismatches == 0);
+		std::cout << "Line " << width << "x" << height << (m_isNonStandard ? " non-standard" : "") << ": " << numMismatches
+				  << " mismatches" << std::endl;
+	}
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestPatchesGPU()
+{
+	// Stacks of separate patches of several sizes, and images which are not powers of 2 with
+	// overlapping patches whose last ones are moved to the edges. The output must agree with
+	// the CPU within a gray level, with both thresholds.
+	const int NUM_CASES = 6;
+	const int cases[NUM_CASES][4] = {{8, 8*64, 8, 8}, {32, 32*50, 32, 32}, {64, 64*8, 64, 64}, {2, 2*16, 2, 2},
+									 {100, 70, 16, 4}, {48, 40, 8, 3}};
+	const float THRESH = 0.05f;
+	bool bResult = true;
+
+	unsigned int seed = 97531;
+	for (int c = 0; c < NUM_CASES && bResult; c++)
+	{
+		int width = cases[c][0];
+		int height = cases[c][1];
+		int patchSize = cases[c][2];
+		int step = cases[c][3];
+		int numPixels = width*height;
+		std::vector<unsigned char> in(numPixels), out(numPixels), ref(numPixels);
+		MakeTestFrame(&in[0], numPixels, width, 80, 0.07, 30, 0.11, 21, seed);
+
+		for (int soft = 0; soft < 2 && bResult; soft++)
+		{
+			CleanNoisePatchesCPU(&in[0], &ref[0], width, height, patchSize, step, THRESH, soft == 1);
+			bResult = (CleanNoisePatches(&in[0], &out[0], width, height, patchSize, step, THRESH, soft == 1) == 0);
+			int numMismatches = 0;
+			for (int i = 0; i < numPixels; i++)
+				numMismatches += (abs((int)out[i] - (int)ref[i]) > 1);
+			bResult = bResult && (numMismatches == 0);
+			std::cout << "Patches of " << patchSize << " step " << step << " in " << width << "x" << height
+					  << (soft ? " soft: " : " hard: ") << numMismatches << " mismatches" << std::endl;
+		}
+	}
+
+	// Patches larger than PATCH_MAX_SIZE or not a power of 2 are not supported
+	std::vector<unsigned char> image(128*128);
+	bResult = bResult && (CleanNoisePatches(&image[0], &image[0], 128, 128, 128, 128, THRESH, false) != 0);
+	bResult = bResult && (CleanNoisePatches(&image[0], &image[0], 128, 128, 24, 24, THRESH, false) != 0);
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestHaarTransform2DCPU()
+{
+	// The cache-blocked 2D transforms must agree with the naive ones and reproduce the input.
+	// 512x512 and 64x1024 are transformed in several strips of columns.
+	const int NUM_SIZES = 6;
+	const int sizes[NUM_SIZES][2] = {{2, 2}, {8, 1}, {1, 16}, {256, 8}, {64, 1024}, {512, 512}};
+	bool bResult = true;
+
+	unsigned int seed = 24680;
+	for (int s = 0; s < NUM_SIZES && bResult; s++)
+	{
+		int width = sizes[s][0];
+		int height = sizes[s][1];
+		int numElements = width*height;
+		std::vector<float> in(numElements), coefs(numElements), refCoefs(numElements);
+		std::vector<float> scratch(CHaarCPU::GetScratchLen(width, height));
+		for (int i = 0; i < numElements; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			in[i] = (float)((seed >> 16) % 256) / 255.f;
+		}
+
+		coefs = in;
+		refCoefs = in;
+		bResult = CHaarCPU::ForwardTransform2D(&coefs[0], width, height, &scratch[0]) &&
+				  CHaarCPU::ForwardTransform2DNaive(&refCoefs[0], width, height) &&
+				  OpenCLEnv::CompareFloatBuffers(&coefs[0], &refCoefs[0], numElements);
+		bResult = bResult && CHaarCPU::InverseTransform2D(&coefs[0], width, height, &scratch[0]) &&
+				  CHaarCPU::InverseTransform2DNaive(&refCoefs[0], width, height) &&
+				  OpenCLEnv::CompareFloatBuffers(&coefs[0], &in[0], numElements) &&
+				  OpenCLEnv::CompareFloatBuffers(&refCoefs[0], &in[0], numElements);
+		std::cout << "Blocked 2D transform on the CPU " << width << "x" << height << ": " << (bResult ? "passed" : "failed") << std::endl;
+	}
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestRegionGPU()
+{
+	// Regions of frames with padded rows, in every pipeline, must be identical to 'CleanNoise' on
+	// the packed region, and the pixels around them must be left alone
+	const int NUM_CASES = 3;
+	const int cases[NUM_CASES][6] = {{300, 200, 37, 21, 128, 64}, {256, 128, 0, 0, 256, 128}, {70, 40, 3, 5, 2, 32}};
+	const int PADDING = 13;
+	const float THRESH = 0.1f;
+	CTestModeGuard modeGuard(*this);
+	bool bResult = true;
+
+	unsigned int seed = 13579;
+	for (int c = 0; c < NUM_CASES && bResult; c++)
+	{
+		int width = cases[c][0];
+		int height = cases[c][1];
+		int pitch = width + PADDING;
+		int roiX = cases[c][2];
+		int roiY = cases[c][3];
+		int roiWidth = cases[c][4];
+		int roiHeight = cases[c][5];
+		std::vector<unsigned char> in(pitch*height), out(pitch*height), roiIn(roiWidth*roiHeight), ref(roiWidth*roiHeight);
+		MakeTestFrame(&in[0], pitch*height, pitch, 80, 0.03, 0, 0.0, 31, seed);
+		for (int y = 0; y < roiHeight; y++)
+			memcpy(&roiIn[y*roiWidth], &in[(roiY + y)*pitch + roiX], roiWidth);
+
+		for (int mode = 0; mode < 3 && bResult; mode++)
+		{
+			m_isInPlace = (mode == 1);
+			m_isNonStandard = (mode == 2);
+			bResult = (CleanNoise(&roiIn[0], &ref[0], roiWidth, roiHeight, THRESH, true) == 0);
+			memset(&out[0], 0xA5, out.size());
+			bResult = bResult && (CleanNoiseRegion(&in[0], pitch, &out[0], pitch, roiX, roiY, roiWidth, roiHeight, THRESH, true) == 0);
+			int numMismatches = 0;
+			for (int y = 0; y < height; y++)
+			{
+				for (int x = 0; x < pitch; x++)
+				{
+					bool isInside = (x >= roiX && x < roiX + roiWidth && y >= roiY && y < roiY + roiHeight);
+					int expected = isInside ? ref[(y - roiY)*roiWidth + x - roiX] : 0xA5;
+					numMismatches += (out[y*pitch + x] != expected);
+				}
+			}
+			bResult = bResult && (numMismatches == 0);
+			std::cout << "Region " << roiWidth << "x" << roiHeight << " at (" << roiX << ", " << roiY << ") of " << width << "x" << height
+					  << (mode == 1 ? " in place" : (mode == 2 ? " non-standard" : "")) << ": " << numMismatches << " mismatches" << std::endl;
+		}
+	}
+
+	// Regions which do not fit in the pitch are not supported
+	std::vector<unsigned char> image(64*64);
+	bResult = bResult && (CleanNoiseRegion(&image[0], 64, &image[0], 64, 8, 0, 64, 64, THRESH, true) != 0);
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestSignalStreamGPU()
+{
+	// A stream fed in uneven chunks must give the blocks of a per-block CPU reference, the last
+	// one extended with its last sample, and exactly the output of a single call
+	const int NUM_CHANNELS = 3;
+	const int BLOCK_LEN = 64;
+	const int NUM_SAMPLES = 1000;
+	const int NUM_CHUNKS = 6;
+	const int chunkLens[NUM_CHUNKS] = {1, 63, 200, 0, 129, 607};
+	const float THRESH = 0.3f;
+
+	std::vector<float> in(NUM_CHANNELS*NUM_SAMPLES), out(NUM_CHANNELS*NUM_SAMPLES), ref(NUM_CHANNELS*NUM_SAMPLES);
+	std::vector<float> wholeOut(NUM_CHANNELS*NUM_SAMPLES);
+	unsigned int seed = 24680;
+	for (int i = 0; i < NUM_CHANNELS*NUM_SAMPLES; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		in[i] = (float)(sin(0.02*(i % NUM_SAMPLES) + i / NUM_SAMPLES) + (float)((seed >> 16) % 101) / 250.f - 0.2f);
+	}
+
+	float block[BLOCK_LEN], coefs[BLOCK_LEN];
+	for (int c = 0; c < NUM_CHANNELS; c++)
+	{
+		for (int start = 0; start < NUM_SAMPLES; start += BLOCK_LEN)
+		{
+			for (int i = 0; i < BLOCK_LEN; i++)
+				block[i] = in[c*NUM_SAMPLES + (start + i < NUM_SAMPLES ? start + i : NUM_SAMPLES - 1)];
+			CNoiseCleaner::ForwardHaarTransformCPU(block, BLOCK_LEN, coefs, 0);
+			for (int i = 0; i < BLOCK_LEN; i++)
+			{
+				float res = fabs(coefs[i]) - THRESH;
+				coefs[i] = (res > 0.f) ? (coefs[i] > 0.f ? res : -res) : 0.f;
+			}
+			CNoiseCleaner::InverseHaarTransformCPU(coefs, BLOCK_LEN, block, 0);
+			for (int i = 0; i < BLOCK_LEN && start + i < NUM_SAMPLES; i++)
+				ref[c*NUM_SAMPLES + start + i] = block[i];
+		}
+	}
+
+	const float* ppIn[NUM_CHANNELS];
+	float* ppOut[NUM_CHANNELS];
+	SSignalStream* pStream = CreateSignalStream(NUM_CHANNELS, BLOCK_LEN);
+	bool bResult = (pStream != NULL);
+	int numIn = 0;
+	int numOut = 0;
+	for (int k = 0; k <= NUM_CHUNKS && bResult; k++)
+	{
+		for (int c = 0; c < NUM_CHANNELS; c++)
+		{
+			ppIn[c] = &in[c*NUM_SAMPLES + numIn];
+			ppOut[c] = &out[c*NUM_SAMPLES + numOut];
+		}
+		int numWritten = (k < NUM_CHUNKS) ? CleanNoiseSignal(pStream, ppIn, chunkLens[k], ppOut, THRESH, true) :
+											FlushSignalStream(pStream, ppOut, THRESH, true);
+		// A block is emitted as soon as its last sample is given
+		int numExpected = (k < NUM_CHUNKS) ? (numIn + chunkLens[k]) / BLOCK_LEN * BLOCK_LEN - numOut : NUM_SAMPLES - numOut;
+		bResult = (numWritten == numExpected);
+		numIn += (k < NUM_CHUNKS) ? chunkLens[k] : 0;
+		numOut += numWritten;
+	}
+	bResult = bResult && CompareTransformResult(&ref[0], &out[0], NUM_CHANNELS*NUM_SAMPLES, "Signal stream");
+
+	// The whole signal in one call
+	for (int c = 0; c < NUM_CHANNELS && bResult; c++)
+	{
+		ppIn[c] = &in[c*NUM_SAMPLES];
+		ppOut[c] = &wholeOut[c*NUM_SAMPLES];
+	}
+	int numWhole = bResult ? CleanNoiseSignal(pStream, ppIn, NUM_SAMPLES, ppOut, THRESH, true) : -1;
+	for (int c = 0; c < NUM_CHANNELS && numWhole >= 0; c++)
+		ppOut[c] = &wholeOut[c*NUM_SAMPLES + numWhole];
+	int numFlushed = (numWhole >= 0) ? FlushSignalStream(pStream, ppOut, THRESH, true) : -1;
+	bResult = bResult && (numWhole + numFlushed == NUM_SAMPLES);
+	for (int c = 0; c < NUM_CHANNELS && bResult; c++)
+		bResult = (memcmp(&wholeOut[c*NUM_SAMPLES], &out[c*NUM_SAMPLES], NUM_SAMPLES*sizeof(float)) == 0);
+	std::cout << "Signal stream of " << NUM_CHANNELS << " channels in blocks of " << BLOCK_LEN << ": "
+			  << (bResult ? "identical" : "different") << " to a single call" << std::endl;
+	ReleaseSignalStream(pStream);
+
+	// Block lengths which are not powers of two are not supported
+	bResult = bResult && (CreateSignalStream(NUM_CHANNELS, 48) == NULL);
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestNeighThreshGPU()
+{
+	// The kernel must match the CPU reference in both layouts, with windows crossing the tiles of
+	// the work-groups and the subbands. 'CleanNoise' must agree with the CPU within a gray level
+	// and give the same frames when the in-place mode is selected, which it does not use.
+	const int NUM_CASES = 4;
+	const int cases[NUM_CASES][5] = {{64, 32, 2, 0, 3}, {32, 64, 1, 1, 5}, {8, 4, 3, 1, 3}, {128, 128, 1, 0, 7}};
+	const float THRESH = 0.4f;
+	// The half precision pipeline rounds the coefficients between its stages
+	const int maxDiff = m_isHalfPrecision ? 3 : 1;
+	CTestModeGuard modeGuard(*this);
+	bool bResult = true;
+
+	unsigned int seed = 97531;
+	for (int c = 0; c < NUM_CASES && bResult; c++)
+	{
+		int rowLen = cases[c][0];
+		int numRows = cases[c][1];
+		int numMatrices = cases[c][2];
+		bool isNS = (cases[c][3] != 0);
+		int matrixLen = rowLen*numRows;
+		int numElements = matrixLen*numMatrices;
+		std::vector<float> coefs(numElements), ref(numElements), res(numElements);
+		for (int i = 0; i < numElements; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			coefs[i] = (float)((int)((seed >> 16) % 201) - 100) / 100.f;
+		}
+		for (int m = 0; m < numMatrices; m++)
+			NeighThreshCPU(&coefs[m*matrixLen], rowLen, numRows, isNS, cases[c][4], THRESH, &ref[m*matrixLen]);
+
+		SCleanNoiseStats stats;
+		SWorker* pWorker = AcquireWorker();
+		ReserveWorkspace(*pWorker, numElements, numElements, 1);
+		WriteCoefBuffer(*pWorker, pWorker->gInBuff, &coefs[0], numElements);
+		m_neighWindowSize = cases[c][4];
+		bResult = MatrixNeighThreshGPU(*pWorker, pWorker->gInBuff, pWorker->gOutBuff, rowLen, numRows, numMatrices, isNS, THRESH, stats,
+									   SCleanNoiseStats::THRESHOLD);
+		ReadCoefBuffer(*pWorker, pWorker->gOutBuff, &res[0], numElements);
+		ReleaseWorker(pWorker);
+		bResult = bResult && CompareTransformResult(&ref[0], &res[0], numElements, "Neighbourhood thresh");
+		std::cout << "Neighbourhood thresh " << rowLen << "x" << numRows << (isNS ? " non-standard" : "") << " window "
+				  << cases[c][4] << ": " << (bResult ? "passed" : "failed") << std::endl;
+	}
+
+	// 'CleanNoise' in the non-standard layout against the CPU, thresholding the coefficients of the
+	// CPU so that the comparison does not depend on the rounding of the device transform
+	const int WIDTH = 64;
+	const int HEIGHT = 32;
+	const int frameLen = WIDTH*HEIGHT;
+	const float IMAGE_THRESH = 0.08f;
+	std::vector<unsigned char> in(frameLen), out(frameLen), inPlaceOut(frameLen);
+	std::vector<float> frame(frameLen), coefs(frameLen), thresholded(frameLen), res(frameLen);
+	MakeTestFrame(&in[0], frameLen, WIDTH, 80, 0.1, 30, 0.07, 41, seed);
+	for (int i = 0; i < frameLen; i++)
+		frame[i] = (float)in[i] / 255.f;
+	ForwardNonStandardCPU(&frame[0], WIDTH, HEIGHT, &coefs[0]);
+	NeighThreshCPU(&coefs[0], WIDTH, HEIGHT, true, 3, IMAGE_THRESH, &thresholded[0]);
+	InverseNonStandardCPU(&thresholded[0], WIDTH, HEIGHT, &res[0]);
+	bResult = bResult && SetNeighThreshMode(3);
+	m_isNonStandard = true;
+	bResult = bResult && (CleanNoise(&in[0], &out[0], WIDTH, HEIGHT, IMAGE_THRESH, false) == 0);
+	m_isNonStandard = false;
+	int numMismatches = 0;
+	for (int i = 0; i < frameLen; i++)
+		numMismatches += (abs((int)out[i] - (int)(unsigned char)(char)(res[i] * 255.f)) > maxDiff);
+	bResult = bResult && (numMismatches == 0);
+	std::cout << "Neighbourhood thresh non-standard " << WIDTH << "x" << HEIGHT << ": " << numMismatches << " mismatches" << std::endl;
+
+	// Square frames in the in-place mode go through the default pipeline
+	bResult = bResult && (CleanNoise(&in[0], &out[0], HEIGHT, HEIGHT, IMAGE_THRESH, false) == 0);
+	m_isInPlace = true;
+	bResult = bResult && (CleanNoise(&in[0], &inPlaceOut[0], HEIGHT, HEIGHT, IMAGE_THRESH, false) == 0);
+	bResult = bResult && (memcmp(&out[0], &inPlaceOut[0], HEIGHT*HEIGHT) == 0);
+
+	// The threshold sweeps apply the same shrink: 'Reconstruct' and the sparse round trip give the
+	// frames of 'CleanNoise', and 'EvaluateThresholds' the metrics of the device coefficients
+	std::vector<unsigned char> sweepOut(frameLen);
+	for (int mode = 0; mode < 2 && bResult; mode++)
+	{
+		m_isNonStandard = (mode == 1);
+		SCoefficients* pCoefs = ForwardTransform(&in[0], WIDTH, HEIGHT);
+		SSparseCoefficients sparse;
+		SThresholdMetrics metrics;
+		bResult = (pCoefs != NULL) && (CleanNoise(&in[0], &out[0], WIDTH, HEIGHT, IMAGE_THRESH, false) == 0);
+		bResult = bResult && (Reconstruct(pCoefs, &sweepOut[0], IMAGE_THRESH, false) == 0) &&
+				  (memcmp(&out[0], &sweepOut[0], frameLen) == 0);
+		bResult = bResult && (CompactCoefficients(pCoefs, IMAGE_THRESH, false, &sparse) == 0) &&
+				  (ReconstructSparse(&sparse, &sweepOut[0]) == 0) && (memcmp(&out[0], &sweepOut[0], frameLen) == 0);
+		bResult = bResult && (EvaluateThresholds(pCoefs, &IMAGE_THRESH, 1, false, &metrics) == 0);
+		if (bResult)
+		{
+			// The standard decomposition leaves the frame transposed
+			SWorker* pWorker = AcquireWorker();
+			ReadCoefBuffer(*pWorker, pCoefs->gCoefsBuff, &coefs[0], frameLen);
+			ReleaseWorker(pWorker);
+			NeighThreshCPU(&coefs[0], m_isNonStandard ? WIDTH : HEIGHT, m_isNonStandard ? HEIGHT : WIDTH, m_isNonStandard, 3, IMAGE_THRESH,
+						   &thresholded[0]);
+			double sumSqErr = 0.0;
+			int numZeros = 0;
+			for (int i = 0; i < frameLen; i++)
+			{
+				sumSqErr += (double)(coefs[i] - thresholded[i]) * (coefs[i] - thresholded[i]);
+				numZeros += (thresholded[i] == 0.f);
+			}
+			double mse = sumSqErr * 255.0 * 255.0 / frameLen;
+			double maxMseDiff = (m_isHalfPrecision ? 1e-2 : 1e-3) * mse + 1e-6;
+			bResult = (fabs(metrics.sparsity - (double)numZeros / frameLen) < 1e-6) && (fabs(metrics.mse - mse) <= maxMseDiff) &&
+					  (sparse.indices.size() == (size_t)(frameLen - numZeros));
+			std::cout << "Neighbourhood threshold sweep" << (m_isNonStandard ? " non-standard" : "") << ": sparsity " << metrics.sparsity
+					  << ", PSNR " << metrics.psnrDb << " dB" << (bResult ? "" : " (mismatch)") << std::endl;
+		}
+		ReleaseCoefficients(pCoefs);
+	}
+	m_isNonStandard = false;
+
+	// The incremental streams only threshold pointwise
+	bResult = bResult && (CreateIncrementalStream(HEIGHT, HEIGHT) == NULL);
+
+	// Even and too large windows are not supported
+	bResult = bResult && !SetNeighThreshMode(4) && !SetNeighThreshMode(NEIGH_MAX_WINDOW_SIZE + 2);
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestThumbnailsGPU()
+{
+	// The frame must be identical to 'CleanNoise' in every pipeline and the thumbnails must be the
+	// block means of the denoised frame, which is truncated to gray levels while they are rounded.
+	// The frames stay well within the gray levels, which 'CleanNoise' does not saturate.
+	const int NUM_CASES = 2;
+	const int cases[NUM_CASES][2] = {{128, 64}, {32, 16}};
+	const int NUM_THUMBNAILS = 3;
+	const int levels[NUM_CASES][NUM_THUMBNAILS] = {{3, 1, 2}, {4, 2, 1}};
+	const float THRESH = 0.1f;
+	CTestModeGuard modeGuard(*this);
+	bool bResult = true;
+
+	unsigned int seed = 11235;
+	for (int c = 0; c < NUM_CASES && bResult; c++)
+	{
+		int width = cases[c][0];
+		int height = cases[c][1];
+		std::vector<unsigned char> in(width*height), ref(width*height), out(width*height);
+		std::vector<unsigned char> thumbnails[NUM_THUMBNAILS];
+		unsigned char* ppThumbnails[NUM_THUMBNAILS];
+		for (int t = 0; t < NUM_THUMBNAILS; t++)
+		{
+			thumbnails[t].resize((width >> levels[c][t])*(height >> levels[c][t]));
+			ppThumbnails[t] = &thumbnails[t][0];
+		}
+		MakeTestFrame(&in[0], width*height, width, 50, 0.05, 30, 0.09, 31, seed);
+
+		for (int mode = 0; mode < 3 && bResult; mode++)
+		{
+			m_isInPlace = (mode == 1);
+			m_isNonStandard = (mode == 2);
+			bResult = (CleanNoise(&in[0], &ref[0], width, height, THRESH, true) == 0);
+			bResult = bResult && (CleanNoiseThumbnails(&in[0], &out[0], width, height, THRESH, true, levels[c], NUM_THUMBNAILS,
+													   ppThumbnails) == 0);
+			int numMismatches = 0;
+			for (int i = 0; i < width*height; i++)
+				numMismatches += (out[i] != ref[i]);
+			for (int t = 0; t < NUM_THUMBNAILS; t++)
+			{
+				int blockSide = 1 << levels[c][t];
+				int thumbWidth = width >> levels[c][t];
+				for (int i = 0; i < (int)thumbnails[t].size(); i++)
+				{
+					int sum = 0;
+					for (int y = 0; y < blockSide; y++)
+						for (int x = 0; x < blockSide; x++)
+							sum += ref[((i / thumbWidth)*blockSide + y)*width + (i % thumbWidth)*blockSide + x];
+					float mean = (float)sum / (blockSide*blockSide);
+					numMismatches += (fabs(thumbnails[t][i] - mean) >= 1.5f);
+				}
+			}
+			bResult = bResult && (numMismatches == 0);
+			std::cout << "Thumbnails of " << width << "x" << height << (mode == 1 ? " in place" : (mode == 2 ? " non-standard" : ""))
+					  << ": " << numMismatches << " mismatches" << std::endl;
+		}
+	}
+
+	// Levels which are repeated, out of range or beyond the frame are not supported
+	std::vector<unsigned char> image(64*8), thumbnail(64*8);
+	unsigned char* pThumbnail = &thumbnail[0];
+	const int badLevels[4][2] = {{1, 1}, {0, 1}, {THUMBNAIL_MAX_LEVEL + 1, 1}, {4, 1}};
+	for (int i = 0; i < 4; i++)
+	{
+		unsigned char* ppBad[2] = {pThumbnail, pThumbnail};
+		bResult = bResult && (CleanNoiseThumbnails(&image[0], &image[0], 64, 8, THRESH, true, badLevels[i], 2, ppBad) != 0);
+	}
+	bResult = bResult && (CleanNoiseThumbnails(&image[0], &image[0], 64, 8, THRESH, true, badLevels[3] + 1, 1, &pThumbnail) == 0);
+
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TestMetricsGPU()
+{
+	// The metrics of 'CleanNoiseBatch' against those of the thresholded coefficients of the CPU
+	// transforms, for pointwise and neighbourhood thresholding in every pipeline. The frames must
+	// not change when the metrics are requested. The device transforms (and the halves) round
+	// differently, which may move a few coefficients across the threshold.
+	// The long frame has more levels than SCleanNoiseMetrics keeps, the lines have none along one side.
+	const int NUM_CASES = 9;
+	// width, height, non-standard, in place, soft, neighbourhood window
+	const int cases[NUM_CASES][6] = {{64, 32, 0, 0, 0, 0}, {32, 64, 0, 0, 1, 0}, {64, 32, 1, 0, 1, 0}, {32, 32, 0, 1, 0, 0},
+									 {32, 32, 0, 1, 1, 0}, {32, 64, 0, 0, 0, 3}, {1 << 17, 2, 0, 0, 0, 0}, {1, 64, 0, 0, 1, 0},
+									 {64, 1, 0, 0, 0, 0}};
+	const int NUM_FRAMES = 2;
+	const float THRESH = 0.08f;
+	const double SCALE = 255.0 * 255.0;
+	const double tolerance = m_isHalfPrecision ? 2e-2 : 1e-3;
+	const double sparsityTolerance = m_isHalfPrecision ? 1e-2 : 1e-3;
+	CTestModeGuard modeGuard(*this);
+	bool bResult = true;
+
+	unsigned int seed = 31415;
+	for (int c = 0; c < NUM_CASES && bResult; c++)
+	{
+		int width = cases[c][0];
+		int height = cases[c][1];
+		bool isNS = (cases[c][2] != 0);
+		bool isSoft = (cases[c][4] != 0);
+		int frameLen = width*height;
+		unsigned int numLevelsWidth = 0;
+		unsigned int numLevelsHeight = 0;
+		CNoiseCleaner::GetNumLevels(width, numLevelsWidth);
+		CNoiseCleaner::GetNumLevels(height, numLevelsHeight);
+		std::vector<unsigned char> in(frameLen*NUM_FRAMES), ref(frameLen*NUM_FRAMES), out(frameLen*NUM_FRAMES);
+		std::vector<float> frame(frameLen), coefs(frameLen), thresholded(frameLen), transposed(frameLen), transposedRes(frameLen);
+		unsigned char* ppIn[NUM_FRAMES];
+		unsigned char* ppRef[NUM_FRAMES];
+		unsigned char* ppOut[NUM_FRAMES];
+		SCleanNoiseMetrics metrics[NUM_FRAMES];
+		MakeTestFrame(&in[0], frameLen*NUM_FRAMES, width, 80, 0.1, 30, 0.07, 41, seed);
+		for (int f = 0; f < NUM_FRAMES; f++)
+		{
+			ppIn[f] = &in[f*frameLen];
+			ppRef[f] = &ref[f*frameLen];
+			ppOut[f] = &out[f*frameLen];
+		}
+
+		m_isNonStandard = isNS;
+		m_isInPlace = (cases[c][3] != 0);
+		m_neighWindowSize = cases[c][5];
+		bResult = (CleanNoiseBatch(ppIn, ppRef, NUM_FRAMES, width, height, THRESH, isSoft) == 0);
+		bResult = bResult && (CleanNoiseBatch(ppIn, ppOut, NUM_FRAMES, width, height, THRESH, isSoft, NULL, metrics) == 0);
+		bResult = bResult && (out == ref);
+
+		for (int f = 0; f < NUM_FRAMES && bResult; f++)
+		{
+			for (int i = 0; i < frameLen; i++)
+				frame[i] = (float)in[f*frameLen + i] / 255.f;
+			if (isNS)
+				ForwardNonStandardCPU(&frame[0], width, height, &coefs[0]);
+			else
+			{
+				coefs = frame;
+				CHaarCPU::ForwardTransform2DNaive(&coefs[0], width, height);
+			}
+			if (cases[c][5] == 0)
+			{
+				for (int i = 0; i < frameLen; i++)
+				{
+					float mag = (float)fabs(coefs[i]);
+					thresholded[i] = (mag <= THRESH) ? 0.f : (isSoft ? (coefs[i] > 0.f ? mag - THRESH : THRESH - mag) : coefs[i]);
+				}
+			}
+			else
+			{
+				// The neighbourhoods are taken in the transposed layout of the device
+				for (int y = 0; y < height; y++)
+					for (int x = 0; x < width; x++)
+						transposed[x*height + y] = coefs[y*width + x];
+				NeighThreshCPU(&transposed[0], height, width, false, cases[c][5], THRESH, &transposedRes[0]);
+				for (int y = 0; y < height; y++)
+					for (int x = 0; x < width; x++)
+						thresholded[y*width + x] = transposedRes[x*height + y];
+			}
+
+			// Level 1 is the finest, in the standard decomposition a subband counts in the level of
+			// its finer side. 'levelX' or 'levelY' stays 0 along an approximation.
+			double err = 0.0, numZeros = 0.0, approxEnergy = 0.0;
+			double detailEnergy[SCleanNoiseMetrics::MAX_LEVELS][3] = {{0.0}};
+			int numLevels = (int)(isNS ? (numLevelsWidth < numLevelsHeight ? numLevelsWidth : numLevelsHeight)
+									   : (numLevelsWidth > numLevelsHeight ? numLevelsWidth : numLevelsHeight));
+			for (int y = 0; y < height; y++)
+			{
+				for (int x = 0; x < width; x++)
+				{
+					double res = thresholded[y*width + x];
+					double diff = coefs[y*width + x] - res;
+					err += diff*diff;
+					numZeros += (res == 0.0);
+					int levelX = 0;
+					int levelY = 0;
+					if (isNS)
+					{
+						int level = 1;
+						while (level <= numLevels && x < (width >> level) && y < (height >> level))
+							level++;
+						levelX = (level <= numLevels && x >= (width >> level)) ? level : 0;
+						levelY = (level <= numLevels && y >= (height >> level)) ? level : 0;
+					}
+					else
+					{
+						for (int v = x; v > 0; v >>= 1)
+							levelX++;
+						for (int v = y; v > 0; v >>= 1)
+							levelY++;
+						levelX = (x > 0) ? (int)numLevelsWidth + 1 - levelX : 0;
+						levelY = (y > 0) ? (int)numLevelsHeight + 1 - levelY : 0;
+					}
+					if (levelX == 0 && levelY == 0)
+					{
+						approxEnergy += res*res;
+						continue;
+					}
+					int level = levelX;
+					int orientation = 2;
+					if (levelY == 0 || (levelX != 0 && levelX < levelY))
+						orientation = 0;
+					else if (levelX == 0 || levelY < levelX)
+					{
+						level = levelY;
+						orientation = 1;
+					}
+					if (level > SCleanNoiseMetrics::MAX_LEVELS)
+						level = SCleanNoiseMetrics::MAX_LEVELS;
+					detailEnergy[level - 1][orientation] += res*res;
+				}
+			}
+			if (numLevels > SCleanNoiseMetrics::MAX_LEVELS)
+				numLevels = SCleanNoiseMetrics::MAX_LEVELS;
+
+			// A coefficient which crosses the threshold moves about the energy of the threshold
+			const SCleanNoiseMetrics& m = metrics[f];
+			double flipEnergy = sparsityTolerance * frameLen * THRESH * THRESH * SCALE;
+			int numMismatches = (m.numLevels != numLevels);
+			numMismatches += (fabs(m.mse - err * SCALE / frameLen) > tolerance * err * SCALE / frameLen + flipEnergy / frameLen);
+			numMismatches += (fabs(m.sparsity - numZeros / frameLen) > sparsityTolerance);
+			numMismatches += (fabs(m.approxEnergy - approxEnergy * SCALE) > tolerance * approxEnergy * SCALE + flipEnergy);
+			for (int level = 0; level < numLevels; level++)
+			{
+				for (int o = 0; o < 3; o++)
+					numMismatches += (fabs(m.detailEnergy[level][o] - detailEnergy[level][o] * SCALE) >
+									  tolerance * detailEnergy[level][o] * SCALE + flipEnergy);
+			}
+			bResult = (numMismatches == 0);
+			std::cout << "Metrics of " << width << "x" << height << (isNS ? " non-standard" : "") << (m_isInPlace ? " in place" : "")
+					  << (isSoft ? " soft" : " hard") << (m_neighWindowSize ? " neighbourhood" : "") << " frame " << f << ": mse "
+					  << m.mse << " (" << err * SCALE / frameLen << ") sparsity " << m.sparsity << " (" << numZeros / frameLen << ")"
+					  << (bResult ? " passed" : " failed") << std::endl;
+		}
 	}
 
-	delete[] pTempBuff;
-	delete[] pResBuff;
-	delete[] pCorrectBuff;
-	clReleaseMemObject(gInBuff);
-	clReleaseMemObject(gOutBuff);
-
 	return bResult;
 }
 //-----------------------------------------------------------------------------------------
-bool CNoiseCleaner::TestMatThreshGPU()
+bool CNoiseCleaner::TestIntegerGPU()
 {
-	const int TEMP_BUFF_SIZE = 5;
-	float tempBuff[TEMP_BUFF_SIZE] = {0.f, -1.f, 2.f, -3.f, 4.f};
-	float resBuff[TEMP_BUFF_SIZE];
-	float correctBuff[TEMP_BUFF_SIZE] = {0.f, 0.f, 2.f, -3.f, 4.f};
-	float thresh = 1.f;
-
-	cl_int      clErr;
-	cl_mem		gInBuff;
-	cl_mem		gOutBuff;
-	cl_ulong	matThreshKernelTime = 0;
-
-	unsigned int gBuffSize = TEMP_BUFF_SIZE * sizeof(float);
-	gInBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_ONLY, gBuffSize, NULL, NULL);
-	gOutBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_WRITE_ONLY, gBuffSize, NULL, NULL);
-
-	clErr = clEnqueueWriteBuffer(m_oclEnv.m_cmdQ, gInBuff, CL_TRUE, 0, gBuffSize, tempBuff, 0, NULL, NULL);
-	OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+	// Without thresholding both the device and the CPU must reproduce the input exactly, and
+	// with thresholding they must agree with each other. 4096 samples need two passes.
+	const int NUM_SIZES = 5;
+	const int sizes[NUM_SIZES][2] = {{8, 8}, {64, 32}, {16, 256}, {256, 256}, {4096, 4}};
+	const float THRESH = 0.1f;
+	bool bResult = true;
 
-	bool bResult = MatrixThreshGPU(gInBuff, gOutBuff, TEMP_BUFF_SIZE, thresh, matThreshKernelTime);
-	OpenCLEnv::PrintProfilingInfo(matThreshKernelTime, "Matrix thresh");
-	if (bResult)
+	unsigned int seed = 24680;
+	for (int s = 0; s < NUM_SIZES && bResult; s++)
 	{
-		clErr = clEnqueueReadBuffer(m_oclEnv.m_cmdQ, gOutBuff, CL_TRUE, 0, gBuffSize, resBuff, 0, NULL, NULL);
-		OpenCLEnv::CheckForError(clErr, "reading data from device");
-		if (!OpenCLEnv::CompareFloatBuffers(correctBuff, resBuff, TEMP_BUFF_SIZE))
-				bResult = false;
-	}
+		int width = sizes[s][0];
+		int height = sizes[s][1];
+		int numPixels = width*height;
+		std::vector<unsigned char> in8(numPixels), out8(numPixels), ref8(numPixels);
+		std::vector<unsigned short> in16(numPixels), out16(numPixels), ref16(numPixels);
+		for (int i = 0; i < numPixels; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			in16[i] = (unsigned short)(seed >> 16);
+			in8[i] = (unsigned char)(in16[i] >> 8);
+		}
 
-	clReleaseMemObject(gInBuff);
-	clReleaseMemObject(gOutBuff);
+		bResult = (CleanNoiseInteger(&in8[0], &out8[0], width, height, 0.f, false) == 0) && (out8 == in8);
+		bResult = bResult && (CleanNoiseInteger(&in16[0], &out16[0], width, height, 0.f, false) == 0) && (out16 == in16);
+		bResult = bResult && (CIntegerHaar::CleanNoise(&in8[0], &ref8[0], width, height, 0.f, false) == 0) && (ref8 == in8);
+		bResult = bResult && (CIntegerHaar::CleanNoise(&in16[0], &ref16[0], width, height, 0.f, false) == 0) && (ref16 == in16);
+		for (int soft = 0; soft < 2 && bResult; soft++)
+		{
+			CleanNoiseInteger(&in8[0], &out8[0], width, height, THRESH, soft == 1);
+			CIntegerHaar::CleanNoise(&in8[0], &ref8[0], width, height, THRESH, soft == 1);
+			CleanNoiseInteger(&in16[0], &out16[0], width, height, THRESH, soft == 1);
+			CIntegerHaar::CleanNoise(&in16[0], &ref16[0], width, height, THRESH, soft == 1);
+			bResult = (out8 == ref8) && (out16 == ref16);
+		}
+		std::cout << "Integer CleanNoise " << width << "x" << height << (bResult ? ": exact" : ": mismatch") << std::endl;
+	}
 
 	return bResult;
 }
@@ -313,42 +3757,40 @@ bool CNoiseCleaner::TestHaarTransformGPU()
 		cl_mem					gInBuff;
 		cl_mem					gOutBuff;
 		cl_mem					gPartialBuff;
-		cl_ulong				totalFWTKernelTime = 0;
-		cl_ulong				totalIWTKernelTime = 0;
+		SCleanNoiseStats		stats;
+		SWorker*		pWorker = AcquireWorker();
 
 		// -----------------------------------------
 		// Allocate GPU buffers and send data to GPU
 		// -----------------------------------------
-		unsigned int gBuffSize = buffLen * sizeof(float);
-		gInBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, gBuffSize, NULL, NULL);
+		unsigned int gBuffSize = buffLen * (unsigned int)m_coefSize;
+		gInBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, gBuffSize, NULL, &clErr);
+		OpenCLEnv::CheckForError(clErr, "allocating device buffer");
 		gOutBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, gBuffSize, NULL, NULL);
 		gPartialBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_WRITE_ONLY, gBuffSize, NULL, NULL);
 
-		clErr = clEnqueueWriteBuffer(m_oclEnv.m_cmdQ, gInBuff, CL_TRUE, 0, gBuffSize, pInBuff, 0, NULL, NULL);
-		OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+		WriteCoefBuffer(*pWorker, gInBuff, pInBuff, buffLen);
 	
-		if (!ForwardHaarTransformGPU(gInBuff, gOutBuff, gPartialBuff, 1, numLevels, buffLen, globalOffset, totalFWTKernelTime))
+		if (!ForwardHaarTransformGPU(*pWorker, gInBuff, gOutBuff, gPartialBuff, 1, numLevels, buffLen, globalOffset, globalOffset, stats, SCleanNoiseStats::FWT_ROWS))
 			result = false;
-		OpenCLEnv::PrintProfilingInfo(totalFWTKernelTime, "ForwardHaarTransformGPU");
+		OpenCLEnv::PrintProfilingInfo(stats.stageTimes[SCleanNoiseStats::FWT_ROWS], "ForwardHaarTransformGPU");
 		if (result)
 		{
-			clErr = clEnqueueReadBuffer(m_oclEnv.m_cmdQ, gOutBuff, CL_TRUE, 0, gBuffSize, pOutBuff, 0, NULL, NULL);
-			OpenCLEnv::CheckForError(clErr, "reading data from device");
+			ReadCoefBuffer(*pWorker, gOutBuff, pOutBuff, buffLen);
 
 			if (OpenCLEnv::ReadFileFloat(TEST_REGRESS_FILE_1, &pRefData, &lenRef))
 			{
-				if (lenRef != buffLen || !OpenCLEnv::CompareFloatBuffers(pOutBuff, pRefData, buffLen))
+				if (lenRef != buffLen || !CompareTransformResult(pRefData, pOutBuff, buffLen, "ForwardHaarTransformGPU"))
 					result = false;
 				if (result)
 				{
-					if (!InverseHaarTransformGPU(gOutBuff, gInBuff, gPartialBuff, 1, numLevels, buffLen, globalOffset, totalIWTKernelTime))
+					if (!InverseHaarTransformGPU(*pWorker, gOutBuff, gInBuff, gPartialBuff, 1, numLevels, buffLen, globalOffset, globalOffset, stats, SCleanNoiseStats::IWT_ROWS))
 						result = false;
-					OpenCLEnv::PrintProfilingInfo(totalIWTKernelTime, "InverseHaarTransformGPU");
+					OpenCLEnv::PrintProfilingInfo(stats.stageTimes[SCleanNoiseStats::IWT_ROWS], "InverseHaarTransformGPU");
 					if (result)
 					{
-						clErr = clEnqueueReadBuffer(m_oclEnv.m_cmdQ, gInBuff, CL_TRUE, 0, gBuffSize, pInvRefData, 0, NULL, NULL);
-						OpenCLEnv::CheckForError(clErr, "reading data from device");
-						if (!OpenCLEnv::CompareFloatBuffers(pInBuff, pInvRefData, buffLen))
+						ReadCoefBuffer(*pWorker, gInBuff, pInvRefData, buffLen);
+						if (!CompareTransformResult(pInBuff, pInvRefData, buffLen, "InverseHaarTransformGPU"))
 							result = false;
 					}
 				}
@@ -359,6 +3801,7 @@ bool CNoiseCleaner::TestHaarTransformGPU()
 		delete[] pOutBuff;
 		delete[] pRefData;
 		delete[] pInvRefData;
+		ReleaseWorker(pWorker);
 		clReleaseMemObject(gInBuff);
 		clReleaseMemObject(gOutBuff);
 		clReleaseMemObject(gPartialBuff);
@@ -366,6 +3809,81 @@ bool CNoiseCleaner::TestHaarTransformGPU()
 	return result;
 }
 //-----------------------------------------------------------------------------------------
+void CNoiseCleaner::MakeTestFrame(unsigned char* pFrame, int len, int width, int ampX, double freqX, int ampY, double freqY,
+								  int noiseLevels, unsigned int& seed)
+{
+	for (int i = 0; i < len; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		pFrame[i] = (unsigned char)(128 + ampX*sin(freqX*(i % width)) + ampY*cos(freqY*(i / width)) + ((seed >> 16) % noiseLevels) -
+									noiseLevels / 2);
+	}
+}
+//-----------------------------------------------------------------------------------------
+CNoiseCleaner::CTestModeGuard::CTestModeGuard(CNoiseCleaner& cleaner) :
+m_cleaner(cleaner),
+m_isInPlace(cleaner.m_isInPlace),
+m_isNonStandard(cleaner.m_isNonStandard),
+m_neighWindowSize(cleaner.m_neighWindowSize)
+{
+}
+//-----------------------------------------------------------------------------------------
+CNoiseCleaner::CTestModeGuard::~CTestModeGuard()
+{
+	m_cleaner.m_isInPlace = m_isInPlace;
+	m_cleaner.m_isNonStandard = m_isNonStandard;
+	m_cleaner.m_neighWindowSize = m_neighWindowSize;
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::WriteCoefBuffer(SWorker& worker, cl_mem gBuff, const float* pBuff, size_t buffLen)
+{
+	cl_int clErr;
+	if (!m_isHalfPrecision)
+	{
+		clErr = clEnqueueWriteBuffer(worker.cmdQ, gBuff, CL_TRUE, 0, buffLen * sizeof(float), pBuff, 0, NULL, NULL);
+		OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+		return;
+	}
+
+	std::vector<cl_half> halves(buffLen);
+	for (size_t i = 0; i < buffLen; i++)
+		halves[i] = OpenCLEnv::FloatToHalf(pBuff[i]);
+	clErr = clEnqueueWriteBuffer(worker.cmdQ, gBuff, CL_TRUE, 0, buffLen * sizeof(cl_half), &halves[0], 0, NULL, NULL);
+	OpenCLEnv::CheckForError(clErr, "writing input buffer data to device");
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::ReadCoefBuffer(SWorker& worker, cl_mem gBuff, float* pBuff, size_t buffLen)
+{
+	cl_int clErr;
+	if (!m_isHalfPrecision)
+	{
+		clErr = clEnqueueReadBuffer(worker.cmdQ, gBuff, CL_TRUE, 0, buffLen * sizeof(float), pBuff, 0, NULL, NULL);
+		OpenCLEnv::CheckForError(clErr, "reading data from device");
+		return;
+	}
+
+	std::vector<cl_half> halves(buffLen);
+	clErr = clEnqueueReadBuffer(worker.cmdQ, gBuff, CL_TRUE, 0, buffLen * sizeof(cl_half), &halves[0], 0, NULL, NULL);
+	OpenCLEnv::CheckForError(clErr, "reading data from device");
+	for (size_t i = 0; i < buffLen; i++)
+		pBuff[i] = OpenCLEnv::HalfToFloat(halves[i]);
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::CompareTransformResult(const float* pRefBuff, const float* pBuff, unsigned int buffLen, const char* pName) const
+{
+	if (!m_isHalfPrecision)
+		return OpenCLEnv::CompareFloatBuffers(pRefBuff, pBuff, buffLen);
+
+	// The stored coefficients are rounded to halves, so the result is only compared by its PSNR,
+	// relative to the largest magnitude in the reference
+	float peak = 0.f;
+	for (unsigned int i = 0; i < buffLen; i++)
+		peak = (fabs(pRefBuff[i]) > peak) ? fabs(pRefBuff[i]) : peak;
+	double psnr = OpenCLEnv::ComputePSNR(pRefBuff, pBuff, buffLen, peak);
+	std::cout << pName << " PSNR (half precision): " << psnr << " dB" << std::endl;
+	return (psnr >= HALF_MIN_PSNR_DB);
+}
+//-----------------------------------------------------------------------------------------
 bool CNoiseCleaner::TestHaarTransformCPU()
 {
 	float* pInData = NULL;
@@ -403,179 +3921,544 @@ bool CNoiseCleaner::TestHaarTransformCPU()
 	return result;
 }
 //-----------------------------------------------------------------------------------------
-bool CNoiseCleaner::ForwardHaarTransformGPU(cl_mem gInBuff, cl_mem gOutBuff, cl_mem gPartialBuff, int numGroups,
-											unsigned int numLevels, unsigned int dataLen, unsigned int globalOffset, cl_ulong& kernelTime)
+bool CNoiseCleaner::ForwardHaarTransformGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, cl_mem gPartialBuff, int numGroups,
+											unsigned int numLevels, unsigned int dataLen, unsigned int inOffset,
+											unsigned int outOffset, SCleanNoiseStats& stats, int stage,
+											int kernelIdx /*= FWT_KERNEL_IDX*/)
 {
 	cl_int                  clErr;
-	cl_event                kernelEvent;
-	cl_ulong				totalKernelTime = 0;
+	cl_event                kernelEvent = NULL;
 
-	unsigned int numThreadsLeft = dataLen >> 1;
-	unsigned int numLevelsLeft = numLevels;
-	unsigned int globalOffsetByChars = globalOffset * sizeof(float);
+	// Rows of a single sample (the columns of frames with a width of 1) are their own coefficients
+	if (numLevels == 0)
+		return CopyRowsGPU(worker, gInBuff, gOutBuff, numGroups, dataLen, inOffset, outOffset, kernelIdx == FWT_INT_KERNEL, stats, stage);
 
-	// Number of levels on device are determined by the work-group size
-	size_t localWorkItems;
-	size_t globalWorkItems;
-	unsigned int maxLevelsOnDevice = 0;
-	unsigned int currLevels = 0;
-	CNoiseCleaner::GetNumLevels(m_oclEnv.m_kernelWorkGroupSizes[FWT_KERNEL_IDX], maxLevelsOnDevice);
-	maxLevelsOnDevice++;
+	// Number of levels on device are determined by the work-group size, or by the tuning
+	unsigned int maxLevelsOnDevice = GetLevelsPerPass(kernelIdx, dataLen);
+	unsigned int numPasses = (numLevels + maxLevelsOnDevice - 1) / maxLevelsOnDevice;
 
-	while (numThreadsLeft > 0)
+	// ---------------------------------------------------------------------------------------
+	// Every pass reduces the approximation left by the previous one (the first pass starts
+	// from the rows in 'gInBuff') and writes its details to 'gOutBuff'. The intermediate
+	// approximations alternate between two regions of 'gPartialBuff', the first one sized
+	// for the output of the first pass, and the last pass writes the top coefficient of
+	// every row to 'gOutBuff'.
+	// ---------------------------------------------------------------------------------------
+	cl_mem gSrcBuff = gInBuff;
+	unsigned int inLen = dataLen;
+	unsigned int srcOffset = inOffset;
+	unsigned int inStride = dataLen;
+	unsigned int numLevelsLeft = numLevels;
+	unsigned int regionOffsets[2] = {0, 0};
+	for (unsigned int pass = 0; pass < numPasses; pass++)
 	{
-		currLevels = numLevelsLeft < maxLevelsOnDevice ? numLevelsLeft : maxLevelsOnDevice;
-		localWorkItems = 1 << (currLevels - 1);
-		globalWorkItems = numThreadsLeft*numGroups;
-		// Each thread stores two floats in local memory
-		unsigned int locMemSize = localWorkItems * 2 * sizeof(cl_float);
+		unsigned int currLevels = numLevelsLeft < maxLevelsOnDevice ? numLevelsLeft : maxLevelsOnDevice;
+		unsigned int approxLen = inLen >> currLevels;
+		bool isLastPass = (pass + 1 == numPasses);
+		if (pass == 0)
+			regionOffsets[1] = approxLen*numGroups;
+		cl_mem gApproxBuff = isLastPass ? gOutBuff : gPartialBuff;
+		unsigned int approxOffset = isLastPass ? outOffset : regionOffsets[pass % 2];
+		unsigned int approxStride = isLastPass ? dataLen : approxLen;	// Intermediate rows are packed
+
+		// Each work-item covers 8 samples, shorter blocks are done by a single work-item
+		size_t localWorkItems = (currLevels >= 3) ? ((size_t)1 << (currLevels - 3)) : 1;
+		size_t globalWorkItems = localWorkItems*approxLen*numGroups;
+		// One float per work-item plus the padding
+		unsigned int locMemSize = (unsigned int)(localWorkItems + localWorkItems / NUM_BANKS) * sizeof(cl_float);
 
 		// Set arguments 
-		clSetKernelArg(m_oclEnv.m_kernels[FWT_KERNEL_IDX], 0, sizeof(cl_mem), &gInBuff);
-		clSetKernelArg(m_oclEnv.m_kernels[FWT_KERNEL_IDX], 1, sizeof(cl_mem), &gOutBuff);
-		clSetKernelArg(m_oclEnv.m_kernels[FWT_KERNEL_IDX], 2, sizeof(cl_mem), &gPartialBuff);
-		clSetKernelArg(m_oclEnv.m_kernels[FWT_KERNEL_IDX], 3, locMemSize, NULL);
-		clSetKernelArg(m_oclEnv.m_kernels[FWT_KERNEL_IDX], 4, sizeof(unsigned int), &currLevels);
-		clSetKernelArg(m_oclEnv.m_kernels[FWT_KERNEL_IDX], 5, sizeof(unsigned int), &globalOffset);
-		clSetKernelArg(m_oclEnv.m_kernels[FWT_KERNEL_IDX], 6, sizeof(unsigned int), &dataLen);
+		cl_kernel kernel = worker.kernels[kernelIdx];
+		clSetKernelArg(kernel, 0, sizeof(cl_mem), &gSrcBuff);
+		clSetKernelArg(kernel, 1, sizeof(cl_mem), &gOutBuff);
+		clSetKernelArg(kernel, 2, sizeof(cl_mem), &gApproxBuff);
+		clSetKernelArg(kernel, 3, locMemSize, NULL);
+		clSetKernelArg(kernel, 4, sizeof(unsigned int), &currLevels);
+		clSetKernelArg(kernel, 5, sizeof(unsigned int), &inLen);
+		clSetKernelArg(kernel, 6, sizeof(unsigned int), &srcOffset);
+		clSetKernelArg(kernel, 7, sizeof(unsigned int), &inStride);
+		clSetKernelArg(kernel, 8, sizeof(unsigned int), &outOffset);
+		clSetKernelArg(kernel, 9, sizeof(unsigned int), &dataLen);
+		clSetKernelArg(kernel, 10, sizeof(unsigned int), &approxOffset);
+		clSetKernelArg(kernel, 11, sizeof(unsigned int), &approxStride);
 		
 		// Run kernel
-		clErr = clEnqueueNDRangeKernel(m_oclEnv.m_cmdQ, m_oclEnv.m_kernels[FWT_KERNEL_IDX], 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, &kernelEvent);
+		clErr = clEnqueueNDRangeKernel(worker.cmdQ, kernel, 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
 		OpenCLEnv::CheckForError(clErr, "enqueuing FWT kernel");
-		
-		clErr = clWaitForEvents(1, &kernelEvent);
-		OpenCLEnv::CheckForError(clErr, "wait for kernel to finish");
-
-		totalKernelTime += OpenCLEnv::GetKernelTime(kernelEvent);
+		RecordCommand(worker, kernelEvent, stats, stage, KERNEL_NAMES[kernelIdx]);
 
+		gSrcBuff = gApproxBuff;
+		inLen = approxLen;
+		srcOffset = approxOffset;
+		inStride = approxStride;
 		numLevelsLeft -= currLevels;
-		numThreadsLeft >>= currLevels;
-
-		clReleaseEvent(kernelEvent);
 	}
-	kernelTime = totalKernelTime;
 
 	return true;
 }
 //-----------------------------------------------------------------------------------------
-bool CNoiseCleaner::InverseHaarTransformGPU(cl_mem gInBuff, cl_mem gOutBuff, cl_mem gPartialBuff, int numGroups,
-											unsigned int numLevels, unsigned int dataLen, unsigned int globalOffset, cl_ulong& kernelTime)
+bool CNoiseCleaner::InverseHaarTransformGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, cl_mem gPartialBuff, int numGroups,
+											unsigned int numLevels, unsigned int dataLen, unsigned int inOffset,
+											unsigned int outOffset, SCleanNoiseStats& stats, int stage,
+											int kernelIdx /*= IWT_KERNEL*/)
 {
 	cl_int                  clErr;
-	cl_event                kernelEvent;
-	cl_event                bufferSyncEvent;
-	cl_ulong				totalKernelTime = 0;
+	cl_event                kernelEvent = NULL;
 
-	unsigned int numThreadsLeft = dataLen >> 1;
-	unsigned int numLevelsLeft = numLevels;
-	unsigned int globalOffsetByChars = globalOffset * sizeof(float);
+	if (numLevels == 0)
+		return CopyRowsGPU(worker, gInBuff, gOutBuff, numGroups, dataLen, inOffset, outOffset, kernelIdx == IWT_INT_KERNEL, stats, stage);
 
-	// Number of levels on device are determined by the work-group size
-	size_t localWorkItems;
-	size_t globalWorkItems;
-	unsigned int maxLevelsOnDevice = 0;
-	unsigned int currLevels = 0;
-	CNoiseCleaner::GetNumLevels(m_oclEnv.m_kernelWorkGroupSizes[IWT_KERNEL], maxLevelsOnDevice);
-	maxLevelsOnDevice++;
-
-	// Activate first stage kernel
-	currLevels = numLevelsLeft < maxLevelsOnDevice ? numLevelsLeft : maxLevelsOnDevice;
-	localWorkItems = 1 << (currLevels - 1);
-	globalWorkItems = localWorkItems*numGroups;
-	// Each thread stores two floats in local memory
-	unsigned int locMemSize = localWorkItems * 2 * sizeof(cl_float);
-	// Set arguments 
-	clSetKernelArg(m_oclEnv.m_kernels[IWT_KERNEL], 0, sizeof(cl_mem), &gInBuff);
-	clSetKernelArg(m_oclEnv.m_kernels[IWT_KERNEL], 1, locMemSize, NULL);
-	clSetKernelArg(m_oclEnv.m_kernels[IWT_KERNEL], 2, locMemSize, NULL);
-	clSetKernelArg(m_oclEnv.m_kernels[IWT_KERNEL], 3, sizeof(cl_float), NULL);
-	clSetKernelArg(m_oclEnv.m_kernels[IWT_KERNEL], 4, sizeof(unsigned int), &currLevels);
-	clSetKernelArg(m_oclEnv.m_kernels[IWT_KERNEL], 5, sizeof(unsigned int), &globalOffset);
-	clSetKernelArg(m_oclEnv.m_kernels[IWT_KERNEL], 6, sizeof(unsigned int), &dataLen);
-		
-	// Run kernel
-	clErr = clEnqueueNDRangeKernel(m_oclEnv.m_cmdQ, m_oclEnv.m_kernels[IWT_KERNEL], 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, &kernelEvent);
-	OpenCLEnv::CheckForError(clErr, "enqueuing FWT kernel");
-		
-	clErr = clWaitForEvents(1, &kernelEvent);
-	OpenCLEnv::CheckForError(clErr, "wait for kernel to finish");
+	// Number of levels on device are determined by the work-group size, or by the tuning
+	unsigned int maxLevelsOnDevice = GetLevelsPerPass(kernelIdx, dataLen);
+	unsigned int numPasses = (numLevels + maxLevelsOnDevice - 1) / maxLevelsOnDevice;
+
+	// ---------------------------------------------------------------------------------------
+	// Every pass expands the approximation left by the previous one (the first pass starts
+	// from the top coefficient in 'gInBuff'). The intermediate approximations alternate
+	// between 'gPartialBuff' and 'gOutBuff' such that the last pass writes to 'gOutBuff',
+	// so no pass reads and writes the same buffer and nothing has to be copied at the end.
+	// ---------------------------------------------------------------------------------------
+	cl_mem gApproxBuff = gInBuff;
+	unsigned int approxOffset = inOffset;
+	unsigned int approxStride = dataLen;
+	unsigned int approxLen = 1;
+	unsigned int numLevelsLeft = numLevels;
+	for (unsigned int pass = 0; pass < numPasses; pass++)
+	{
+		// The first pass takes the remainder, so the intermediate approximations are as short as possible
+		unsigned int currLevels = (pass == 0) ? numLevels - (numPasses - 1)*maxLevelsOnDevice : maxLevelsOnDevice;
+		unsigned int outLen = approxLen << currLevels;
+		bool isToOutBuff = ((numPasses - pass) % 2) == 1;
+		cl_mem gDstBuff = isToOutBuff ? gOutBuff : gPartialBuff;
+		unsigned int dstOffset = isToOutBuff ? outOffset : 0;
+		unsigned int outStride = isToOutBuff ? dataLen : outLen;	// Intermediate rows are packed
 
-	totalKernelTime += OpenCLEnv::GetKernelTime(kernelEvent);
+		size_t localWorkItems = (size_t)1 << (currLevels - 1);
+		size_t globalWorkItems = localWorkItems*approxLen*numGroups;
+		// Each thread stores two floats in each of the local buffers
+		unsigned int locMemSize = localWorkItems * 2 * sizeof(cl_float);
 
-	numLevelsLeft -= currLevels;
-	numThreadsLeft = 1 << currLevels;
-		
-	bool switchBuffers = false;
+		// Set arguments 
+		cl_kernel kernel = worker.kernels[kernelIdx];
+		clSetKernelArg(kernel, 0, sizeof(cl_mem), &gInBuff);
+		clSetKernelArg(kernel, 1, sizeof(cl_mem), &gApproxBuff);
+		clSetKernelArg(kernel, 2, sizeof(cl_mem), &gDstBuff);
+		clSetKernelArg(kernel, 3, locMemSize, NULL);
+		clSetKernelArg(kernel, 4, locMemSize, NULL);
+		clSetKernelArg(kernel, 5, sizeof(unsigned int), &currLevels);
+		clSetKernelArg(kernel, 6, sizeof(unsigned int), &approxLen);
+		clSetKernelArg(kernel, 7, sizeof(unsigned int), &inOffset);
+		clSetKernelArg(kernel, 8, sizeof(unsigned int), &dataLen);
+		clSetKernelArg(kernel, 9, sizeof(unsigned int), &approxOffset);
+		clSetKernelArg(kernel, 10, sizeof(unsigned int), &approxStride);
+		clSetKernelArg(kernel, 11, sizeof(unsigned int), &dstOffset);
+		clSetKernelArg(kernel, 12, sizeof(unsigned int), &outStride);
 
-	if (!switchBuffers)
-	{
-		clErr = clEnqueueCopyBuffer(m_oclEnv.m_cmdQ, gInBuff, gOutBuff, globalOffsetByChars, globalOffsetByChars, numGroups*dataLen*sizeof(float), 0, NULL, &bufferSyncEvent);
-		OpenCLEnv::CheckForError(clErr, "copy buffers inside device");
-		clErr = clWaitForEvents(1, &bufferSyncEvent);
-		OpenCLEnv::CheckForError(clErr, "wait for buffer copy inside device");
+		// Run kernel
+		clErr = clEnqueueNDRangeKernel(worker.cmdQ, kernel, 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
+		OpenCLEnv::CheckForError(clErr, "enqueuing IWT kernel");
+		RecordCommand(worker, kernelEvent, stats, stage, KERNEL_NAMES[kernelIdx]);
 
-		clReleaseEvent(bufferSyncEvent);
+		gApproxBuff = gDstBuff;
+		approxOffset = dstOffset;
+		approxStride = outStride;
+		approxLen = outLen;
+		numLevelsLeft -= currLevels;
 	}
-	kernelTime = totalKernelTime;
 
 	return true;
 }
 //-----------------------------------------------------------------------------------------
-bool CNoiseCleaner::TransposeMatrixGPU(cl_mem gInBuff, cl_mem gOutBuff, int width, int height, cl_ulong& kernelTime)
+bool CNoiseCleaner::CopyRowsGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, int numRows, unsigned int dataLen, unsigned int inOffset,
+								unsigned int outOffset, bool isInteger, SCleanNoiseStats& stats, int stage)
+{
+	if (gInBuff == gOutBuff && inOffset == outOffset)
+		return true;
+
+	cl_event copyEvent = NULL;
+	size_t elemSize = isInteger ? sizeof(cl_int) : m_coefSize;
+	size_t copySize = numRows*dataLen*elemSize;
+	cl_int clErr = clEnqueueCopyBuffer(worker.cmdQ, gInBuff, gOutBuff, inOffset*elemSize, outOffset*elemSize, copySize, 0, NULL,
+									   GetEventSlot(&copyEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing buffer copy");
+	RecordCommand(worker, copyEvent, stats, stage, "copy", copySize);
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::TransposeMatrixGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, int width, int height, int numMatrices,
+									   SCleanNoiseStats& stats, int stage, bool isInteger /*= false*/)
 {
 	cl_int                  clErr;
-	cl_event                kernelEvent;
+	cl_event                kernelEvent = NULL;
 
-	unsigned int locMemSize = TILE_SIZE * TILE_SIZE * sizeof(cl_float);
-	clSetKernelArg(m_oclEnv.m_kernels[MAT_TRANSPOSE_KERNEL], 0, sizeof(cl_mem), &gInBuff);
-	clSetKernelArg(m_oclEnv.m_kernels[MAT_TRANSPOSE_KERNEL], 1, sizeof(cl_mem), &gOutBuff);
-	clSetKernelArg(m_oclEnv.m_kernels[MAT_TRANSPOSE_KERNEL], 2, locMemSize, NULL);
-	clSetKernelArg(m_oclEnv.m_kernels[MAT_TRANSPOSE_KERNEL], 3, sizeof(unsigned int), &width);
-	clSetKernelArg(m_oclEnv.m_kernels[MAT_TRANSPOSE_KERNEL], 4, sizeof(unsigned int), &height);
+	// The rows of the tiles are padded by one element
+	size_t tileSize = GetTransposeTileSize();
+	unsigned int locMemSize = (unsigned int)(tileSize * (tileSize + 1) * sizeof(cl_float));
+	bool isInPlace = (gInBuff == gOutBuff);
+	if (isInPlace && (width != height || isInteger))
+		return false;	// Only square matrices of floats can be transposed in place
 
-	size_t localWorkItems[2] = {TILE_SIZE, TILE_SIZE};
-	size_t globalWorkItems[2];
+	int kernelIdx = isInPlace ? MAT_TRANSPOSE_INPLACE_KERNEL : MAT_TRANSPOSE_KERNEL;
+	if (isInteger)
+		kernelIdx = MAT_TRANSPOSE_INT_KERNEL;
+	if (isInPlace)
+	{
+		clSetKernelArg(worker.kernels[kernelIdx], 0, sizeof(cl_mem), &gInBuff);
+		clSetKernelArg(worker.kernels[kernelIdx], 1, locMemSize, NULL);
+		clSetKernelArg(worker.kernels[kernelIdx], 2, locMemSize, NULL);
+		clSetKernelArg(worker.kernels[kernelIdx], 3, sizeof(unsigned int), &width);
+	}
+	else
+	{
+		clSetKernelArg(worker.kernels[kernelIdx], 0, sizeof(cl_mem), &gInBuff);
+		clSetKernelArg(worker.kernels[kernelIdx], 1, sizeof(cl_mem), &gOutBuff);
+		clSetKernelArg(worker.kernels[kernelIdx], 2, locMemSize, NULL);
+		clSetKernelArg(worker.kernels[kernelIdx], 3, sizeof(unsigned int), &width);
+		clSetKernelArg(worker.kernels[kernelIdx], 4, sizeof(unsigned int), &height);
+	}
+
+	// The third dimension selects the matrix
+	size_t localWorkItems[3] = {tileSize, tileSize, 1};
+	size_t globalWorkItems[3];
 	globalWorkItems[0] = ((width - 1) / localWorkItems[0] + 1) * localWorkItems[0];
 	globalWorkItems[1] = ((height - 1) / localWorkItems[1] + 1) * localWorkItems[1];
-	clErr = clEnqueueNDRangeKernel(m_oclEnv.m_cmdQ, m_oclEnv.m_kernels[MAT_TRANSPOSE_KERNEL], 2, NULL, globalWorkItems, localWorkItems, 0, NULL, &kernelEvent);
+	globalWorkItems[2] = numMatrices;
+	clErr = clEnqueueNDRangeKernel(worker.cmdQ, worker.kernels[kernelIdx], 3, NULL, globalWorkItems, localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
 	OpenCLEnv::CheckForError(clErr, "enqueuing transpose kernel");
-
-	clErr = clWaitForEvents(1, &kernelEvent);
-	OpenCLEnv::CheckForError(clErr, "wait for kernel to finish");
-
-	kernelTime = OpenCLEnv::GetKernelTime(kernelEvent);
-	clReleaseEvent(kernelEvent);
+	RecordCommand(worker, kernelEvent, stats, stage, KERNEL_NAMES[kernelIdx]);
 
 	return true;
 }
 //-----------------------------------------------------------------------------------------
-bool CNoiseCleaner::MatrixThreshGPU(cl_mem gInBuff, cl_mem gOutBuff, unsigned int dataLen, float thresh, cl_ulong& kernelTime, bool isSoftThresh /*= false*/)
+bool CNoiseCleaner::MatrixThreshGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, unsigned int dataLen, float thresh, SCleanNoiseStats& stats, int stage,
+									bool isSoftThresh /*= false*/)
 {
 	cl_int                  clErr;
-	cl_event                kernelEvent;
+	cl_event                kernelEvent = NULL;
 
 	int kernelIdx = MAT_HT_THRESH_KERNEL;
 	if (isSoftThresh)
 		kernelIdx = MAT_ST_THRESH_KERNEL;
 
-	clSetKernelArg(m_oclEnv.m_kernels[kernelIdx], 0, sizeof(cl_mem), &gInBuff);
-	clSetKernelArg(m_oclEnv.m_kernels[kernelIdx], 1, sizeof(cl_mem), &gOutBuff);
-	clSetKernelArg(m_oclEnv.m_kernels[kernelIdx], 2, sizeof(float), &thresh);
+	clSetKernelArg(worker.kernels[kernelIdx], 0, sizeof(cl_mem), &gInBuff);
+	clSetKernelArg(worker.kernels[kernelIdx], 1, sizeof(cl_mem), &gOutBuff);
+	clSetKernelArg(worker.kernels[kernelIdx], 2, sizeof(float), &thresh);
+	clSetKernelArg(worker.kernels[kernelIdx], 3, sizeof(unsigned int), &dataLen);
 
-	size_t localWorkItems = 256;
+	size_t localWorkItems = GetThreshWorkGroupSize();
 	size_t globalWorkItems = ((dataLen - 1) / localWorkItems + 1) * localWorkItems;
-	clErr = clEnqueueNDRangeKernel(m_oclEnv.m_cmdQ, m_oclEnv.m_kernels[kernelIdx], 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, &kernelEvent);
+	clErr = clEnqueueNDRangeKernel(worker.cmdQ, worker.kernels[kernelIdx], 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
 	OpenCLEnv::CheckForError(clErr, "enqueuing matrix thresh kernel");
+	RecordCommand(worker, kernelEvent, stats, stage, KERNEL_NAMES[kernelIdx]);
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::ThresholdCoefsGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, int numFrames, int width, int height,
+									  bool isNonStandard, float thresh, bool isSoftThresh, SCleanNoiseStats& stats)
+{
+	// The coefficients thresholded in place are gone afterwards, so the kernel of the metrics
+	// thresholds them itself before
+	bool isInPlace = (gInBuff == gOutBuff);
+	bool bResult = true;
+	if (worker.isMetricsRequested && isInPlace)
+		bResult = CollectMetricsGPU(worker, gInBuff, gInBuff, numFrames, width, height, isNonStandard, thresh, isSoftThresh, stats);
+
+	if (m_neighWindowSize == 0)
+		bResult = bResult && MatrixThreshGPU(worker, gInBuff, gOutBuff, width*height*numFrames, thresh, stats, SCleanNoiseStats::THRESHOLD,
+											 isSoftThresh);
+	else if (isNonStandard)
+		bResult = bResult && MatrixNeighThreshGPU(worker, gInBuff, gOutBuff, width, height, numFrames, true, thresh, stats,
+												  SCleanNoiseStats::THRESHOLD);
+	else	// The standard decomposition leaves the frames transposed
+		bResult = bResult && MatrixNeighThreshGPU(worker, gInBuff, gOutBuff, height, width, numFrames, false, thresh, stats,
+												  SCleanNoiseStats::THRESHOLD);
+
+	if (worker.isMetricsRequested && !isInPlace)
+		bResult = bResult && CollectMetricsGPU(worker, gInBuff, gOutBuff, numFrames, width, height, isNonStandard, thresh, isSoftThresh, stats);
+	return bResult;
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::GetMetricsLayout(int width, int height, bool isNonStandard, unsigned int& numLevels, size_t& numGroups,
+									 size_t& localWorkItems) const
+{
+	unsigned int numLevelsWidth = 0;
+	unsigned int numLevelsHeight = 0;
+	CNoiseCleaner::GetNumLevels(width, numLevelsWidth);
+	CNoiseCleaner::GetNumLevels(height, numLevelsHeight);
+	if (isNonStandard)
+		numLevels = (numLevelsWidth < numLevelsHeight) ? numLevelsWidth : numLevelsHeight;
+	else
+		numLevels = (numLevelsWidth > numLevelsHeight) ? numLevelsWidth : numLevelsHeight;
+	if (numLevels > SCleanNoiseMetrics::MAX_LEVELS)
+		numLevels = SCleanNoiseMetrics::MAX_LEVELS;	// The coarser levels are added to the last one
+
+	// Enough work-groups to fill the device, every one strides over the frame. The sums of a
+	// work-item take many registers, which may limit the work-group size of the kernel, and
+	// all of them are reduced together in the 32 KB of local memory every device has
+	size_t numSums = 3 + 3*numLevels;
+	localWorkItems = GetThreshWorkGroupSize();
+	while (localWorkItems > 1 && (localWorkItems > m_oclEnv.m_kernelWorkGroupSizes[COEF_METRICS_KERNEL] ||
+								  numSums*localWorkItems*sizeof(float) > METRICS_LOCAL_MEM_SIZE))
+		localWorkItems /= 2;
+	numGroups = ((size_t)width*height - 1) / localWorkItems + 1;
+	if (numGroups > METRICS_MAX_GROUPS)
+		numGroups = METRICS_MAX_GROUPS;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::CollectMetricsGPU(SWorker& worker, cl_mem gCoefsBuff, cl_mem gThreshedBuff, int numFrames, int width, int height,
+									  bool isNonStandard, float thresh, bool isSoftThresh, SCleanNoiseStats& stats)
+{
+	cl_int                  clErr;
+	cl_event                kernelEvent = NULL;
+
+	unsigned int numLevels;
+	size_t numGroups, localSize;
+	GetMetricsLayout(width, height, isNonStandard, numLevels, numGroups, localSize);
+	size_t numSums = 3 + 3*numLevels;
+	size_t metricsLen = numFrames*numGroups*numSums;
+	if (worker.metricsBuffLen < metricsLen)
+	{
+		if (worker.metricsBuffLen > 0)
+			clReleaseMemObject(worker.gMetricsBuff);
+		worker.gMetricsBuff = clCreateBuffer(m_oclEnv.m_context, CL_MEM_READ_WRITE, metricsLen * sizeof(float), NULL, &clErr);
+		OpenCLEnv::CheckForError(clErr, "allocating device buffer");
+		worker.metricsBuffLen = metricsLen;
+	}
+
+	// The standard decomposition leaves the frames transposed
+	unsigned int threshMode = (gCoefsBuff != gThreshedBuff) ? 0 : (isSoftThresh ? 2 : 1);
+	unsigned int rowLen = isNonStandard ? width : height;
+	unsigned int numRows = isNonStandard ? height : width;
+	unsigned int isNS = isNonStandard ? 1 : 0;
+	size_t localWorkItems[2] = {localSize, 1};
+	size_t globalWorkItems[2] = {numGroups*localWorkItems[0], (size_t)numFrames};
+	cl_kernel kernel = worker.kernels[COEF_METRICS_KERNEL];
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), &gCoefsBuff);
+	clSetKernelArg(kernel, 1, sizeof(cl_mem), &gThreshedBuff);
+	clSetKernelArg(kernel, 2, sizeof(float), &thresh);
+	clSetKernelArg(kernel, 3, sizeof(unsigned int), &threshMode);
+	clSetKernelArg(kernel, 4, sizeof(unsigned int), &rowLen);
+	clSetKernelArg(kernel, 5, sizeof(unsigned int), &numRows);
+	clSetKernelArg(kernel, 6, sizeof(unsigned int), &isNS);
+	clSetKernelArg(kernel, 7, sizeof(unsigned int), &numLevels);
+	clSetKernelArg(kernel, 8, numSums*localSize * sizeof(float), NULL);
+	clSetKernelArg(kernel, 9, sizeof(cl_mem), &worker.gMetricsBuff);
+	clErr = clEnqueueNDRangeKernel(worker.cmdQ, kernel, 2, NULL, globalWorkItems, localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing metrics kernel");
+	RecordCommand(worker, kernelEvent, stats, SCleanNoiseStats::METRICS, KERNEL_NAMES[COEF_METRICS_KERNEL]);
+
+	// The read completes before the blocking read of the frames, which follows it in the queue
+	unsigned int sumsSize = (unsigned int)(metricsLen * sizeof(float));
+	worker.metricsSums.resize(metricsLen);
+	clErr = clEnqueueReadBuffer(worker.cmdQ, worker.gMetricsBuff, CL_FALSE, 0, sumsSize, &worker.metricsSums[0], 0, NULL,
+								GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "reading metrics from device");
+	RecordCommand(worker, kernelEvent, stats, SCleanNoiseStats::DOWNLOAD, "read metrics", sumsSize);
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::FinishMetrics(const SWorker& worker, int numFrames, int width, int height, bool isNonStandard,
+								  SCleanNoiseMetrics* pMetrics) const
+{
+	unsigned int numLevels;
+	size_t numGroups, localSize;
+	GetMetricsLayout(width, height, isNonStandard, numLevels, numGroups, localSize);
+	size_t numSums = 3 + 3*numLevels;
+
+	// The coefficients are in gray levels divided by 255
+	const double SCALE = 255.0 * 255.0;
+	double frameLen = (double)width*height;
+	std::vector<double> sums(numSums);
+	for (int frame = 0; frame < numFrames; frame++)
+	{
+		sums.assign(numSums, 0.0);
+		for (size_t group = 0; group < numGroups; group++)
+		{
+			const float* pGroupSums = &worker.metricsSums[(frame*numGroups + group)*numSums];
+			for (size_t s = 0; s < numSums; s++)
+				sums[s] += pGroupSums[s];
+		}
+
+		SCleanNoiseMetrics& metrics = pMetrics[frame];
+		memset(&metrics, 0, sizeof(metrics));
+		metrics.mse = sums[0] * SCALE / frameLen;
+		metrics.psnrDb = (metrics.mse > 0.0) ? 10.0 * log10(SCALE / metrics.mse) : HUGE_VAL;
+		metrics.sparsity = sums[1] / frameLen;
+		metrics.numLevels = (int)numLevels;
+		metrics.approxEnergy = sums[2] * SCALE;
+		for (unsigned int level = 0; level < numLevels; level++)
+		{
+			for (int orientation = 0; orientation < 3; orientation++)
+				metrics.detailEnergy[level][orientation] = sums[3 + level*3 + orientation] * SCALE;
+		}
+	}
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::MatrixNeighThreshGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, int rowLen, int numRows, int numMatrices,
+										 bool isNonStandard, float thresh, SCleanNoiseStats& stats, int stage)
+{
+	cl_int                  clErr;
+	cl_event                kernelEvent = NULL;
 
-	clErr = clWaitForEvents(1, &kernelEvent);
-	OpenCLEnv::CheckForError(clErr, "wait for kernel to finish");
+	if (gInBuff == gOutBuff)
+		return false;	// The halos of a work-group are written by its neighbours
 
-	kernelTime = OpenCLEnv::GetKernelTime(kernelEvent);
-	clReleaseEvent(kernelEvent);
+	// The work-groups are the square tiles of the transposes, with a halo of half the window
+	size_t tileSize = GetTransposeTileSize();
+	unsigned int radius = m_neighWindowSize / 2;
+	unsigned int isNS = isNonStandard ? 1 : 0;
+	unsigned int locMemSize = (unsigned int)((tileSize + 2*radius) * (tileSize + 2*radius) * sizeof(cl_float));
+	cl_kernel kernel = worker.kernels[MAT_NEIGH_THRESH_KERNEL];
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), &gInBuff);
+	clSetKernelArg(kernel, 1, sizeof(cl_mem), &gOutBuff);
+	clSetKernelArg(kernel, 2, locMemSize, NULL);
+	clSetKernelArg(kernel, 3, sizeof(unsigned int), &rowLen);
+	clSetKernelArg(kernel, 4, sizeof(unsigned int), &numRows);
+	clSetKernelArg(kernel, 5, sizeof(float), &thresh);
+	clSetKernelArg(kernel, 6, sizeof(unsigned int), &radius);
+	clSetKernelArg(kernel, 7, sizeof(unsigned int), &isNS);
+
+	// The third dimension selects the matrix
+	size_t localWorkItems[3] = {tileSize, tileSize, 1};
+	size_t globalWorkItems[3];
+	globalWorkItems[0] = ((rowLen - 1) / localWorkItems[0] + 1) * localWorkItems[0];
+	globalWorkItems[1] = ((numRows - 1) / localWorkItems[1] + 1) * localWorkItems[1];
+	globalWorkItems[2] = numMatrices;
+	clErr = clEnqueueNDRangeKernel(worker.cmdQ, kernel, 3, NULL, globalWorkItems, localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing neighbourhood thresh kernel");
+	RecordCommand(worker, kernelEvent, stats, stage, KERNEL_NAMES[MAT_NEIGH_THRESH_KERNEL]);
+
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+bool CNoiseCleaner::MatrixThreshIntGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, int width, int height, int numMatrices,
+									   float thresh, SCleanNoiseStats& stats, int stage, bool isSoftThresh)
+{
+	cl_int                  clErr;
+	cl_event                kernelEvent = NULL;
+
+	unsigned int levelsX = 0;
+	unsigned int levelsY = 0;
+	CNoiseCleaner::GetNumLevels(width, levelsX);
+	CNoiseCleaner::GetNumLevels(height, levelsY);
+	unsigned int dataLen = width*height*numMatrices;
+
+	int kernelIdx = isSoftThresh ? MAT_ST_THRESH_INT_KERNEL : MAT_HT_THRESH_INT_KERNEL;
+	clSetKernelArg(worker.kernels[kernelIdx], 0, sizeof(cl_mem), &gInBuff);
+	clSetKernelArg(worker.kernels[kernelIdx], 1, sizeof(cl_mem), &gOutBuff);
+	clSetKernelArg(worker.kernels[kernelIdx], 2, sizeof(float), &thresh);
+	clSetKernelArg(worker.kernels[kernelIdx], 3, sizeof(unsigned int), &dataLen);
+	clSetKernelArg(worker.kernels[kernelIdx], 4, sizeof(unsigned int), &levelsX);
+	clSetKernelArg(worker.kernels[kernelIdx], 5, sizeof(unsigned int), &levelsY);
+
+	size_t localWorkItems = GetThreshWorkGroupSize();
+	size_t globalWorkItems = ((dataLen - 1) / localWorkItems + 1) * localWorkItems;
+	clErr = clEnqueueNDRangeKernel(worker.cmdQ, worker.kernels[kernelIdx], 1, NULL, &globalWorkItems, &localWorkItems, 0, NULL, GetEventSlot(&kernelEvent));
+	OpenCLEnv::CheckForError(clErr, "enqueuing matrix thresh kernel");
+	RecordCommand(worker, kernelEvent, stats, stage, KERNEL_NAMES[kernelIdx]);
 
 	return true;
 }
 //-----------------------------------------------------------------------------------------
+void CNoiseCleaner::RecordCommand(SWorker& worker, cl_event event, SCleanNoiseStats& stats, int stage, const char* pName, cl_ulong numBytes /*= 0*/)
+{
+	stats.launches[stage]++;
+	if (stage == SCleanNoiseStats::UPLOAD)
+		stats.bytesToDevice += numBytes;
+	else if (stage == SCleanNoiseStats::DOWNLOAD)
+		stats.bytesFromDevice += numBytes;
+
+	if (!m_oclEnv.m_isProfilingEnabled)
+		return;		// No event was requested, the in-order queue keeps the commands ordered
+
+	cl_int clErr = clWaitForEvents(1, &event);
+	OpenCLEnv::CheckForError(clErr, "wait for command to finish");
+
+	cl_ulong queuedTime, submitTime, startTime, endTime;
+	OpenCLEnv::GetCommandTimes(event, &queuedTime, &submitTime, &startTime, &endTime);
+	clReleaseEvent(event);
+
+	stats.stageTimes[stage] += endTime - startTime;
+	stats.queuedTimes[stage] += (startTime > queuedTime) ? (startTime - queuedTime) : 0;
+	if (m_pTracer)
+		m_pTracer->AddCommand(worker.cmdQ, pName, SCleanNoiseStats::STAGE_NAMES[stage], queuedTime, submitTime, startTime, endTime, numBytes);
+}
+//-----------------------------------------------------------------------------------------
+unsigned int CNoiseCleaner::GetMaxLevelsOnDevice(int kernelIdx) const
+{
+	// A work-group of N work-items transforms 2N samples, or 8N for the forward transform
+	// which does its first three levels in registers
+	unsigned int maxLevelsOnDevice = 0;
+	CNoiseCleaner::GetNumLevels((unsigned int)m_oclEnv.m_kernelWorkGroupSizes[kernelIdx], maxLevelsOnDevice);
+	bool isForward = (kernelIdx == FWT_KERNEL_IDX || kernelIdx == FWT_INT_KERNEL);
+	return maxLevelsOnDevice + (isForward ? 3 : 1);
+}
+//-----------------------------------------------------------------------------------------
+unsigned int CNoiseCleaner::GetLevelsPerPass(int kernelIdx, unsigned int dataLen) const
+{
+	unsigned int maxLevelsOnDevice = GetMaxLevelsOnDevice(kernelIdx);
+	unsigned int log2Len = 0;
+	CNoiseCleaner::GetNumLevels(dataLen, log2Len);
+	if (log2Len >= STuningParams::MAX_LOG2_LEN)
+		return maxLevelsOnDevice;
+
+	// The integer kernels follow the tuning of the float ones
+	bool isForward = (kernelIdx == FWT_KERNEL_IDX || kernelIdx == FWT_INT_KERNEL);
+	unsigned int levelsPerPass = isForward ? m_tuning.fwtLevelsPerPass[log2Len] : m_tuning.iwtLevelsPerPass[log2Len];
+	return (levelsPerPass == 0 || levelsPerPass > maxLevelsOnDevice) ? maxLevelsOnDevice : levelsPerPass;
+}
+//-----------------------------------------------------------------------------------------
+unsigned int CNoiseCleaner::GetTransposeTileSize() const
+{
+	// A tile is transposed by a work-group of 'tileSize' x 'tileSize' work-items
+	size_t tileSize = (m_tuning.transposeTileSize > 0) ? m_tuning.transposeTileSize : TILE_SIZE;
+	const int kernelIndices[3] = {MAT_TRANSPOSE_KERNEL, MAT_TRANSPOSE_INPLACE_KERNEL, MAT_TRANSPOSE_INT_KERNEL};
+	for (int i = 0; i < 3; i++)
+	{
+		if (tileSize * tileSize > m_oclEnv.m_kernelWorkGroupSizes[kernelIndices[i]])
+			return TILE_SIZE;
+	}
+	return (unsigned int)tileSize;
+}
+//-----------------------------------------------------------------------------------------
+unsigned int CNoiseCleaner::GetThreshWorkGroupSize() const
+{
+	size_t workGroupSize = (m_tuning.threshWorkGroupSize > 0) ? m_tuning.threshWorkGroupSize : THRESH_WORK_GROUP_SIZE;
+	const int kernelIndices[4] = {MAT_HT_THRESH_KERNEL, MAT_ST_THRESH_KERNEL, MAT_HT_THRESH_INT_KERNEL, MAT_ST_THRESH_INT_KERNEL};
+	for (int i = 0; i < 4; i++)
+	{
+		if (workGroupSize > m_oclEnv.m_kernelWorkGroupSizes[kernelIndices[i]])
+			return THRESH_WORK_GROUP_SIZE;
+	}
+	return (unsigned int)workGroupSize;
+}
+//-----------------------------------------------------------------------------------------
+size_t CNoiseCleaner::GetPartialBuffLen(unsigned int numLevels, unsigned int dataLen, unsigned int numRows,
+										 bool isInteger /*= false*/) const
+{
+	// Only multi-pass transforms need room for the intermediate approximations. The forward
+	// transform keeps two of them (the second one is at most half the first), the inverse
+	// one only the last, which is no longer than the first approximation of the forward one
+	size_t partialBuffLen = 1;
+	unsigned int maxLevelsFWT = GetLevelsPerPass(isInteger ? FWT_INT_KERNEL : FWT_KERNEL_IDX, dataLen);
+	unsigned int maxLevelsIWT = GetLevelsPerPass(isInteger ? IWT_INT_KERNEL : IWT_KERNEL, dataLen);
+	if (numLevels > maxLevelsFWT)
+	{
+		size_t approxLen = (size_t)numRows * (dataLen >> maxLevelsFWT);
+		partialBuffLen = approxLen + approxLen / 2;
+	}
+	if (numLevels > maxLevelsIWT)
+	{
+		size_t approxLen = (size_t)numRows * (dataLen >> maxLevelsIWT);
+		if (approxLen > partialBuffLen)
+			partialBuffLen = approxLen;
+	}
+	return partialBuffLen;
+}
+//-----------------------------------------------------------------------------------------
 bool CNoiseCleaner::GetNumLevels(unsigned int buffLen, unsigned int& numLevels)
 {
 	numLevels = (unsigned int)(log((double)buffLen) / log(2.0));
@@ -652,4 +4535,189 @@ void CNoiseCleaner::InverseHaarTransformCPU(const float* pInBuff, unsigned int b
 	delete[] pTempIn;
 }
 //-----------------------------------------------------------------------------------------
+void CNoiseCleaner::ForwardNonStandardCPU(const float* pInBuff, int width, int height, float* pOutBuff)
+{
+	memcpy(pOutBuff, pInBuff, width * height * sizeof(float));
+	std::vector<float> approx(width * height);
+
+	// Every level divides the approximation the previous one left into its four quadrants
+	int w = width;
+	int h = height;
+	while (w > 1 && h > 1)
+	{
+		for (int y = 0; y < h; y++)
+			memcpy(&approx[y*w], pOutBuff + y*width, w * sizeof(float));
+		w /= 2;
+		h /= 2;
+		for (int y = 0; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				float a = approx[2*y*2*w + 2*x];
+				float b = approx[2*y*2*w + 2*x + 1];
+				float c = approx[(2*y + 1)*2*w + 2*x];
+				float d = approx[(2*y + 1)*2*w + 2*x + 1];
+				pOutBuff[y*width + x] = (a + b + c + d) * 0.5f;
+				pOutBuff[y*width + w + x] = (a - b + c - d) * 0.5f;
+				pOutBuff[(h + y)*width + x] = (a + b - c - d) * 0.5f;
+				pOutBuff[(h + y)*width + w + x] = (a - b - c + d) * 0.5f;
+			}
+		}
+	}
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::InverseNonStandardCPU(const float* pInBuff, int width, int height, float* pOutBuff)
+{
+	memcpy(pOutBuff, pInBuff, width * height * sizeof(float));
+	std::vector<float> approx(width * height);
+
+	int w = width;
+	int h = height;
+	while (w > 1 && h > 1)
+	{
+		w /= 2;
+		h /= 2;
+	}
+	while (w < width && h < height)
+	{
+		for (int y = 0; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				float ll = pOutBuff[y*width + x];
+				float hl = pOutBuff[y*width + w + x];
+				float lh = pOutBuff[(h + y)*width + x];
+				float hh = pOutBuff[(h + y)*width + w + x];
+				approx[2*y*2*w + 2*x] = (ll + hl + lh + hh) * 0.5f;
+				approx[2*y*2*w + 2*x + 1] = (ll - hl + lh - hh) * 0.5f;
+				approx[(2*y + 1)*2*w + 2*x] = (ll + hl - lh - hh) * 0.5f;
+				approx[(2*y + 1)*2*w + 2*x + 1] = (ll - hl - lh + hh) * 0.5f;
+			}
+		}
+		w *= 2;
+		h *= 2;
+		for (int y = 0; y < h; y++)
+			memcpy(pOutBuff + y*width, &approx[y*w], w * sizeof(float));
+	}
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::NeighThreshCPU(const float* pInBuff, int rowLen, int numRows, bool isNonStandard, int windowSize, float thresh,
+								   float* pOutBuff)
+{
+	int radius = windowSize / 2;
+	for (int y = 0; y < numRows; y++)
+	{
+		for (int x = 0; x < rowLen; x++)
+		{
+			// The subband of the coefficient along each axis, an empty one for the approximation
+			int startX = 0, endX = 0, startY = 0, endY = 0;
+			if (!isNonStandard)
+			{
+				for (startX = 1; startX*2 <= x; startX *= 2);
+				endX = (x == 0) ? 1 : startX*2;
+				startX = (x == 0) ? 0 : startX;
+				for (startY = 1; startY*2 <= y; startY *= 2);
+				endY = (y == 0) ? 1 : startY*2;
+				startY = (y == 0) ? 0 : startY;
+				if (x == 0 && y == 0)
+					endX = 0;
+			}
+			else
+			{
+				for (int w = rowLen / 2, h = numRows / 2; w > 0 && h > 0; w /= 2, h /= 2)
+				{
+					if (x >= w || y >= h)
+					{
+						startX = (x >= w) ? w : 0;
+						endX = startX + w;
+						startY = (y >= h) ? h : 0;
+						endY = startY + h;
+						break;
+					}
+				}
+			}
+
+			float coef = pInBuff[y*rowLen + x];
+			if (endX == 0)
+			{
+				pOutBuff[y*rowLen + x] = coef;
+				continue;
+			}
+			float energy = 0.f;
+			for (int winY = (y - radius > startY ? y - radius : startY); winY < endY && winY <= y + radius; winY++)
+				for (int winX = (x - radius > startX ? x - radius : startX); winX < endX && winX <= x + radius; winX++)
+					energy += pInBuff[winY*rowLen + winX] * pInBuff[winY*rowLen + winX];
+			float shrink = (energy > 0.f) ? 1.f - thresh*thresh / energy : 0.f;
+			pOutBuff[y*rowLen + x] = coef * (shrink > 0.f ? shrink : 0.f);
+		}
+	}
+}
+//-----------------------------------------------------------------------------------------
+void CNoiseCleaner::CleanNoisePatchesCPU(const unsigned char* in, unsigned char* out, int width, int height, int patchSize, int step,
+										  float thresh, bool isSoftThresh)
+{
+	int numPatchesX = (width - patchSize + step - 1) / step + 1;
+	int numPatchesY = (height - patchSize + step - 1) / step + 1;
+	bool isOverlapping = (step != patchSize || width % patchSize != 0 || height % patchSize != 0);
+	std::vector<float> patch(patchSize * patchSize), column(patchSize), temp(patchSize);
+	std::vector<int> sums(width * height, 0), coverage(width * height, 0);
+
+	for (int patchY = 0; patchY < numPatchesY; patchY++)
+	{
+		for (int patchX = 0; patchX < numPatchesX; patchX++)
+		{
+			int startX = (patchX*step < width - patchSize) ? patchX*step : width - patchSize;
+			int startY = (patchY*step < height - patchSize) ? patchY*step : height - patchSize;
+			for (int y = 0; y < patchSize; y++)
+			{
+				for (int x = 0; x < patchSize; x++)
+					temp[x] = (float)in[(startY + y)*width + startX + x] / 255.f;
+				ForwardHaarTransformCPU(&temp[0], patchSize, &patch[y*patchSize], 0);
+			}
+			for (int x = 0; x < patchSize; x++)
+			{
+				for (int y = 0; y < patchSize; y++)
+					temp[y] = patch[y*patchSize + x];
+				ForwardHaarTransformCPU(&temp[0], patchSize, &column[0], 0);
+				for (int y = 0; y < patchSize; y++)
+				{
+					float res = fabs(column[y]) - thresh;
+					if (isSoftThresh)
+						temp[y] = (res > 0.f) ? ((column[y] < 0.f) ? -res : res) : 0.f;
+					else
+						temp[y] = (res > 0.f) ? column[y] : 0.f;
+				}
+				InverseHaarTransformCPU(&temp[0], patchSize, &column[0], 0);
+				for (int y = 0; y < patchSize; y++)
+					patch[y*patchSize + x] = column[y];
+			}
+			for (int y = 0; y < patchSize; y++)
+			{
+				InverseHaarTransformCPU(&patch[y*patchSize], patchSize, &temp[0], 0);
+				for (int x = 0; x < patchSize; x++)
+				{
+					int idx = (startY + y)*width + startX + x;
+					float res = temp[x] * 255.f;
+					if (isOverlapping)
+					{
+						sums[idx] += (int)floor(res * 256.f + 0.5f);
+						coverage[idx]++;
+					}
+					else
+						out[idx] = (unsigned char)((res < 0.f) ? 0.f : ((res > 255.f) ? 255.f : res));
+				}
+			}
+		}
+	}
+
+	if (isOverlapping)
+	{
+		for (int i = 0; i < width*height; i++)
+		{
+			float res = (float)sums[i] / (coverage[i] * 256.f);
+			out[i] = (unsigned char)((res < 0.f) ? 0.f : ((res > 255.f) ? 255.f : res));
+		}
+	}
+}
+//-----------------------------------------------------------------------------------------
 
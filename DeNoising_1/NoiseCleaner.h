@@ -23,6 +23,83 @@
 
 
 #include <CL/cl.h>
+#include "NoiseCleanerStats.h"
+#include "EventTracer.h"
+#include <vector>
+
+
+/** Effective bandwidth of the transpose kernels, in GB/s of bytes read plus written per second of kernel time,
+	next to a device-to-device copy of the same matrix as measured by 'CNoiseCleaner::MeasureTransposeBandwidth' **/
+struct STransposeBandwidth
+{
+	double	outOfPlaceGBs;
+	double	inPlaceGBs;			// 0 for matrices which are not square
+	double	copyGBs;
+};
+
+/** Device memory used by one 'CleanNoiseBatch' call in bytes, see 'CNoiseCleaner::GetDeviceMemoryFootprint' **/
+struct SDeviceMemoryFootprint
+{
+	size_t	frameBytes;			// The buffer the frames are uploaded to
+	size_t	outBytes;			// The second full-size buffer, or only the scratch of the in-place pipeline
+	size_t	partialBytes;		// The intermediate approximations of the multi-pass transforms
+	size_t	totalBytes;
+	bool	isInPlace;			// False if the in-place pipeline was asked for but cannot be used
+};
+
+/** What one 'CNoiseCleaner::CleanNoiseIncremental' call recomputed **/
+struct SIncrementalInfo
+{
+	int		numTiles;
+	int		numDirtyTiles;		// Tiles with at least one pixel which differs from the previous frame
+	bool	isFullRecompute;	// The first frame, a new threshold or too many dirty tiles
+};
+
+/** Quality and sparsity of one frame of 'CNoiseCleaner::CleanNoise', reduced on the device. The
+	energies of at most MAX_LEVELS levels are kept: for a side of 2^17 or more the coarser levels
+	are added to level MAX_LEVELS, which is 'numLevels' then **/
+struct SCleanNoiseMetrics
+{
+	enum { MAX_LEVELS = 16 };
+
+	double	mse;							// Of the denoised frame against the input in gray levels, before the rounding
+	double	psnrDb;							// HUGE_VAL if the thresholding removed nothing
+	double	sparsity;						// Fraction of the coefficients which are zero after the thresholding
+	int		numLevels;						// Of 'detailEnergy', at most MAX_LEVELS
+	double	approxEnergy;					// The energies of the coefficients after the thresholding, in gray
+	double	detailEnergy[MAX_LEVELS][3];	// levels squared, by [level - 1][details along x, along y, both]
+};
+
+/** One of the thresholds evaluated by 'CNoiseCleaner::EvaluateThresholds' **/
+struct SThresholdMetrics
+{
+	float	thresh;
+	double	sparsity;		// Fraction of the coefficients which are zero after the thresholding
+	double	mse;			// Mean squared difference (in gray levels) of the reconstruction from the input
+	double	psnrDb;			// PSNR of the reconstruction against the input, HUGE_VAL if they are identical
+};
+
+/** The coefficients of one frame which survive a threshold, see 'CNoiseCleaner::CompactCoefficients' **/
+struct SSparseCoefficients
+{
+	int						width;
+	int						height;
+	bool					isNonStandard;	// The decomposition of the coefficients, see 'CNoiseCleaner::SetNonStandardMode'
+	std::vector<cl_uint>	indices;	// Ascending positions in the transformed frame, which is transposed in the
+	std::vector<float>		values;		// standard decomposition (index = x*height + y for column x and row y) and
+										// not in the non-standard one (index = y*width + x)
+};
+
+/** Launch parameters of the kernels on one device, see 'CNoiseCleaner::AutoTune'. Zero selects the default **/
+struct STuningParams
+{
+	enum { MAX_LOG2_LEN = 32 };
+
+	unsigned int	transposeTileSize;					// Side of the square transpose work-groups
+	unsigned int	threshWorkGroupSize;
+	unsigned int	fwtLevelsPerPass[MAX_LOG2_LEN];		// Indexed by log2 of the row length, 0 for the most levels
+	unsigned int	iwtLevelsPerPass[MAX_LOG2_LEN];		// one work-group of the kernel can do
+};
 
 
 // -----------------------------------------------------------------------------------------
@@ -34,11 +111,26 @@
 // the accompanying 'HWT_kernels.cl' file and compiles them. This results in a
 // slight delay, but once an instance is constructed it can be used throughout
 // the application many times without recompiling the kernels.
+// 'CleanNoise' may be called from several threads at the same time. Every call takes a
+// worker (a command queue, its own kernel objects and device workspaces) from a pool which
+// grows on demand, so concurrent calls never share OpenCL objects with mutable state.
 // -----------------------------------------------------------------------------------------
 class CNoiseCleaner
 {
 public:
-	CNoiseCleaner();
+	// -----------------------------------------------------------------------------------------
+	// 'deviceType' - Selects the OpenCL device to run on, the first GPU is used by default.
+	// 'isProfilingEnabled' - If false the command queue is created without
+	//						  CL_QUEUE_PROFILING_ENABLE and no per-command events are waited on,
+	//						  so 'SCleanNoiseStats' only carries counters and host times.
+	// 'isHalfPrecision' - If true the wavelet coefficients are kept in device memory as 16-bit
+	//					   halves (the kernels are built with COEF_HALF), which halves the memory
+	//					   traffic of every stage and the device memory. All arithmetic is still
+	//					   done in 32-bit floats, only the stored coefficients are rounded.
+	// The tuning file of the device (see 'AutoTune') is loaded if it exists.
+	// -----------------------------------------------------------------------------------------
+	CNoiseCleaner(cl_device_type deviceType = CL_DEVICE_TYPE_GPU, bool isProfilingEnabled = true,
+				  bool isHalfPrecision = false);
 	~CNoiseCleaner();
 
 	// -----------------------------------------------------------------------------------------
@@ -51,14 +143,234 @@ public:
 	// 3. Run inverse Haar transform on the filtered wavelet coefficients.
 	// 'width', 'height' - Specify the size of the 'in' matrix, it is assumed that 'width'=2^J and
 	//					   'height'= 2^K, in other words, width and height are equal to some power of 2
-	//						and it doesn't have to be same power. However the maximal possible size of
-	//						width and height is limited to 1024.
+	//						and it doesn't have to be same power.
 	// 'thresh' - Specifies the threshold to use during the 2nd stage.
 	// 'isSoftThresh' - If this value is true then 'soft threshold' is used, otherwise 'hard threshold' is
 	//					used in the 2nd stage. The behaviour of this two thresholding techniques is exactly 
 	//					the same as in WaveLab's 'ThreshWave2' function (which is part of DeNoising package).
+	// 'pStats' - If not NULL, receives the per-stage timings and counters of this call.
+	// 'pMetrics' - If not NULL, receives the MSE/PSNR of the output against the input, the sparsity
+	//				of the thresholded coefficients and their energy per subband. They are reduced
+	//				from the coefficients on the device (the transform is orthonormal, so the energy
+	//				the thresholding removes is the squared error of the output) and only the sums
+	//				of the work-groups are read back. Level 1 is the finest, in the standard
+	//				decomposition the subbands of two scales count in the finer one. Their kernel
+	//				time is accounted to the METRICS stage.
+	// Returns 0 on success, nonzero if 'width' or 'height' is not a power of 2 (nothing is written
+	// to 'out' then) or the device failed.
+	// -----------------------------------------------------------------------------------------
+	int CleanNoise(unsigned char *in, unsigned char *out, int width, int height, float thresh, bool isSoftThresh,
+				   SCleanNoiseStats* pStats = NULL, SCleanNoiseMetrics* pMetrics = NULL);
+
+	// -----------------------------------------------------------------------------------------
+	// Same as 'CleanNoise' for 'numFrames' matrices of the same size, 'ppIn[i]' is cleaned into
+	// 'ppOut[i]'. All frames go through the pipeline together, so every kernel is launched once
+	// for the whole batch, which amortizes the launch and transfer overheads of small frames.
+	// 'pStats' describes the whole batch, 'pMetrics' has an entry for every frame.
+	// -----------------------------------------------------------------------------------------
+	int CleanNoiseBatch(unsigned char** ppIn, unsigned char** ppOut, int numFrames, int width, int height, float thresh,
+						bool isSoftThresh, SCleanNoiseStats* pStats = NULL, SCleanNoiseMetrics* pMetrics = NULL);
+
+	// -----------------------------------------------------------------------------------------
+	// Same as 'CleanNoise' for the 'roiWidth' x 'roiHeight' region at ('roiX', 'roiY') of frames
+	// whose rows start every 'inPitch' and 'outPitch' bytes ('IplImage::widthStep'), so padded
+	// rows and windows of larger frames need no repacking. Only the region is transferred,
+	// straight from and to the given buffers with clEnqueueWriteBufferRect/ReadBufferRect, and
+	// converted from and to gray levels on the device, so the cost follows the region and not
+	// the frame. The sides of the region must be powers of 2, the pixels of 'out' outside it are
+	// not touched and the output is identical to 'CleanNoise' on the packed region.
+	// -----------------------------------------------------------------------------------------
+	int CleanNoiseRegion(const unsigned char* in, int inPitch, unsigned char* out, int outPitch, int roiX, int roiY, int roiWidth,
+						 int roiHeight, float thresh, bool isSoftThresh, SCleanNoiseStats* pStats = NULL);
+
+	// -----------------------------------------------------------------------------------------
+	// Same as 'CleanNoise', and also writes previews of the denoised frame at 'numThumbnails'
+	// levels: 'ppThumbnails[i]' receives the (width >> pLevels[i]) x (height >> pLevels[i])
+	// approximation of level 'pLevels[i]', which is its LL subband rescaled to gray levels, or
+	// the mean of every 2^level x 2^level block. They are reduced in local memory by the kernel
+	// which converts the frame to gray levels on the device and read back with it in one
+	// transfer. The levels must be distinct, from 1 to THUMBNAIL_MAX_LEVEL and not beyond the
+	// sides of the frame.
+	// -----------------------------------------------------------------------------------------
+	enum { THUMBNAIL_MAX_LEVEL = 4 };
+	int CleanNoiseThumbnails(const unsigned char* in, unsigned char* out, int width, int height, float thresh, bool isSoftThresh,
+							 const int* pLevels, int numThumbnails, unsigned char** ppThumbnails, SCleanNoiseStats* pStats = NULL);
+
+	// -----------------------------------------------------------------------------------------
+	// Same as 'CleanNoise' with the integer-to-integer Haar transform (the S-transform, see
+	// IntegerHaar.h) on 'int' coefficients, for 8-bit or 16-bit samples. The transform is
+	// exactly reversible, so with a zero threshold 'out' is identical to 'in', and the result
+	// is bit-exact with 'CIntegerHaar::CleanNoise' on the CPU for any threshold. 'thresh' is
+	// relative to the full scale like for 'CleanNoise' and is scaled to every coefficient,
+	// so the output stays close to the floating point pipeline. Always uses the default
+	// (not in-place) pipeline.
+	// -----------------------------------------------------------------------------------------
+	int CleanNoiseInteger(const unsigned char* in, unsigned char* out, int width, int height, float thresh, bool isSoftThresh,
+						  SCleanNoiseStats* pStats = NULL);
+	int CleanNoiseInteger(const unsigned short* in, unsigned short* out, int width, int height, float thresh, bool isSoftThresh,
+						  SCleanNoiseStats* pStats = NULL);
+
+	// -----------------------------------------------------------------------------------------
+	// Incremental denoising of a sequence of frames of the same size which change in small
+	// regions (surveillance or screen capture feeds). A stream keeps the frame and its wavelet
+	// coefficients resident on the device. Every frame is compared with the previous one on the
+	// device in square tiles of 'tileSize' (a power of 2 which divides the width and the height),
+	// only the rows of the tiles which changed are transformed again and only the coefficients
+	// whose support covers them are transformed along the columns. Then only the pixels of the
+	// changed tiles are reconstructed, directly from the coefficients on their path. The
+	// other pixels keep their previous output, although changes elsewhere may move them
+	// slightly through the coarse coefficients. The whole frame is recomputed for the first
+	// frame, a new threshold or mode, or when more than 'maxDirtyFraction' of the tiles changed.
+	// A stream is used by one thread at a time and must be released before this instance.
+	// Only the standard decomposition and the pointwise thresholding are supported, the stream is
+	// not created and the frames fail while the non-standard decomposition or the neighbourhood
+	// thresholding is selected. Returns NULL if the sizes are not supported.
+	// -----------------------------------------------------------------------------------------
+	struct SIncrementalStream;
+	SIncrementalStream* CreateIncrementalStream(int width, int height, int tileSize = 32, float maxDirtyFraction = 0.25f);
+	void ReleaseIncrementalStream(SIncrementalStream* pStream);
+	int CleanNoiseIncremental(SIncrementalStream* pStream, const unsigned char* in, unsigned char* out, float thresh,
+							  bool isSoftThresh, SCleanNoiseStats* pStats = NULL, SIncrementalInfo* pInfo = NULL);
+
+	// -----------------------------------------------------------------------------------------
+	// Streaming denoising of unbounded 1D signals (sensor time series) on 'numChannels'
+	// channels which advance together. Every channel is cut into consecutive blocks of
+	// 'blockLen' samples (a power of 2) which go through the 1D forward transform, the
+	// thresholding and the inverse transform independently, since the Haar basis functions
+	// of a block do not reach beyond it. 'CleanNoiseSignal' takes the next 'numSamples'
+	// samples of every channel and writes the denoised samples of the blocks they complete,
+	// the blocks of all the channels go through the kernels together, one launch per stage.
+	// A stream only keeps the samples of the incomplete block of every channel, so a sample is
+	// emitted at most 'blockLen' - 1 samples after it was given. 'ppOut[c]' must have room for
+	// 'numSamples' + 'blockLen' - 1 samples, the number of samples written to every channel is
+	// returned, or -1 on failure. 'FlushSignalStream' emits the incomplete blocks, extended
+	// with their last sample, and restarts the stream. 'thresh' is in sample units.
 	// -----------------------------------------------------------------------------------------
-	int CleanNoise(unsigned char *in, unsigned char *out, int width, int height, float thresh, bool isSoftThresh);
+	struct SSignalStream;
+	SSignalStream* CreateSignalStream(int numChannels, int blockLen = 1024);
+	void ReleaseSignalStream(SSignalStream* pStream);
+	int CleanNoiseSignal(SSignalStream* pStream, const float* const* ppIn, int numSamples, float* const* ppOut, float thresh,
+						 bool isSoftThresh, SCleanNoiseStats* pStats = NULL);
+	int FlushSignalStream(SSignalStream* pStream, float* const* ppOut, float thresh, bool isSoftThresh, SCleanNoiseStats* pStats = NULL);
+
+	// -----------------------------------------------------------------------------------------
+	// Threshold sweeps on one frame. 'ForwardTransform' uploads the frame and runs the forward
+	// transforms once, the coefficients stay on the device until 'ReleaseCoefficients'.
+	// 'Reconstruct' runs only the thresholding and the inverse transforms, and its output is
+	// identical to 'CleanNoise' with the same threshold. 'EvaluateThresholds' evaluates
+	// 'numThresholds' thresholds in a single launch without reconstructing: the transform is
+	// orthonormal, so the squared error of a reconstruction equals the energy of the coefficients
+	// the thresholding removes. With the neighbourhood thresholding every threshold takes a
+	// thresholding and a metrics launch instead, and 'isSoftThresh' is ignored. 'ForwardTransform'
+	// uses the decomposition selected when it is called, the coefficients keep it for the other
+	// calls. It returns NULL if the size is not supported. The coefficients must be released
+	// before this instance.
+	// -----------------------------------------------------------------------------------------
+	struct SCoefficients;
+	SCoefficients* ForwardTransform(const unsigned char* in, int width, int height, SCleanNoiseStats* pStats = NULL);
+	void ReleaseCoefficients(SCoefficients* pCoefs);
+	int Reconstruct(SCoefficients* pCoefs, unsigned char* out, float thresh, bool isSoftThresh, SCleanNoiseStats* pStats = NULL);
+	int EvaluateThresholds(SCoefficients* pCoefs, const float* pThresholds, int numThresholds, bool isSoftThresh,
+						   SThresholdMetrics* pMetrics, SCleanNoiseStats* pStats = NULL);
+
+	// -----------------------------------------------------------------------------------------
+	// Sparse output for archiving or transmitting coefficients rather than pixels.
+	// 'CompactCoefficients' thresholds the coefficients of 'ForwardTransform' and compacts the
+	// nonzero ones on the device with a parallel prefix sum, so only the (index, value) pairs
+	// are read back. 'ReconstructSparse' scatters the pairs into a zeroed matrix on the device
+	// and runs the inverse transforms, its output is identical to 'Reconstruct' with the
+	// threshold the pairs were compacted with, also with the neighbourhood thresholding.
+	// Both return 0 on success.
+	// -----------------------------------------------------------------------------------------
+	int CompactCoefficients(SCoefficients* pCoefs, float thresh, bool isSoftThresh, SSparseCoefficients* pSparse,
+							SCleanNoiseStats* pStats = NULL);
+	int ReconstructSparse(const SSparseCoefficients* pSparse, unsigned char* out, SCleanNoiseStats* pStats = NULL);
+
+	// -----------------------------------------------------------------------------------------
+	// Denoises an 8-bit image patch by patch, for patch-based workflows with many small blocks.
+	// Every square patch of 'patchSize' (a power of 2 from 2 to PATCH_MAX_SIZE) goes through the
+	// forward transforms, the thresholding and the inverse transforms of 'CleanNoise' in the local
+	// memory of one work-group, so all the patches take a single launch. The patches start every
+	// 'step' pixels (1 to 'patchSize') along both sides and the last ones are moved to the right
+	// and bottom edges, so the image sides need not be multiples of 'step' or powers of 2, only
+	// at least 'patchSize'. Overlapping patches are averaged on the device. A stack of separate
+	// patches is passed as an image of 'patchSize' x (N * 'patchSize') with a 'step' of 'patchSize'.
+	// The coefficients are kept in 32-bit floats also in the half precision mode. The kernel time
+	// is accounted to the FWT_ROWS stage and the averaging to IWT_ROWS. Returns 0 on success.
+	// -----------------------------------------------------------------------------------------
+	enum { PATCH_MAX_SIZE = 64 };
+	int CleanNoisePatches(const unsigned char* in, unsigned char* out, int width, int height, int patchSize, int step, float thresh,
+						  bool isSoftThresh, SCleanNoiseStats* pStats = NULL);
+
+	// -----------------------------------------------------------------------------------------
+	// Returns the name of the OpenCL device used by this instance.
+	// -----------------------------------------------------------------------------------------
+	const char* GetDeviceName() const { return m_oclEnv.m_deviceName; }
+
+	// -----------------------------------------------------------------------------------------
+	// Attaches a collector which receives the stats of every subsequent 'CleanNoise' call,
+	// NULL detaches it. The collector is not owned by this instance. It must not be changed
+	// while 'CleanNoise' calls are in flight.
+	// -----------------------------------------------------------------------------------------
+	void SetStatsCollector(CCleanNoiseStatsCollector* pCollector) { m_pStatsCollector = pCollector; }
+	bool IsProfilingEnabled() const { return m_oclEnv.m_isProfilingEnabled; }
+	bool IsHalfPrecision() const { return m_isHalfPrecision; }
+
+	// -----------------------------------------------------------------------------------------
+	// Selects the single-buffer pipeline for subsequent calls: the frames are transformed,
+	// thresholded and transposed inside the buffer they are uploaded to. Rows which are too long
+	// for one work-group go through a small scratch buffer a chunk of rows at a time. This about
+	// halves the device memory of a call. Frames which are not square still need a second
+	// full-size buffer for the transposes and use the default pipeline. It must not be changed
+	// while 'CleanNoise' calls are in flight.
+	// -----------------------------------------------------------------------------------------
+	void SetInPlaceMode(bool isInPlace) { m_isInPlace = isInPlace; }
+	bool IsInPlaceMode() const { return m_isInPlace; }
+
+	// -----------------------------------------------------------------------------------------
+	// Selects the non-standard (Mallat) 2D decomposition for subsequent 'CleanNoise' calls
+	// instead of the standard one. Every level does one step along the rows and one along the
+	// columns of the approximation the previous level left (the LL quadrant), so the details
+	// of different levels are not mixed across the rows and the columns, and the result differs
+	// from the standard decomposition. A fused kernel loads a tile of the approximation into
+	// local memory once and does several levels on it, which takes about one global read and
+	// write per launch instead of the row, transpose and column sweeps of every level. Its
+	// kernel time is accounted to the FWT_ROWS and IWT_ROWS stages. It takes precedence over the
+	// in-place mode, frames with a side of 1 use the standard decomposition. It must not be
+	// changed while 'CleanNoise' calls are in flight.
+	// -----------------------------------------------------------------------------------------
+	void SetNonStandardMode(bool isNonStandard) { m_isNonStandard = isNonStandard; }
+	bool IsNonStandardMode() const { return m_isNonStandard; }
+
+	// -----------------------------------------------------------------------------------------
+	// Selects the neighbourhood (NeighShrink) thresholding for subsequent 'CleanNoise' and
+	// 'Reconstruct' calls instead of the pointwise one: every detail coefficient is scaled by
+	// max(0, 1 - thresh^2/S^2), where S^2 is the energy of the coefficients of its subband in
+	// the 'windowSize' x 'windowSize' window around it, and 'isSoftThresh' is ignored. This
+	// leaves fewer isolated coefficients, which show as artifacts after the pointwise
+	// thresholding, at about the cost of the pointwise pass. 'windowSize' must be odd and at
+	// most NEIGH_MAX_WINDOW_SIZE, 0 selects the pointwise thresholding again. The in-place mode
+	// is not used while it is selected, and the incremental streams fail, since their tiles are
+	// thresholded pointwise. It must not be changed while calls are in flight.
+	// -----------------------------------------------------------------------------------------
+	enum { NEIGH_MAX_WINDOW_SIZE = 7 };
+	bool SetNeighThreshMode(int windowSize);
+	int GetNeighWindowSize() const { return m_neighWindowSize; }
+
+	// -----------------------------------------------------------------------------------------
+	// Fills 'footprint' with the device memory a 'CleanNoiseBatch' call on 'numFrames' frames of
+	// the given size needs with the default or the in-place pipeline, or with the non-standard
+	// decomposition when it is selected. Returns false if the size is not supported.
+	// -----------------------------------------------------------------------------------------
+	bool GetDeviceMemoryFootprint(int width, int height, int numFrames, bool isInPlace, SDeviceMemoryFootprint& footprint) const;
+
+	// -----------------------------------------------------------------------------------------
+	// Attaches a tracer which records every command issued by subsequent 'CleanNoise' calls
+	// (with all four profiling timestamps) and the host-side spans around them, NULL detaches
+	// it. Commands are only recorded when profiling is enabled. The tracer is not owned by
+	// this instance. It must not be changed while 'CleanNoise' calls are in flight.
+	// -----------------------------------------------------------------------------------------
+	void SetTracer(CEventTracer* pTracer);
 
 
 	// -----------------------------------------------------------------------------------------
@@ -67,22 +379,214 @@ public:
 	// -----------------------------------------------------------------------------------------
 	bool PerformSelfTest();
 
+	// -----------------------------------------------------------------------------------------
+	// Times 'numIterations' transposes of a 'width' x 'height' matrix with the out-of-place and
+	// (for square matrices) the in-place kernel, and the same number of device-to-device copies
+	// of the matrix, which is the bound the transposes can reach. Requires profiling.
+	// -----------------------------------------------------------------------------------------
+	bool MeasureTransposeBandwidth(int width, int height, int numIterations, STransposeBandwidth& result);
+
+	// -----------------------------------------------------------------------------------------
+	// Benchmarks the candidate transpose tile sizes, thresholding work-group sizes and levels per
+	// pass of the transforms on square frames of the given sizes (powers of 2), keeps the fastest
+	// of each (the one with the lowest kernel time over 'numIterations' runs) and saves them to
+	// 'pFilename', or to the tuning file of the device if NULL. Requires profiling. It must not be
+	// called while 'CleanNoise' calls are in flight.
+	// -----------------------------------------------------------------------------------------
+	bool AutoTune(const int* pSizes, int numSizes, int numIterations, const char* pFilename = NULL);
+
+	// -----------------------------------------------------------------------------------------
+	// Load and save the tuning parameters, from and to the tuning file of the device if
+	// 'pFilename' is NULL. The file is a text file of 'key value' lines. Loading fails if the
+	// file is missing or was written for another device, and leaves the parameters unchanged.
+	// -----------------------------------------------------------------------------------------
+	bool LoadTuning(const char* pFilename = NULL);
+	bool SaveTuning(const char* pFilename = NULL) const;
+	const STuningParams& GetTuning() const { return m_tuning; }
+	/** 'HWT_tuning_<device>.txt' in the current directory, with '_half' for the half precision mode **/
+	const char* GetTuningFilename() const { return m_tuningFilename; }
+
 	
 private:
 	enum KernelIndices
 	{
-		FWT_KERNEL_IDX, IWT_KERNEL, MAT_TRANSPOSE_KERNEL, MAT_HT_THRESH_KERNEL, MAT_ST_THRESH_KERNEL, NUM_KERNELS
+		FWT_KERNEL_IDX, IWT_KERNEL, MAT_TRANSPOSE_KERNEL, MAT_HT_THRESH_KERNEL, MAT_ST_THRESH_KERNEL,
+		MAT_TRANSPOSE_INPLACE_KERNEL, FWT_INT_KERNEL, IWT_INT_KERNEL, MAT_TRANSPOSE_INT_KERNEL, MAT_HT_THRESH_INT_KERNEL,
+		MAT_ST_THRESH_INT_KERNEL, TILE_DIFF_KERNEL, IWT_TILES_KERNEL,
+		MAT_THRESH_METRICS_KERNEL, SPARSE_COUNT_KERNEL, SPARSE_SCAN_KERNEL, SPARSE_COMPACT_KERNEL, SPARSE_SCATTER_KERNEL,
+		NS_FWT_TILE_KERNEL, NS_IWT_TILE_KERNEL, PATCH_CLEAN_KERNEL, PATCH_NORMALIZE_KERNEL,
+		BYTES_TO_COEF_KERNEL, COEF_TO_BYTES_KERNEL, MAT_NEIGH_THRESH_KERNEL, COEF_TO_THUMBNAILS_KERNEL, COEF_METRICS_KERNEL,
+		NUM_KERNELS
 	};
-	OpenCLEnv	m_oclEnv;
+
+	/** The per-call state of 'CleanNoise', a worker is used by one call at a time **/
+	struct SWorker
+	{
+		cl_command_queue	cmdQ;
+		cl_kernel			kernels[NUM_KERNELS];
+		cl_mem				gInBuff;
+		cl_mem				gOutBuff;
+		cl_mem				gPartialBuff;
+		cl_mem				gBytesBuff;			// Gray levels of a region
+		size_t				buffLen;			// In coefficients, the workspaces only grow
+		size_t				outBuffLen;			// Only a scratch in the in-place pipeline
+		size_t				partialBuffLen;
+		size_t				bytesBuffLen;		// In bytes
+		float*				pHostBuff;			// 'buffLen' floats used for the coefficient conversion
+		bool				isMetricsRequested;	// The thresholding also reduces the metrics of the frames
+		cl_mem				gMetricsBuff;		// The sums of the work-groups, read into 'metricsSums'
+		size_t				metricsBuffLen;		// In floats
+		std::vector<float>	metricsSums;
+	};
+
+	OpenCLEnv					m_oclEnv;
+	CCleanNoiseStatsCollector*	m_pStatsCollector;
+	CEventTracer*				m_pTracer;
+	std::vector<SWorker*>		m_workers;			// All workers, owned by this instance
+	std::vector<SWorker*>		m_freeWorkers;		// Workers not used by any call
+	CMutex						m_workersMutex;
+	bool						m_isInPlace;
+	bool						m_isNonStandard;
+	int							m_neighWindowSize;	// 0 for the pointwise thresholding
+	bool						m_isHalfPrecision;
+	size_t						m_coefSize;			// Bytes of a coefficient in device memory
+	STuningParams				m_tuning;
+	char						m_tuningFilename[256];
+
+	/** Takes a free worker, creating a new one if all are busy, and returns it to the pool **/
+	SWorker* AcquireWorker();
+	void ReleaseWorker(SWorker* pWorker);
+	/** Makes sure the workspaces of 'worker' hold at least 'buffLen', 'outBuffLen' and 'partialBuffLen' coefficients
+		and 'bytesBuffLen' bytes **/
+	void ReserveWorkspace(SWorker& worker, size_t buffLen, size_t outBuffLen, size_t partialBuffLen, size_t bytesBuffLen = 0);
+	/** Lengths (in coefficients) of the workspaces a 'CleanNoiseBatch' call needs, 'isInPlace' is cleared
+		if the in-place pipeline cannot be used for this size **/
+	void GetWorkspaceLens(int width, int height, int numFrames, bool& isInPlace, size_t& buffLen, size_t& outBuffLen,
+						  size_t& partialBuffLen, bool isNonStandard = false) const;
+	/** Rows of 'dataLen' transformed at a time through the scratch of the in-place pipeline **/
+	static int GetInPlaceChunkRows(unsigned int dataLen, int numRows);
+	/** Registers the queue of the given worker with the tracer, called with 'm_workersMutex' held **/
+	void AddWorkerQueueToTracer(size_t workerIdx);
+
+	/** The stages of 'CleanNoiseBatch' on frames uploaded to 'worker.gInBuff'. The default pipeline leaves the
+		result in 'worker.gOutBuff', the in-place one (square frames only) in 'worker.gInBuff' **/
+	bool CleanNoiseGPU(SWorker& worker, int numFrames, int width, int height, float thresh, bool isSoftThresh,
+					   SCleanNoiseStats& stats);
+	bool CleanNoiseInPlaceGPU(SWorker& worker, int numFrames, int width, int height, float thresh, bool isSoftThresh,
+							  SCleanNoiseStats& stats);
+	/** The two halves of 'CleanNoiseGPU': the forward transforms of the frames in 'gSrcBuff' into 'gCoefsBuff',
+		and the thresholding and inverse transforms of 'gCoefsBuff' into 'worker.gOutBuff'. Both use the
+		workspaces of 'worker'. 'InverseThresholded2DGPU' starts from coefficients which are already
+		thresholded in 'worker.gInBuff' **/
+	bool ForwardTransform2DGPU(SWorker& worker, cl_mem gSrcBuff, cl_mem gCoefsBuff, int numFrames, int width, int height,
+							   SCleanNoiseStats& stats);
+	bool InverseTransform2DGPU(SWorker& worker, cl_mem gCoefsBuff, int numFrames, int width, int height, float thresh,
+							   bool isSoftThresh, SCleanNoiseStats& stats);
+	bool InverseThresholded2DGPU(SWorker& worker, int numFrames, int width, int height, SCleanNoiseStats& stats);
+	/** The non-standard decomposition of the frames in 'gSrcBuff' into 'gCoefsBuff' and its inverse from 'gCoefsBuff'
+		into 'gDstBuff', through the two halves of 'worker.gPartialBuff' **/
+	bool IsNonStandardUsed(int width, int height) const { return m_isNonStandard && width > 1 && height > 1; }
+	bool ForwardNonStandardGPU(SWorker& worker, cl_mem gSrcBuff, cl_mem gCoefsBuff, int numFrames, int width, int height,
+							   SCleanNoiseStats& stats);
+	bool InverseNonStandardGPU(SWorker& worker, cl_mem gCoefsBuff, cl_mem gDstBuff, int numFrames, int width, int height,
+							   SCleanNoiseStats& stats);
+	/** One launch of the non-standard tile kernels: the approximation it starts from, the tile and the levels it does **/
+	struct SNonStandardLaunch
+	{
+		unsigned int	width;
+		unsigned int	height;
+		unsigned int	tileWidth;
+		unsigned int	tileHeight;
+		unsigned int	levels;
+	};
+	void GetNonStandardLaunches(int kernelIdx, int width, int height, std::vector<SNonStandardLaunch>& launches) const;
+	/** Length (in coefficients) 'gPartialBuff' needs for both directions of the non-standard decomposition **/
+	size_t GetNonStandardPartialLen(int width, int height, int numFrames) const;
+	/** The integer pipeline, 'thresh' is in sample units and the result is left in 'worker.gOutBuff' **/
+	int CleanNoiseIntegerImpl(const void* pIn, void* pOut, bool is16Bit, int width, int height, float thresh, bool isSoftThresh,
+							  SCleanNoiseStats* pStats);
+	bool CleanNoiseIntegerGPU(SWorker& worker, int width, int height, float thresh, bool isSoftThresh, SCleanNoiseStats& stats);
+	/** The stages of 'CleanNoiseIncremental', the full one leaves the result in 'worker.gOutBuff' and the
+		incremental one the changed tiles in 'stream.gTileOutBuff' **/
+	bool CleanNoiseFullGPU(SWorker& worker, SIncrementalStream& stream, float thresh, bool isSoftThresh, SCleanNoiseStats& stats);
+	bool CleanNoiseTilesGPU(SWorker& worker, SIncrementalStream& stream, int numDirtyTiles, float thresh, bool isSoftThresh,
+							SCleanNoiseStats& stats);
+	/** Clean the first 'numBlocks' blocks of every channel of a signal stream, the carried samples followed by
+		'ppIn', and write the first 'numOut' samples of every channel to 'ppOut' **/
+	bool CleanNoiseSignalGPU(SSignalStream& stream, const float* const* ppIn, int numBlocks, float* const* ppOut, int numOut,
+							 float thresh, bool isSoftThresh, SCleanNoiseStats& stats);
+	/** Convert 'len' gray levels to coefficients in 'pHostBuff' (floats, or packed halves in the half precision
+		mode) starting at coefficient 'offset', and back **/
+	void ConvertToCoefs(const unsigned char* in, float* pHostBuff, unsigned int offset, unsigned int len) const;
+	void ConvertFromCoefs(const float* pHostBuff, unsigned int offset, unsigned int len, unsigned char* out) const;
+	/** Transforms 'numRows' rows of 'worker.gInBuff' in place, through the scratch in 'worker.gOutBuff' when
+		the rows are longer than one work-group covers **/
+	bool HaarTransformInPlaceGPU(SWorker& worker, bool isForward, int numRows, unsigned int numLevels, unsigned int dataLen,
+								 SCleanNoiseStats& stats, int stage);
 
 	/** Each one of this method activates OpenCL kernels with the given parameters and leaves the results on the GPU **/
-	bool ForwardHaarTransformGPU(cl_mem gInBuff, cl_mem gOutBuff, cl_mem gPartialBuff, int numGroups,
-								 unsigned int numLevels, unsigned int dataLen, unsigned int globalOffset, cl_ulong& kernelTime);
-	bool InverseHaarTransformGPU(cl_mem gInBuff, cl_mem gOutBuff, cl_mem gPartialBuff, int numGroups,
-							     unsigned int numLevels, unsigned int dataLen, unsigned int globalOffset, cl_ulong& kernelTime);
-	bool TransposeMatrixGPU(cl_mem gInBuff, cl_mem gOutBuff, int width, int height, cl_ulong& kernelTime);
-	bool MatrixThreshGPU(cl_mem gInBuff, cl_mem gOutBuff, unsigned int dataLen, float thresh, cl_ulong& kernelTime, bool isSoftThresh = false);
+	/** The commands are issued on the queue of 'worker' and accounted to 'stage' in 'stats' **/
+	/** 'inOffset' and 'outOffset' are the offsets (in coefficients) of the first row in 'gInBuff' and 'gOutBuff' **/
+	/** 'kernelIdx' selects the float or the integer kernel of the transform **/
+	bool ForwardHaarTransformGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, cl_mem gPartialBuff, int numGroups,
+								 unsigned int numLevels, unsigned int dataLen, unsigned int inOffset,
+								 unsigned int outOffset, SCleanNoiseStats& stats, int stage, int kernelIdx = FWT_KERNEL_IDX);
+	bool InverseHaarTransformGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, cl_mem gPartialBuff, int numGroups,
+							     unsigned int numLevels, unsigned int dataLen, unsigned int inOffset,
+								 unsigned int outOffset, SCleanNoiseStats& stats, int stage, int kernelIdx = IWT_KERNEL);
+	/** Copies 'numRows' rows of 'dataLen' (floats or ints), the transforms of rows without levels **/
+	bool CopyRowsGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, int numRows, unsigned int dataLen, unsigned int inOffset,
+					 unsigned int outOffset, bool isInteger, SCleanNoiseStats& stats, int stage);
+	/** 'TransposeMatrixGPU' works in place when 'gInBuff' and 'gOutBuff' are the same buffer, which requires
+		a square matrix of floats **/
+	bool TransposeMatrixGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, int width, int height, int numMatrices,
+							SCleanNoiseStats& stats, int stage, bool isInteger = false);
+	/** Threshold the coefficients of 'numFrames' frames the way the current mode selects, in the
+		standard (transposed) or non-standard layout **/
+	bool ThresholdCoefsGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, int numFrames, int width, int height, bool isNonStandard,
+						   float thresh, bool isSoftThresh, SCleanNoiseStats& stats);
+	/** Reduce the metrics of the frames in 'gCoefsBuff' thresholded into 'gThreshedBuff' on the device and
+		read the sums of the work-groups into 'worker.metricsSums'. If they are the same buffer the
+		coefficients are not thresholded yet and the pointwise thresholding is applied in the kernel **/
+	bool CollectMetricsGPU(SWorker& worker, cl_mem gCoefsBuff, cl_mem gThreshedBuff, int numFrames, int width, int height,
+						   bool isNonStandard, float thresh, bool isSoftThresh, SCleanNoiseStats& stats);
+	void GetMetricsLayout(int width, int height, bool isNonStandard, unsigned int& numLevels, size_t& numGroups,
+						  size_t& localWorkItems) const;
+	void FinishMetrics(const SWorker& worker, int numFrames, int width, int height, bool isNonStandard,
+					   SCleanNoiseMetrics* pMetrics) const;
+	/** The pointwise thresholds of 'EvaluateThresholds' take a single launch, the neighbourhood ones a
+		thresholding and a metrics launch each **/
+	bool EvaluateThresholdsGPU(SWorker& worker, const SCoefficients& coefs, const float* pThresholds, int numThresholds,
+							   bool isSoftThresh, SThresholdMetrics* pMetrics, SCleanNoiseStats& stats);
+	bool EvaluateNeighThresholdsGPU(SWorker& worker, const SCoefficients& coefs, const float* pThresholds, int numThresholds,
+									SThresholdMetrics* pMetrics, SCleanNoiseStats& stats);
+	bool MatrixNeighThreshGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, int rowLen, int numRows, int numMatrices,
+							  bool isNonStandard, float thresh, SCleanNoiseStats& stats, int stage);
+	bool MatrixThreshGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, unsigned int dataLen, float thresh, SCleanNoiseStats& stats, int stage,
+						 bool isSoftThresh = false);
+	/** Thresholds the integer coefficients of 'numMatrices' matrices of 'width' rows of 'height' (the layout after
+		the column transform) **/
+	bool MatrixThreshIntGPU(SWorker& worker, cl_mem gInBuff, cl_mem gOutBuff, int width, int height, int numMatrices,
+							float thresh, SCleanNoiseStats& stats, int stage, bool isSoftThresh);
+
+	/** Returns the event slot to pass to an enqueue call, NULL when profiling is disabled **/
+	cl_event* GetEventSlot(cl_event* pEvent) { return m_oclEnv.m_isProfilingEnabled ? pEvent : NULL; }
+	/** Completes the bookkeeping of one enqueued command: counts the launch and the bytes moved,
+		and when profiling is enabled waits for 'event', accumulates its times, passes them to the
+		tracer under 'pName' and releases it **/
+	void RecordCommand(SWorker& worker, cl_event event, SCleanNoiseStats& stats, int stage, const char* pName, cl_ulong numBytes = 0);
 
+	/** Number of transform levels a single work-group of the given kernel can perform **/
+	unsigned int GetMaxLevelsOnDevice(int kernelIdx) const;
+	/** Levels every pass of the transform kernel does on rows of 'dataLen', the tuned value capped by the device **/
+	unsigned int GetLevelsPerPass(int kernelIdx, unsigned int dataLen) const;
+	/** The tuned launch parameters, or the defaults if the tuned ones do not fit the kernels on this device **/
+	unsigned int GetTransposeTileSize() const;
+	unsigned int GetThreshWorkGroupSize() const;
+	/** Kernel time (in ns) of the fastest of 'numIterations' runs of 'stage' on a 'size' x 'size' frame **/
+	cl_ulong TimeStageGPU(SWorker& worker, int stage, int size, int numIterations);
+	/** Length (in coefficients) 'gPartialBuff' needs for transforming 'numRows' rows of 'dataLen' **/
+	size_t GetPartialBuffLen(unsigned int numLevels, unsigned int dataLen, unsigned int numRows, bool isInteger = false) const;
 	static bool GetNumLevels(unsigned int buffLen, unsigned int& numLevels);
 	static char* KERNEL_NAMES[NUM_KERNELS];
 
@@ -90,11 +594,56 @@ private:
 	bool TestHaarTransformGPU();
 	bool TestMatTransposeGPU();
 	bool TestMatThreshGPU();
+	bool TestConcurrencyGPU();
+	bool TestInPlaceGPU();
+	bool TestIntegerGPU();
+	bool TestIncrementalGPU();
+	bool TestThresholdSweepGPU();
+	bool TestSparseGPU();
+	bool TestNonStandardGPU();
+	bool TestPatchesGPU();
+	bool TestRegionGPU();
+	bool TestSignalStreamGPU();
+	bool TestNeighThreshGPU();
+	bool TestThumbnailsGPU();
+	bool TestMetricsGPU();
+	/** Fills 'len' gray levels of test frames with rows of 'width': waves of 'ampX' and 'ampY' levels along
+		the rows and the columns around mid-gray, and noise of 'noiseLevels' levels from the generator in 'seed' **/
+	static void MakeTestFrame(unsigned char* pFrame, int len, int width, int ampX, double freqX, int ampY, double freqY,
+							  int noiseLevels, unsigned int& seed);
+	/** Restores the pipeline and thresholding modes a test selects when it goes out of scope **/
+	class CTestModeGuard
+	{
+	public:
+		CTestModeGuard(CNoiseCleaner& cleaner);
+		~CTestModeGuard();
+
+	private:
+		CNoiseCleaner&	m_cleaner;
+		bool			m_isInPlace;
+		bool			m_isNonStandard;
+		int				m_neighWindowSize;
+	};
+	/** Copy float buffers to and from coefficient buffers, converting them in the half precision mode **/
+	void WriteCoefBuffer(SWorker& worker, cl_mem gBuff, const float* pBuff, size_t buffLen);
+	void ReadCoefBuffer(SWorker& worker, cl_mem gBuff, float* pBuff, size_t buffLen);
+	/** Compares a transform result with the reference, exactly or by its PSNR in the half precision mode **/
+	bool CompareTransformResult(const float* pRefBuff, const float* pBuff, unsigned int buffLen, const char* pName) const;
 
 	/** CPU routines for testing **/
 	static bool TestHaarTransformCPU();
+	static bool TestHaarTransform2DCPU();
 	static void ForwardHaarTransformCPU(const float* pInBuff, unsigned int buffLen, float* pOutBuff, unsigned int globalOffset);
 	static void InverseHaarTransformCPU(const float* pInBuff, unsigned int buffLen, float* pOutBuff, unsigned int globalOffset);
+	/** The non-standard 2D decomposition of a row-major 'width' x 'height' frame, in the layout of the tile kernels **/
+	static void ForwardNonStandardCPU(const float* pInBuff, int width, int height, float* pOutBuff);
+	static void InverseNonStandardCPU(const float* pInBuff, int width, int height, float* pOutBuff);
+	/** The thresholding of 'Mat_Neigh_Threshold_kernel' on one matrix of 'numRows' rows of 'rowLen' coefficients **/
+	static void NeighThreshCPU(const float* pInBuff, int rowLen, int numRows, bool isNonStandard, int windowSize, float thresh,
+							   float* pOutBuff);
+	/** 'CleanNoisePatches' on the CPU **/
+	static void CleanNoisePatchesCPU(const unsigned char* in, unsigned char* out, int width, int height, int patchSize, int step,
+									 float thresh, bool isSoftThresh);
 };
 
 
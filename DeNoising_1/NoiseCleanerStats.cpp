@@ -0,0 +1,240 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "NoiseCleanerStats.h"
+#include <iomanip>
+#include <string>
+
+
+const char* SCleanNoiseStats::STAGE_NAMES[NUM_STAGES] =
+	{"upload", "fwt_rows", "transpose_rows", "fwt_cols", "threshold", "iwt_cols", "transpose_cols", "iwt_rows", "metrics", "download"};
+
+//-----------------------------------------------------------------------------------------
+SCleanNoiseStats::SCleanNoiseStats()
+{
+	Reset();
+}
+//-----------------------------------------------------------------------------------------
+void SCleanNoiseStats::Reset()
+{
+	for (int i = 0; i < NUM_STAGES; i++)
+	{
+		stageTimes[i] = 0;
+		queuedTimes[i] = 0;
+		launches[i] = 0;
+	}
+	bytesToDevice = 0;
+	bytesFromDevice = 0;
+	hostTime = 0;
+	totalTime = 0;
+	isProfiled = false;
+}
+//-----------------------------------------------------------------------------------------
+cl_ulong SCleanNoiseStats::GetKernelTime() const
+{
+	cl_ulong kernelTime = 0;
+	for (int i = FWT_ROWS; i <= METRICS; i++)
+		kernelTime += stageTimes[i];
+	return kernelTime;
+}
+//-----------------------------------------------------------------------------------------
+cl_ulong SCleanNoiseStats::GetTransferTime() const
+{
+	return stageTimes[UPLOAD] + stageTimes[DOWNLOAD];
+}
+//-----------------------------------------------------------------------------------------
+cl_ulong SCleanNoiseStats::GetQueuedTime() const
+{
+	cl_ulong queuedTime = 0;
+	for (int i = 0; i < NUM_STAGES; i++)
+		queuedTime += queuedTimes[i];
+	return queuedTime;
+}
+//-----------------------------------------------------------------------------------------
+cl_uint SCleanNoiseStats::GetNumLaunches() const
+{
+	cl_uint numLaunches = 0;
+	for (int i = 0; i < NUM_STAGES; i++)
+		numLaunches += launches[i];
+	return numLaunches;
+}
+//-----------------------------------------------------------------------------------------
+CStatsHistogram::CStatsHistogram()
+{
+	Reset();
+}
+//-----------------------------------------------------------------------------------------
+void CStatsHistogram::Reset()
+{
+	for (int i = 0; i < NUM_BUCKETS; i++)
+		m_buckets[i] = 0;
+	m_count = 0;
+	m_sum = 0;
+	m_min = 0;
+	m_max = 0;
+}
+//-----------------------------------------------------------------------------------------
+void CStatsHistogram::Add(cl_ulong value)
+{
+	int bucket = 0;
+	while (bucket < NUM_BUCKETS - 1 && (value >> (bucket + 1)) != 0)
+		bucket++;
+	m_buckets[bucket]++;
+
+	if (m_count == 0 || value < m_min)
+		m_min = value;
+	if (value > m_max)
+		m_max = value;
+	m_count++;
+	m_sum += value;
+}
+//-----------------------------------------------------------------------------------------
+void CStatsHistogram::Merge(const CStatsHistogram& other)
+{
+	if (other.m_count == 0)
+		return;
+	for (int i = 0; i < NUM_BUCKETS; i++)
+		m_buckets[i] += other.m_buckets[i];
+	if (m_count == 0 || other.m_min < m_min)
+		m_min = other.m_min;
+	if (other.m_max > m_max)
+		m_max = other.m_max;
+	m_count += other.m_count;
+	m_sum += other.m_sum;
+}
+//-----------------------------------------------------------------------------------------
+cl_ulong CStatsHistogram::GetPercentile(double percentile) const
+{
+	if (m_count == 0)
+		return 0;
+
+	cl_ulong rank = (cl_ulong)((percentile / 100.0) * m_count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > m_count)
+		rank = m_count;
+
+	cl_ulong cumCount = 0;
+	int bucket = 0;
+	while (cumCount + m_buckets[bucket] < rank)
+		cumCount += m_buckets[bucket++];
+
+	double lower = (double)GetBucketLowerBound(bucket);
+	double upper = (bucket < NUM_BUCKETS - 1) ? (double)GetBucketLowerBound(bucket + 1) : (double)m_max;
+	double fraction = (double)(rank - cumCount) / (double)m_buckets[bucket];
+	cl_ulong value = (cl_ulong)(lower + fraction * (upper - lower));
+
+	if (value < m_min)
+		value = m_min;
+	if (value > m_max)
+		value = m_max;
+	return value;
+}
+//-----------------------------------------------------------------------------------------
+cl_ulong CStatsHistogram::GetBucketLowerBound(int bucket)
+{
+	return (bucket == 0) ? 0 : ((cl_ulong)1 << bucket);
+}
+//-----------------------------------------------------------------------------------------
+CCleanNoiseStatsCollector::CCleanNoiseStatsCollector()
+{
+	Reset();
+}
+//-----------------------------------------------------------------------------------------
+void CCleanNoiseStatsCollector::Reset()
+{
+	CMutexLock lock(m_mutex);
+	m_numCalls = 0;
+	m_numLaunches = 0;
+	m_bytesToDevice = 0;
+	m_bytesFromDevice = 0;
+	for (int i = 0; i < SCleanNoiseStats::NUM_STAGES; i++)
+	{
+		m_stageHists[i].Reset();
+		m_queuedHists[i].Reset();
+	}
+	m_kernelHist.Reset();
+	m_transferHist.Reset();
+	m_hostHist.Reset();
+	m_totalHist.Reset();
+}
+//-----------------------------------------------------------------------------------------
+void CCleanNoiseStatsCollector::Add(const SCleanNoiseStats& stats)
+{
+	CMutexLock lock(m_mutex);
+	m_numCalls++;
+	m_numLaunches += stats.GetNumLaunches();
+	m_bytesToDevice += stats.bytesToDevice;
+	m_bytesFromDevice += stats.bytesFromDevice;
+	m_hostHist.Add(stats.hostTime);
+	m_totalHist.Add(stats.totalTime);
+
+	if (!stats.isProfiled)
+		return;		// Device times are all zero, they would only skew the histograms
+
+	for (int i = 0; i < SCleanNoiseStats::NUM_STAGES; i++)
+	{
+		m_stageHists[i].Add(stats.stageTimes[i]);
+		m_queuedHists[i].Add(stats.queuedTimes[i]);
+	}
+	m_kernelHist.Add(stats.GetKernelTime());
+	m_transferHist.Add(stats.GetTransferTime());
+}
+//-----------------------------------------------------------------------------------------
+static void PrintHistogram(std::ostream& os, const char* pName, const CStatsHistogram& hist)
+{
+	os << "  " << std::left << std::setw(22) << pName << std::right
+	   << std::setw(8) << hist.GetCount()
+	   << std::setw(12) << hist.GetMean() / 1e3
+	   << std::setw(12) << (double)hist.GetPercentile(50.0) / 1e3
+	   << std::setw(12) << (double)hist.GetPercentile(99.0) / 1e3
+	   << std::setw(12) << (double)hist.GetMax() / 1e3 << "\n";
+}
+//-----------------------------------------------------------------------------------------
+void CCleanNoiseStatsCollector::Print(std::ostream& os) const
+{
+	CMutexLock lock(m_mutex);
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+
+	os << "CleanNoise calls: " << m_numCalls << ", launches: " << m_numLaunches
+	   << ", bytes to device: " << m_bytesToDevice << ", bytes from device: " << m_bytesFromDevice << "\n";
+	os << std::fixed << std::setprecision(2);
+	os << "  " << std::left << std::setw(22) << "(micro sec)" << std::right << std::setw(8) << "count"
+	   << std::setw(12) << "mean" << std::setw(12) << "p50" << std::setw(12) << "p99" << std::setw(12) << "max" << "\n";
+	PrintHistogram(os, "total", m_totalHist);
+	PrintHistogram(os, "host", m_hostHist);
+	if (m_kernelHist.GetCount() > 0)
+	{
+		PrintHistogram(os, "kernels", m_kernelHist);
+		PrintHistogram(os, "transfers", m_transferHist);
+		for (int i = 0; i < SCleanNoiseStats::NUM_STAGES; i++)
+			PrintHistogram(os, SCleanNoiseStats::STAGE_NAMES[i], m_stageHists[i]);
+		for (int i = 0; i < SCleanNoiseStats::NUM_STAGES; i++)
+		{
+			std::string name = std::string(SCleanNoiseStats::STAGE_NAMES[i]) + " queued";
+			PrintHistogram(os, name.c_str(), m_queuedHists[i]);
+		}
+	}
+
+	os.flags(flags);
+	os.precision(precision);
+}
+//-----------------------------------------------------------------------------------------
@@ -0,0 +1,153 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef __NOISE_CLEANER_STATS_H__
+#define __NOISE_CLEANER_STATS_H__
+
+#include <CL/cl.h>
+#include <iostream>
+#include "Utils.h"
+
+
+// -----------------------------------------------------------------------------------------
+// Per-stage breakdown of a single 'CleanNoise' call. All times are in nanoseconds.
+// 'stageTimes' is the sum of START->END of the OpenCL commands issued in each stage and
+// 'queuedTimes' the sum of their QUEUED->START latencies; both are only filled when the
+// cleaner was created with profiling enabled ('isProfiled'). Launch and byte counters are
+// always filled. 'hostTime' covers the host-side conversion loops and 'totalTime' the
+// whole call as seen by the caller.
+// -----------------------------------------------------------------------------------------
+struct SCleanNoiseStats
+{
+	enum Stages
+	{
+		UPLOAD, FWT_ROWS, TRANSPOSE_ROWS, FWT_COLS, THRESHOLD, IWT_COLS, TRANSPOSE_COLS, IWT_ROWS, METRICS, DOWNLOAD, NUM_STAGES
+	};
+
+	cl_ulong	stageTimes[NUM_STAGES];
+	cl_ulong	queuedTimes[NUM_STAGES];
+	cl_uint		launches[NUM_STAGES];
+	cl_ulong	bytesToDevice;
+	cl_ulong	bytesFromDevice;
+	cl_ulong	hostTime;
+	cl_ulong	totalTime;
+	bool		isProfiled;
+
+	SCleanNoiseStats();
+	void Reset();
+
+	cl_ulong GetKernelTime() const;
+	cl_ulong GetTransferTime() const;
+	cl_ulong GetQueuedTime() const;
+	cl_uint GetNumLaunches() const;
+
+	static const char* STAGE_NAMES[NUM_STAGES];
+};
+
+
+// -----------------------------------------------------------------------------------------
+// Log2-bucketed histogram of nanosecond samples. Bucket 'i' holds the samples in
+// [2^i, 2^(i+1)) (bucket 0 also holds zero), which keeps the relative error of the
+// reported percentiles below 2x at a fixed, tiny memory cost. Exact count, sum, minimum
+// and maximum are kept alongside the buckets.
+// -----------------------------------------------------------------------------------------
+class CStatsHistogram
+{
+public:
+	enum { NUM_BUCKETS = 64 };
+
+	CStatsHistogram();
+	void Reset();
+	void Add(cl_ulong value);
+	void Merge(const CStatsHistogram& other);
+
+	cl_ulong GetCount() const { return m_count; }
+	cl_ulong GetSum() const { return m_sum; }
+	cl_ulong GetMin() const { return m_count ? m_min : 0; }
+	cl_ulong GetMax() const { return m_max; }
+	double GetMean() const { return m_count ? (double)m_sum / (double)m_count : 0.0; }
+	cl_ulong GetBucketCount(int bucket) const { return m_buckets[bucket]; }
+
+	// -----------------------------------------------------------------------------------------
+	// Estimates the given percentile (0-100) by linear interpolation inside the bucket that
+	// holds the nearest-rank sample, clamped to the observed minimum and maximum.
+	// -----------------------------------------------------------------------------------------
+	cl_ulong GetPercentile(double percentile) const;
+
+	static cl_ulong GetBucketLowerBound(int bucket);
+
+private:
+	cl_ulong	m_buckets[NUM_BUCKETS];
+	cl_ulong	m_count;
+	cl_ulong	m_sum;
+	cl_ulong	m_min;
+	cl_ulong	m_max;
+};
+
+
+// -----------------------------------------------------------------------------------------
+// Aggregates the 'SCleanNoiseStats' of many calls into per-stage histograms and running
+// totals. An instance can be attached to a CNoiseCleaner with 'SetStatsCollector' so every
+// call is added automatically. Device-time histograms only receive profiled calls.
+// 'Add', 'Reset' and 'Print' may be called from several threads, the getters should only be
+// used once no more calls are being added.
+// -----------------------------------------------------------------------------------------
+class CCleanNoiseStatsCollector
+{
+public:
+	CCleanNoiseStatsCollector();
+	void Reset();
+	void Add(const SCleanNoiseStats& stats);
+
+	cl_ulong GetNumCalls() const { return m_numCalls; }
+	cl_ulong GetNumLaunches() const { return m_numLaunches; }
+	cl_ulong GetBytesToDevice() const { return m_bytesToDevice; }
+	cl_ulong GetBytesFromDevice() const { return m_bytesFromDevice; }
+
+	const CStatsHistogram& GetStageHistogram(int stage) const { return m_stageHists[stage]; }
+	const CStatsHistogram& GetQueuedHistogram(int stage) const { return m_queuedHists[stage]; }
+	const CStatsHistogram& GetKernelHistogram() const { return m_kernelHist; }
+	const CStatsHistogram& GetTransferHistogram() const { return m_transferHist; }
+	const CStatsHistogram& GetHostHistogram() const { return m_hostHist; }
+	const CStatsHistogram& GetTotalHistogram() const { return m_totalHist; }
+
+	// -----------------------------------------------------------------------------------------
+	// Writes a human-readable summary (count, mean, p50, p99 and max per histogram, in
+	// microseconds) to the given stream.
+	// -----------------------------------------------------------------------------------------
+	void Print(std::ostream& os) const;
+
+private:
+	cl_ulong		m_numCalls;
+	cl_ulong		m_numLaunches;
+	cl_ulong		m_bytesToDevice;
+	cl_ulong		m_bytesFromDevice;
+	CStatsHistogram	m_stageHists[SCleanNoiseStats::NUM_STAGES];
+	CStatsHistogram	m_queuedHists[SCleanNoiseStats::NUM_STAGES];
+	CStatsHistogram	m_kernelHist;
+	CStatsHistogram	m_transferHist;
+	CStatsHistogram	m_hostHist;
+	CStatsHistogram	m_totalHist;
+	mutable CMutex	m_mutex;
+};
+
+
+
+#endif	// __NOISE_CLEANER_STATS_H__
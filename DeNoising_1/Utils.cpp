@@ -19,11 +19,19 @@
 // SOFTWARE.
 
 #include "Utils.h"
+#include <string.h>
 #include <fstream>
 #include <vector>
 #include <cmath>
 #include <iomanip>
 
+#if defined(_WIN32) || defined(_WIN64) || defined(_WINDOWS)
+#include <windows.h>
+#else
+#include <time.h>
+#include <pthread.h>
+#endif
+
 //-----------------------------------------------------------------------------------------
 void OpenCLEnv::ReadFileToString(const char *filename, char **fileString)
 {   
@@ -55,7 +63,7 @@ void OpenCLEnv::PrintProfilingInfo(cl_event kernelEvent, const char* pKernelName
 //-----------------------------------------------------------------------------------------
 void OpenCLEnv::PrintProfilingInfo(cl_ulong totalKernelTime, const char* pKernelName)
 {
-	std::cout << pKernelName << " ran for: " << (double)(totalKernelTime)/(double)10e3 << " micro sec\n";
+	std::cout << pKernelName << " ran for: " << (double)(totalKernelTime)/1e3 << " micro sec\n";
 }
 //-----------------------------------------------------------------------------------------
 cl_ulong OpenCLEnv::GetKernelTime(cl_event kernelEvent)
@@ -71,6 +79,64 @@ cl_ulong OpenCLEnv::GetKernelTime(cl_event kernelEvent)
 	return (kernelEndTime - kernelStartTime);
 }
 //-----------------------------------------------------------------------------------------
+void OpenCLEnv::GetCommandTimes(cl_event event, cl_ulong* pQueued, cl_ulong* pSubmit, cl_ulong* pStart, cl_ulong* pEnd)
+{
+	cl_int 		clErr;
+
+	clErr = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), pQueued, NULL);
+	OpenCLEnv::CheckForError(clErr, "getting command profiling info");
+	clErr = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), pSubmit, NULL);
+	OpenCLEnv::CheckForError(clErr, "getting command profiling info");
+	clErr = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), pStart, NULL);
+	OpenCLEnv::CheckForError(clErr, "getting command profiling info");
+	clErr = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), pEnd, NULL);
+	OpenCLEnv::CheckForError(clErr, "getting command profiling info");
+}
+//-----------------------------------------------------------------------------------------
+cl_ulong OpenCLEnv::GetHostTime()
+{
+#if defined(_WIN32) || defined(_WIN64) || defined(_WINDOWS)
+	LARGE_INTEGER perfFreq;
+	LARGE_INTEGER perfCounter;
+	QueryPerformanceFrequency(&perfFreq);
+	QueryPerformanceCounter(&perfCounter);
+	return (cl_ulong)(((double)perfCounter.QuadPart / (double)perfFreq.QuadPart) * 1e9);
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (cl_ulong)now.tv_sec * 1000000000 + (cl_ulong)now.tv_nsec;
+#endif
+}
+//-----------------------------------------------------------------------------------------
+bool OpenCLEnv::IsDeviceTypeAvailable(cl_device_type deviceType)
+{
+	cl_device_id deviceID;
+	return (FindDevice(deviceType, &deviceID) == CL_SUCCESS);
+}
+//-----------------------------------------------------------------------------------------
+cl_int OpenCLEnv::FindDevice(cl_device_type deviceType, cl_device_id* pDeviceID)
+{
+	cl_uint				numPlatforms = 0;
+	cl_platform_id*		platformIDs = NULL;
+	cl_int				clErr;
+
+	//
+	// Have to find a device of the requested type by querying each available platform 
+	//
+	clErr = clGetPlatformIDs(0, NULL, &numPlatforms);
+	if (clErr != CL_SUCCESS || numPlatforms == 0)
+		return CL_DEVICE_NOT_FOUND;
+	platformIDs = new cl_platform_id[numPlatforms];
+	clGetPlatformIDs(numPlatforms, platformIDs, NULL);
+	unsigned int i = 0;
+	clErr = clGetDeviceIDs(platformIDs[i++], deviceType, 1, pDeviceID, NULL);
+	while (clErr != CL_SUCCESS && i < numPlatforms)
+	    clErr = clGetDeviceIDs(platformIDs[i++], deviceType, 1, pDeviceID, NULL);
+	delete[] platformIDs;	// platformIDs no longer needed
+
+	return clErr;
+}
+//-----------------------------------------------------------------------------------------
 bool OpenCLEnv::ReadFileFloat(const char* filename, float** data, unsigned int* len)
 {
 	if (filename == NULL || len == NULL || data == NULL)
@@ -133,28 +199,115 @@ bool OpenCLEnv::CompareFloatBuffers(const float* pInBuff1, const float* pInBuff2
 	return true;
 }
 //-----------------------------------------------------------------------------------------
-OpenCLEnv::OpenCLEnv(const char* pFilename, int numKernels, char** pKernelNames)
+double OpenCLEnv::ComputePSNR(const float* pRefBuff, const float* pBuff, unsigned int buffLen, double peak)
+{
+	double sumSqErr = 0.0;
+	for (unsigned int i = 0; i < buffLen; i++)
+	{
+		double err = (double)pRefBuff[i] - (double)pBuff[i];
+		sumSqErr += err * err;
+	}
+	if (sumSqErr == 0.0 || buffLen == 0)
+		return HUGE_VAL;	// Identical buffers
+
+	return 10.0 * log10(peak * peak / (sumSqErr / buffLen));
+}
+//-----------------------------------------------------------------------------------------
+double OpenCLEnv::ComputePSNR(const unsigned char* pRefBuff, const unsigned char* pBuff, unsigned int buffLen)
+{
+	double sumSqErr = 0.0;
+	for (unsigned int i = 0; i < buffLen; i++)
+	{
+		double err = (double)pRefBuff[i] - (double)pBuff[i];
+		sumSqErr += err * err;
+	}
+	if (sumSqErr == 0.0 || buffLen == 0)
+		return HUGE_VAL;	// Identical buffers
+
+	return 10.0 * log10(255.0 * 255.0 / (sumSqErr / buffLen));
+}
+//-----------------------------------------------------------------------------------------
+cl_half OpenCLEnv::FloatToHalf(float value)
+{
+	cl_uint bits;
+	memcpy(&bits, &value, sizeof(bits));
+	cl_uint sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+	cl_uint mantissa = bits & 0x7fffff;
+
+	if (((bits >> 23) & 0xff) == 0xff)
+		return (cl_half)(sign | 0x7c00 | (mantissa ? 0x200 : 0));	// Inf or NaN
+	if (exponent >= 31)
+		return (cl_half)(sign | 0x7c00);							// Overflow to infinity
+	if (exponent <= 0)
+	{
+		if (exponent < -10)
+			return (cl_half)sign;									// Underflow to zero
+		// Denormal half, the implicit bit becomes explicit
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		cl_uint halfMantissa = mantissa >> shift;
+		cl_uint rest = mantissa & ((1u << shift) - 1);
+		cl_uint halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (halfMantissa & 1)))
+			halfMantissa++;
+		return (cl_half)(sign | halfMantissa);
+	}
+
+	cl_uint halfBits = ((cl_uint)exponent << 10) | (mantissa >> 13);
+	cl_uint rest = mantissa & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (halfBits & 1)))
+		halfBits++;		// May carry into the exponent, which is still correct
+	return (cl_half)(sign | halfBits);
+}
+//-----------------------------------------------------------------------------------------
+float OpenCLEnv::HalfToFloat(cl_half value)
+{
+	cl_uint sign = ((cl_uint)value & 0x8000) << 16;
+	cl_uint exponent = ((cl_uint)value >> 10) & 0x1f;
+	cl_uint mantissa = (cl_uint)value & 0x3ff;
+	cl_uint bits;
+
+	if (exponent == 0x1f)
+		bits = sign | 0x7f800000 | (mantissa << 13);				// Inf or NaN
+	else if (exponent != 0)
+		bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	else if (mantissa == 0)
+		bits = sign;												// Zero
+	else
+	{
+		// Denormal half, normalize it
+		exponent = 127 - 15 + 1;
+		while ((mantissa & 0x400) == 0)
+		{
+			mantissa <<= 1;
+			exponent--;
+		}
+		bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+	}
+
+	float result;
+	memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+//-----------------------------------------------------------------------------------------
+OpenCLEnv::OpenCLEnv(const char* pFilename, int numKernels, char** pKernelNames, cl_device_type deviceType /*= CL_DEVICE_TYPE_GPU*/,
+					 bool isProfilingEnabled /*= true*/, const char* pBuildOptions /*= NULL*/)
 {
-	cl_uint				numPlatforms = 0;
-	cl_platform_id*		platformIDs = NULL;
 	cl_int				clErr;
 	cl_bool				supportsImages;
 	char*				pOCLKernelsStr = NULL;
 
 
 	//
-	// Have to find a GPU device by querying each available platform 
+	// Find a device of the requested type (a GPU by default)
 	//
-	clErr = clGetPlatformIDs(0, NULL, &numPlatforms);
-	CheckForError(clErr, "querying platforms");
-	platformIDs = new cl_platform_id[numPlatforms];
-	clGetPlatformIDs(numPlatforms, platformIDs, NULL);
-	unsigned int i = 0;
-	clErr = clGetDeviceIDs(platformIDs[i++], CL_DEVICE_TYPE_GPU, 1, &m_deviceID, NULL);
-	while (clErr != CL_SUCCESS && i < numPlatforms)
-	    clErr = clGetDeviceIDs(platformIDs[i++], CL_DEVICE_TYPE_GPU, 1, &m_deviceID, NULL);
+	clErr = FindDevice(deviceType, &m_deviceID);
 	CheckForError(clErr, "querying for device");
-	delete[] platformIDs;	// platformIDs no longer needed
+
+	clErr = clGetDeviceInfo(m_deviceID, CL_DEVICE_NAME, sizeof(m_deviceName), m_deviceName, NULL);
+	if (clErr != CL_SUCCESS)
+		m_deviceName[0] = '\0';
 
 	// 
 	// Check whether the device supports images 
@@ -164,12 +317,13 @@ OpenCLEnv::OpenCLEnv(const char* pFilename, int numKernels, char** pKernelNames)
 	m_isSupportsImages = (bool)supportsImages;
 	
 	//
-	// Create context and command queue; both are needed for running kernels
+	// Create context and command queue; both are needed for running kernels. Profiling
+	// adds overhead to every command, so it is only enabled on request
 	//
+	m_isProfilingEnabled = isProfilingEnabled;
 	m_context = clCreateContext(0, 1, &m_deviceID, NULL, NULL, &clErr);  
 	CheckForError(clErr, "creating context");
-	m_cmdQ = clCreateCommandQueue(m_context, m_deviceID, CL_QUEUE_PROFILING_ENABLE, &clErr); 
-	CheckForError(clErr, "creating command queue");
+	m_cmdQ = CreateCommandQueue();
 
 	//
 	// Read the kernels from disk
@@ -182,7 +336,7 @@ OpenCLEnv::OpenCLEnv(const char* pFilename, int numKernels, char** pKernelNames)
 	//
 	// Compile the program (print the build log if needed) and query for the kernel
 	//
-	clErr = clBuildProgram(m_program, 0, NULL, NULL, NULL, NULL);
+	clErr = clBuildProgram(m_program, 0, NULL, pBuildOptions, NULL, NULL);
 	if (clErr != CL_SUCCESS) {
 		std::cout << "OpenCL error: building program (" << clErr << ")!" << std::endl;
 		size_t buildLogSize = 0;
@@ -200,17 +354,14 @@ OpenCLEnv::OpenCLEnv(const char* pFilename, int numKernels, char** pKernelNames)
 	delete[] pOCLKernelsStr;	// the kernel source no longer needed 
 	
 	m_numKernels = numKernels;
+	m_pKernelNames = pKernelNames;
 	m_kernels = new cl_kernel[m_numKernels];
-	for (int i = 0; i < m_numKernels; i++)
-	{
-		m_kernels[i] = clCreateKernel(m_program, pKernelNames[i], &clErr);
-		CheckForError(clErr, "querying for kernel");
-	}
+	CreateKernels(m_kernels);
 
 	//
 	// Get max workgroup size
 	//
-	m_kernelWorkGroupSizes = new unsigned int[m_numKernels];
+	m_kernelWorkGroupSizes = new size_t[m_numKernels];
 	for (int i = 0; i < m_numKernels; i++)
 	{
 		clErr = clGetKernelWorkGroupInfo(m_kernels[i], m_deviceID, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t),
@@ -232,3 +383,164 @@ OpenCLEnv::~OpenCLEnv()
 	clReleaseContext(m_context);
 }
 //-----------------------------------------------------------------------------------------
+cl_command_queue OpenCLEnv::CreateCommandQueue()
+{
+	cl_int clErr;
+	cl_command_queue cmdQ = clCreateCommandQueue(m_context, m_deviceID, m_isProfilingEnabled ? CL_QUEUE_PROFILING_ENABLE : 0, &clErr); 
+	CheckForError(clErr, "creating command queue");
+	return cmdQ;
+}
+//-----------------------------------------------------------------------------------------
+void OpenCLEnv::CreateKernels(cl_kernel* pKernels)
+{
+	cl_int clErr;
+	for (int i = 0; i < m_numKernels; i++)
+	{
+		pKernels[i] = clCreateKernel(m_program, m_pKernelNames[i], &clErr);
+		CheckForError(clErr, "querying for kernel");
+	}
+}
+//-----------------------------------------------------------------------------------------
+#if defined(_WIN32) || defined(_WIN64) || defined(_WINDOWS)
+CMutex::CMutex()
+{
+	m_pHandle = new CRITICAL_SECTION;
+	InitializeCriticalSection((CRITICAL_SECTION*)m_pHandle);
+}
+//-----------------------------------------------------------------------------------------
+CMutex::~CMutex()
+{
+	DeleteCriticalSection((CRITICAL_SECTION*)m_pHandle);
+	delete (CRITICAL_SECTION*)m_pHandle;
+}
+//-----------------------------------------------------------------------------------------
+void CMutex::Lock()
+{
+	EnterCriticalSection((CRITICAL_SECTION*)m_pHandle);
+}
+//-----------------------------------------------------------------------------------------
+void CMutex::Unlock()
+{
+	LeaveCriticalSection((CRITICAL_SECTION*)m_pHandle);
+}
+//-----------------------------------------------------------------------------------------
+struct SThreadStart
+{
+	CThread::ThreadFunc		pFunc;
+	void*					pArg;
+};
+//-----------------------------------------------------------------------------------------
+static DWORD WINAPI ThreadEntry(LPVOID pParam)
+{
+	SThreadStart start = *(SThreadStart*)pParam;
+	delete (SThreadStart*)pParam;
+	start.pFunc(start.pArg);
+	return 0;
+}
+//-----------------------------------------------------------------------------------------
+bool CThread::Start(ThreadFunc pFunc, void* pArg)
+{
+	if (m_pHandle)
+		return false;
+	SThreadStart* pStart = new SThreadStart;
+	pStart->pFunc = pFunc;
+	pStart->pArg = pArg;
+	m_pHandle = CreateThread(NULL, 0, ThreadEntry, pStart, 0, NULL);
+	if (!m_pHandle)
+		delete pStart;
+	return (m_pHandle != NULL);
+}
+//-----------------------------------------------------------------------------------------
+void CThread::Join()
+{
+	if (!m_pHandle)
+		return;
+	WaitForSingleObject((HANDLE)m_pHandle, INFINITE);
+	CloseHandle((HANDLE)m_pHandle);
+	m_pHandle = NULL;
+}
+//-----------------------------------------------------------------------------------------
+cl_ulong CThread::GetCurrentID()
+{
+	return (cl_ulong)GetCurrentThreadId();
+}
+#else
+//-----------------------------------------------------------------------------------------
+CMutex::CMutex()
+{
+	m_pHandle = new pthread_mutex_t;
+	pthread_mutex_init((pthread_mutex_t*)m_pHandle, NULL);
+}
+//-----------------------------------------------------------------------------------------
+CMutex::~CMutex()
+{
+	pthread_mutex_destroy((pthread_mutex_t*)m_pHandle);
+	delete (pthread_mutex_t*)m_pHandle;
+}
+//-----------------------------------------------------------------------------------------
+void CMutex::Lock()
+{
+	pthread_mutex_lock((pthread_mutex_t*)m_pHandle);
+}
+//-----------------------------------------------------------------------------------------
+void CMutex::Unlock()
+{
+	pthread_mutex_unlock((pthread_mutex_t*)m_pHandle);
+}
+//-----------------------------------------------------------------------------------------
+struct SThreadStart
+{
+	CThread::ThreadFunc		pFunc;
+	void*					pArg;
+};
+//-----------------------------------------------------------------------------------------
+static void* ThreadEntry(void* pParam)
+{
+	SThreadStart start = *(SThreadStart*)pParam;
+	delete (SThreadStart*)pParam;
+	start.pFunc(start.pArg);
+	return NULL;
+}
+//-----------------------------------------------------------------------------------------
+bool CThread::Start(ThreadFunc pFunc, void* pArg)
+{
+	if (m_pHandle)
+		return false;
+	SThreadStart* pStart = new SThreadStart;
+	pStart->pFunc = pFunc;
+	pStart->pArg = pArg;
+	pthread_t* pThread = new pthread_t;
+	if (pthread_create(pThread, NULL, ThreadEntry, pStart) != 0)
+	{
+		delete pStart;
+		delete pThread;
+		return false;
+	}
+	m_pHandle = pThread;
+	return true;
+}
+//-----------------------------------------------------------------------------------------
+void CThread::Join()
+{
+	if (!m_pHandle)
+		return;
+	pthread_join(*(pthread_t*)m_pHandle, NULL);
+	delete (pthread_t*)m_pHandle;
+	m_pHandle = NULL;
+}
+//-----------------------------------------------------------------------------------------
+cl_ulong CThread::GetCurrentID()
+{
+	return (cl_ulong)(size_t)pthread_self();
+}
+#endif
+//-----------------------------------------------------------------------------------------
+CThread::CThread() : m_pHandle(NULL)
+{
+}
+//-----------------------------------------------------------------------------------------
+CThread::~CThread()
+{
+	Join();
+}
+//-----------------------------------------------------------------------------------------
@@ -60,6 +60,21 @@ public:
 	// ----------------------------------------------------------------------------
 	static cl_ulong GetKernelTime(cl_event event);
 
+	// ----------------------------------------------------------------------------
+	// Helper function to extract all four profiling timestamps of a command
+	// ----------------------------------------------------------------------------
+	static void GetCommandTimes(cl_event event, cl_ulong* pQueued, cl_ulong* pSubmit, cl_ulong* pStart, cl_ulong* pEnd);
+
+	// ----------------------------------------------------------------------------
+	// Helper function to read a monotonic host clock (in nanoseconds)
+	// ----------------------------------------------------------------------------
+	static cl_ulong GetHostTime();
+
+	// ----------------------------------------------------------------------------
+	// Helper function to check whether any platform has a device of the given type
+	// ----------------------------------------------------------------------------
+	static bool IsDeviceTypeAvailable(cl_device_type deviceType);
+
 	// ----------------------------------------------------------------------------
 	// Helper function to read generic float file
 	// ----------------------------------------------------------------------------
@@ -75,17 +90,101 @@ public:
 	// ----------------------------------------------------------------------------
 	static bool CompareFloatBuffers(const float* pInBuff1, const float* pInBuff2, unsigned int buffLen);
 
+	// ----------------------------------------------------------------------------
+	// Helper functions to compute the peak signal-to-noise ratio (in dB) of a buffer
+	// against a reference, 'peak' is the maximal value of the signal (255 for 8-bit)
+	// ----------------------------------------------------------------------------
+	static double ComputePSNR(const float* pRefBuff, const float* pBuff, unsigned int buffLen, double peak);
+	static double ComputePSNR(const unsigned char* pRefBuff, const unsigned char* pBuff, unsigned int buffLen);
+
+	// ----------------------------------------------------------------------------
+	// Helper functions to convert between float and IEEE 754 half precision, the
+	// same conversion 'vstore_half' performs (round to nearest even)
+	// ----------------------------------------------------------------------------
+	static cl_half FloatToHalf(float value);
+	static float HalfToFloat(cl_half value);
+
 	cl_device_id		m_deviceID;
+	char				m_deviceName[128];
 	cl_context			m_context; 
 	cl_command_queue	m_cmdQ;
 	cl_program			m_program;
 	int					m_numKernels;
 	cl_kernel*			m_kernels;
-	unsigned int*		m_kernelWorkGroupSizes;
+	size_t*				m_kernelWorkGroupSizes;
 	bool				m_isSupportsImages;
+	bool				m_isProfilingEnabled;
 
-	OpenCLEnv(const char* pFilename, int numKernels, char** pKernelNames);
+	// 'pBuildOptions' - Passed to the OpenCL compiler, e.g. to define macros which select a
+	//					 variant of the kernels.
+	OpenCLEnv(const char* pFilename, int numKernels, char** pKernelNames, cl_device_type deviceType = CL_DEVICE_TYPE_GPU,
+			  bool isProfilingEnabled = true, const char* pBuildOptions = NULL);
 	~OpenCLEnv();
+
+	// ----------------------------------------------------------------------------
+	// Create another command queue on the device (with profiling if enabled) and
+	// another set of kernel objects, in the order of 'pKernelNames'. Kernel arguments
+	// are stored per kernel object, so each thread enqueuing kernels needs its own set
+	// ----------------------------------------------------------------------------
+	cl_command_queue CreateCommandQueue();
+	void CreateKernels(cl_kernel* pKernels);
+
+private:
+	char**				m_pKernelNames;
+
+	static cl_int FindDevice(cl_device_type deviceType, cl_device_id* pDeviceID);
+};
+
+
+// ----------------------------------------------------------------------------
+// Minimal portable mutex and thread wrappers (Win32 or pthreads)
+// ----------------------------------------------------------------------------
+class CMutex
+{
+public:
+	CMutex();
+	~CMutex();
+	void Lock();
+	void Unlock();
+
+private:
+	CMutex(const CMutex&);
+	CMutex& operator=(const CMutex&);
+
+	void*	m_pHandle;
+};
+
+class CMutexLock
+{
+public:
+	explicit CMutexLock(CMutex& mutex) : m_mutex(mutex) { m_mutex.Lock(); }
+	~CMutexLock() { m_mutex.Unlock(); }
+
+private:
+	CMutexLock(const CMutexLock&);
+	CMutexLock& operator=(const CMutexLock&);
+
+	CMutex&	m_mutex;
+};
+
+class CThread
+{
+public:
+	typedef void (*ThreadFunc)(void* pArg);
+
+	CThread();
+	~CThread();		// Joins the thread if it is still running
+	bool Start(ThreadFunc pFunc, void* pArg);
+	void Join();
+
+	// Returns an identifier of the calling thread, unique among the running threads
+	static cl_ulong GetCurrentID();
+
+private:
+	CThread(const CThread&);
+	CThread& operator=(const CThread&);
+
+	void*		m_pHandle;
 };
 
 